@@ -0,0 +1,56 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local bench = require('./common')
+local fs = require('fs')
+local path = require('path')
+
+local reads = bench.scale(2000)
+
+-- Small enough to stay in the page cache, the read path is what's timed
+local fixtures = {
+  { name = "fs.readFile.4k", size = 4 * 1024 },
+  { name = "fs.readFile.256k", size = 256 * 1024 }
+}
+
+local steps = {}
+for _, fixture in ipairs(fixtures) do
+  steps[#steps + 1] = function (done)
+    local file = path.join(__dirname, "bench-fs-" .. fixture.size .. ".tmp")
+    fs.writeFileSync(file, bench.randomString(fixture.size))
+    local rec = bench.recorder()
+    local i = 0
+    local function nextRead()
+      i = i + 1
+      if i > reads then
+        fs.unlinkSync(file)
+        rec:report(fixture.name, { unit = "reads/s" })
+        return done()
+      end
+      local start = rec:start()
+      fs.readFile(file, function (err, data)
+        assert(not err, err)
+        assert(#data == fixture.size)
+        rec:stop(start)
+        nextRead()
+      end)
+    end
+    nextRead()
+  end
+end
+bench.series(steps)
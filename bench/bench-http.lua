@@ -0,0 +1,92 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local bench = require('./common')
+local http = require('http')
+local net = require('net')
+local table = require('table')
+
+local HOST = "127.0.0.1"
+local CONNECTIONS = 8
+
+-- Request header counts, parsing them is most of the server's work
+local headerCounts = { 1, 16, 64 }
+local requests = bench.scale(20000)
+
+local server = http.createServer(function (request, response)
+  response:writeHead(200, {
+    ["Content-Type"] = "text/plain",
+    ["Content-Length"] = 2
+  })
+  response:finish("ok")
+end)
+
+local function buildRequest(count)
+  local lines = { "GET /bench HTTP/1.1", "Host: " .. HOST }
+  for i = 2, count do
+    lines[#lines + 1] = "X-Bench-" .. i .. ": " .. bench.randomString(24)
+  end
+  return table.concat(lines, "\r\n") .. "\r\n\r\n"
+end
+
+-- CONNECTIONS keep-alive clients, each waits for its response before
+-- sending the next request
+local function run(count, done)
+  local request = buildRequest(count)
+  local rec = bench.recorder()
+  local sent = 0
+  local open = CONNECTIONS
+  for _ = 1, CONNECTIONS do
+    local client
+    local buffered = ""
+    local start
+    local function send()
+      if sent >= requests then
+        client:done()
+        open = open - 1
+        if open == 0 then
+          rec:report("http.headers." .. count, { unit = "req/s" })
+          done()
+        end
+        return
+      end
+      sent = sent + 1
+      start = rec:start()
+      client:write(request)
+    end
+    client = net.createConnection(bench.port, HOST, send)
+    client:on('data', function (data)
+      buffered = buffered .. data
+      local last = buffered:find("\r\n\r\nok", 1, true)
+      if last then
+        buffered = buffered:sub(last + 6)
+        rec:stop(start)
+        send()
+      end
+    end)
+  end
+end
+
+server:listen(bench.port, HOST, function ()
+  local steps = {}
+  for _, count in ipairs(headerCounts) do
+    steps[#steps + 1] = function (done) run(count, done) end
+  end
+  steps[#steps + 1] = function () server:close() end
+  bench.series(steps)
+end)
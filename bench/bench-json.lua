@@ -0,0 +1,44 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local bench = require('./common')
+local JSON = require('json')
+local math = require('math')
+
+-- Shaped like an API response, the same every run
+local items = {}
+for i = 1, 2000 do
+  items[i] = {
+    id = i,
+    name = bench.randomString(16),
+    score = math.floor(math.random() * 100000) / 100,
+    tags = { bench.randomString(5), bench.randomString(8) },
+    active = i % 3 == 0,
+    parent = i > 1 and i - 1 or JSON.null
+  }
+end
+local doc = { total = #items, items = items }
+local text = JSON.stringify(doc)
+
+bench.sync("json.stringify", { iterations = 20, bytes = #text }, function ()
+  JSON.stringify(doc)
+end)
+
+bench.sync("json.parse", { iterations = 20, bytes = #text }, function ()
+  JSON.parse(text)
+end)
@@ -0,0 +1,65 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local bench = require('./common')
+local net = require('net')
+
+local HOST = "127.0.0.1"
+
+-- Round trips of one chunk each, timing how long every echo takes
+local chunk = bench.randomString(64 * 1024)
+local rounds = bench.scale(1000)
+
+local server = net.createServer(function (client)
+  client:on('data', function (data)
+    client:write(data)
+  end)
+  client:on('end', function ()
+    client:done()
+  end)
+end)
+
+server:listen(bench.port, HOST, function ()
+  local rec = bench.recorder()
+  local client
+  local round = 0
+  local received = 0
+  local start
+
+  local function send()
+    round = round + 1
+    if round > rounds then
+      rec:report("stream.echo", { bytes = #chunk * rounds })
+      client:done()
+      server:close()
+      return
+    end
+    received = 0
+    start = rec:start()
+    client:write(chunk)
+  end
+
+  client = net.createConnection(bench.port, HOST, send)
+  client:on('data', function (data)
+    received = received + #data
+    if received == #chunk then
+      rec:stop(start)
+      send()
+    end
+  end)
+end)
@@ -0,0 +1,102 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local bench = require('./common')
+local tls = require('tls')
+local fs = require('fs')
+local path = require('path')
+
+local HOST = "127.0.0.1"
+local ca = path.join(__dirname, '..', 'tests', 'ca')
+local options = {
+  key = fs.readFileSync(path.join(ca, 'server.key.insecure')),
+  cert = fs.readFileSync(path.join(ca, 'server.crt'))
+}
+
+local handshakes = bench.scale(300)
+local chunk = bench.randomString(64 * 1024)
+local bulkBytes = bench.scale(256) * #chunk
+
+local mode = "handshake"
+local server = tls.createServer(options, function (conn)
+  if mode == "handshake" then
+    return conn:done()
+  end
+  local received = 0
+  conn:on('data', function (data)
+    received = received + #data
+    if received >= bulkBytes then
+      conn:write("done")
+    end
+  end)
+end)
+
+-- One connection at a time, full handshakes without session reuse
+local function handshake(done)
+  local rec = bench.recorder()
+  local i = 0
+  local function nextConnection()
+    i = i + 1
+    if i > handshakes then
+      rec:report("tls.handshake", { unit = "handshakes/s" })
+      return done()
+    end
+    local start = rec:start()
+    local conn
+    conn = tls.connect({ port = bench.port, host = HOST }, function ()
+      rec:stop(start)
+    end)
+    conn:on('end', function ()
+      conn:destroy()
+      nextConnection()
+    end)
+    conn:on('error', function (err) error(err) end)
+  end
+  nextConnection()
+end
+
+-- Client to server throughput over one connection
+local function bulk(done)
+  mode = "bulk"
+  local rec = bench.recorder()
+  local conn
+  local start
+  local sent = 0
+  local function fill()
+    while sent < bulkBytes do
+      sent = sent + #chunk
+      if conn:write(chunk) == false then
+        return conn:once('drain', fill)
+      end
+    end
+  end
+  conn = tls.connect({ port = bench.port, host = HOST }, function ()
+    start = rec:start()
+    fill()
+  end)
+  conn:on('data', function ()
+    rec:stop(start)
+    rec:report("tls.bulk", { bytes = bulkBytes })
+    conn:destroy()
+    done()
+  end)
+end
+
+server:listen(bench.port, HOST, function ()
+  bench.series({ handshake, bulk, function () server:close() end })
+end)
@@ -0,0 +1,87 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local bench = require('./common')
+local dgram = require('dgram')
+local timer = require('timer')
+
+local HOST = "127.0.0.1"
+
+-- Packets kept in flight, the receiver acks each window so the loopback
+-- buffers never overflow and drop
+local WINDOW = 64
+local packets = bench.scale(100000)
+local payload = bench.randomString(512)
+
+local receiver = dgram.createSocket('udp4')
+local sender = dgram.createSocket('udp4')
+local rec = bench.recorder()
+local received = 0
+local sent = 0
+local start
+
+local function sendWindow()
+  for _ = 1, WINDOW do
+    if sent >= packets then return end
+    sent = sent + 1
+    sender:send(payload, bench.port, HOST)
+  end
+end
+
+local watchdog
+local function finish()
+  timer.clearTimer(watchdog)
+  rec:stop(start)
+  rec:report("udp.pps", {
+    count = received,
+    unit = "packets/s",
+    fields = { lost = sent - received }
+  })
+  receiver:close()
+  sender:close()
+end
+
+-- Lost packets or acks stall the window, send on or give up at the end
+local lastReceived = -1
+watchdog = timer.setInterval(200, function ()
+  if received ~= lastReceived then
+    lastReceived = received
+  elseif sent >= packets then
+    finish()
+  else
+    sendWindow()
+  end
+end)
+
+receiver:on('message', function (msg)
+  received = received + 1
+  if received == packets then
+    finish()
+  elseif received % WINDOW == 0 then
+    receiver:send("ack", bench.port + 1, HOST)
+  end
+end)
+
+sender:on('message', function ()
+  sendWindow()
+end)
+
+receiver:bind(bench.port, HOST)
+sender:bind(bench.port + 1, HOST)
+start = rec:start()
+sendWindow()
@@ -0,0 +1,60 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local bench = require('./common')
+local zlibNative = require('zlib_native')
+local table = require('table')
+
+-- Text with some repetition in it, compresses to about a third
+local words = {}
+for i = 1, 512 do
+  words[i] = bench.randomString(3 + i % 7, "etaoinshrdlu")
+end
+local parts = {}
+local size = 0
+while size < 1024 * 1024 do
+  local word = words[(#parts * 7919) % #words + 1]
+  parts[#parts + 1] = word
+  size = size + #word + 1
+end
+local input = table.concat(parts, " ")
+local compressed = zlibNative.new('deflate', 6):write(input, "finish")
+
+bench.sync("zlib.deflate", { iterations = 4, bytes = #input }, function ()
+  zlibNative.new('deflate', 6):write(input, "finish")
+end)
+
+bench.sync("zlib.inflate", { iterations = 10, bytes = #input }, function ()
+  zlibNative.new('inflate'):write(compressed, "finish")
+end)
+
+-- The same on the thread pool, one stream after the other
+local rounds = bench.scale(40)
+local rec = bench.recorder()
+local function deflateAsync(i)
+  if i > rounds then
+    return rec:report("zlib.deflateAsync", { bytes = #input * rounds })
+  end
+  local start = rec:start()
+  zlibNative.new('deflate', 6):writeAsync(input, "finish", function (err)
+    assert(not err, err)
+    rec:stop(start)
+    deflateAsync(i + 1)
+  end)
+end
+deflateAsync(1)
@@ -0,0 +1,173 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+-- Shared helpers of the benchmarks, each prints its results as JSON lines
+
+local hrtime = require('uv').Process.hrtime
+local JSON = require('json')
+local math = require('math')
+local table = require('table')
+
+local bench = {}
+
+-- Every run works on the same data
+math.randomseed(1234)
+
+bench.hrtime = hrtime
+
+-- The port each benchmark listens on, run.lua hands out a fresh one
+bench.port = tonumber(process.env.PORT) or 10900
+
+-- Quick runs for checking the benchmarks work, not for numbers
+bench.quick = process.env.BENCH_QUICK ~= nil
+
+-- n scaled down in quick runs
+function bench.scale(n)
+  if bench.quick then
+    return math.max(1, math.floor(n / 20))
+  end
+  return n
+end
+
+-- length pseudo random bytes drawn from alphabet, the same every run
+function bench.randomString(length, alphabet)
+  alphabet = alphabet or "abcdefghijklmnopqrstuvwxyz0123456789 "
+  local parts = {}
+  for i = 1, length do
+    local n = math.random(#alphabet)
+    parts[i] = alphabet:sub(n, n)
+  end
+  return table.concat(parts)
+end
+
+-- The q quantile of a sorted list
+local function quantile(sorted, q)
+  if #sorted == 0 then return 0 end
+  return sorted[math.max(1, math.ceil(#sorted * q))]
+end
+
+--[[
+Collects how long each operation took, in ms:
+
+    local rec = bench.recorder()
+    local start = rec:start()
+    ...
+    rec:stop(start)
+    rec:report("http.get", { bytes = total })
+
+report prints name, value, unit, count, p50, p99, mean and max.  value is
+MB/s when bytes is given, or operations per second using rate, "req/s"
+or such, as the unit.  Both go by the wall time from the first start to
+the last stop.  options.fields are copied into the result.
+]]
+local Recorder = {}
+Recorder.__index = Recorder
+
+function bench.recorder()
+  return setmetatable({ samples = {}, first = nil, last = nil }, Recorder)
+end
+
+function Recorder:start()
+  local now = hrtime()
+  if not self.first then self.first = now end
+  return now
+end
+
+function Recorder:stop(start)
+  local now = hrtime()
+  self.samples[#self.samples + 1] = now - start
+  self.last = now
+end
+
+-- Records a sample of ms that was timed some other way
+function Recorder:add(ms)
+  self.samples[#self.samples + 1] = ms
+end
+
+function Recorder:report(name, options)
+  options = options or {}
+  local samples = self.samples
+  table.sort(samples)
+  local total = 0
+  for i = 1, #samples do total = total + samples[i] end
+  local elapsed = options.elapsed or ((self.last or 0) - (self.first or 0))
+  if elapsed <= 0 then elapsed = total end
+  local count = options.count or #samples
+  local result = {
+    name = name,
+    count = count,
+    p50 = quantile(samples, 0.50),
+    p99 = quantile(samples, 0.99),
+    mean = #samples > 0 and total / #samples or 0,
+    max = samples[#samples] or 0
+  }
+  for key, value in pairs(options.fields or {}) do
+    result[key] = value
+  end
+  if options.bytes then
+    result.unit = "MB/s"
+    result.value = options.bytes / 1048576 / (elapsed / 1000)
+  else
+    result.unit = options.unit or "ops/s"
+    result.value = count / (elapsed / 1000)
+  end
+  bench.report(result)
+end
+
+-- Prints a result as one JSON line
+function bench.report(result)
+  process.stdout:write(JSON.stringify(result) .. "\n")
+end
+
+--[[
+Times fn(i) synchronously, options.iterations calls per sample for
+options.samples samples after a warm up round.  p50 and p99 are of the
+per call time of the samples.
+]]
+function bench.sync(name, options, fn)
+  local iterations = bench.scale(options.iterations or 1000)
+  local rounds = options.samples or 20
+  for i = 1, iterations do fn(i) end
+  local rec = bench.recorder()
+  local elapsed = 0
+  for _ = 1, rounds do
+    local start = hrtime()
+    for i = 1, iterations do fn(i) end
+    local time = hrtime() - start
+    elapsed = elapsed + time
+    rec:add(time / iterations)
+  end
+  rec:report(name, {
+    count = iterations * rounds,
+    elapsed = elapsed,
+    bytes = options.bytes and options.bytes * iterations * rounds,
+    unit = options.unit
+  })
+end
+
+-- Runs the async scenarios in order, each calls done() when it's finished
+function bench.series(steps)
+  local i = 0
+  local function nextStep()
+    i = i + 1
+    if steps[i] then steps[i](nextStep) end
+  end
+  nextStep()
+end
+
+return bench
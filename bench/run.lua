@@ -0,0 +1,159 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+--[[
+Runs the bench-*.lua benchmarks one after the other and checks their
+results against baseline.json.
+
+    luvit run.lua [--save] [--tolerance 0.15] [name ...]
+
+Every result comes out on stdout as a JSON line with the baseline value
+and the relative change added, a summary goes to stderr.  A value more than
+tolerance below its baseline is a regression and fails the run.  --save
+merges the results into baseline.json instead of checking them.  Names
+pick benchmarks by file, "json" runs bench-json.lua.  BENCH_QUICK=1 makes
+every benchmark do a fraction of the work, for checking they run.
+]]
+
+local childprocess = require('childprocess')
+local fs = require('fs')
+local path = require('path')
+local JSON = require('json')
+local table = require('table')
+local string = require('string')
+
+local baselinePath = path.join(__dirname, 'baseline.json')
+
+local save = false
+local tolerance = tonumber(process.env.BENCH_TOLERANCE) or 0.15
+local only = {}
+local i = 1
+while process.argv[i] do
+  local arg = process.argv[i]
+  if arg == "--save" then
+    save = true
+  elseif arg == "--tolerance" then
+    i = i + 1
+    tolerance = tonumber(process.argv[i])
+  else
+    only[arg] = true
+  end
+  i = i + 1
+end
+
+local files = {}
+for _, name in ipairs(fs.readdirSync(__dirname)) do
+  local short = name:match('^bench%-(.*)%.lua$')
+  if short and (next(only) == nil or only[short]) then
+    files[#files + 1] = name
+  end
+end
+table.sort(files)
+
+local baseline = {}
+if fs.existsSync(baselinePath) then
+  baseline = JSON.parse(fs.readFileSync(baselinePath))
+end
+
+local results = {}
+local failed = {}
+local regressions = {}
+local port = 10900
+local finish
+
+-- Checks a result against the baseline and prints it
+local function compare(result)
+  local base = baseline[result.name]
+  if base and base.unit == result.unit and base.value > 0 then
+    result.baseline = base.value
+    result.change = result.value / base.value - 1
+    if result.change < -tolerance then
+      result.status = "regression"
+      regressions[#regressions + 1] = result
+    else
+      result.status = "ok"
+    end
+  else
+    result.status = "new"
+  end
+  process.stdout:write(JSON.stringify(result) .. "\n")
+end
+
+local function runFile(index)
+  local file = files[index]
+  if not file then return finish() end
+  port = port + 10
+  local env = { PORT = tostring(port), PATH = process.env.PATH }
+  if process.env.BENCH_QUICK then env.BENCH_QUICK = process.env.BENCH_QUICK end
+  local child = childprocess.spawn(process.argv[0], { path.join(__dirname, file) }, { env = env })
+  local stdout, stderr = {}, {}
+  child.stdout:on('data', function (chunk) stdout[#stdout + 1] = chunk end)
+  child.stderr:on('data', function (chunk) stderr[#stderr + 1] = chunk end)
+  -- 'exit' can come before the pipes are read to the end, the results are
+  -- only complete once the exit and both ends are in
+  local code
+  local waiting = 3
+  local function settle()
+    waiting = waiting - 1
+    if waiting > 0 then return end
+    for line in table.concat(stdout):gmatch("[^\n]+") do
+      if line:sub(1, 1) == "{" then
+        local result = JSON.parse(line)
+        result.file = file
+        results[#results + 1] = result
+        compare(result)
+      end
+    end
+    if code ~= 0 then
+      failed[#failed + 1] = file
+      process.stderr:write(file .. " failed with " .. code .. "\n" .. table.concat(stderr))
+    end
+    runFile(index + 1)
+  end
+  child.stdout:on('end', settle)
+  child.stderr:on('end', settle)
+  child:on('exit', function (exitCode)
+    code = exitCode
+    settle()
+  end)
+end
+
+finish = function ()
+  if save then
+    for _, result in ipairs(results) do
+      baseline[result.name] = {
+        value = result.value,
+        unit = result.unit,
+        p50 = result.p50,
+        p99 = result.p99
+      }
+    end
+    fs.writeFileSync(baselinePath, JSON.stringify(baseline, { beautify = true }) .. "\n")
+    process.stderr:write("Saved " .. #results .. " results to " .. baselinePath .. "\n")
+    return process.exit(#failed > 0 and 1 or 0)
+  end
+  for _, result in ipairs(regressions) do
+    process.stderr:write(string.format("REGRESSION %s: %.2f %s, baseline %.2f (%+.1f%%)\n",
+      result.name, result.value, result.unit, result.baseline, result.change * 100))
+  end
+  process.stderr:write(string.format("%d results, %d regressions, %d failed\n",
+    #results, #regressions, #failed))
+  process.exit((#regressions > 0 or #failed > 0) and 1 or 0)
+end
+
+runFile(1)
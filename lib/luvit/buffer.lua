@@ -17,29 +17,53 @@ limitations under the License.
 --]]
 
 local table = require('table')
+local math = require('math')
+local string = require('string')
 local Object = require('core').Object
 local bit = require('bit')
 local ffi = require('ffi')
 ffi.cdef([[
   void *malloc (size_t __size);
   void free (void *__ptr);
+  void *memmove (void *__dest, const void *__src, size_t __n);
+  void *memchr (const void *__s, int __c, size_t __n);
+  int memcmp (const void *__s1, const void *__s2, size_t __n);
 ]])
 
 local buffer = {}
 
+--[[
+A fixed size block of native memory.  Offsets are 1-based like strings and
+ranges include both ends.  Buffers go straight to the native write paths
+of streams, files, TLS and zlib without becoming strings first.
+
+    local buf = Buffer:new(8)
+    buf:writeUInt32BE(1, 0xdeadbeef)
+    buf:readUInt16LE(3)
+    buf:slice(5, 8)   -- shares the memory of buf
+]]
 local Buffer = Object:extend()
 buffer.Buffer = Buffer
 
-function Buffer:initialize(length)
+local bytePointer = ffi.typeof("unsigned char*")
+
+function Buffer:initialize(length, size, finalizer)
   if type(length) == "number" then
     self.length = length
-    self.ctype = ffi.gc(ffi.cast("unsigned char*", ffi.C.malloc(length)), ffi.C.free)
+    self.ctype = ffi.gc(ffi.cast(bytePointer, ffi.C.malloc(length)), ffi.C.free)
   elseif type(length) == "string" then
+    -- Copied, Lua strings are immutable and may be collected under us
     local string = length
     self.length = #string
-    self.ctype = ffi.cast("unsigned char*", string)
+    self.ctype = ffi.gc(ffi.cast(bytePointer, ffi.C.malloc(#string)), ffi.C.free)
+    ffi.copy(self.ctype, string, #string)
+  elseif type(length) == "userdata" then
+    -- Take ownership of malloc'd native memory, like the chunks handed out
+    -- by Stream:readStart2(), or of other memory released by finalizer
+    self.length = size
+    self.ctype = ffi.gc(ffi.cast(bytePointer, length), finalizer or ffi.C.free)
   else
-    error("Input must be a string or number")
+    error("Input must be a string, number or pointer")
   end
 end
 
@@ -54,7 +78,11 @@ function Buffer.meta:__ipairs()
 end
 
 function Buffer.meta:__tostring()
-  return ffi.string(self.ctype)
+  return ffi.string(self.ctype, self.length)
+end
+
+function Buffer.meta:__len()
+  return self.length
 end
 
 function Buffer.meta:__concat(other)
@@ -72,6 +100,7 @@ end
 function Buffer.meta:__newindex(key, value)
   if type(key) == "number" then
     if key < 1 or key > self.length then error("Index out of bounds") end
+    if self.readonly then error("Buffer is read-only") end
     self.ctype[key - 1] = value
     return
   end
@@ -86,65 +115,389 @@ function Buffer:inspect()
   return "<Buffer " .. table.concat(parts, " ") .. ">"
 end
 
+-- Pointer to size bytes at offset, or an error naming the caller's line
+local function at(self, offset, size)
+  if offset < 1 or offset + size - 1 > self.length then
+    error("Index out of bounds", 3)
+  end
+  return self.ctype + (offset - 1)
+end
+
+local function writable(self, offset, size)
+  if self.readonly then error("Buffer is read-only", 3) end
+  return at(self, offset, size)
+end
+
 local function compliment8(value)
   return value < 0x80 and value or -0x100 + value
 end
 
+local function compliment16(value)
+  return value < 0x8000 and value or -0x10000 + value
+end
+
 function Buffer:readUInt8(offset)
-  return self[offset]
+  return at(self, offset, 1)[0]
 end
 
 function Buffer:readInt8(offset)
-  return compliment8(self[offset])
+  return compliment8(at(self, offset, 1)[0])
 end
 
-local function compliment16(value)
-  return value < 0x8000 and value or -0x10000 + value
+function Buffer:writeUInt8(offset, value)
+  writable(self, offset, 1)[0] = value
 end
+Buffer.writeInt8 = Buffer.writeUInt8
+
+-- Wider values are read and written through pointers of their type, with
+-- a byte swap when the order asked for isn't the machine's.  Floats go
+-- through scratch so their loads are always aligned.
+local uint16Pointer = ffi.typeof("uint16_t*")
+local uint32Pointer = ffi.typeof("uint32_t*")
+local int32Pointer = ffi.typeof("int32_t*")
+local scratch = ffi.new("union { uint8_t bytes[8]; float f; double d; }")
 
-function Buffer:readUInt16LE(offset)
-  return bit.lshift(self[offset + 1], 8) +
-                    self[offset]
+local function swap16(value)
+  return bit.rshift(bit.bswap(value), 16)
 end
 
-function Buffer:readUInt16BE(offset)
-  return bit.lshift(self[offset], 8) +
-                    self[offset + 1]
+local function toScratch(pointer, size, swap)
+  if swap then
+    for i = 0, size - 1 do
+      scratch.bytes[i] = pointer[size - 1 - i]
+    end
+  else
+    ffi.copy(scratch.bytes, pointer, size)
+  end
 end
 
-function Buffer:readInt16LE(offset)
-  return compliment16(self:readUInt16LE(offset))
+local function fromScratch(pointer, size, swap)
+  if swap then
+    for i = 0, size - 1 do
+      pointer[i] = scratch.bytes[size - 1 - i]
+    end
+  else
+    ffi.copy(pointer, scratch.bytes, size)
+  end
 end
 
-function Buffer:readInt16BE(offset)
-  return compliment16(self:readUInt16BE(offset))
+local function defineOrder(order, swap)
+  Buffer["readUInt16" .. order] = function (self, offset)
+    local value = ffi.cast(uint16Pointer, at(self, offset, 2))[0]
+    return swap and swap16(value) or value
+  end
+
+  Buffer["readInt16" .. order] = function (self, offset)
+    local value = ffi.cast(uint16Pointer, at(self, offset, 2))[0]
+    return compliment16(swap and swap16(value) or value)
+  end
+
+  Buffer["readUInt32" .. order] = function (self, offset)
+    local value = ffi.cast(uint32Pointer, at(self, offset, 4))[0]
+    return swap and bit.bswap(value) % 0x100000000 or value
+  end
+
+  Buffer["readInt32" .. order] = function (self, offset)
+    local value = ffi.cast(int32Pointer, at(self, offset, 4))[0]
+    return swap and bit.bswap(value) or value
+  end
+
+  Buffer["readFloat" .. order] = function (self, offset)
+    toScratch(at(self, offset, 4), 4, swap)
+    return scratch.f
+  end
+
+  Buffer["readDouble" .. order] = function (self, offset)
+    toScratch(at(self, offset, 8), 8, swap)
+    return scratch.d
+  end
+
+  Buffer["writeUInt16" .. order] = function (self, offset, value)
+    ffi.cast(uint16Pointer, writable(self, offset, 2))[0] = swap and swap16(value) or value
+  end
+
+  Buffer["writeUInt32" .. order] = function (self, offset, value)
+    -- bit ops work modulo 2^32, so this takes signed values too
+    ffi.cast(int32Pointer, writable(self, offset, 4))[0] = swap and bit.bswap(value) or bit.tobit(value)
+  end
+
+  Buffer["writeFloat" .. order] = function (self, offset, value)
+    local pointer = writable(self, offset, 4)
+    scratch.f = value
+    fromScratch(pointer, 4, swap)
+  end
+
+  Buffer["writeDouble" .. order] = function (self, offset, value)
+    local pointer = writable(self, offset, 8)
+    scratch.d = value
+    fromScratch(pointer, 8, swap)
+  end
+
+  Buffer["writeInt16" .. order] = Buffer["writeUInt16" .. order]
+  Buffer["writeInt32" .. order] = Buffer["writeUInt32" .. order]
 end
 
-function Buffer:readUInt32LE(offset)
-  return self[offset + 3] * 0x1000000 +
-         bit.lshift(self[offset + 2], 16) +
-         bit.lshift(self[offset + 1], 8) +
-                    self[offset]
+defineOrder("LE", not ffi.abi("le"))
+defineOrder("BE", ffi.abi("le"))
+
+-- Checks an inclusive i..j range like string.sub takes, defaulting to all
+local function range(self, i, j)
+  i = i or 1
+  j = j or self.length
+  if i < 1 or j > self.length or j < i - 1 then
+    error("Range out of bounds", 3)
+  end
+  return i, j
 end
 
-function Buffer:readUInt32BE(offset)
-  return self[offset] * 0x1000000 +
-         bit.lshift(self[offset + 1], 16) +
-         bit.lshift(self[offset + 2], 8) +
-                    self[offset + 3]
+function Buffer:toString(i, j)
+  i, j = range(self, i, j)
+  return ffi.string(self.ctype + (i - 1), j - i + 1)
 end
 
-function Buffer:readInt32LE(offset)
-  return bit.tobit(self:readUInt32LE(offset))
+--[[
+A Buffer over bytes i to j of this one.  It shares the memory, so writes
+show through both ways, and keeps this Buffer alive while it's in use.
+]]
+function Buffer:slice(i, j)
+  i, j = range(self, i, j)
+  local view = Buffer:create()
+  view.length = j - i + 1
+  view.ctype = self.ctype + (i - 1)
+  view.parent = self
+  view.readonly = self.readonly
+  return view
 end
 
-function Buffer:readInt32BE(offset)
-  return bit.tobit(self:readUInt32BE(offset))
+-- Copies bytes sourceStart to sourceEnd into target at targetStart, as much
+-- as fits, and returns how many were copied.  The ranges may overlap.
+function Buffer:copy(target, targetStart, sourceStart, sourceEnd)
+  targetStart = targetStart or 1
+  sourceStart, sourceEnd = range(self, sourceStart, sourceEnd)
+  if target.readonly then error("Buffer is read-only") end
+  if targetStart < 1 or targetStart > target.length + 1 then
+    error("Index out of bounds")
+  end
+  local count = math.min(sourceEnd - sourceStart + 1, target.length - targetStart + 1)
+  ffi.C.memmove(target.ctype + (targetStart - 1), self.ctype + (sourceStart - 1), count)
+  return count
 end
 
-function Buffer:toString(i, j)
-  local offset = i and i - 1 or 0
-  return ffi.string(self.ctype + offset, (j or self.length) - offset)
+-- Sets bytes i to j to value, a byte or the first byte of a string
+function Buffer:fill(value, i, j)
+  if self.readonly then error("Buffer is read-only") end
+  i, j = range(self, i, j)
+  if type(value) == "string" then
+    value = value:byte(1)
+  end
+  ffi.fill(self.ctype + (i - 1), j - i + 1, value)
+  return self
+end
+
+-- Offset of the first value at or after start, a byte, a string or a
+-- Buffer, or nil when there's none
+function Buffer:indexOf(value, start)
+  start = start or 1
+  if start < 1 then error("Index out of bounds") end
+  local base = self.ctype
+  local last = self.length
+  if type(value) == "number" then
+    if start > last then return end
+    local found = ffi.C.memchr(base + (start - 1), value, last - start + 1)
+    if found == nil then return end
+    return tonumber(ffi.cast(bytePointer, found) - base) + 1
+  end
+
+  local needle, size
+  if type(value) == "string" then
+    needle, size = value, #value
+  else
+    needle, size = value.ctype, value.length
+  end
+  if size == 0 then
+    return start <= last + 1 and start or nil
+  end
+  local first = type(needle) == "string" and needle:byte(1) or needle[0]
+  local offset = start
+  while offset + size - 1 <= last do
+    local found = ffi.C.memchr(base + (offset - 1), first, last - size + 2 - offset)
+    if found == nil then return end
+    found = ffi.cast(bytePointer, found)
+    if ffi.C.memcmp(found, needle, size) == 0 then
+      return tonumber(found - base) + 1
+    end
+    offset = tonumber(found - base) + 2
+  end
+end
+
+--[[
+A queue of chunks for data that arrives in pieces, so building it up
+doesn't copy what came before.  Strings and Buffers go in, strings come
+out, and the bytes are only joined once they're taken.  Buffers are held
+as they are, so leave them alone until their bytes have been taken.
+
+    local list = BufferList:new()
+    list:push(chunk)
+    local line = list:readUntil("\r\n")  -- nil until a whole line is in
+    local body = list:toString()
+]]
+local BufferList = Object:extend()
+buffer.BufferList = BufferList
+
+function BufferList:initialize()
+  self.chunks = {}
+  self.first = 1
+  self.last = 0
+  -- Bytes of chunks[first] already consumed
+  self.offset = 0
+  self.length = 0
+  -- How far readUntil has looked for its delimiter without finding it
+  self.scanned = 0
+end
+
+function BufferList.meta:__len()
+  return self.length
+end
+
+-- Chunks are strings or Buffers, these read either
+local function chunkLength(chunk)
+  return type(chunk) == "string" and #chunk or chunk.length
+end
+
+local function chunkSub(chunk, i, j)
+  if type(chunk) == "string" then
+    return chunk:sub(i, j)
+  end
+  j = math.min(j or chunk.length, chunk.length)
+  if j < i then return "" end
+  return chunk:toString(i, j)
+end
+
+function BufferList:push(chunk)
+  if type(chunk) ~= "string" and not (type(chunk) == "table" and chunk.ctype) then
+    chunk = tostring(chunk)
+  end
+  local length = chunkLength(chunk)
+  if length == 0 then return end
+  self.last = self.last + 1
+  self.chunks[self.last] = chunk
+  self.length = self.length + length
+end
+
+-- Removes and returns the first n bytes, or all of them when there are fewer
+function BufferList:consume(n)
+  local chunks = self.chunks
+  n = math.min(n, self.length)
+  if n <= 0 then return "" end
+  self.length = self.length - n
+  self.scanned = math.max(self.scanned - n, 0)
+
+  local parts = {}
+  while n > 0 do
+    local chunk = chunks[self.first]
+    local available = chunkLength(chunk) - self.offset
+    if n < available then
+      parts[#parts + 1] = chunkSub(chunk, self.offset + 1, self.offset + n)
+      self.offset = self.offset + n
+      break
+    end
+    parts[#parts + 1] = chunkSub(chunk, self.offset + 1)
+    chunks[self.first] = nil
+    self.first = self.first + 1
+    self.offset = 0
+    n = n - available
+  end
+  if self.first > self.last then
+    self.first = 1
+    self.last = 0
+  end
+  return #parts == 1 and parts[1] or table.concat(parts)
+end
+
+-- Position of the first needle, a string or a byte, at or after start,
+-- matches across chunk boundaries included.  nil when there's none.
+function BufferList:indexOf(needle, start)
+  if type(needle) == "number" then
+    needle = string.char(needle)
+  end
+  start = math.max(start or 1, 1)
+  local size = #needle
+  if size == 0 then
+    return start <= self.length + 1 and start or nil
+  end
+
+  local chunks = self.chunks
+  -- Position in the list of the first byte of chunk i
+  local base = 1 - self.offset
+  for i = self.first, self.last do
+    local chunk = chunks[i]
+    local length = chunkLength(chunk)
+    local limit = base + length
+    if limit > start then
+      -- Only the first chunk has bytes before the list's start
+      local skip = i == self.first and self.offset or 0
+      local from = math.max(start - base + 1, skip + 1)
+      local found
+      if type(chunk) == "string" then
+        found = chunk:find(needle, from, true)
+      elseif from <= length then
+        found = chunk:indexOf(needle, from)
+      end
+      if found then
+        return base + found - 1
+      end
+      -- A match starting in the last size - 1 bytes runs into later chunks
+      if size > 1 and i < self.last then
+        local tailStart = math.max(length - size + 2, from)
+        if tailStart <= length then
+          local parts = { chunkSub(chunk, tailStart) }
+          local have = #parts[1]
+          local j = i + 1
+          while have < #parts[1] + size - 1 and j <= self.last do
+            parts[#parts + 1] = chunkSub(chunks[j], 1, size - 1)
+            have = have + #parts[#parts]
+            j = j + 1
+          end
+          found = table.concat(parts):find(needle, 1, true)
+          if found and found <= #parts[1] then
+            return base + tailStart + found - 2
+          end
+        end
+      end
+    end
+    base = limit
+  end
+end
+
+-- Takes the bytes up to delimiter and the delimiter itself off the front
+-- and returns the former, or nil when delimiter hasn't come yet.  Where
+-- the last search stopped is remembered, so feeding a long line in many
+-- chunks doesn't search it over and over.
+function BufferList:readUntil(delimiter)
+  local found = self:indexOf(delimiter, self.scanned - #delimiter + 2)
+  if not found then
+    self.scanned = self.length
+    return
+  end
+  local data = self:consume(found - 1)
+  self:consume(#delimiter)
+  self.scanned = 0
+  return data
+end
+
+-- Joins everything into a single chunk without consuming it
+function BufferList:toString()
+  if self.length == 0 then return "" end
+  local chunk = self.chunks[self.first]
+  if self.first == self.last and self.offset == 0 and type(chunk) == "string" then
+    return chunk
+  end
+  local scanned = self.scanned
+  local data = self:consume(self.length)
+  self:push(data)
+  self.scanned = scanned
+  return data
 end
+BufferList.meta.__tostring = BufferList.toString
 
 return buffer
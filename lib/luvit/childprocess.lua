@@ -16,6 +16,10 @@ limitations under the License.
 
 --]]
 local Process = require('uv').Process
+local Emitter = require('core').Emitter
+local Error = require('core').Error
+local BufferList = require('buffer').BufferList
+local timer = require('timer')
 local table = require('table')
 
 local childProcess = {}
@@ -31,8 +35,15 @@ function childProcess.spawn(command, args, options)
     env = process.env
   end
 
+  local n = 0
   for k, v in pairs(env) do
-    table.insert(envPairs, k .. '=' .. v)
+    n = n + 1
+    envPairs[n] = k .. '=' .. v
+  end
+
+  -- The child opens its end of the ipc channel from here
+  if options.ipc then
+    envPairs[n + 1] = 'LUVIT_CHANNEL_FD=3'
   end
 
   options.envPairs = envPairs
@@ -57,5 +68,334 @@ function childProcess.execFile(command, args, options, callback)
   end)
 end
 
+--[[
+A pool of long-lived children serving framed requests over their stdio, for
+tools that would otherwise be spawned once per job.
+
+    local pool = childProcess.createPool("resize-server", {}, { size = 4 })
+    pool:request(payload, function (err, response) ... end)
+    pool:close()
+
+Requests go to a child's stdin and responses are read back from its stdout
+in the same order, so a child must answer each request with exactly one
+response.  With framing "line", the default, a frame is a line ending in
+"\n".  With "length" it is its size in decimal, "\n", then that many bytes,
+for payloads with newlines in them.
+
+options, besides those for spawn:
+
+    size          children kept running, 4 by default
+    concurrency   requests written to a child ahead of its answers, 1
+    maxQueue      requests waiting for a child before new ones fail with
+                  EAGAIN, unlimited by default
+    timeout       ms a request may take, past it the child is replaced
+    maxRequests   requests a child serves before it's replaced
+    restartDelay  ms before a child that exited is replaced, 100
+    maxSpawnErrors  spawns in a row that may fail before the pool stops
+                  trying, after which requests fail with the spawn error, 10
+
+A child that exits fails what it still had with ECHILD.  What children
+write to stderr is emitted as 'stderr' with the chunk and their pid.
+]]
+local Pool = Emitter:extend()
+childProcess.Pool = Pool
+
+Pool.size = 4
+Pool.concurrency = 1
+Pool.restartDelay = 100
+Pool.maxSpawnErrors = 10
+
+local function poolError(message, code)
+  local err = Error:new(message)
+  err.code = code
+  return err
+end
+
+function Pool:initialize(command, args, options)
+  options = options or {}
+  self.command = command
+  self.args = args or {}
+  self.options = options
+  self.size = options.size or Pool.size
+  self.concurrency = options.concurrency or Pool.concurrency
+  self.maxQueue = options.maxQueue
+  self.timeout = options.timeout
+  self.maxRequests = options.maxRequests
+  self.restartDelay = options.restartDelay or Pool.restartDelay
+  self.maxSpawnErrors = options.maxSpawnErrors or Pool.maxSpawnErrors
+  self.framing = options.framing or "line"
+  if self.framing ~= "line" and self.framing ~= "length" then
+    error("Unknown framing " .. tostring(self.framing))
+  end
+  self.workers = {}
+  -- Requests waiting for a child, first to last
+  self.queue = {}
+  self.first = 1
+  self.last = 0
+  self.served = 0
+  self.restarts = 0
+  self.timeouts = 0
+  self.spawnErrors = 0
+  -- Spawns that failed since the last one that worked
+  self.failedSpawns = 0
+  for i = 1, self.size do
+    self:_spawn()
+  end
+end
+
+function Pool:_spawn()
+  if self.closed then return end
+  local ok, child = pcall(childProcess.spawn, self.command, self.args, self.options)
+  if not ok then
+    self.spawnErrors = self.spawnErrors + 1
+    self.failedSpawns = self.failedSpawns + 1
+    -- With nobody left to serve them, waiting requests get the error
+    if #self.workers == 0 then
+      self:_failQueue(child)
+    end
+    -- The command is most likely missing, stop retrying it forever
+    if self.failedSpawns >= self.maxSpawnErrors then
+      self.spawnError = child
+      return
+    end
+    self:_respawn()
+    return
+  end
+  self.failedSpawns = 0
+  self.spawnError = nil
+  local worker = {
+    child = child,
+    pid = child.pid,
+    buffer = BufferList:new(),
+    inflight = {},
+    served = 0
+  }
+  self.workers[#self.workers + 1] = worker
+  child.stdout:on('data', function (chunk)
+    self:_onData(worker, chunk)
+  end)
+  child.stderr:on('data', function (chunk)
+    self:emit('stderr', chunk, worker.pid)
+  end)
+  child:on('exit', function (code, signal)
+    self:_onExit(worker, code, signal)
+  end)
+  self:_dispatch()
+end
+
+function Pool:_respawn()
+  timer.setTimeout(self.restartDelay, function ()
+    self:_spawn()
+  end)
+end
+
+-- Takes worker out of the pool, it gets no more requests
+function Pool:_remove(worker)
+  local workers = self.workers
+  for i = 1, #workers do
+    if workers[i] == worker then
+      table.remove(workers, i)
+      return true
+    end
+  end
+  return false
+end
+
+-- Lets a child finish what it has and exit on end of input
+function Pool:_retire(worker)
+  if worker.retired then return end
+  worker.retired = true
+  if self:_remove(worker) then
+    self:_spawn()
+  end
+  if #worker.inflight == 0 then
+    worker.child.stdin:close()
+  end
+end
+
+function Pool:_onExit(worker, code, signal)
+  local replace = self:_remove(worker)
+  worker.exited = true
+  local inflight = worker.inflight
+  worker.inflight = {}
+  for i = 1, #inflight do
+    local request = inflight[i]
+    if request.timer then timer.clearTimer(request.timer) end
+    request.callback(poolError("child " .. worker.pid .. " exited with code "
+      .. tostring(code) .. " and signal " .. tostring(signal), "ECHILD"))
+  end
+  if replace and not self.closed then
+    self.restarts = self.restarts + 1
+    self:_respawn()
+  end
+  self:_dispatch()
+end
+
+function Pool:_onData(worker, chunk)
+  local buffer = worker.buffer
+  buffer:push(chunk)
+  while not worker.exited do
+    local frame
+    if self.framing == "line" then
+      frame = buffer:readUntil("\n")
+      if not frame then return end
+    else
+      if not worker.need then
+        local header = buffer:readUntil("\n")
+        if not header then return end
+        worker.need = tonumber(header)
+        if not worker.need then
+          -- Out of step with the child, start over with a new one
+          self:_remove(worker)
+          self:_respawn()
+          worker.child:kill(15)
+          return
+        end
+      end
+      if #buffer < worker.need then return end
+      frame = buffer:consume(worker.need)
+      worker.need = nil
+    end
+    self:_respond(worker, frame)
+  end
+end
+
+function Pool:_respond(worker, frame)
+  local request = table.remove(worker.inflight, 1)
+  -- Nobody asked, the child is talking out of turn
+  if not request then return end
+  if request.timer then timer.clearTimer(request.timer) end
+  worker.served = worker.served + 1
+  self.served = self.served + 1
+  if worker.retired then
+    if #worker.inflight == 0 then
+      worker.child.stdin:close()
+    end
+  elseif self.maxRequests and worker.served >= self.maxRequests then
+    self:_retire(worker)
+  end
+  request.callback(nil, frame)
+  self:_dispatch()
+end
+
+function Pool:_send(worker, request)
+  local inflight = worker.inflight
+  inflight[#inflight + 1] = request
+  local payload = request.payload
+  if self.framing == "line" then
+    worker.child.stdin:write({ payload, "\n" })
+  else
+    worker.child.stdin:write({ #payload .. "\n", payload })
+  end
+  if self.timeout then
+    request.timer = timer.setTimeout(self.timeout, function ()
+      request.timer = nil
+      self.timeouts = self.timeouts + 1
+      -- The answer may still come, so the child can't be trusted to stay in
+      -- step, it fails its other requests as it exits
+      for i = 1, #worker.inflight do
+        if worker.inflight[i] == request then
+          table.remove(worker.inflight, i)
+          break
+        end
+      end
+      if self:_remove(worker) then
+        self.restarts = self.restarts + 1
+        self:_spawn()
+      end
+      worker.child:kill(15)
+      request.callback(poolError("request timed out", "ETIMEDOUT"))
+    end)
+  end
+end
+
+-- Hands queued requests to the least busy children with room for them
+function Pool:_dispatch()
+  while self.first <= self.last do
+    local best
+    local workers = self.workers
+    for i = 1, #workers do
+      local worker = workers[i]
+      local load = #worker.inflight
+      if load < self.concurrency and (not best or load < #best.inflight) then
+        best = worker
+        if load == 0 then break end
+      end
+    end
+    if not best then return end
+    local request = self.queue[self.first]
+    self.queue[self.first] = nil
+    self.first = self.first + 1
+    self:_send(best, request)
+  end
+  self.first = 1
+  self.last = 0
+end
+
+function Pool:_failQueue(err)
+  local queue = self.queue
+  for i = self.first, self.last do
+    local request = queue[i]
+    queue[i] = nil
+    request.callback(err)
+  end
+  self.first = 1
+  self.last = 0
+end
+
+-- Sends payload, a string or Buffer, to the next free child.  callback(err,
+-- response) gets the response frame as a string.
+function Pool:request(payload, callback)
+  if self.closed then
+    return callback(poolError("pool is closed", "EPIPE"))
+  end
+  if self.spawnError and #self.workers == 0 then
+    return callback(self.spawnError)
+  end
+  if self.maxQueue and self.last - self.first + 1 >= self.maxQueue then
+    return callback(poolError("too many queued requests", "EAGAIN"))
+  end
+  self.last = self.last + 1
+  self.queue[self.last] = { payload = payload, callback = callback }
+  self:_dispatch()
+end
+
+-- Fails the queue and lets every child exit once it has answered what it's
+-- got, none are replaced anymore
+function Pool:close()
+  if self.closed then return end
+  self.closed = true
+  self:_failQueue(poolError("pool is closed", "EPIPE"))
+  local workers = self.workers
+  self.workers = {}
+  for i = 1, #workers do
+    local worker = workers[i]
+    worker.retired = true
+    if #worker.inflight == 0 then
+      worker.child.stdin:close()
+    end
+  end
+end
+
+function Pool:stats()
+  local busy = 0
+  for i = 1, #self.workers do
+    if #self.workers[i].inflight > 0 then busy = busy + 1 end
+  end
+  return {
+    workers = #self.workers,
+    busy = busy,
+    queued = self.last - self.first + 1,
+    served = self.served,
+    restarts = self.restarts,
+    timeouts = self.timeouts,
+    spawnErrors = self.spawnErrors
+  }
+end
+
+function childProcess.createPool(command, args, options)
+  return Pool:new(command, args, options)
+end
+
 return childProcess
 
@@ -0,0 +1,563 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local core = require('core')
+local uv = require('uv')
+local net = require('net')
+local timer = require('timer')
+local JSON = require('json')
+local childProcess = require('childprocess')
+local table = require('table')
+local BufferList = require('buffer').BufferList
+
+local Emitter = core.Emitter
+local Error = core.Error
+local Tcp = uv.Tcp
+local Pipe = uv.Pipe
+
+--[[
+Runs a server over several processes.  The master forks workers that run
+the same script, and the net servers they listen with get their sockets
+from the master:
+
+    local cluster = require('cluster')
+    if cluster.isMaster then
+      for i = 1, 4 do cluster.fork() end
+    else
+      require('http').createServer(onRequest):listen(8080)
+    end
+
+With schedulingPolicy "shared" every worker gets the listening socket and
+accepts from it.  With "rr" the master accepts and hands the connections to
+the workers in turn.  Workers that die are started again, and restart()
+replaces them one at a time without leaving the port unserved.
+
+Workers must require cluster before they listen.
+]]
+local cluster = Emitter:new()
+
+cluster.isWorker = process.env.LUVIT_CLUSTER_WORKER ~= nil
+cluster.isMaster = not cluster.isWorker
+
+-- The script arguments, without the interpreter's own
+local scriptArgs = {}
+for i = 1, #process.argv do
+  scriptArgs[i] = process.argv[i]
+end
+
+cluster.settings = {
+  -- Script the workers run
+  exec = process.script,
+  args = scriptArgs,
+  -- "shared" or "rr"
+  schedulingPolicy = "shared",
+  -- Start workers that die on their own again
+  autoRestart = true,
+  -- Milliseconds to wait before doing so, so a crashing worker doesn't spin
+  restartDelay = 100,
+  -- Milliseconds a disconnected worker gets before it's sent SIGTERM
+  killTimeout = 5000
+}
+
+--[[ Channel ]]--
+
+-- Newline separated JSON messages over an ipc pipe, a message can carry a
+-- handle along
+local Channel = Emitter:extend()
+
+function Channel:initialize(pipe)
+  self.pipe = pipe
+  self.buffer = BufferList:new()
+  -- Handles received ahead of the messages they came with
+  self.handles = {}
+
+  pipe:on('handle', function (kind)
+    local handle = kind == 'tcp' and Tcp:new() or Pipe:new(false)
+    pipe:accept(handle)
+    self.handles[#self.handles + 1] = handle
+  end)
+  pipe:on('data', function (chunk)
+    self:_onData(chunk)
+  end)
+  pipe:on('end', function ()
+    self:close()
+  end)
+  pipe:readStart()
+end
+
+function Channel:_onData(chunk)
+  local buffer = self.buffer
+  buffer:push(chunk)
+  while true do
+    local line = buffer:readUntil("\n")
+    if not line then break end
+    local message = JSON.parse(line)
+    local handle
+    if message.handle then
+      handle = table.remove(self.handles, 1)
+    end
+    self:emit('message', message, handle)
+  end
+end
+
+function Channel:send(message, handle, callback)
+  if self.closed then return end
+  if handle then
+    message.handle = true
+    self.pipe:write2(JSON.stringify(message) .. "\n", handle, callback)
+  else
+    self.pipe:write(JSON.stringify(message) .. "\n", callback)
+  end
+end
+
+function Channel:close()
+  if self.closed then return end
+  self.closed = true
+  if not self.pipe._closed then
+    self.pipe:close()
+  end
+  for i = 1, #self.handles do
+    self.handles[i]:close()
+  end
+  self.handles = {}
+  self:emit('close')
+end
+
+--[[ Master ]]--
+
+local function addressKey(ip, port)
+  return ip .. ":" .. port
+end
+
+local function bindHandle(ip, port, options)
+  local handle = Tcp:new()
+  local ok, err = pcall(function ()
+    if net.isIPv6(ip) == 6 then
+      handle:bind6(ip, port, options)
+    else
+      handle:bind(ip, port, options)
+    end
+  end)
+  if not ok then
+    handle:close()
+    return nil, err
+  end
+  return handle
+end
+
+-- key -> bound socket handed to every worker listening on it
+local sharedHandles = {}
+-- key -> { handle = listening socket, workers = {...}, next = n }
+local roundRobin = {}
+
+local function roundRobinRemove(worker, key)
+  local function remove(entry)
+    for i = #entry.workers, 1, -1 do
+      if entry.workers[i] == worker then
+        table.remove(entry.workers, i)
+      end
+    end
+  end
+  if key then
+    if roundRobin[key] then remove(roundRobin[key]) end
+    return
+  end
+  for _, entry in pairs(roundRobin) do
+    remove(entry)
+  end
+end
+
+local function roundRobinListen(key, ip, port, options)
+  local entry = roundRobin[key]
+  if entry then return entry end
+  local handle, err = bindHandle(ip, port, options)
+  if not handle then return nil, err end
+  entry = { handle = handle, workers = {}, next = 0 }
+  local ok
+  ok, err = pcall(handle.listen, handle, function (err)
+    if err then return end
+    local client = Tcp:new()
+    handle:accept(client)
+    local count = #entry.workers
+    if count == 0 then
+      return client:close()
+    end
+    entry.next = entry.next % count + 1
+    local worker = entry.workers[entry.next]
+    worker.channel:send({ cmd = "connection", key = key }, client, function ()
+      client:close()
+    end)
+  end, options and options.backlog)
+  if not ok then
+    handle:close()
+    return nil, err
+  end
+  roundRobin[key] = entry
+  return entry
+end
+
+local Worker = Emitter:extend()
+cluster.Worker = Worker
+
+-- id -> Worker, for the workers that are running
+cluster.workers = {}
+
+local nextId = 0
+local disconnecting = false
+
+function Worker:initialize(id, env)
+  local settings = cluster.settings
+  self.id = id
+  self.env = env
+  self.state = "starting"
+
+  local childEnv = {}
+  for name, value in pairs(process.env) do
+    childEnv[name] = value
+  end
+  for name, value in pairs(env or {}) do
+    childEnv[name] = value
+  end
+  childEnv.LUVIT_CLUSTER_WORKER = tostring(id)
+
+  local args = { settings.exec }
+  for i = 1, #settings.args do
+    args[i + 1] = settings.args[i]
+  end
+
+  self.process = childProcess.spawn(process.execPath, args, {
+    env = childEnv,
+    ipc = true
+  })
+  self.process.stdout:on('data', function (chunk)
+    process.stdout:write(chunk)
+  end)
+  self.process.stderr:on('data', function (chunk)
+    process.stderr:write(chunk)
+  end)
+
+  self.channel = Channel:new(self.process.channel)
+  self.channel:on('message', function (message, handle)
+    self:_onMessage(message, handle)
+  end)
+  self.process:on('exit', function (code, signal)
+    self:_onExit(code, signal)
+  end)
+end
+
+function Worker:_onMessage(message, handle)
+  local cmd = message.cmd
+  if cmd == "online" then
+    self.state = "online"
+    self:emit('online')
+    cluster:emit('online', self)
+  elseif cmd == "listen" then
+    self:_listen(message)
+  elseif cmd == "listening" then
+    self.state = "listening"
+    local address = { address = message.ip, port = message.port }
+    self:emit('listening', address)
+    cluster:emit('listening', self, address)
+  elseif cmd == "close" then
+    roundRobinRemove(self, message.key)
+  elseif cmd == "message" then
+    self:emit('message', message.data)
+    cluster:emit('message', self, message.data)
+  end
+  if handle then
+    handle:close()
+  end
+end
+
+function Worker:_listen(message)
+  local key = addressKey(message.ip, message.port)
+  local reply = { cmd = "listenReply", seq = message.seq }
+
+  if cluster.settings.schedulingPolicy == "rr" then
+    local entry, err = roundRobinListen(key, message.ip, message.port, message.options)
+    if not entry then
+      reply.error = tostring(err)
+    else
+      entry.workers[#entry.workers + 1] = self
+      reply.roundRobin = true
+    end
+    return self.channel:send(reply)
+  end
+
+  local handle = sharedHandles[key]
+  if not handle then
+    local err
+    handle, err = bindHandle(message.ip, message.port, message.options)
+    if not handle then
+      reply.error = tostring(err)
+      return self.channel:send(reply)
+    end
+    sharedHandles[key] = handle
+  end
+  self.channel:send(reply, handle)
+end
+
+function Worker:_onExit(code, signal)
+  self.state = "dead"
+  if self.killTimer then
+    timer.clearTimer(self.killTimer)
+    self.killTimer = nil
+  end
+  cluster.workers[self.id] = nil
+  roundRobinRemove(self)
+  self.channel:close()
+  self:emit('exit', code, signal)
+  cluster:emit('exit', self, code, signal)
+
+  if not self.suicide and not disconnecting and cluster.settings.autoRestart then
+    timer.setTimeout(cluster.settings.restartDelay, function ()
+      if not disconnecting then
+        cluster.fork(self.env)
+      end
+    end)
+  end
+end
+
+-- Sends data to the worker's cluster.worker 'message' listeners
+function Worker:send(data)
+  self.channel:send({ cmd = "message", data = data })
+end
+
+--[[
+Asks the worker to close its servers and exit once its connections are
+done.  It's killed if it's still there after settings.killTimeout.
+]]
+function Worker:disconnect()
+  if self.suicide or self.state == "dead" then return end
+  self.suicide = true
+  self.state = "disconnecting"
+  roundRobinRemove(self)
+  self.channel:send({ cmd = "disconnect" })
+  self.killTimer = timer.setTimeout(cluster.settings.killTimeout, function ()
+    self.killTimer = nil
+    self:kill()
+  end)
+end
+
+function Worker:kill(signal)
+  if self.state == "dead" then return end
+  self.suicide = true
+  self.process:kill(signal or 15)
+end
+
+function cluster.setupMaster(settings)
+  for name, value in pairs(settings or {}) do
+    cluster.settings[name] = value
+  end
+end
+
+-- Starts a worker, env adds to the environment it gets
+function cluster.fork(env)
+  assert(cluster.isMaster, "cluster.fork is only for the master")
+  assert(cluster.settings.exec, "cluster.settings.exec is not set")
+  nextId = nextId + 1
+  local worker = Worker:new(nextId, env)
+  cluster.workers[worker.id] = worker
+  cluster:emit('fork', worker)
+  return worker
+end
+
+local function currentWorkers()
+  local list = {}
+  for _, worker in pairs(cluster.workers) do
+    list[#list + 1] = worker
+  end
+  table.sort(list, function (a, b) return a.id < b.id end)
+  return list
+end
+
+--[[
+Replaces the workers one at a time.  Each one's replacement is forked and
+listening before it gets disconnected, so connections keep being served.
+callback(err) runs once all of them have been replaced, or when a
+replacement dies before it listens.
+]]
+function cluster.restart(callback)
+  local workers = currentWorkers()
+  local index = 0
+  local function replaceNext()
+    index = index + 1
+    local worker = workers[index]
+    if not worker then
+      if callback then callback() end
+      return
+    end
+    if worker.state == "dead" or worker.suicide then
+      return replaceNext()
+    end
+    local replacement = cluster.fork(worker.env)
+    local settled = false
+    replacement:once('listening', function ()
+      if settled then return end
+      settled = true
+      worker:once('exit', replaceNext)
+      worker:disconnect()
+    end)
+    replacement:once('exit', function ()
+      if settled then return end
+      settled = true
+      if callback then
+        callback(Error:new("worker " .. replacement.id .. " exited before listening"))
+      end
+    end)
+  end
+  replaceNext()
+end
+
+-- Disconnects every worker and closes the master's sockets, callback runs
+-- once all of the workers have exited
+function cluster.disconnect(callback)
+  disconnecting = true
+  local workers = currentWorkers()
+  local remaining = #workers
+  local function done()
+    for key, handle in pairs(sharedHandles) do
+      handle:close()
+      sharedHandles[key] = nil
+    end
+    for key, entry in pairs(roundRobin) do
+      entry.handle:close()
+      roundRobin[key] = nil
+    end
+    disconnecting = false
+    if callback then callback() end
+  end
+  if remaining == 0 then return done() end
+  for i = 1, remaining do
+    workers[i]:once('exit', function ()
+      remaining = remaining - 1
+      if remaining == 0 then done() end
+    end)
+    workers[i]:disconnect()
+  end
+end
+
+--[[ Worker side ]]--
+
+if cluster.isWorker then
+  local pipe = Pipe:new(true)
+  pipe:open(tonumber(process.env.LUVIT_CHANNEL_FD))
+  local id = tonumber(process.env.LUVIT_CLUSTER_WORKER)
+  -- Processes this one starts aren't workers of the cluster
+  process.env.LUVIT_CLUSTER_WORKER = nil
+  process.env.LUVIT_CHANNEL_FD = nil
+
+  local channel = Channel:new(pipe)
+  local seq = 0
+  -- seq -> function (reply, handle) for listens the master hasn't answered
+  local pending = {}
+  -- net servers listening through the master
+  local servers = {}
+  -- key -> server for the round robin ones
+  local roundRobinServers = {}
+
+  local worker = Emitter:new()
+  worker.id = id
+  cluster.worker = worker
+
+  -- Sends data to the master's worker 'message' listeners
+  function worker:send(data)
+    channel:send({ cmd = "message", data = data })
+  end
+
+  -- Closes the servers so the process can exit once its connections end
+  function worker:disconnect()
+    for server in pairs(servers) do
+      if server._handle then
+        server:close()
+      end
+    end
+    channel:close()
+  end
+
+  channel:on('message', function (message, handle)
+    local cmd = message.cmd
+    if cmd == "listenReply" then
+      local callback = pending[message.seq]
+      pending[message.seq] = nil
+      if callback then return callback(message, handle) end
+    elseif cmd == "connection" then
+      local server = roundRobinServers[message.key]
+      if server and handle then
+        return server:_onConnection(handle)
+      end
+    elseif cmd == "message" then
+      worker:emit('message', message.data)
+    elseif cmd == "disconnect" then
+      worker:disconnect()
+    end
+    if handle then
+      handle:close()
+    end
+  end)
+  channel:on('close', function ()
+    channel = nil
+    worker:emit('disconnect')
+    for server in pairs(servers) do
+      if server._handle then
+        server:close()
+      end
+    end
+  end)
+
+  net._clusterListen = function (server, port, ip, options, callback)
+    local key = addressKey(ip, port)
+    seq = seq + 1
+    pending[seq] = function (reply, handle)
+      if reply.error then
+        if handle then handle:close() end
+        return server:emit('error', Error:new(reply.error))
+      end
+
+      servers[server] = true
+      server:once('close', function ()
+        servers[server] = nil
+        if roundRobinServers[key] == server then
+          roundRobinServers[key] = nil
+          if channel then channel:send({ cmd = "close", key = key }) end
+        end
+      end)
+
+      if reply.roundRobin then
+        -- The placeholder handle is only there for close to find
+        roundRobinServers[key] = server
+        if callback then callback() end
+      else
+        server._handle:close()
+        server._handle = handle
+        local ok, err = pcall(server._listenHandle, server, callback,
+          options and options.backlog)
+        if not ok then
+          return server:emit('error', err)
+        end
+      end
+      channel:send({ cmd = "listening", key = key, ip = ip, port = port })
+    end
+    -- Master side bind, the options are all plain values
+    channel:send({ cmd = "listen", seq = seq, ip = ip, port = port, options = options })
+  end
+
+  channel:send({ cmd = "online" })
+end
+
+return cluster
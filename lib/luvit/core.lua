@@ -146,7 +146,7 @@ local Emitter = Object:extend()
 core.Emitter = Emitter
 
 -- By default, and error events that are not listened for should throw errors
-function Emitter:missingHandlerType(name, ...)
+local function missingHandlerType(self, name, ...)
   if name == "error" then
     local args = {...}
     --error(tostring(args[1]))
@@ -167,70 +167,148 @@ function Emitter:missingHandlerType(name, ...)
     end
   end
 end
+Emitter.missingHandlerType = missingHandlerType
 
--- Same as `Emitter:on` except it de-registers itself after the first event.
-function Emitter:once(name, callback)
-  local function wrapped(...)
-    self:removeListener(name, wrapped)
-    callback(...)
+--[[
+handlers[name] is the listener itself while there's just one, or else a
+list of them.  A list marks its once listeners in list.once by position.
+Removing listeners puts a copy without them in handlers[name] instead of
+shifting the list, so emits already going over it carry on undisturbed.
+]]
+
+-- What handlers[name] becomes without list's listeners equal to callback,
+-- all of them when nil, or without just the one at index
+local function without(list, callback, index)
+  local once = list.once
+  local copy, copyOnce = {}, nil
+  local count = 0
+  for i = 1, #list do
+    local listener = list[i]
+    local drop
+    if index then
+      drop = i == index
+    else
+      drop = callback == nil or listener == callback
+    end
+    if not drop then
+      count = count + 1
+      copy[count] = listener
+      if once and once[i] then
+        copyOnce = copyOnce or {}
+        copyOnce[count] = true
+      end
+    end
   end
-  self:on(name, wrapped)
-  return self
+  if count == 0 then return nil end
+  if count == 1 and not copyOnce then return copy[1] end
+  copy.once = copyOnce
+  return copy
 end
 
--- Adds an event listener (`callback`) for the named event `name`.
-function Emitter:on(name, callback)
+local function addListener(self, name, callback, once)
   local handlers = rawget(self, "handlers")
   if not handlers then
     handlers = {}
     rawset(self, "handlers", handlers)
   end
-  local handlers_for_type = rawget(handlers, name)
-  if not handlers_for_type then
+  local current = rawget(handlers, name)
+  if not current then
     if self.addHandlerType then
       self:addHandlerType(name)
     end
-    handlers_for_type = {}
-    rawset(handlers, name, handlers_for_type)
+    if not once then
+      rawset(handlers, name, callback)
+      return self
+    end
+    current = {}
+    rawset(handlers, name, current)
+  elseif type(current) == "function" then
+    current = { current }
+    rawset(handlers, name, current)
+  end
+  local index = #current + 1
+  current[index] = callback
+  if once then
+    current.once = current.once or {}
+    current.once[index] = true
   end
-  table.insert(handlers_for_type, callback)
   return self
 end
 
+-- Same as `Emitter:on` except it de-registers itself after the first event.
+function Emitter:once(name, callback)
+  return addListener(self, name, callback, true)
+end
+
+-- Adds an event listener (`callback`) for the named event `name`.
+function Emitter:on(name, callback)
+  return addListener(self, name, callback, false)
+end
+
+-- Unregisters the once listener at index of list before it's called, false
+-- when an emit nested in this one got to it first
+local function takeOnce(handlers, name, list, index)
+  local current = rawget(handlers, name)
+  if current ~= list then
+    -- Replaced since this emit started, look for it in the copy
+    local callback = list[index]
+    local once = type(current) == "table" and current.once
+    index = nil
+    if once then
+      for i = 1, #current do
+        if once[i] and current[i] == callback then
+          index = i
+          break
+        end
+      end
+    end
+    if not index then return false end
+  end
+  rawset(handlers, name, without(current, nil, index))
+  return true
+end
+
 -- Emit a named event to all listeners with optional data argument(s).
+-- Listeners added or removed meanwhile only count from the next emit.
 function Emitter:emit(name, ...)
   local handlers = rawget(self, "handlers")
-  if not handlers then
-    self:missingHandlerType(name, ...)
-    return
-  end
-  local handlers_for_type = rawget(handlers, name)
-  if not handlers_for_type then
-    self:missingHandlerType(name, ...)
-    return
+  local current = handlers and rawget(handlers, name)
+  if not current then
+    local missing = self.missingHandlerType
+    -- The default only cares about errors, skip the call for the rest
+    if name == "error" or missing ~= missingHandlerType then
+      missing(self, name, ...)
+    end
+    return self
   end
-  for i, callback in ipairs(handlers_for_type) do
-    callback(...)
+  if type(current) == "function" then
+    current(...)
+    return self
   end
-  for i = #handlers_for_type, 1, -1 do
-    if not handlers_for_type[i] then
-      table.remove(handlers_for_type, i)
+
+  local once = current.once
+  for i = 1, #current do
+    if not (once and once[i]) or takeOnce(handlers, name, current, i) then
+      current[i](...)
     end
   end
   return self
 end
 
--- Remove a listener so that it no longer catches events.
+-- Remove a listener so that it no longer catches events, or all of them
+-- when callback is nil.
 function Emitter:removeListener(name, callback)
   local handlers = rawget(self, "handlers")
   if not handlers then return end
-  local handlers_for_type = rawget(handlers, name)
-  if not handlers_for_type then return end
-  for i = #handlers_for_type, 1, -1 do
-    if handlers_for_type[i] == callback or callback == nil then
-      handlers_for_type[i] = nil
+  local current = rawget(handlers, name)
+  if not current then return end
+  if type(current) == "function" then
+    if callback == nil or current == callback then
+      rawset(handlers, name, nil)
     end
+    return
   end
+  rawset(handlers, name, without(current, callback))
 end
 
 --[[
@@ -264,15 +342,24 @@ contain a uv struct (it's pure lua)
 local iStream = Emitter:extend()
 core.iStream = iStream
 
+--[[
+Writes everything self emits to target.  When target:write returns false
+the source is paused, and resumed on target's 'drain', so a slow target
+doesn't have a fast source's data pile up in memory.
+]]
 function iStream:pipe(target)
+  -- Only resume what the pipe paused itself
+  local paused = false
   self:on('data', function (chunk)
-    if target:write(chunk) == false and self.pause then
+    if target:write(chunk) == false and self.pause and not paused then
+      paused = true
       self:pause()
     end
   end)
 
   target:on('drain', function()
-    if self.resume then
+    if paused and self.resume then
+      paused = false
       self:resume()
     end
   end)
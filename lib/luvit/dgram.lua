@@ -21,13 +21,15 @@ limitations under the License.
 local dns = require('dns')
 local net = require('net')
 local Udp = require('uv').Udp
+local Timer = require('uv').Timer
 local Emitter = require('core').Emitter
+local Error = require('core').Error
 
 local dgram = {}
 
 local function lookup(address, family, callback)
   local matchedFamily = net.isIP(address)
-  if matchedFamily then
+  if matchedFamily ~= 0 then
     return callback(nil, address, matchedFamily)
   end
   return dns.lookup(address, family, callback)
@@ -90,11 +92,18 @@ function Socket:_initEmitters()
     self:emit('message', msg, rinfo)
   end)
 
+  self._handle:on('messages', function(msgs, addresses, ports, count)
+    self:emit('messages', msgs, addresses, ports, count)
+  end)
+
   self._handle:on('error', function(err)
     self:emit('error', err)
   end)
 end
 
+-- Formats a packed address from a 'messages' event
+dgram.addressToString = Udp.addressToString
+
 function dgram.createSocket(family, listener)
   return Socket:new(family, listener)
 end
@@ -132,6 +141,153 @@ function Socket:send(msg, port, address, callback)
   end)
 end
 
+-- Hostname destinations of sendBatch are re-resolved after this many
+-- seconds, addresses given as ips are kept for good
+Socket.destinationTtl = 10
+-- The destination cache starts over once it holds this many
+Socket.maxDestinations = 1024
+
+-- Resolves and packs host:port once, callback(err, destination)
+function Socket:_destination(host, port, callback)
+  local destinations = self._destinations
+  if not destinations or self._destinationCount >= self.maxDestinations then
+    destinations = {}
+    self._destinations = destinations
+    self._destinationCount = 0
+  end
+  local key = host .. ':' .. port
+  local destination = destinations[key]
+  if destination and (not destination.expires or destination.expires > Timer.now()) then
+    return callback(nil, destination)
+  end
+
+  self._handle.lookup(host, function(err, ip)
+    if err then return callback(err) end
+    destination = { ip = ip, port = port, packed = Udp.packAddress(ip, port) }
+    if net.isIP(host) == 0 then
+      destination.expires = Timer.now() + self.destinationTtl * 1000
+    end
+    if not destinations[key] then
+      self._destinationCount = self._destinationCount + 1
+    end
+    destinations[key] = destination
+    callback(nil, destination)
+  end)
+end
+
+--[[
+Send many datagrams at once, with a single callback once they're all out:
+
+    socket:sendBatch({
+      { "ping", 5000, "10.0.0.1" },
+      { buffer, 5000, "10.0.0.2" },
+    }, function (err, sent) end)
+
+Destinations are resolved once and cached on the socket.  The datagrams go
+out in one sendmmsg call where there is one, anything that doesn't fit in
+the socket buffer is queued like a plain send.  A batch sent right away
+still calls back on the next tick.
+]]
+function Socket:sendBatch(list, callback)
+  self:_healthCheck()
+  self:_startReceiving()
+
+  local count = #list
+  local datagrams, destinations, resolved = {}, {}, {}
+  local waiting = count
+  local failed = false
+
+  local function finish(err, sent)
+    if callback then
+      callback(err, sent)
+    elseif err then
+      self:emit('error', err)
+    end
+  end
+
+  local function submit()
+    if not self._handle then
+      return finish(Error:new('socket closed'), 0)
+    end
+    local sent, err = self._handle:sendBatch(datagrams, destinations)
+    if err or sent == count then
+      return process.nextTick(function()
+        finish(err, sent)
+      end)
+    end
+
+    -- The socket buffer filled up, libuv queues the rest
+    local left = count - sent
+    for i = sent + 1, count do
+      local destination = resolved[i]
+      self._handle:send(datagrams[i], destination.port, destination.ip, function(err)
+        if failed then return end
+        if err then
+          failed = true
+          return finish(err, sent)
+        end
+        sent = sent + 1
+        left = left - 1
+        if left == 0 then
+          finish(nil, sent)
+        end
+      end)
+    end
+  end
+
+  if count == 0 then
+    return process.nextTick(function()
+      finish(nil, 0)
+    end)
+  end
+
+  for i = 1, count do
+    local entry = list[i]
+    datagrams[i] = entry[1]
+    self:_destination(entry[3], entry[2], function(err, destination)
+      if failed then return end
+      if err then
+        failed = true
+        return finish(err, 0)
+      end
+      resolved[i] = destination
+      destinations[i] = destination.packed
+      waiting = waiting - 1
+      if waiting == 0 then
+        submit()
+      end
+    end)
+  end
+end
+
+--[[
+Receive in batches, as one 'messages' event per wakeup instead of a
+'message' per datagram:
+
+    socket:setBatchMode({ batch = 64, size = 1500 })
+    socket:on('messages', function (msgs, addresses, ports, count)
+      for i = 1, count do
+        -- dgram.addressToString(addresses[i]) when the text is wanted
+      end
+    end)
+
+Pass false to go back to 'message' events.
+]]
+function Socket:setBatchMode(options)
+  self:_healthCheck()
+  local receiving = self._receiving
+  self:_stopReceiving()
+  if options then
+    if options == true then options = {} end
+    self._batch = { options.batch, options.size }
+  else
+    self._batch = nil
+  end
+  if receiving then
+    self:_startReceiving()
+  end
+end
+
 function Socket:close()
   self:_healthCheck()
   self:_stopReceiving()
@@ -205,7 +361,11 @@ function Socket:_startReceiving()
     end
   end
 
-  self._handle:recvStart()
+  if self._batch then
+    self._handle:recvBatchStart(self._batch[1], self._batch[2])
+  else
+    self._handle:recvStart()
+  end
   self._receiving = true
 end
 
@@ -214,7 +374,11 @@ function Socket:_stopReceiving()
     return
   end
 
-  self._handle:recvStop()
+  if self._batch then
+    self._handle:recvBatchStop()
+  else
+    self._handle:recvStop()
+  end
   self._receiving = false
 end
 
@@ -19,16 +19,194 @@ limitations under the License.
 local native = require('uv_native')
 local constants = require('constants')
 local Error = require('core').Error
+local Object = require('core').Object
 local string = require('string')
+local math = require('math')
 
 local dns = {}
 
+--[[
+Answers for A, AAAA and lookup queries, kept for as long as their records
+say.  Concurrent queries for one name share a single request.  Failures
+are kept for negativeTtl unless the error is marked transient.
+
+    dns.cache = dns.DnsCache:new({ maxEntries = 100 })
+    dns.cache = false -- no caching
+
+Callbacks get the cached tables themselves, so don't modify them.
+]]
+local DnsCache = Object:extend()
+dns.DnsCache = DnsCache
+
+DnsCache.maxEntries = 1000
+-- Seconds, getaddrinfo doesn't report TTLs so lookups are kept this long
+DnsCache.lookupTtl = 10
+DnsCache.negativeTtl = 5
+-- Upper bound on any record TTL, in seconds
+DnsCache.maxTtl = 300
+
+function DnsCache:initialize(options)
+  options = options or {}
+  self.maxEntries = options.maxEntries or DnsCache.maxEntries
+  self.lookupTtl = options.lookupTtl or DnsCache.lookupTtl
+  self.negativeTtl = options.negativeTtl or DnsCache.negativeTtl
+  self.maxTtl = options.maxTtl or DnsCache.maxTtl
+  self.entries = {}
+  self.count = 0
+  -- Queries in flight, key -> callbacks waiting on them
+  self.pending = {}
+  -- Doubly linked list, most recently used first
+  self.head = nil
+  self.tail = nil
+  self.hits = 0
+  self.negativeHits = 0
+  self.misses = 0
+  self.coalesced = 0
+  self.evictions = 0
+end
+
+function DnsCache:_unlink(entry)
+  if entry.prev then entry.prev.next = entry.next else self.head = entry.next end
+  if entry.next then entry.next.prev = entry.prev else self.tail = entry.prev end
+  entry.prev = nil
+  entry.next = nil
+end
+
+function DnsCache:_pushFront(entry)
+  entry.next = self.head
+  if self.head then self.head.prev = entry end
+  self.head = entry
+  if not self.tail then self.tail = entry end
+end
+
+function DnsCache:_remove(entry)
+  self.entries[entry.key] = nil
+  self.count = self.count - 1
+  self:_unlink(entry)
+end
+
+function DnsCache:get(key)
+  local entry = self.entries[key]
+  if not entry then return end
+  if entry.expires <= native.now() then
+    self:_remove(entry)
+    return
+  end
+  self:_unlink(entry)
+  self:_pushFront(entry)
+  return entry
+end
+
+-- Keeps a result for ttl seconds, results is the list of callback arguments
+function DnsCache:set(key, results, ttl)
+  local entry = self.entries[key]
+  if entry then self:_remove(entry) end
+  ttl = math.min(ttl, self.maxTtl)
+  if ttl <= 0 or self.maxEntries <= 0 then return end
+  entry = { key = key, results = results, expires = native.now() + ttl * 1000 }
+  self.entries[key] = entry
+  self.count = self.count + 1
+  self:_pushFront(entry)
+  while self.count > self.maxEntries do
+    self:_remove(self.tail)
+    self.evictions = self.evictions + 1
+  end
+end
+
+function DnsCache:clear()
+  self.entries = {}
+  self.count = 0
+  self.head = nil
+  self.tail = nil
+end
+
+function DnsCache:stats()
+  return {
+    size = self.count,
+    hits = self.hits,
+    negativeHits = self.negativeHits,
+    misses = self.misses,
+    coalesced = self.coalesced,
+    evictions = self.evictions,
+  }
+end
+
+--[[
+Calls callback with the cached result for key, or runs query(done) once for
+all concurrent misses.  done(ttl, err, ...) takes how long to keep the
+result followed by the callback arguments.
+]]
+function DnsCache:query(key, query, callback)
+  local entry = self:get(key)
+  if entry then
+    if entry.results[1] then
+      self.negativeHits = self.negativeHits + 1
+    else
+      self.hits = self.hits + 1
+    end
+    if callback then
+      -- Stay asynchronous like a real query
+      process.nextTick(function ()
+        callback(unpack(entry.results, 1, entry.results.n))
+      end)
+    end
+    return
+  end
+
+  local waiting = self.pending[key]
+  if waiting then
+    self.coalesced = self.coalesced + 1
+    waiting[#waiting + 1] = callback or false
+    return
+  end
+  waiting = { callback or false }
+  self.pending[key] = waiting
+  self.misses = self.misses + 1
+
+  query(function (ttl, ...)
+    self.pending[key] = nil
+    local results = { n = select('#', ...), ... }
+    local err = results[1]
+    if err then
+      ttl = err.transient and 0 or self.negativeTtl
+    end
+    self:set(key, results, ttl)
+    for i = 1, #waiting do
+      if waiting[i] then
+        waiting[i](unpack(results, 1, results.n))
+      end
+    end
+  end)
+end
+
+dns.cache = DnsCache:new()
+
+-- The lowest TTL of a reply, or 0 to not keep it
+local function minTtl(ttls)
+  local ttl
+  for i = 1, ttls and #ttls or 0 do
+    if not ttl or ttls[i] < ttl then ttl = ttls[i] end
+  end
+  return ttl or 0
+end
+
+local function cachedQuery(name, domain, query, callback)
+  if not dns.cache then
+    return query(domain, callback)
+  end
+  dns.cache:query(name .. "\0" .. domain:lower(), function (done)
+    query(domain, function (err, addresses, ttls)
+      done(minTtl(ttls), err, addresses, ttls)
+    end)
+  end, callback)
+end
+
 function dns.resolve4(domain, callback)
-  native.dnsQueryA(domain, callback)
+  cachedQuery("A", domain, native.dnsQueryA, callback)
 end
 
 function dns.resolve6(domain, callback)
-  native.dnsQueryAaaa(domain, callback)
+  cachedQuery("AAAA", domain, native.dnsQueryAaaa, callback)
 end
 
 function dns.resolveCname(domain, callback)
@@ -92,7 +270,22 @@ function dns.lookup(domain, family, callback)
     return
   end
 
-  native.dnsGetAddrInfo(domain, family, function(err, addresses)
+  local function getAddrInfo(callback)
+    native.dnsGetAddrInfo(domain, family, callback)
+  end
+  -- Nothing to gain caching addresses that are already addresses
+  local cache = dns.cache
+  if cache and native.dnsIsIp(domain) == 0 then
+    getAddrInfo = function (callback)
+      cache:query("lookup\0" .. family .. "\0" .. domain:lower(), function (done)
+        native.dnsGetAddrInfo(domain, family, function (err, addresses)
+          done(cache.lookupTtl, err, addresses)
+        end)
+      end, callback)
+    end
+  end
+
+  getAddrInfo(function(err, addresses)
     if err then
       callback(err)
       return
@@ -18,82 +18,365 @@ limitations under the License.
 
 local coroutine = require('coroutine')
 local debug = require 'debug'
+local timer = require('timer')
+local Error = require('core').Error
 local fiber = {}
 
-function fiber.new(block, callback)
-  local paused
-  local co = coroutine.create(block)
-
-  local function formatError(err)
-    local stack = debug.traceback(co, tostring(err))
-    if type(err) == "table" then
-      err.message = stack
-      return err
+--[[
+Fibers run a function in a coroutine that can wait for callback style
+operations as if they returned.  Coroutines are kept in a pool once their
+fiber ends and reused for the next, and each fiber has one resume callback
+that it hands to everything it awaits, so waiting allocates nothing.
+
+    fiber.spawn(function (path)
+      local err, data = fiber.await(fs.readFile, path)
+      fiber.sleep(10)
+      return data
+    end, { timeout = 5000 }, callback, "config.json")
+]]
+
+local Fiber = {}
+Fiber.__index = Fiber
+fiber.Fiber = Fiber
+
+-- Finished coroutines waiting for their next fiber
+local pool = {}
+local pooled = 0
+-- Most coroutines kept around
+fiber.poolSize = 64
+local created = 0
+
+-- The fiber whose coroutine is running
+local current
+
+-- First value a coroutine yields when its function has returned, and the
+-- value a cancelled await is resumed with
+local FINISHED = {}
+local CANCELLED = {}
+
+local function onError(err)
+  if err == CANCELLED then return err end
+  if type(err) == "table" then
+    if err.cancelled then return err end
+    -- The traceback goes on a copy, err may be shared with other callers
+    local wrapped = setmetatable({}, getmetatable(err))
+    for key, value in pairs(err) do
+      rawset(wrapped, key, value)
     end
-    return stack
+    rawset(wrapped, "message", debug.traceback(tostring(err), 2))
+    rawset(wrapped, "cause", err)
+    return wrapped
   end
+  return debug.traceback(tostring(err), 2)
+end
 
-  local function check(success, ...)
-    if not success then
-      if callback then
-        return callback(formatError(...))
-      else
-        error(formatError(...))
-      end
-    end
-    if not paused then
-      return callback and callback(nil, ...)
+-- Runs one fiber's function after another, for as long as it's pooled
+local function body(fn, ...)
+  return body(coroutine.yield(FINISHED, xpcall(fn, onError, ...)))
+end
+
+local step
+
+local function enter(fib, ...)
+  local previous = current
+  current = fib
+  local co = fib.co
+  return step(fib, previous, co, coroutine.resume(co, ...))
+end
+
+local function finish(fib, co, success, ...)
+  fib.done = true
+  fib.co = nil
+  if fib.timer then
+    timer.clearTimer(fib.timer)
+    fib.timer = nil
+  end
+  if pooled < fiber.poolSize then
+    pooled = pooled + 1
+    pool[pooled] = co
+  end
+  local callback = fib.callback
+  if not success then
+    if callback then return callback((...)) end
+    error((...), 0)
+  end
+  if callback then return callback(nil, ...) end
+end
+
+step = function (fib, previous, co, ok, first, ...)
+  current = previous
+  if not ok then
+    -- Only happens when body itself breaks, the coroutine is gone
+    fib.done = true
+    error(first, 0)
+  end
+  if first == FINISHED then
+    return finish(fib, co, ...)
+  end
+end
+
+-- Each fiber's resume callback, replaced when an await is abandoned so a
+-- late callback can't resume whatever the fiber waits on next
+local function newResume(fib)
+  local resume
+  resume = function (...)
+    if fib.resume ~= resume or not fib.waiting then return end
+    fib.waiting = false
+    if current == fib then
+      -- Called back before await yielded
+      fib.early = { n = select("#", ...), ... }
+      return
     end
-    paused = false
+    return enter(fib, ...)
+  end
+  return resume
+end
+
+local function cancelError(message, code)
+  local err = Error:new(message)
+  err.code = code
+  err.cancelled = true
+  return err
+end
+
+--[[
+Starts fn(...) in a fiber and returns it.  callback(err, ...) gets what fn
+returned, or what it threw.  Without a callback errors are rethrown.
+options.timeout cancels the fiber with an ETIMEDOUT error after that many
+milliseconds.
+]]
+function fiber.spawn(fn, options, callback, ...)
+  local co = pool[pooled]
+  if co then
+    pool[pooled] = nil
+    pooled = pooled - 1
+  else
+    co = coroutine.create(body)
+    created = created + 1
+  end
+  local fib = setmetatable({ co = co, callback = callback, waiting = false }, Fiber)
+  fib.resume = newResume(fib)
+  if options and options.timeout then
+    fib.timer = timer.setTimeout(options.timeout, function ()
+      fib.timer = nil
+      fib:cancel(cancelError("fiber timed out", "ETIMEDOUT"))
+    end)
+  end
+  enter(fib, fn, ...)
+  return fib
+end
+
+local function resumed(fib, first, ...)
+  if first == CANCELLED then
+    error(fib.cancelled, 0)
+  end
+  return first, ...
+end
+
+--[[
+Calls fn(..., resume) and waits for resume(...), returning what it got.
+Must be called from inside a fiber.
+]]
+function fiber.await(fn, ...)
+  local fib = current
+  if not fib then
+    error("fiber.await must be called from inside a fiber", 2)
+  end
+  if fib.cancelled then
+    error(fib.cancelled, 0)
+  end
+  local resume = fib.resume
+  local n = select("#", ...)
+  fib.waiting = true
+  if n == 0 then
+    fn(resume)
+  elseif n == 1 then
+    fn(..., resume)
+  elseif n == 2 then
+    local a, b = ...
+    fn(a, b, resume)
+  elseif n == 3 then
+    local a, b, c = ...
+    fn(a, b, c, resume)
+  else
+    local args = { ... }
+    args[n + 1] = resume
+    fn(unpack(args, 1, n + 1))
   end
 
-  local function wait(fn, ...)
-    if type(fn) ~= "function" then
-      error("can only wait on functions")
+  local early = fib.early
+  if early then
+    fib.early = nil
+    return unpack(early, 1, early.n)
+  end
+  return resumed(fib, coroutine.yield())
+end
+
+local function wakeAfter(ms, resume)
+  timer.setTimeout(ms, resume)
+end
+
+-- Waits ms milliseconds without blocking the loop
+function fiber.sleep(ms)
+  fiber.await(wakeAfter, ms)
+end
+
+-- The running fiber, or nil outside of one
+function fiber.current()
+  return current
+end
+
+--[[
+Stops the fiber at its current await with err, an ECANCELED error by
+default, that it may catch like any other.  Whatever it was waiting on is
+ignored when it completes.
+]]
+function Fiber:cancel(err)
+  if self.done or self.cancelled then return end
+  self.cancelled = err or cancelError("fiber cancelled", "ECANCELED")
+  if not self.waiting then
+    -- Cancelling itself, or it'll see it at its next await
+    if current == self then error(self.cancelled, 0) end
+    return
+  end
+  self.waiting = false
+  self.resume = newResume(self)
+  enter(self, CANCELLED)
+end
+
+function fiber.stats()
+  return { pooled = pooled, created = created }
+end
+
+-- Runs tasks[i]() in fibers, at most limit at a time, and calls
+-- onDone(i, err, result) as each finishes until that returns true
+local function runLimited(tasks, limit, onDone)
+  local count = #tasks
+  local started = 0
+  local active = 0
+  local running = {}
+  local stopped = false
+
+  local function stop()
+    stopped = true
+    for _, fib in pairs(running) do
+      fib:cancel()
     end
-    local args = {...}
-    args[#args + 1] = function (...)
-      check(coroutine.resume(co, ...))
+  end
+
+  local launch
+  local function settled(i, err, result)
+    running[i] = nil
+    active = active - 1
+    if stopped then return end
+    if onDone(i, err, result) then return stop() end
+    launch()
+  end
+
+  launch = function ()
+    while not stopped and started < count and (not limit or active < limit) do
+      started = started + 1
+      active = active + 1
+      local i = started
+      local fib = fiber.spawn(tasks[i], nil, function (err, result)
+        settled(i, err, result)
+      end)
+      if not fib.done then running[i] = fib end
     end
-    fn(unpack(args))
-    paused = true
-    return coroutine.yield()
   end
 
-  local function wrap(fn, handleErrors)
+  launch()
+end
 
-    if type(fn) == "table" then
-      return setmetatable({}, {
-        __index = function (table, key)
-          return fn[key] and wrap(fn[key], handleErrors)
-        end
-      })
+--[[
+Runs the functions in tasks each in a fiber, no more than limit at once
+when it's given, and calls callback(nil, results) with the first value
+each returned, in order.  The first error cancels the rest and goes to
+callback instead.  From a fiber, fiber.await(fiber.all, tasks, limit).
+]]
+function fiber.all(tasks, limit, callback)
+  local results = {}
+  local remaining = #tasks
+  if remaining == 0 then return callback(nil, results) end
+  runLimited(tasks, limit, function (i, err, result)
+    if err then
+      callback(err)
+      return true
+    end
+    results[i] = result
+    remaining = remaining - 1
+    if remaining == 0 then
+      callback(nil, results)
+      return true
     end
+  end)
+end
 
-    if type(fn) ~= "function" then
-      error("Can only wrap functions or tables of functions")
+--[[
+Like fiber.all, but callback(nil, result, i) gets the first task to
+succeed and the others are cancelled.  Failed tasks make room for the
+next under the limit, and only when all fail is callback(err) called,
+with the last error.
+]]
+function fiber.race(tasks, limit, callback)
+  local remaining = #tasks
+  if remaining == 0 then return callback(Error:new("race of no tasks")) end
+  runLimited(tasks, limit, function (i, err, result)
+    if not err then
+      callback(nil, result, i)
+      return true
     end
-    -- Do a simple curry for the passthrough wait wrapper
-    if not handleErrors then
-      return function (...)
-        return wait(fn, ...)
-      end
+    remaining = remaining - 1
+    if remaining == 0 then
+      callback(err)
+      return true
     end
+  end)
+end
+
+--[[ The original interface ]]--
+
+local function wait(fn, ...)
+  if type(fn) ~= "function" then
+    error("can only wait on functions")
+  end
+  return fiber.await(fn, ...)
+end
+
+local function wrap(fn, handleErrors)
+
+  if type(fn) == "table" then
+    return setmetatable({}, {
+      __index = function (table, key)
+        return fn[key] and wrap(fn[key], handleErrors)
+      end
+    })
+  end
 
-    -- Or magically pull out the error argument and throw it if it's there.
-    -- Return all other values if no error.
+  if type(fn) ~= "function" then
+    error("Can only wrap functions or tables of functions")
+  end
+  -- Do a simple curry for the passthrough wait wrapper
+  if not handleErrors then
     return function (...)
-      local result = {wait(fn, ...)}
-      local err = result[1]
-      if err then error(err) end
-      return unpack(result, 2)
+      return wait(fn, ...)
     end
+  end
 
+  -- Or magically pull out the error argument and throw it if it's there.
+  -- Return all other values if no error.
+  return function (...)
+    local result = {wait(fn, ...)}
+    local err = result[1]
+    if err then error(err) end
+    return unpack(result, 2)
   end
 
-  check(coroutine.resume(co, wrap, wait))
+end
 
+-- block(wrap, wait) in a fiber, callback(err, ...) gets its results
+function fiber.new(block, callback)
+  fiber.spawn(block, nil, callback, wrap, wait)
 end
 
 return fiber
-
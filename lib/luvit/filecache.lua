@@ -0,0 +1,346 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local fs = require('fs')
+local zlibNative = require('zlib_native')
+local Watcher = require('uv').Watcher
+local Object = require('core').Object
+local osDate = require('os').date
+local stringFormat = require('string').format
+
+local filecache = {}
+
+-- Both caches keep their entries in a doubly linked list, most recently
+-- used first, with head and tail on the cache itself
+local function unlink(list, entry)
+  if entry.prev then entry.prev.next = entry.next else list.head = entry.next end
+  if entry.next then entry.next.prev = entry.prev else list.tail = entry.prev end
+  entry.prev = nil
+  entry.next = nil
+end
+
+local function pushFront(list, entry)
+  entry.next = list.head
+  if list.head then list.head.prev = entry end
+  list.head = entry
+  if not list.tail then list.tail = entry end
+end
+
+--[[
+A bounded LRU of open files and their stat results, for serving the same
+files over and over without reopening and restating them.  Entries are
+dropped when a watcher reports the file changed.
+
+    cache:open(path, function (err, entry)
+      -- use entry.fd, entry.stat, entry.etag, entry.lastModified
+      cache:release(entry)
+    end)
+
+An entry stays open while it's in use, even if it gets evicted or
+invalidated meanwhile.  Every successful open must be paired with a
+release.
+]]
+local FileCache = Object:extend()
+filecache.FileCache = FileCache
+
+-- Default number of files kept open
+FileCache.max = 64
+
+function FileCache:initialize(options)
+  options = options or {}
+  self.max = options.max or FileCache.max
+  self.entries = {}
+  self.count = 0
+  -- Opens in progress, path -> list of callbacks waiting on it
+  self.pending = {}
+  -- Doubly linked list, most recently used first
+  self.head = nil
+  self.tail = nil
+  self.hits = 0
+  self.misses = 0
+end
+
+-- Closes an entry's fd once nobody is using it anymore
+local function closeIfIdle(entry)
+  if entry.stale and entry.refs == 0 and not entry.closed then
+    entry.closed = true
+    fs.close(entry.fd, function () end)
+  end
+end
+
+-- Takes an entry out of the cache, it's closed once the last user is done
+function FileCache:_remove(entry)
+  if self.entries[entry.path] ~= entry then return end
+  self.entries[entry.path] = nil
+  self.count = self.count - 1
+  unlink(self, entry)
+  entry.stale = true
+  if entry.watcher then
+    entry.watcher:close()
+    entry.watcher = nil
+  end
+  closeIfIdle(entry)
+end
+
+function FileCache:_evict()
+  local entry = self.tail
+  while self.count > self.max and entry do
+    local prev = entry.prev
+    if entry.refs == 0 then
+      self:_remove(entry)
+    end
+    entry = prev
+  end
+end
+
+-- Forget a path, eg. after rewriting it
+function FileCache:invalidate(path)
+  local entry = self.entries[path]
+  if entry then
+    self:_remove(entry)
+  end
+end
+
+-- Close everything that isn't in use
+function FileCache:clear()
+  local entry = self.head
+  while entry do
+    local next = entry.next
+    self:_remove(entry)
+    entry = next
+  end
+end
+
+function FileCache:release(entry)
+  entry.refs = entry.refs - 1
+  closeIfIdle(entry)
+end
+
+function FileCache:_finishOpen(path, err, entry)
+  local callbacks = self.pending[path]
+  self.pending[path] = nil
+  for i = 1, #callbacks do
+    if entry then
+      entry.refs = entry.refs + 1
+    end
+    callbacks[i](err, entry)
+  end
+end
+
+function FileCache:open(path, callback)
+  local entry = self.entries[path]
+  if entry then
+    self.hits = self.hits + 1
+    unlink(self, entry)
+    pushFront(self, entry)
+    entry.refs = entry.refs + 1
+    return callback(nil, entry)
+  end
+
+  -- Share a single open between concurrent requests for the same file
+  local callbacks = self.pending[path]
+  if callbacks then
+    callbacks[#callbacks + 1] = callback
+    return
+  end
+  self.pending[path] = {callback}
+  self.misses = self.misses + 1
+
+  fs.open(path, "r", "0644", function (err, fd)
+    if err then return self:_finishOpen(path, err) end
+    fs.fstat(fd, function (err, stat)
+      if err then
+        fs.close(fd, function () end)
+        return self:_finishOpen(path, err)
+      end
+      local entry = {
+        path = path,
+        fd = fd,
+        stat = stat,
+        etag = stringFormat('"%x-%x"', stat.size, stat.mtime),
+        lastModified = osDate("!%a, %d %b %Y %H:%M:%S GMT", stat.mtime),
+        refs = 0
+      }
+      -- Directories and such aren't worth keeping open
+      if stat.is_file then
+        self.entries[path] = entry
+        self.count = self.count + 1
+        pushFront(self, entry)
+        local ok, watcher = pcall(Watcher.new, Watcher, path)
+        if ok then
+          entry.watcher = watcher
+          -- The cache shouldn't keep the process alive
+          watcher:unref()
+          watcher:on('change', function ()
+            self:_remove(entry)
+          end)
+        end
+        self:_evict()
+      else
+        entry.stale = true
+      end
+      self:_finishOpen(path, nil, entry)
+    end)
+  end)
+end
+
+-- Shared cache used by http Response:sendFile by default
+filecache.default = FileCache:new()
+
+-- Window bits for each content coding, gzip adds 16 for its wrapper
+local WINDOW_BITS = { gzip = 31, deflate = 15 }
+
+--[[
+An LRU of compressed response bodies capped by their total size, so hot
+assets are compressed once instead of per request.  Compression runs on the
+thread pool and concurrent requests for the same body share it.
+
+    compressed:compress(key, body, "gzip", function (err, data) ... end)
+    compressed:file(entry, "gzip", function (err, data) ... end)
+
+file takes a FileCache entry and keys on its path, size and mtime, so a
+changed file is compressed afresh.  A .gz file next to it is used instead
+for gzip when it's at least as new.  data is nil when the body is too big
+to keep in memory.
+]]
+local CompressedCache = Object:extend()
+filecache.CompressedCache = CompressedCache
+
+-- Default cap on the bytes kept
+CompressedCache.maxBytes = 32 * 1024 * 1024
+-- Bodies bigger than this are not compressed into memory
+CompressedCache.maxEntrySize = 4 * 1024 * 1024
+-- Each body is compressed once and served many times, spend the time
+CompressedCache.level = 9
+
+function CompressedCache:initialize(options)
+  options = options or {}
+  self.maxBytes = options.maxBytes or CompressedCache.maxBytes
+  self.maxEntrySize = options.maxEntrySize or CompressedCache.maxEntrySize
+  self.level = options.level or CompressedCache.level
+  self.entries = {}
+  self.pending = {}
+  self.size = 0
+  self.head = nil
+  self.tail = nil
+  self.hits = 0
+  self.misses = 0
+end
+
+function CompressedCache:get(key)
+  local entry = self.entries[key]
+  if not entry then return end
+  unlink(self, entry)
+  pushFront(self, entry)
+  return entry.data
+end
+
+function CompressedCache:remove(key)
+  local entry = self.entries[key]
+  if not entry then return end
+  self.entries[key] = nil
+  self.size = self.size - #entry.data
+  unlink(self, entry)
+end
+
+function CompressedCache:set(key, data)
+  self:remove(key)
+  if #data > self.maxBytes then return end
+  local entry = { key = key, data = data }
+  self.entries[key] = entry
+  self.size = self.size + #data
+  pushFront(self, entry)
+  while self.size > self.maxBytes do
+    self:remove(self.tail.key)
+  end
+end
+
+-- Calls produce(done) once for concurrent misses on a key and caches what
+-- it hands to done
+function CompressedCache:_fill(key, produce, callback)
+  local data = self:get(key)
+  if data then
+    self.hits = self.hits + 1
+    return callback(nil, data)
+  end
+  local waiting = self.pending[key]
+  if waiting then
+    waiting[#waiting + 1] = callback
+    return
+  end
+  waiting = { callback }
+  self.pending[key] = waiting
+  self.misses = self.misses + 1
+  produce(function (err, data)
+    self.pending[key] = nil
+    if data then
+      self:set(key, data)
+    end
+    for i = 1, #waiting do
+      waiting[i](err, data)
+    end
+  end)
+end
+
+function CompressedCache:_deflate(body, encoding, callback)
+  local stream = zlibNative.new('deflate', self.level, WINDOW_BITS[encoding])
+  stream:writeAsync(body, "finish", callback)
+end
+
+function CompressedCache:compress(key, body, encoding, callback)
+  if not WINDOW_BITS[encoding] then
+    error("Unsupported encoding " .. tostring(encoding))
+  end
+  self:_fill(key .. "\0" .. encoding, function (done)
+    self:_deflate(body, encoding, done)
+  end, callback)
+end
+
+function CompressedCache:file(entry, encoding, callback)
+  if not WINDOW_BITS[encoding] then
+    error("Unsupported encoding " .. tostring(encoding))
+  end
+  local stat = entry.stat
+  local key = stringFormat("%s\0%x-%x\0%s", entry.path, stat.size, stat.mtime, encoding)
+  self:_fill(key, function (done)
+    local function compressFile()
+      if stat.size > self.maxEntrySize then return done() end
+      fs.read(entry.fd, 0, stat.size, function (err, body)
+        if err then return done(err) end
+        self:_deflate(body, encoding, done)
+      end)
+    end
+    if encoding ~= "gzip" then return compressFile() end
+    local sidecar = entry.path .. ".gz"
+    fs.stat(sidecar, function (err, sidecarStat)
+      if err or not sidecarStat.is_file or sidecarStat.mtime < stat.mtime
+        or sidecarStat.size > self.maxEntrySize then
+        return compressFile()
+      end
+      fs.readFile(sidecar, function (err, data)
+        if err then return compressFile() end
+        done(nil, data)
+      end)
+    end)
+  end, callback)
+end
+
+-- Shared cache used by Response:sendFile with compressed = true
+filecache.compressed = CompressedCache:new()
+
+return filecache
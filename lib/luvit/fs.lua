@@ -17,9 +17,10 @@ limitations under the License.
 --]]
 
 local native = require('uv_native')
-local table = require('table')
 local pathlib = require('path')
 local iStream = require('core').iStream
+local Buffer = require('buffer').Buffer
+local ffi = require('ffi')
 local fs = {}
 
 local function passthrough(arg)
@@ -32,8 +33,6 @@ end
 
 local func_descs = {
   Close = { passthrough },
-  Read = { passthrough, passthrough, passthrough },
-  Write = { passthrough, passthrough, passthrough },
   Unlink = { longpath },
   Mkdir = { longpath, passthrough},
   Rmdir = { longpath },
@@ -98,6 +97,88 @@ for name, param_handlers in pairs(func_descs) do
   fs[name:lower() .. "Sync"] = sync
 end
 
+--[[
+fs.read(fd, position, length, callback) reads into a new string and calls
+back with (err, chunk, length).  fs.read(fd, position, buffer, offset, length,
+callback) fills buffer from the zero based offset instead and calls back with
+(err, length), so repeated reads don't churn out strings.  position nil reads
+from the current file position.
+]]
+function fs.read(fd, position, length, ...)
+  if type(length) == "table" then
+    local offset, count, callback = ...
+    return native.fsRead(fd, position, length, offset, count, callback or default)
+  end
+  return native.fsRead(fd, position, length, (...) or default)
+end
+
+function fs.readSync(fd, position, length, offset, count)
+  if type(length) == "table" then
+    return native.fsRead(fd, position, length, offset, count)
+  end
+  return native.fsRead(fd, position, length)
+end
+
+--[[
+fs.write(fd, position, data, callback) writes a string or Buffer.
+fs.write(fd, position, data, offset, length, callback) writes length bytes of
+it from the zero based offset, without a substring.  Calls back with (err,
+written).  position -1 writes at the current file position.
+]]
+function fs.write(fd, position, data, offset, ...)
+  if type(offset) == "number" then
+    local length, callback = ...
+    return native.fsWrite(fd, position, data, offset, length, callback or default)
+  end
+  return native.fsWrite(fd, position, data, offset or default)
+end
+
+function fs.writeSync(fd, position, data, offset, length)
+  if offset then
+    return native.fsWrite(fd, position, data, offset, length)
+  end
+  return native.fsWrite(fd, position, data)
+end
+
+--[[
+Writes a list of strings and Buffers in one go, with writev where there is
+one.  Calls back with (err, written) once all of it is written.
+]]
+if native.fsWritev then
+  function fs.writev(fd, position, chunks, callback)
+    return native.fsWritev(fd, position, chunks, callback or default)
+  end
+
+  function fs.writevSync(fd, position, chunks)
+    return native.fsWritev(fd, position, chunks)
+  end
+else
+  function fs.writev(fd, position, chunks, callback)
+    callback = callback or default
+    local total = 0
+    local i = 0
+    local function nextChunk(err, written)
+      if err then return callback(err) end
+      total = total + (written or 0)
+      i = i + 1
+      if i > #chunks then return callback(nil, total) end
+      local chunk = chunks[i]
+      fs.write(fd, position < 0 and position or position + total, chunk, 0, #chunk, nextChunk)
+    end
+    nextChunk()
+  end
+
+  function fs.writevSync(fd, position, chunks)
+    local total = 0
+    for i = 1, #chunks do
+      local chunk = chunks[i]
+      total = total + fs.writeSync(fd, position < 0 and position or position + total,
+        chunk, 0, #chunk)
+    end
+    return total
+  end
+end
+
 local function modeNum(m, def)
   local t = type(m)
   if t == 'number' then
@@ -145,20 +226,125 @@ function fs.existsSync(path)
   error(err)
 end
 
-local function writeAll(fd, offset, buffer, callback)
-  fs.write(fd, offset, buffer, function(err, written)
-    if err then
-      fs.close(fd, function()
-        if callback then callback(err) end
-      end)
+--[[
+Walks the tree under root, calling back with (err, entries, done) for each
+batch of entries found.  Entries are stat tables with path and name added.
+
+    fs.walk(root, {extensions = {".png", ".jpg"}}, function (err, entries, done)
+    end)
+
+options:
+  maxDepth - how deep to go, 0 only looks at root's own entries
+  glob - only report names matching this pattern of * and ?
+  extensions - only report names ending in one of these
+  followSymlinks - stat links and go into linked directories
+  batchSize - at most this many entries per callback
+
+The filters only pick what's reported, the walk still goes into every
+directory.  Directories that can't be read are skipped.  The walk runs in
+the thread pool, a batch at a time.
+]]
+if native.fsWalk then
+  function fs.walk(root, options, callback)
+    if type(options) == "function" then
+      callback = options
+      options = nil
     end
-    if written == #buffer then
-      fs.close(fd, callback)
-    else
-      offset = offset + written
-      writeAll(fd, offset, buffer, callback)
+    native.fsWalk(pathlib._makeLong(root), options, callback)
+  end
+else
+  local function globPattern(glob)
+    local pattern = glob:gsub("[%^%$%(%)%%%.%[%]%+%-]", "%%%0")
+    return "^" .. pattern:gsub("%*", ".*"):gsub("%?", ".") .. "$"
+  end
+
+  -- The same walk from Lua, a batch per directory.  Unlike the native one
+  -- it doesn't notice symlink cycles.
+  function fs.walk(root, options, callback)
+    if type(options) == "function" then
+      callback = options
+      options = nil
     end
-  end)
+    options = options or {}
+    local maxDepth = options.maxDepth or -1
+    local pattern = options.glob and globPattern(options.glob)
+    local extensions = options.extensions
+    local statEntry = options.followSymlinks and fs.stat or fs.lstat
+    local pending = 0
+
+    local function matches(name)
+      if pattern and not name:match(pattern) then return false end
+      if not extensions then return true end
+      for i = 1, #extensions do
+        local ext = extensions[i]
+        if name:sub(-#ext) == ext then return true end
+      end
+      return false
+    end
+
+    local walkDir
+    walkDir = function (dir, depth, isRoot)
+      pending = pending + 1
+      fs.readdir(dir, function (err, names)
+        if err then
+          if isRoot then return callback(err) end
+          names = {}
+        end
+        local entries = {}
+        local left = #names
+        local function finish()
+          pending = pending - 1
+          callback(nil, entries, pending == 0)
+        end
+        if left == 0 then return finish() end
+        for i = 1, #names do
+          local name = names[i]
+          local path = pathlib.join(dir, name)
+          statEntry(path, function (err, stat)
+            if not err then
+              stat.path = path
+              stat.name = name
+              if matches(name) then
+                entries[#entries + 1] = stat
+              end
+              if stat.is_directory and (maxDepth < 0 or depth < maxDepth) then
+                walkDir(path, depth + 1)
+              end
+            end
+            left = left - 1
+            if left == 0 then finish() end
+          end)
+        end
+      end)
+    end
+    walkDir(root, 0, true)
+  end
+end
+
+
+-- closes fd
+local function writeAll(fd, position, data, callback)
+  local length = #data
+  local done = 0
+  local function writeRest()
+    fs.write(fd, position, data, done, length - done, function(err, written)
+      if err then
+        return fs.close(fd, function()
+          if callback then callback(err) end
+        end)
+      end
+      done = done + written
+      if position >= 0 then
+        position = position + written
+      end
+      if done == length then
+        fs.close(fd, callback)
+      else
+        writeRest()
+      end
+    end)
+  end
+  writeRest()
 end
 
 function fs.appendFile(path, data, callback)
@@ -177,7 +363,7 @@ function fs.appendFileSync(path, data)
   local ok, err
   ok, err = pcall(function()
     while written < length do
-      written = written + fs.writeSync(fd, -1, data)
+      written = written + fs.writeSync(fd, -1, data, written, length - written)
     end
   end)
   if not ok then
@@ -230,13 +416,15 @@ local read_options = {
   mode = "0644",
   chunk_size = CHUNK_SIZE,
   offset = 0,
+  buffers = nil, -- read into a ring of this many Buffers instead of strings
   fd = nil,
   reading = nil,
   length = nil -- nil means read to EOF
 }
 local read_meta = {__index=read_options}
 
--- TODO: Implement backpressure here and in tcp streams
+-- pause() and resume() hold reading back, so pipe() keeps to the pace of
+-- its target
 local ReadStream = iStream:extend()
 fs.ReadStream = ReadStream
 
@@ -251,6 +439,17 @@ function ReadStream:initialize(path, options)
   self.options = options
   self.offset = options.offset
 
+  -- Each Buffer is emitted as 'data' along with how much of it was filled.
+  -- It's refilled once the ring comes round to it again, so listeners may
+  -- hold on to it for buffers - 1 more reads.
+  if options.buffers then
+    self.ring = {}
+    for i = 1, options.buffers do
+      self.ring[i] = Buffer:new(options.chunk_size)
+    end
+    self.ringIndex = 1
+  end
+
   if (options.fd ~= nil) then
     self.fd = options.fd
     self:_read()
@@ -271,6 +470,21 @@ function ReadStream:readStart()
   self:_read()
 end
 
+-- Stops reading after a read in progress, its chunk still gets emitted
+function ReadStream:pause()
+  self.paused = true
+end
+
+function ReadStream:resume()
+  if not self.paused then
+    return
+  end
+  self.paused = false
+  if self.fd and not self.reading and not self.ended then
+    self:_read()
+  end
+end
+
 function ReadStream:_read()
   local options = self.options
 
@@ -280,7 +494,7 @@ function ReadStream:_read()
 
   self.reading = true
 
-  fs.read(self.fd, self.offset, to_read, function (err, chunk, len)
+  local function onRead(err, chunk, len)
     if err or len == 0 then
       fs.close(self.fd, function (err)
         if err then return self:emit("error", err) end
@@ -289,49 +503,85 @@ function ReadStream:_read()
       if err then return self:emit("error", err) end
 
       self.reading = false
+      self.ended = true
       self:emit("end")
     else
-      self:emit("data", chunk, len)
       self.offset = self.offset + len
-      self:_read()
+      self:emit("data", chunk, len)
+      if self.paused then
+        self.reading = false
+      else
+        self:_read()
+      end
     end
+  end
+
+  local ring = self.ring
+  if not ring then
+    return fs.read(self.fd, self.offset, to_read, onRead)
+  end
+  local buffer = ring[self.ringIndex]
+  self.ringIndex = self.ringIndex % #ring + 1
+  fs.read(self.fd, self.offset, buffer, 0, to_read, function (err, len)
+    onRead(err, buffer, len)
   end)
 end
 
--- TODO: Implement backpressure here and in tcp streams
 function fs.createReadStream(path, options)
   return ReadStream:new(pathlib._makeLong(path), options)
 end
 
-function fs.readFileSync(path)
-  local fd = fs.openSync(pathlib._makeLong(path), "r", "0666")
-  local parts = {}
-  local length = 0
-  local offset = 0
-  repeat
-    local chunk, len = fs.readSync(fd, offset, CHUNK_SIZE)
-    if len > 0 then
-      offset = offset + len
-      length = length + 1
-      parts[length] = chunk
-    end
-  until len == 0
-  fs.closeSync(fd)
-  return table.concat(parts)
+if ffi.os ~= "Windows" then
+  ffi.cdef([[
+    int munmap(void *addr, size_t length);
+  ]])
 end
 
-function fs.readFile(path, callback)
-  local stream = fs.createReadStream(pathlib._makeLong(path))
-  local parts = {}
-  local num = 0
-  stream:on("data", function (chunk, len)
-    num = num + 1
-    parts[num] = chunk
-  end)
-  stream:on("end", function ()
-    return callback(nil, table.concat(parts, ""))
+-- Wraps what fsReadFile returns in mmap mode in a read-only Buffer that
+-- unmaps the file once collected.  Files it couldn't map, like empty ones,
+-- come back as strings and get copied.
+local function mappedBuffer(data, length)
+  local buffer
+  if type(data) == "string" then
+    buffer = Buffer:new(#data)
+    ffi.copy(buffer.ctype, data, #data)
+  else
+    buffer = Buffer:new(data, length, function (pointer)
+      ffi.C.munmap(pointer, length)
+    end)
+  end
+  buffer.readonly = true
+  return buffer
+end
+
+--[[
+Reads a whole file with one read sized from fstat.  With options.mmap the
+file is mapped instead and comes back as a read-only Buffer, which suits big
+files that are read a lot and rarely change.  A mapped file must not be
+truncated while the Buffer is in use.
+]]
+function fs.readFileSync(path, options)
+  local mmap = options and options.mmap
+  local data, length = native.fsReadFile(pathlib._makeLong(path), mmap)
+  if mmap then
+    return mappedBuffer(data, length)
+  end
+  return data
+end
+
+function fs.readFile(path, options, callback)
+  if type(options) == "function" then
+    callback = options
+    options = nil
+  end
+  local mmap = options and options.mmap
+  native.fsReadFile(pathlib._makeLong(path), mmap, function (err, data, length)
+    if err then return callback(err) end
+    if mmap then
+      data = mappedBuffer(data, length)
+    end
+    callback(nil, data)
   end)
-  stream:on("error", callback)
 end
 
 function fs.writeFileSync(path, data)
@@ -346,20 +596,7 @@ function fs.writeFile(path, data, callback)
   end
   fs.open(pathlib._makeLong(path), "w", "0666", function (err, fd)
     if err then return callback(err) end
-    local offset = 0
-    local length = #data
-    local function writechunk()
-      fs.write(fd, offset, data:sub(offset + 1, CHUNK_SIZE + offset), function (err, bytes_written)
-        if err then return callback(err) end
-        if bytes_written + offset < length then
-          offset = offset + bytes_written
-          writechunk()
-        else
-          fs.close(fd, callback)
-        end
-      end)
-    end
-    writechunk()
+    writeAll(fd, 0, data, callback)
   end)
 end
 
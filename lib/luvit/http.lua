@@ -18,13 +18,23 @@ limitations under the License.
 
 local net = require('net')
 local HttpParser = require('http_parser')
+local chunkFrame = HttpParser.chunkFrame
 local table = require('table')
 local osDate = require('os').date
+local osTime = require('os').time
 local string = require('string')
 local stringFormat = require('string').format
 local Object = require('core').Object
 local Error = require('core').Error
+local BufferList = require('buffer').BufferList
 local url = require('url')
+local fs = require('fs')
+local mime = require('mime')
+local timer = require('timer')
+local filecache = require('filecache')
+local zlib = require('zlib')
+local mathMin = require('math').min
+local mathHuge = require('math').huge
 
 local END_OF_FILE = 0
 local CRLF = '\r\n'
@@ -97,6 +107,57 @@ local STATUS_CODES = {
 }
 http.STATUS_CODES = STATUS_CODES
 
+-- Serialized status lines, filled in as codes get used
+local STATUS_LINES = {}
+
+-- The Date header only changes once a second, so keep the formatted line
+-- around instead of calling os.date for every response
+local dateTime, dateLine
+
+local function getDateLine()
+  local now = osTime()
+  if now ~= dateTime then
+    dateTime = now
+    -- This should be RFC 1123 date format
+    -- IE: Tue, 15 Nov 1994 08:12:31 GMT
+    dateLine = osDate("!Date: %a, %d %b %Y %H:%M:%S GMT\r\n", now)
+  end
+  return dateLine
+end
+
+-- Returns the current RFC 1123 date, as sent in the Date header
+function http.date()
+  return getDateLine():sub(7, -3)
+end
+
+--[[
+A set of headers serialized once, for headers that are the same on every
+response like Server or CORS ones.  Add it to a response with
+response:addHeaderBlock(block), or to every response of a server by putting
+it in server.headerBlocks.
+]]
+local HeaderBlock = Object:extend()
+http.HeaderBlock = HeaderBlock
+
+function HeaderBlock:initialize(headers)
+  local lines = {}
+  self.names = {}
+  -- Lowercased name of each line, for leaving out some of them
+  self.lineNames = {}
+  for field, value in pairs(headers) do
+    -- Accept {name, value} pairs too, for repeated headers
+    if type(field) == "number" then
+      field = value[1]
+      value = value[2]
+    end
+    lines[#lines + 1] = field .. ": " .. value .. "\r\n"
+    self.lineNames[#lines] = field:lower()
+    self.names[field:lower()] = true
+  end
+  self.lines = lines
+  self.data = table.concat(lines)
+end
+
 --------------------------------------------------------------------------------
 --[[ Incoming Message Base Class ]]--
 local IncomingMessage = iStream:extend()
@@ -153,6 +214,36 @@ function IncomingMessage:_emitEnd()
   self._endEmitted = true
 end
 
+--[[
+Collects the whole body and calls callback(err, body) once it has ended.
+Chunks are joined once at the end rather than as they come.  A body bigger
+than maxLength, when given, destroys the connection and is an error.
+]]
+local function readBody(self, callback, maxLength)
+  local body = BufferList:new()
+  local done = false
+  local function finish(err, data)
+    if done then return end
+    done = true
+    callback(err, data)
+  end
+  self:on('data', function (chunk)
+    if done then return end
+    body:push(chunk)
+    if maxLength and body.length > maxLength then
+      finish(Error:new('body longer than ' .. maxLength .. ' bytes'))
+      self:destroy()
+    end
+  end)
+  self:once('end', function ()
+    finish(nil, body:toString())
+  end)
+  self:once('error', function (err)
+    finish(err)
+  end)
+end
+IncomingMessage.readBody = readBody
+
 function IncomingMessage:_addHeaderLine(field, value)
   local dest = self.complete and self.trailers or self.headers
   local headerMap = {}
@@ -257,7 +348,7 @@ function OutgoingMessage:_writeRaw(data, encoding)
         return false
       end
 
-      local c = table.remove(self.output)
+      local c = table.remove(self.output, 1)
       self.socket:write(c)
     end
 
@@ -339,7 +430,10 @@ function OutgoingMessage:_storeHeader(firstLine, headers)
   end
 
   if sentConnectionHeader == false then
-    local shouldSendKeepAlive = self.shouldKeepAlive and (sentContentLengthHeader or self.useChunkedEncodingByDefault)
+    -- A pooled client connection is only reused when the response delimits
+    -- itself, so the request may be kept alive without a body length
+    local shouldSendKeepAlive = self.shouldKeepAlive and (sentContentLengthHeader or
+      self.useChunkedEncodingByDefault or self.agent ~= nil)
     if shouldSendKeepAlive == true then
       messageHeader = messageHeader .. 'Connection: keep-alive\r\n'
     else
@@ -424,9 +518,7 @@ function OutgoingMessage:write(chunk, encoding)
 
   local ret
   if self.chunkedEncoding then
-    local len = #chunk
-    chunk = tostring(tonumber(len, 16)) .. CRLF .. chunk .. CRLF
-    ret = self:_send(chunk, encoding)
+    ret = self:_send(chunkFrame(chunk), encoding)
   else
     ret = self:_send(chunk, encoding)
   end
@@ -474,9 +566,9 @@ function OutgoingMessage:done(data, encoding)
 
   if hot then
     if self.chunkedEncoding then
-      local l = tostring(tonumber(#data, 16))
-      local buf = self._header .. l .. CRLF .. data .. '\r\n0\r\n' .. self._trailer .. CRLF
-      ret = self.socket:write(buf)
+      local frame = chunkFrame(data, true, self._trailer)
+      table.insert(frame, 1, self._header)
+      ret = self.socket:write(frame)
     else
       ret = self.socket:write(self._header .. data)
     end
@@ -517,7 +609,7 @@ function OutgoingMessage:_flush()
       return
     end
 
-    local data = table.remove(self.output)
+    local data = table.remove(self.output, 1)
     ret = self.socket:write(data)
   end
 
@@ -602,7 +694,253 @@ function ServerResponse:writeHeader(...)
   self:writeHead(...)
 end
 
+--[[ Agent ]]--
+
+--[[
+Pools client connections per host:port.  With keepAlive a connection whose
+response allows it goes back to the pool when the exchange is over, and the
+next request to the same place reuses it instead of connecting again.  At
+most maxSockets connections are open to a host:port at once, requests past
+that wait for one to come free.  Up to maxFreeSockets idle connections are
+kept per host:port and each is closed after idleTimeout ms without use.
+
+    local agent = http.Agent:new({ keepAlive = true, maxSockets = 8 })
+    http.request({ host = "api", port = 8080, agent = agent }, onResponse)
+
+Requests use http.globalAgent unless given an agent, which doesn't keep
+connections alive, or agent = false for a connection of their own.
+]]
+local Agent = Object:extend()
+http.Agent = Agent
+
+-- Default cap on connections open to one host:port
+Agent.maxSockets = 16
+-- Default cap on idle connections kept to one host:port
+Agent.maxFreeSockets = 16
+-- Default time in ms an idle connection is kept, shorter than the server's
+-- keep-alive timeout so we don't write to a connection it's closing
+Agent.idleTimeout = 4000
+
+function Agent:initialize(options)
+  options = options or {}
+  self.keepAlive = options.keepAlive ~= false
+  self.maxSockets = options.maxSockets or Agent.maxSockets
+  self.maxFreeSockets = options.maxFreeSockets or Agent.maxFreeSockets
+  self.idleTimeout = options.idleTimeout or Agent.idleTimeout
+  if options.createConnection then
+    self.createConnection = options.createConnection
+  end
+  -- Keyed by getName: open connection counts, idle connections with the
+  -- most recently used last, and requests waiting for a connection
+  self.sockets = {}
+  self.freeSockets = {}
+  self.requests = {}
+end
+
+function Agent.createConnection(options)
+  return net.createConnection({
+    port = options.port,
+    host = options.host,
+    localAddress = options.localAddress,
+    happyEyeballs = options.happyEyeballs
+  })
+end
+
+-- Requests with the same name may share connections
+function Agent:getName(options)
+  return options.host .. ':' .. options.port .. ':' .. (options.localAddress or '')
+end
+
+function Agent:addRequest(req, options)
+  local name = self:getName(options)
+  local free = self.freeSockets[name]
+  if free then
+    local socket = table.remove(free)
+    if #free == 0 then
+      self.freeSockets[name] = nil
+    end
+    self:_takeFree(socket)
+    return req:onSocket(socket)
+  end
+
+  if (self.sockets[name] or 0) < self.maxSockets then
+    return req:onSocket(self:_createSocket(name, options))
+  end
+
+  req._agentOptions = options
+  local queue = self.requests[name]
+  if not queue then
+    queue = {}
+    self.requests[name] = queue
+  end
+  queue[#queue + 1] = req
+end
+
+function Agent:_createSocket(name, options)
+  local socket = self.createConnection(options)
+  socket._agentName = name
+  self.sockets[name] = (self.sockets[name] or 0) + 1
+  socket:on('close', function()
+    self:_removeSocket(socket)
+  end)
+  return socket
+end
+
+-- Next request waiting for a connection to name
+function Agent:_dequeue(name)
+  local queue = self.requests[name]
+  if not queue then
+    return
+  end
+  local req = table.remove(queue, 1)
+  if #queue == 0 then
+    self.requests[name] = nil
+  end
+  return req
+end
+
+function Agent:_takeFree(socket)
+  socket._agentIdle = false
+  socket._agentTimer:stop()
+  if socket._handle then
+    socket._handle:ref()
+  end
+end
+
+function Agent:_removeSocket(socket)
+  local name = socket._agentName
+  if not name then
+    return
+  end
+  socket._agentName = nil
+
+  if socket._agentIdle then
+    socket._agentIdle = false
+    socket._agentTimer:stop()
+    local free = self.freeSockets[name]
+    for i = 1, #free do
+      if free[i] == socket then
+        table.remove(free, i)
+        break
+      end
+    end
+    if #free == 0 then
+      self.freeSockets[name] = nil
+    end
+  end
+
+  local count = self.sockets[name] - 1
+  self.sockets[name] = count > 0 and count or nil
+
+  -- The closed connection's slot goes to whoever is waiting
+  local req = self:_dequeue(name)
+  if req then
+    req:onSocket(self:_createSocket(name, req._agentOptions))
+  end
+end
+
+-- Takes back a connection whose request and response are complete
+function Agent:_release(socket)
+  local name = socket._agentName
+  if not name then
+    return
+  end
+
+  local req = self:_dequeue(name)
+  if req then
+    return req:onSocket(socket)
+  end
+
+  local free = self.freeSockets[name] or {}
+  if #free >= self.maxFreeSockets then
+    return socket:destroy()
+  end
+  self.freeSockets[name] = free
+  free[#free + 1] = socket
+
+  -- Idle connections don't keep the process alive, nor do the timeouts of
+  -- the request they last carried follow them into the pool
+  socket._agentIdle = true
+  socket:setTimeout(0)
+  if socket._handle then
+    socket._handle:unref()
+  end
+  if not socket._agentTimer then
+    socket._agentTimer = timer.newWheelTimer(function()
+      socket:destroy()
+    end)
+  end
+  socket._agentTimer:start(self.idleTimeout)
+end
+
+-- Closes the idle connections
+function Agent:destroy()
+  local sockets = {}
+  for _, free in pairs(self.freeSockets) do
+    for i = 1, #free do
+      sockets[#sockets + 1] = free[i]
+    end
+  end
+  for i = 1, #sockets do
+    sockets[i]:destroy()
+  end
+end
+
+http.globalAgent = Agent:new({ keepAlive = false, maxSockets = mathHuge })
+
 --[[ Client Request ]]--
+
+-- A client socket's listeners are added once and hand its events to the
+-- request it's carrying, socket._httpMessage, so that a kept alive socket
+-- can carry one request after another
+local function attachClientSocket(socket)
+  if socket._httpClientAttached then
+    return
+  end
+  socket._httpClientAttached = true
+
+  socket:on('drain', function()
+    if socket._httpMessage then
+      socket._httpMessage:emit('drain')
+    end
+  end)
+  socket:on('close', function()
+    if socket._httpMessage then
+      socket._httpMessage:onSocketClose()
+    end
+  end)
+  socket:on('end', function()
+    if socket._httpMessage then
+      socket._httpMessage:emit('end')
+    end
+  end)
+  socket:on('timeout', function()
+    if socket._httpMessage then
+      socket._httpMessage:emit('timeout')
+    end
+  end)
+  socket:on('data', function(chunk)
+    -- Ignore empty chunks
+    if #chunk == 0 then return end
+
+    if socket._httpMessage then
+      socket._httpMessage:_onSocketData(chunk)
+    else
+      -- Nothing is expected on an idle connection
+      socket:destroy()
+    end
+  end)
+  socket:on('error', function(err)
+    local req = socket._httpMessage
+    if req then
+      req._hadError = true
+      req:emit('error', err)
+    else
+      socket:destroy()
+    end
+  end)
+end
+
 local ClientRequest = OutgoingMessage:extend()
 function ClientRequest:initialize(options, callback)
   OutgoingMessage.initialize(self)
@@ -624,6 +962,26 @@ function ClientRequest:initialize(options, callback)
     self:onResponse(callback, ...)
   end)
 
+  self:once('finish', function()
+    self._requestFinished = true
+    self:_releaseSocket()
+  end)
+
+  local agent = options.agent
+  if agent == nil and not options.createConnection then
+    agent = http.globalAgent
+  end
+  self.agent = agent or nil
+
+  -- The agent decides whether the connection outlives the request
+  if self.agent and self.agent.keepAlive then
+    self._last = false
+    self.shouldKeepAlive = true
+  else
+    self._last = true
+    self.shouldKeepAlive = false
+  end
+
   -- TODO Authorization
 
   if options.headers then
@@ -652,25 +1010,17 @@ function ClientRequest:initialize(options, callback)
     self:_storeHeader(self.method .. ' ' .. self.path .. ' HTTP/1.1\r\n', self:_renderHeaders())
   end
 
-  local conn
-  self._last = true
-  self.shouldKeepAlive = false
-
-  if options.createConnection then
-    options.port = port
-    options.host = host
-    conn = options.createConnection(options)
+  options.port = port
+  options.host = host
+  if self.agent then
+    -- Calls onSocket now or once a connection comes free
+    self.agent:addRequest(self, options)
+  elseif options.createConnection then
+    self:onSocket(options.createConnection(options))
   else
-    conn = net.createConnection({
-      port = port,
-      host = host,
-      localAddress = options.localAddress
-    });
+    self:onSocket(Agent.createConnection(options))
   end
 
-  self.socket = conn
-
-  self:onSocket(conn)
   self:_deferToConnect(function()
     self:_flush()
   end)
@@ -681,24 +1031,21 @@ function ClientRequest:setTimeout(msecs, callback)
     self:once('timeout', callback)
   end
 
-  local function emitTimeout()
-    self:emit('timeout')
-  end
-
+  -- The socket's timeouts reach us through attachClientSocket
   if self.socket and self.socket.writable then
-    self.socket:setTimeout(msecs, emitTimeout)
+    self.socket:setTimeout(msecs)
     return
   end
 
   if self.socket then
     self.socket:on('connect', function()
-      self:setTimeout(msecs, emitTimeout)
+      self:setTimeout(msecs)
     end)
     return
   end
 
   self:once('socket', function(sock)
-    self:setTimeout(msecs, emitTimeout)
+    self:setTimeout(msecs)
   end)
 end
 
@@ -721,79 +1068,70 @@ end
 
 function ClientRequest:onSocket(socket)
   local response = ServerResponse:new(self)
-  local headers, current_field
   response.socket = socket
 
   self.socket = socket
+  self.response = response
 
+  -- Headers are collected by the parser and arrive lowercased in info.headers
   self.parser = HttpParser.new("response", {
-    onMessageBegin = function ()
-      headers = {}
-    end,
-    onUrl = function (url)
-    end,
-    onHeaderField = function (field)
-      current_field = field
-    end,
-    onHeaderValue = function (value)
-      headers[current_field:lower()] = value
-    end,
     onHeadersComplete = function (info)
-      response.headers = headers
+      response.headers = info.headers
       response.statusCode = info.status_code
       response.status_code = info.status_code
       response.version_minor = info.version_minor
       response.version_major = info.version_major
       response.httpVersionMinor = info.version_minor
       response.httpVersionMajor = info.version_major
+      response.should_keep_alive = info.should_keep_alive
       self:emit('response', response)
     end,
     onBody = function (chunk)
       response:emit("data", chunk)
     end,
     onMessageComplete = function ()
+      self._responseComplete = true
       response:emit("end")
+      self:_releaseSocket()
     end
-  })
+  }, "map")
   socket._httpMessage = self
 
-  socket:on('drain', function()
-    if self._httpMessage then
-      self._httpMessage:emit('drain')
-    end
-  end)
-  socket:once('close', function()
-    self:onSocketClose()
-  end)
-  socket:once('end', function()
-    self:emit('end')
-  end)
-  socket:once('timeout', function()
-    self:emit('timeout')
-  end)
-  socket:on('data', function(chunk)
-    -- Ignore empty chunks
-    if #chunk == 0 then return end
+  attachClientSocket(socket)
+  self:emit('socket', socket)
+end
 
-    -- Once we're in "upgrade" mode, the protocol is no longer HTTP and we
-    -- shouldn't send data to the HTTP parser
-    if response.upgrade then
-      response:emit("data", chunk)
-      return
-    end
+function ClientRequest:_onSocketData(chunk)
+  -- Once we're in "upgrade" mode, the protocol is no longer HTTP and we
+  -- shouldn't send data to the HTTP parser
+  if self.response.upgrade then
+    self.response:emit("data", chunk)
+    return
+  end
 
-    local nparsed = self.parser:execute(chunk, 0, #chunk)
-    -- If it wasn't all parsed then there was an error parsing
-    if nparsed < #chunk then
-      local err = Error:new('parse error')
-      self:emit("error", err)
-    end
-  end)
-  socket:on('error', function(err)
-    self._hadError = true
-    self:emit('error', err)
-  end)
-  self:emit('socket', socket)
+  local nparsed = self.parser:execute(chunk, 0, #chunk)
+  -- If it wasn't all parsed then there was an error parsing
+  if nparsed < #chunk then
+    local err = Error:new('parse error')
+    self:emit("error", err)
+  end
+end
+
+-- Once both the request and its response are complete, a connection that
+-- both sides agreed to keep alive goes back to the agent.  Any other is
+-- left to close, which the server does after a response without keep-alive.
+function ClientRequest:_releaseSocket()
+  if not self._requestFinished or not self._responseComplete then
+    return
+  end
+  local socket = self.socket
+  if not self.agent or not self.shouldKeepAlive or self._last or
+    not self.response.should_keep_alive or self.response.upgrade or
+    socket._httpMessage ~= self or socket.destroyed then
+    return
+  end
+  socket._httpMessage = nil
+  self.agent:_release(socket)
 end
 
 function ClientRequest:_deferToConnect(callback)
@@ -832,10 +1170,39 @@ function Request:initialize(socket)
   self.socket = socket
 end
 
+local parseQuery = require('http_parser').parseQuery
+
+--[[
+req.query is the parsed query string of req.url, worked out the first
+time it's looked at, so requests that never use it don't pay for it.
+]]
+function Request.meta:__index(key)
+  if key == "query" then
+    local url = rawget(self, "url")
+    local start = url and url:find("?", 1, true)
+    local query = parseQuery(start and url:sub(start + 1) or "")
+    rawset(self, "query", query)
+    return query
+  end
+  return Request[key]
+end
+
 function Request:destroy(...)
   return self.socket:destroy(...)
 end
 
+-- Pausing the request pauses reading from the connection, so a body piped
+-- into a slow destination waits for it
+function Request:pause()
+  self.socket:pause()
+end
+
+function Request:resume()
+  self.socket:resume()
+end
+
+Request.readBody = readBody
+
 --------------------------------------------------------------------------------
 
 local Response = iStream:extend()
@@ -858,6 +1225,23 @@ Response.auto_server = "Luvit"
 Response.auto_chunked_encoding = true
 Response.auto_content_length = true
 Response.auto_content_type = "text/html"
+-- Chunked bodies send writes smaller than this together as one chunk, at
+-- the latest on the next loop iteration.  0 sends every write right away
+Response.chunkCoalesce = 4096
+
+-- Serialized Server lines by auto_server value, shared by all responses
+Response._serverLines = {}
+
+-- Adds a HeaderBlock to this response's head
+function Response:addHeaderBlock(block)
+  if self.headers_sent then error("Headers already sent") end
+  local blocks = self.header_blocks
+  if not blocks then
+    blocks = {}
+    self.header_blocks = blocks
+  end
+  blocks[#blocks + 1] = block
+end
 
 function Response:setCode(code)
   if self.headers_sent then error("Headers already sent") end
@@ -896,12 +1280,22 @@ function Response:unsetHeader(name)
 end
 
 function Response:flushHead(callback)
+  self:_write(self:_serializeHead(), callback)
+end
+
+-- Builds the status line and headers and marks them as sent
+function Response:_serializeHead()
   if self.headers_sent then error("Headers already sent") end
 
   local reason = STATUS_CODES[self.code]
   if not reason then error("Invalid response code " .. tostring(self.code)) end
 
-  local head = {"HTTP/1.1 " .. self.code .. " " .. reason .. "\r\n"}
+  local statusLine = STATUS_LINES[self.code]
+  if not statusLine then
+    statusLine = "HTTP/1.1 " .. self.code .. " " .. reason .. "\r\n"
+    STATUS_LINES[self.code] = statusLine
+  end
+  local head = {statusLine}
   local length = 1
   local has_server, has_content_length, has_date, has_content_type
 
@@ -928,6 +1322,12 @@ function Response:flushHead(callback)
     end
   end
   local has_body = self.has_body
+  -- Headers describing a body imply one, unless the status rules it out
+  local mayHaveBody = not (self.code == 204 or self.code == 304
+    or (self.code >= 100 and self.code < 200))
+  -- Lowercased names set on the response itself, which the server's blocks
+  -- don't repeat
+  local present = {}
 
   for field, value in pairs(self.headers) do
     -- handle headers added with `add_header`
@@ -936,19 +1336,20 @@ function Response:flushHead(callback)
       value = value[2]
     end
     local lower = field:lower()
+    present[lower] = true
     if lower == "server" then
       has_server = true
     elseif lower == "content-length" then
       has_content_length = true
-      self.has_body = true
+      has_body = has_body or mayHaveBody
     elseif lower == "content-type" then
       has_content_type = true
-      self.has_body = true
+      has_body = has_body or mayHaveBody
     elseif lower == "date" then
       has_date = true
     elseif lower == "transfer-encoding" and value:lower() == "chunked" then
       self.chunked = true
-      self.has_body = true
+      has_body = has_body or mayHaveBody
     elseif lower == "connection" then
       self.has_connection = true
     end
@@ -956,6 +1357,62 @@ function Response:flushHead(callback)
     head[length] = field .. ": " .. value .. "\r\n"
   end
 
+  local blocks = self.header_blocks
+  if blocks then
+    for i = 1, #blocks do
+      for name in pairs(blocks[i].names) do
+        present[name] = true
+      end
+    end
+  end
+
+  -- Splice in pre-serialized blocks, the server's first.  Those are only
+  -- defaults, lines for headers the response has are left out.
+  local blockLists = {self.server_header_blocks, self.header_blocks}
+  for i = 1, 2 do
+    blocks = blockLists[i]
+    if blocks then
+      for j = 1, #blocks do
+        local block = blocks[j]
+        local names = block.names
+        local whole = true
+        if i == 1 then
+          for name in pairs(names) do
+            if present[name] then
+              whole = false
+              break
+            end
+          end
+        end
+        if whole then
+          length = length + 1
+          head[length] = block.data
+        else
+          local lineNames = block.lineNames
+          names = {}
+          for k = 1, #block.lines do
+            if not present[lineNames[k]] then
+              names[lineNames[k]] = true
+              length = length + 1
+              head[length] = block.lines[k]
+            end
+          end
+        end
+        if names.server then has_server = true end
+        if names.date then has_date = true end
+        if names["content-length"] then
+          has_content_length = true
+          has_body = has_body or mayHaveBody
+        end
+        if names["content-type"] then
+          has_content_type = true
+          has_body = has_body or mayHaveBody
+        end
+      end
+    end
+  end
+  self.has_body = has_body
+
   -- Implement auto headers so people's http server are more spec compliant
   if not self.has_connection and self.should_keep_alive then
     length = length + 1
@@ -963,7 +1420,12 @@ function Response:flushHead(callback)
   end
   if not has_server and self.auto_server then
     length = length + 1
-    head[length] = "Server: " .. self.auto_server .. "\r\n"
+    local serverLine = self._serverLines[self.auto_server]
+    if not serverLine then
+      serverLine = "Server: " .. self.auto_server .. "\r\n"
+      self._serverLines[self.auto_server] = serverLine
+    end
+    head[length] = serverLine
   end
   if has_body and not has_content_type and self.auto_content_type then
     length = length + 1
@@ -975,15 +1437,14 @@ function Response:flushHead(callback)
     head[length] = "Transfer-Encoding: chunked\r\n"
   end
   if not has_date and self.auto_date then
-    -- This should be RFC 1123 date format
-    -- IE: Tue, 15 Nov 1994 08:12:31 GMT
     length = length + 1
-    head[length] = osDate("!Date: %a, %d %b %Y %H:%M:%S GMT\r\n")
+    head[length] = getDateLine()
   end
 
-  head = table.concat(head, "") .. "\r\n"
-  self.socket:write(head, callback)
+  length = length + 1
+  head[length] = "\r\n"
   self.headers_sent = true
+  return table.concat(head, "")
 end
 
 function Response:writeHead(code, headers, callback)
@@ -1001,7 +1462,19 @@ function Response:writeHead(code, headers, callback)
 end
 
 function Response:writeContinue(callback)
-  self.socket:write('HTTP/1.1 100 Continue\r\n\r\n', callback)
+  self:_write('HTTP/1.1 100 Continue\r\n\r\n', callback)
+end
+
+-- Data with any Buffers in it copied to strings, for output that's kept
+-- around after the write returns while the caller may reuse its Buffers
+local function detach(data)
+  if type(data) ~= 'table' then return data end
+  if data.ctype then return tostring(data) end
+  local copy = {}
+  for i = 1, #data do
+    copy[i] = detach(data[i])
+  end
+  return copy
 end
 
 function Response:write(chunk, callback)
@@ -1011,15 +1484,64 @@ function Response:write(chunk, callback)
     self:flushHead()
   end
   if self.chunked and #chunk > 0 then
-    self.socket:write(stringFormat("%x\r\n", #chunk))
-    self.socket:write(chunk)
-    return self.socket:write("\r\n", callback)
+    local queue = self._chunkQueue
+    if #chunk < self.chunkCoalesce or queue then
+      if not queue then
+        queue = {}
+        self._chunkQueue = queue
+        self._chunkQueueSize = 0
+        self._chunkCallbacks = {}
+      end
+      queue[#queue + 1] = detach(chunk)
+      self._chunkQueueSize = self._chunkQueueSize + #chunk
+      if callback then
+        self._chunkCallbacks[#self._chunkCallbacks + 1] = callback
+      end
+      if self._chunkQueueSize >= self.chunkCoalesce then
+        return self:_flushChunks()
+      end
+      if not self._chunkFlushScheduled then
+        self._chunkFlushScheduled = true
+        timer.setTimeout(0, function ()
+          self._chunkFlushScheduled = false
+          self:_flushChunks()
+        end)
+      end
+      return not self._needDrain
+    end
+    return self:_write(chunkFrame(chunk), callback)
+  end
+  return self:_write(chunk, callback)
+end
+
+-- Takes the chunks write() is holding back and one callback for all of them
+local function takeChunks(response)
+  local queue = response._chunkQueue
+  if not queue then return end
+  local callbacks = response._chunkCallbacks
+  response._chunkQueue = nil
+  response._chunkCallbacks = nil
+  if #callbacks < 2 then
+    return queue, callbacks[1]
+  end
+  return queue, function (...)
+    for i = 1, #callbacks do
+      callbacks[i](...)
+    end
   end
-  return self.socket:write(chunk, callback)
+end
+
+-- Sends the chunks held back so far as a single chunk
+function Response:_flushChunks()
+  local queue, callback = takeChunks(self)
+  if not queue then return not self._needDrain end
+  return self:_write(chunkFrame(queue), callback)
 end
 
 function Response:finish(chunk, callback)
   if chunk and self.has_body == false then error ("Body not allowed") end
+  -- Head, body and chunked terminator all go out in a single write
+  local parts = {}
   if not self.headers_sent then
     if self.has_body == nil then
       if chunk then
@@ -1033,22 +1555,46 @@ function Response:finish(chunk, callback)
         self.has_body = false
       end
     end
-    self:flushHead()
+    parts[1] = self:_serializeHead()
   end
   if type(chunk) == "function" and callback == nil then
     callback = chunk
     chunk = nil
   end
-  if chunk then
-    self:write(chunk)
+  if chunk and #chunk > 0 and self.has_body == false then
+    error("Body not allowed")
   end
+  local written
   if self.chunked then
-    self.socket:write('0\r\n\r\n')
+    -- Whatever write() held back goes into the last chunk
+    local queue
+    queue, written = takeChunks(self)
+    if chunk and #chunk > 0 then
+      queue = queue or {}
+      queue[#queue + 1] = chunk
+    end
+    local frame = chunkFrame(queue or "", true)
+    for i = 1, #frame do
+      parts[#parts + 1] = frame[i]
+    end
+  elseif chunk and #chunk > 0 then
+    parts[#parts + 1] = chunk
+  end
+  if #parts > 0 then
+    self:_write(parts, written)
   end
   self:done(callback)
 end
 
 function Response:done(callback)
+  -- Wait for the responses to earlier pipelined requests
+  if self._held then
+    self._heldDone = {callback}
+    return
+  end
+  if self._onDone then
+    self._onDone(self)
+  end
   if not self.should_keep_alive then
     self.socket:shutdown(function ()
       self:emit("end")
@@ -1068,6 +1614,375 @@ function Response:destroy(...)
   return self.socket:destroy(...)
 end
 
+-- Size of a write, a string, a Buffer or a list of them
+local function byteLength(data)
+  if type(data) == 'table' and not data.ctype then
+    local length = 0
+    for i = 1, #data do
+      length = length + #data[i]
+    end
+    return length
+  end
+  return #data
+end
+
+-- Responses to pipelined requests hold their output in _held until every
+-- response before them is done, so they reach the client in request order.
+-- Up to the socket's high water mark is held without asking the writer to
+-- wait, past it 'drain' follows the release.  Held Buffers are copied.
+function Response:_write(data, callback)
+  local held = self._held
+  if held then
+    held[#held + 1] = {detach(data), callback}
+    self._heldSize = (self._heldSize or 0) + byteLength(data)
+    if self._heldSize < self.socket.highWaterMark then
+      return true
+    end
+    self._needDrain = true
+    return false
+  end
+  if self.socket:write(data, callback) then
+    return true
+  end
+  self._needDrain = true
+  return false
+end
+
+-- The socket's 'drain', for the response currently writing to it
+function Response:_onDrain()
+  if self._needDrain then
+    self._needDrain = false
+    self:emit('drain')
+  end
+end
+
+-- Called once this is the oldest response on the connection
+function Response:_release()
+  local held = self._held
+  if not held then return end
+  self._held = nil
+  local ready = true
+  for i = 1, #held do
+    ready = self.socket:write(held[i][1], held[i][2])
+  end
+  -- Otherwise the socket's own 'drain' follows
+  if ready then
+    self:_onDrain()
+  end
+  if self._heldDone then
+    local callback = self._heldDone[1]
+    self._heldDone = nil
+    self:done(callback)
+  end
+end
+
+-- Codings the server can produce, preferred first when weighted the same
+local ENCODINGS = {"gzip", "deflate"}
+
+-- The content coding to use for a request out of codings, which defaults to
+-- ENCODINGS.  Picks the one the client weights highest, nil when that's
+-- identity or nothing is acceptable.  An explicit q for a coding overrides
+-- the * wildcard.
+local function acceptedEncoding(headers, codings)
+  local accept = headers and headers["accept-encoding"]
+  if not accept then return end
+  local weights = {}
+  for coding, params in accept:lower():gmatch("([%w%-%*]+)%s*([^,]*)") do
+    weights[coding] = tonumber(params:match("q%s*=%s*([%d%.]+)") or 1) or 0
+  end
+  local wildcard = weights["*"]
+  local best, top = nil, 0
+  for _, coding in ipairs(codings or ENCODINGS) do
+    local weight = weights[coding] or wildcard or 0
+    if weight > top then best, top = coding, weight end
+  end
+  -- An explicitly weighted identity wins over anything weighted lower
+  if best and top < (weights.identity or 0) then return end
+  return best
+end
+
+--[[
+Compresses the body with gzip when the request's Accept-Encoding allows it.
+Returns the stream to write or pipe the body into and to finish, which is the
+response itself when the body goes out as is.  Deflating happens on the
+thread pool.
+]]
+function Response:gzip(level)
+  self:addHeader("Vary", "Accept-Encoding")
+  if not acceptedEncoding(self.request and self.request.headers, {"gzip"}) then
+    return self
+  end
+  self:setHeader("Content-Encoding", "gzip")
+  -- The length changes, send it chunked
+  self:unsetHeader("Content-Length")
+  local gzip = zlib.Gzip:new(level)
+  local function resume()
+    gzip:resume()
+  end
+  -- Stop deflating while the socket is backed up, the producer then sees
+  -- gzip's own write return false
+  gzip:on('data', function (chunk)
+    if self:write(chunk) == false then
+      gzip:pause()
+      self:once('drain', resume)
+    end
+  end)
+  gzip:on('end', function ()
+    self:finish()
+  end)
+  gzip:on('error', function (err)
+    self:emit('error', err)
+  end)
+  return gzip
+end
+
+-- Bytes read per chunk when a file can't be handed to sendfile, eg. over TLS
+Response.sendFileChunkSize = 65536
+
+local function matchesETag(header, etag)
+  if header == "*" then return true end
+  for tag in header:gmatch("[^,%s]+") do
+    if tag == etag or tag == "W/" .. etag then return true end
+  end
+  return false
+end
+
+local function isNotModified(headers, entry, etag)
+  local ifNoneMatch = headers["if-none-match"]
+  if ifNoneMatch then
+    return matchesETag(ifNoneMatch, etag)
+  end
+  return headers["if-modified-since"] == entry.lastModified
+end
+
+-- Parses a single "bytes=first-last" range.  Returns the inclusive bounds,
+-- false when the range can't be satisfied, or nil to ignore the header.
+local function parseRange(header, size)
+  local first, last = header:match("^bytes=(%d*)-(%d*)$")
+  if not first or (first == "" and last == "") then return end
+  if first == "" then
+    -- Suffix range, the last n bytes
+    local n = tonumber(last)
+    if n == 0 then return false end
+    first = n < size and size - n or 0
+    last = size - 1
+  else
+    first = tonumber(first)
+    last = last == "" and size - 1 or mathMin(tonumber(last), size - 1)
+  end
+  if first >= size or first > last then return false end
+  return first, last
+end
+
+-- Whether sendfile can write to the socket, not for streams that transform
+-- the data on its way out like TLS
+local function canSendfile(socket)
+  local handle = socket._handle
+  return handle and handle.fileno and handle:fileno() and not socket.ssl
+end
+
+local function pumpSendfile(response, entry, offset, length, done)
+  if length == 0 then return done() end
+  local socket = response.socket
+  if socket.destroyed then return done(Error:new("Socket closed")) end
+  -- Runs on the loop thread and waits for the socket to take more, the
+  -- stream has nothing else to write meanwhile
+  socket._handle:sendfile(entry.fd, offset, length, function (err)
+    if socket.destroyed then return done(Error:new("Socket closed")) end
+    done(err)
+  end)
+end
+
+local function pumpRead(response, entry, offset, remaining, done)
+  if remaining == 0 then return done() end
+  fs.read(entry.fd, offset, mathMin(remaining, response.sendFileChunkSize), function (err, chunk, length)
+    if err then return done(err) end
+    if length == 0 then return done() end
+    response:_write(chunk, function ()
+      pumpRead(response, entry, offset + length, remaining - length, done)
+    end)
+  end)
+end
+
+local function sendFileError(response, err, callback)
+  if callback then return callback(err) end
+  local code = (err.code == "ENOENT" or err.code == "ENOTDIR") and 404 or 500
+  local body = STATUS_CODES[code] .. "\n"
+  response:writeHead(code, {
+    ["Content-Type"] = "text/plain",
+    ["Content-Length"] = #body
+  })
+  response:finish(body)
+end
+
+-- Types worth compressing, the rest are mostly compressed already
+local function isCompressible(contentType)
+  if not contentType then return false end
+  contentType = contentType:lower()
+  return contentType:find("^text/") ~= nil
+    or contentType:find("javascript", 1, true) ~= nil
+    or contentType:find("json", 1, true) ~= nil
+    or contentType:find("xml", 1, true) ~= nil
+end
+
+-- Sets the validators and answers 304 when the client's copy is current
+local function startFile(response, entry, headers, contentType, etag)
+  response:setHeader("ETag", etag)
+  response:setHeader("Last-Modified", entry.lastModified)
+  if contentType then
+    response:setHeader("Content-Type", contentType)
+  end
+  if isNotModified(headers, entry, etag) then
+    response.code = 304
+    response.has_body = false
+    response:finish()
+    return true
+  end
+end
+
+local function sendPlainFile(response, entry, cache, headers, contentType, callback)
+  local size = entry.stat.size
+  response:setHeader("Accept-Ranges", "bytes")
+  if startFile(response, entry, headers, contentType, entry.etag) then
+    cache:release(entry)
+    if callback then callback() end
+    return
+  end
+
+  local offset, length = 0, size
+  local range = headers.range
+  if range and (not headers["if-range"] or headers["if-range"] == entry.etag) then
+    local first, last = parseRange(range, size)
+    if first == false then
+      cache:release(entry)
+      response.code = 416
+      response:setHeader("Content-Range", "bytes */" .. size)
+      response:setHeader("Content-Length", 0)
+      response:finish()
+      if callback then callback() end
+      return
+    elseif first then
+      response.code = 206
+      response:setHeader("Content-Range", stringFormat("bytes %d-%d/%d", first, last, size))
+      offset = first
+      length = last - first + 1
+    end
+  end
+  response:setHeader("Content-Length", length)
+  response.has_body = true
+
+  local function done(err)
+    cache:release(entry)
+    if err then
+      response:destroy(err)
+    else
+      response:finish()
+    end
+    if callback then callback(err) end
+  end
+
+  if response.request and response.request.method == "HEAD" then
+    return done()
+  end
+
+  -- Held pipelined responses can't touch the socket yet
+  if not response._held and canSendfile(response.socket) then
+    -- The head has to be on the wire before sendfile writes behind it
+    response:flushHead(function ()
+      pumpSendfile(response, entry, offset, length, done)
+    end)
+  else
+    response:flushHead()
+    pumpRead(response, entry, offset, length, done)
+  end
+end
+
+local function sendCompressedFile(response, entry, headers, contentType, encoding, data, callback)
+  -- Each coding is its own representation with its own validator
+  local etag = entry.etag:sub(1, -2) .. "-" .. encoding .. '"'
+  if startFile(response, entry, headers, contentType, etag) then
+    if callback then callback() end
+    return
+  end
+  response:setHeader("Content-Encoding", encoding)
+  response:setHeader("Content-Length", #data)
+  response.has_body = true
+  if response.request and response.request.method == "HEAD" then
+    response:finish()
+  else
+    response:finish(data)
+  end
+  if callback then callback() end
+end
+
+--[[
+Sends the file at path as the body of this response.  Open descriptors and
+stat results come from a FileCache, which also provides the ETag and
+Last-Modified headers used to answer conditional requests with 304.  A
+single byte range is answered with 206.  Over plain TCP the body goes
+straight from the file to the socket with sendfile, otherwise it's read in
+chunks.
+
+options:
+  cache        FileCache to use, defaults to filecache.default
+  contentType  defaults to a guess from the path's extension
+  compressed   a CompressedCache, or true for filecache.compressed, to send
+               text types gzip or deflate encoded when the client accepts
+               it.  Compressed bodies are kept in memory and sent whole.
+
+The callback gets an error when the file can't be opened, before anything is
+written.  Without a callback such errors are answered with 404 or 500.
+]]
+function Response:sendFile(path, options, callback)
+  if type(options) == "function" then
+    callback = options
+    options = nil
+  end
+  options = options or {}
+  local cache = options.cache or filecache.default
+
+  cache:open(path, function (err, entry)
+    if err then return sendFileError(self, err, callback) end
+    if not entry.stat.is_file then
+      cache:release(entry)
+      err = Error:new(path .. " is not a file")
+      err.code = "ENOENT"
+      return sendFileError(self, err, callback)
+    end
+
+    local headers = self.request and self.request.headers or {}
+    local contentType
+    local typeName = self.header_names["content-type"]
+    if not typeName then
+      contentType = options.contentType or mime.getType(path)
+    end
+
+    local compressed = options.compressed
+    if compressed == true then
+      compressed = filecache.compressed
+    end
+    if not compressed or entry.stat.size > compressed.maxEntrySize
+      or not isCompressible(contentType or self.headers[typeName]) then
+      return sendPlainFile(self, entry, cache, headers, contentType, callback)
+    end
+
+    -- Caches must not hand one coding to clients asking for another
+    self:addHeader("Vary", "Accept-Encoding")
+    local encoding = acceptedEncoding(headers)
+    if not encoding then
+      return sendPlainFile(self, entry, cache, headers, contentType, callback)
+    end
+    compressed:file(entry, encoding, function (err, data)
+      if err or not data then
+        return sendPlainFile(self, entry, cache, headers, contentType, callback)
+      end
+      -- The body is in memory, the descriptor isn't needed anymore
+      cache:release(entry)
+      sendCompressedFile(self, entry, headers, contentType, encoding, data, callback)
+    end)
+  end)
+end
+
 --------------------------------------------------------------------------------
 function http.request(options, callback)
   if type(options) == 'string' then
@@ -1082,34 +1997,105 @@ function http.get(options, callback)
   return req
 end
 
+-- Default cap on pipelined requests being answered at once per connection,
+-- override with server.maxPipelined
+http.MAX_PIPELINED = 16
+
+-- Default time in ms a client gets to send a request's headers, and that an
+-- idle keep-alive connection stays open waiting for the next request.
+-- Override with server.headersTimeout and server.keepAliveTimeout, 0 turns
+-- them off.
+http.HEADERS_TIMEOUT = 60000
+http.KEEP_ALIVE_TIMEOUT = 5000
+
 function http.onClient(server, client, onConnection)
   -- Convert tcp stream to HTTP stream
   local request
-  local current_field
   local parser
   local url
-  local headers
+  -- Responses not done yet, oldest first.  Only the first one writes to the
+  -- socket, reading pauses when there are too many.
+  local inflight = {}
+  local maxInflight = server.maxPipelined or http.MAX_PIPELINED
+  local paused = false
+  -- What was read past the request that hit the limit, parsed on resuming
+  local unparsed
+  local parseChunk
+
+  -- Gather each loop iteration's writes into one, for handlers that write
+  -- responses in lots of small pieces
+  if server.autoCork then
+    client:setAutoCork(true)
+  end
+
+  -- Both deadlines share a wheel timer, waiting says which one is running
+  local headersTimeout = server.headersTimeout or http.HEADERS_TIMEOUT
+  local keepAliveTimeout = server.keepAliveTimeout or http.KEEP_ALIVE_TIMEOUT
+  local waiting
+  local deadline = timer.newWheelTimer(function ()
+    client:destroy()
+  end)
+
+  local function waitFor(what, msecs)
+    waiting = what
+    if what and msecs > 0 then
+      deadline:start(msecs)
+    else
+      deadline:stop()
+    end
+  end
+
+  waitFor("headers", headersTimeout)
+
+  local function onResponseDone(response)
+    table.remove(inflight, 1)
+    -- Nothing may follow a response that closes the connection
+    if not response.should_keep_alive then
+      inflight = {}
+      return
+    end
+    if #inflight == 0 then
+      waitFor("request", keepAliveTimeout)
+    end
+    if paused and #inflight < maxInflight then
+      paused = false
+      parser:pause(false)
+      -- Not from inside the handler that finished the response
+      local rest = unparsed
+      unparsed = nil
+      process.nextTick(function ()
+        if client.destroyed then return end
+        if rest then parseChunk(rest) end
+        if not paused then client:resume() end
+      end)
+    end
+    if inflight[1] then
+      inflight[1]:_release()
+    end
+  end
+
+  -- Headers are collected by the parser and arrive lowercased in info.headers
   parser = HttpParser.new("request", {
-    onMessageBegin = function ()
-      headers = {}
-    end,
     onUrl = function (value)
       url = value
     end,
-    onHeaderField = function (field)
-      current_field = field:lower()
-    end,
-    onHeaderValue = function (value)
-      headers[current_field] = value
-    end,
     onHeadersComplete = function (info)
+      waitFor(nil)
 
       -- Accept the client and build request and response objects
       request = Request:new(client)
       local response = Response:new(client)
+      response.request = request
+
+      response.server_header_blocks = server.headerBlocks
+      response._onDone = onResponseDone
+      if #inflight > 0 then
+        response._held = {}
+      end
+      inflight[#inflight + 1] = response
 
       request.method = info.method
-      request.headers = headers
+      request.headers = info.headers
       request.url = url
       request.upgrade = info.upgrade
 
@@ -1166,11 +2152,22 @@ function http.onClient(server, client, onConnection)
     onMessageComplete = function ()
       request:emit("end")
       request:removeListener("end")
-      if request.should_keep_alive then
-        parser:finish()
+      -- Enough requests are being answered.  Stop the parser here so the
+      -- rest of this read waits too, not just the next one.
+      if #inflight >= maxInflight and not paused then
+        paused = true
+        parser:pause(true)
+        client:pause()
       end
     end
-  })
+  }, "map")
+
+  -- Only the oldest response is writing to the socket
+  client:on('drain', function ()
+    if inflight[1] then
+      inflight[1]:_onDrain()
+    end
+  end)
 
   client:on("data", function(chunk)
      -- Once we're in "upgrade" mode, the protocol is no longer HTTP and we
@@ -1187,10 +2184,31 @@ function http.onClient(server, client, onConnection)
     -- don't route empty chunks to the parser
     if #chunk == 0 then return end
 
+    if paused then
+      unparsed = (unparsed or "") .. chunk
+      return
+    end
+    parseChunk(chunk)
+  end)
+
+  function parseChunk(chunk)
+    -- The next request on a kept alive connection has started
+    if waiting == "request" then
+      waitFor("headers", headersTimeout)
+    end
+
     -- Parse the chunk of HTTP, this will syncronously emit several of the
     -- above events and return how many bytes were parsed
     local nparsed = parser:execute(chunk, 0, #chunk)
 
+    -- Paused at the limit, the requests left wait for their turn
+    if paused then
+      if nparsed < #chunk then
+        unparsed = chunk:sub(nparsed + 1)
+      end
+      return
+    end
+
     -- If it wasn't all parsed then there was an error parsing
     if nparsed < #chunk and request then
       if request.upgrade then
@@ -1199,17 +2217,21 @@ function http.onClient(server, client, onConnection)
         request:emit("error", "parse error: " .. chunk)
       end
     end
-  end)
+  end
 
   client:once("end", function ()
     if request then
       request:emit("end")
       request:removeListener("end")
     end
-    parser:finish()
+    -- A paused parser still has requests waiting, they go unanswered
+    if not paused then
+      parser:finish()
+    end
   end)
 
   client:once("close", function ()
+    waitFor(nil)
     if request then
       request:emit("end")
       request:removeListener("end")
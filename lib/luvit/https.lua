@@ -19,6 +19,9 @@ local fmt = require('string').format
 local http = require('http')
 local tls = require('tls')
 local url = require('url')
+local mathHuge = require('math').huge
+
+local https = {}
 
 local function createConnection(...)
   local args = {...}
@@ -49,16 +52,35 @@ local function createConnection(...)
   return tls.connect(options, callback)
 end
 
+--[[
+An http.Agent that makes TLS connections, so a kept alive connection saves
+the handshake too.  Connections are only shared between requests for the
+same server name.
+
+    local agent = https.Agent:new({ keepAlive = true })
+    https.request({ host = "api", agent = agent }, onResponse)
+]]
+local Agent = http.Agent:extend()
+Agent.createConnection = createConnection
+
+function Agent:getName(options)
+  return http.Agent.getName(self, options) .. ':' .. (options.servername or '')
+end
+
 local function request(options, callback)
   if options.protocol and options.protocol ~= 'https' then
     error(fmt('Protocol %s not supported', options.protocol))
   end
+  if options.agent == nil then
+    options.agent = https.globalAgent
+  end
   options.createConnection = createConnection
   options.port = options.port or 443
   options.defaultPort = 443
   return http.request(options, callback)
 end
 
-local https = {}
+https.Agent = Agent
+https.globalAgent = Agent:new({ keepAlive = false, maxSockets = mathHuge })
 https.request = request
 return https
@@ -99,67 +99,50 @@ function JSON.streamingParser(callback, options)
 end
 
 
+-- Turns the use_null option into the null sentinel the C decoders take
+local function withNull(options)
+  if options and options.use_null and options.null == nil then
+    local copy = { null = Yajl.null }
+    for k, v in pairs(options) do
+      if k ~= "use_null" then copy[k] = v end
+    end
+    return copy
+  end
+  return options
+end
+
+-- Parses a whole JSON text.  The tables are built by yajl.decode in C, the
+-- options are the same as for streamingParser plus null, array_mt and
+-- object_mt which it passes through.
 function JSON.parse(string, options)
-  local values = {}
-  local parser = JSON.streamingParser(function (value)
-    table.insert(values, value)
-  end, options)
-  parser:parse(string)
-  parser:complete()
-  return unpack(values)
+  return Yajl.decode(string, withNull(options))
 end
 
-function JSON.stringify(value, options)
-  local generator = Yajl.newGenerator();
-  if options then
-    for k,v in pairs(options) do
-      generator:config(k, v)
-    end
-  end
+--[[
+Decodes JSON arriving in chunks, like newline delimited JSON read from a
+socket, calling callback(value, key) as each value completes.  Feed it with
+decoder:parse(chunk) and decoder:complete() at the end.
 
-  local function add(o)
-    local t = type(o)
-    if t == 'nil' or o == JSON.null then
-      generator:null()
-    elseif t == "boolean" then
-      generator:boolean(o)
-    elseif t == "number" then
-      generator:number(o)
-    elseif t == "string" then
-      generator:string(o)
-    elseif t == "table" then
-      -- Check to see if this is an array
-      local is_array = true
-      local i = 1
-      for k,v in pairs(o) do
-        if not (k == i) then
-          is_array = false
-        end
-        i = i + 1
-      end
-      if is_array then
-        generator:arrayOpen()
-        for i,v in ipairs(o) do
-          add(v)
-        end
-        generator:arrayClose()
-      else
-        generator:mapOpen()
-        for k,v in pairs(o) do
-          if not (type(k) == "string" or type(k) == "number") then
-            error("Keys must be strings to stringify as JSON")
-          end
-          generator:string(k)
-          add(v)
-        end
-        generator:mapClose()
-      end
-    else
-      error("Cannot stringify " .. t .. " value")
-    end
+options.path selects values inside the documents instead of whole ones,
+eg. {"events", "*"} decodes every element of each document's events list
+and nothing else.  Everything outside the path is skipped in C without
+building Lua values for it.  Also takes the options of JSON.parse.
+]]
+function JSON.streamingDecoder(callback, options)
+  return Yajl.newDecoder(callback, withNull(options))
+end
+
+-- Serializes a value in a single call to yajl.encode, which walks the tables
+-- in C.  Tables whose keys are exactly 1..n become arrays, others objects.
+-- Accepts the generator options plus null, a value to write as null.
+function JSON.stringify(value, options)
+  local text = Yajl.encode(value, options)
+  -- Like a generator configured with one, hand the output to the callback
+  if options and options.print_callback then
+    options.print_callback(text)
+    return ""
   end
-  add(value)
-  return generator:getBuf()
+  return text
 end
 
 return JSON
@@ -19,6 +19,16 @@ limitations under the License.
 -- Bootstrap require system
 local native = require('uv_native')
 
+-- Set by luvit_main, embedders calling luvit_init directly don't have it
+local startupTimes = STARTUP_TIMES or {}
+_G.STARTUP_TIMES = nil
+do
+  local now = native.hrtime()
+  startupTimes.start = startupTimes.start or now
+  startupTimes.libs = startupTimes.libs or now
+  startupTimes.init = startupTimes.init or now
+end
+
 local Emitter = require('core').Emitter
 
 local Process = Emitter:extend()
@@ -216,16 +226,51 @@ _G.HTTP_VERSION = nil
 _G.ZLIB_VERSION = nil
 _G.OPENSSL_VERSION = nil
 
--- Add a way to exit programs cleanly
+-- Runs the exit handlers once, however the loop comes to an end
 local exiting = false
-function process.exit(exit_code)
+local function emitExit(exit_code)
   if exiting == false then
     exiting = true
-    process:emit('exit', exit_code or 0)
+    process:emit('exit', exit_code)
+    -- Don't lose what async stdio still has queued
+    if process.stdout.flushSync then process.stdout:flushSync(true) end
+    if process.stderr.flushSync then process.stderr:flushSync(true) end
   end
+end
+
+-- Add a way to exit programs cleanly
+function process.exit(exit_code)
+  emitExit(exit_code or 0)
   exitProcess(exit_code or 0)
 end
 
+--[[
+Swaps process.stdout and process.stderr for uv.LogStreams so print and p
+stop blocking the loop on a slow pipe or disk.  options are passed on, set
+options.stderr to false to keep stderr synchronous.
+
+    process.asyncStdio({ interval = 10, maxBytes = 65536, policy = "drop" })
+    p(process.stdout:stats().dropped)
+]]
+function process.asyncStdio(options)
+  options = options or {}
+  local function logStream(fd, stream)
+    if stream.flushSync then return stream end
+    return uv.LogStream:new(fd, {
+      interval = options.interval,
+      maxBytes = options.maxBytes,
+      policy = options.policy,
+      -- Reuse the Tty or Pipe that's already open on fd
+      handle = stream.userdata and stream
+    })
+  end
+  process.stdout = logStream(1, process.stdout)
+  if options.stderr ~= false then
+    process.stderr = logStream(2, process.stderr)
+  end
+  return process.stdout, process.stderr
+end
+
 function process.nextTick(callback)
   timer.setTimeout(0, callback)
 end
@@ -260,6 +305,48 @@ process.env = setmetatable({}, {
 --Retrieve PID
 process.pid = native.getpid()
 
+--[[
+Memory of this process and the Lua heap of this state, in bytes:
+
+    rss        resident set size of the whole process
+    heapUsed   bytes the Lua heap has allocated
+    heapPeak   highest heapUsed so far
+    heapLimit  the cap set by process.setMemoryLimit or LUVIT_MEMORY_LIMIT
+    pooled     whether small blocks come from the luvit size class pools,
+               heapTotal and freeListBytes are only there when they do
+]]
+function process.memoryUsage()
+  return native.memoryStats()
+end
+
+-- Caps the Lua heap at bytes, 0 for no cap.  Allocations past it fail with
+-- a "not enough memory" error, which pcall catches like any other.
+process.setMemoryLimit = native.setMemoryLimit
+
+--[[
+Moves garbage collection to the gaps between callbacks.  Once the heap has
+grown to pause% of what the last cycle left, the loop steps the collector
+in slices of at most sliceMs whenever it has nothing else to run.  Lua's
+own pause is raised to backstop% so it seldom collects inline.
+
+    process.gcSchedule({ sliceMs = 1, pause = 150 })
+    process.gcSchedule(false)
+
+backstop and stepmul are tuned from the allocation rate unless given.
+process.gcStats() reports cycles, slices and their times, and with
+uv.loopStatsEnable() each slice is also a "gc_idle" source.
+]]
+process.gcSchedule = native.gcSchedule
+process.gcStats = native.gcStats
+
+-- Which of the LUVIT_LOOPS loops this state runs on, all of them share the
+-- pid and run the same script.  The process ends once every loop is done,
+-- or right away on process.exit() from any of them.
+process.loopIndex = LOOP_INDEX or 0
+process.loopCount = LOOP_COUNT or 1
+_G.LOOP_INDEX = nil
+_G.LOOP_COUNT = nil
+
 -- Copy date and time over from lua os module into luvit os module
 local OLD_OS = require('os')
 local OS_BINDING = require('os_binding')
@@ -305,6 +392,7 @@ function assert(good, error)
 end
 
 
+startupTimes.bootstrap = native.hrtime()
 
 assert(xpcall(function ()
 
@@ -406,7 +494,9 @@ assert(xpcall(function ()
   end
 
   if file then
-    assert(require('module').myloadfile(require('path').resolve(process.cwd(), file)))()
+    -- Kept for starting the same script again, eg. in cluster workers
+    process.script = require('path').resolve(process.cwd(), file)
+    assert(require('module').myloadfile(process.script))()
   elseif not (native.handleType(0) == "TTY") then
     process.stdin:on("data", function(line)
       repl.evaluateLine(line)
@@ -422,8 +512,34 @@ assert(xpcall(function ()
 
 end, traceback))
 
+local function reportStartup()
+  local now = native.hrtime()
+  -- Milliseconds spent in each phase of startup up to the event loop
+  process.startupTimings = {
+    libs = startupTimes.libs - startupTimes.start,
+    init = startupTimes.init - startupTimes.libs,
+    bootstrap = startupTimes.bootstrap - startupTimes.init,
+    main = now - startupTimes.bootstrap,
+    total = now - startupTimes.start,
+  }
+  if env.get("LUVIT_STARTUP_TIMINGS") then
+    local timings = process.startupTimings
+    process.stderr:write(require('string').format(
+      "startup: libs %.3fms, init %.3fms, bootstrap %.3fms, main %.3fms, total %.3fms\n",
+      timings.libs, timings.init, timings.bootstrap, timings.main, timings.total))
+  end
+end
+reportStartup()
+
 -- Start the event loop
 native.run()
 
--- trigger exit handlers and exit cleanly
-process.exit(process.exitCode or 0)
+if process.loopCount > 1 then
+  -- The other loops may still be running, so return and let main join them,
+  -- process.exitCode is this loop's status
+  process.exitCode = process.exitCode or 0
+  emitExit(process.exitCode)
+else
+  -- trigger exit handlers and exit cleanly
+  process.exit(process.exitCode or 0)
+end
@@ -19,6 +19,7 @@ limitations under the License.
 local fs = require('fs')
 local path = require('path')
 local table = require('table')
+local string = require('string')
 
 
 local module = {}
@@ -28,6 +29,24 @@ module.oldRequire = require
 
 local global_meta = {__index=_G}
 
+-- Probing results, path -> true/false.  Most requires probe the same
+-- directories over and over, missing paths especially.
+local existsCache = {}
+local function exists(filepath)
+  local found = existsCache[filepath]
+  if found == nil then
+    found = fs.existsSync(filepath)
+    existsCache[filepath] = found
+  end
+  return found
+end
+
+-- Resolved requires, dirname -> name -> file path, or false for misses.
+-- Seeded from the manifest when there is one.
+local resolved = {}
+-- Errors for the misses, so a cached miss reports the same thing
+local missing = {}
+
 local function partialRealpath(filepath)
   -- Do some minimal realpathing
   local link
@@ -40,7 +59,7 @@ local function partialRealpath(filepath)
 end
 
 local function myloadfile(filepath)
-  if not fs.existsSync(filepath) then return end
+  if not exists(filepath) then return end
 
   filepath = partialRealpath(filepath)
 
@@ -71,7 +90,7 @@ end
 module.myloadfile = myloadfile
 
 local function myloadlib(filepath)
-  if not fs.existsSync(filepath) then return end
+  if not exists(filepath) then return end
 
   filepath = partialRealpath(filepath)
 
@@ -96,44 +115,50 @@ local function myloadlib(filepath)
   error(error_message)
 end
 
--- tries to load a module at a specified absolute path
-local function loadModule(filepath, verbose)
+local function loadFile(filepath)
+  if path.extname(filepath) == ".luvit" then
+    return myloadlib(filepath)
+  end
+  return myloadfile(filepath)
+end
+
+-- finds the file a module at a specified absolute path lives in
+local function findModule(filepath)
 
   -- First, look for exact file match if the extension is given
   local extension = path.extname(filepath)
-  if extension == ".lua" then
-    return myloadfile(filepath)
-  end
-  if extension == ".luvit" then
-    return myloadlib(filepath)
+  if extension == ".lua" or extension == ".luvit" then
+    return exists(filepath) and filepath or nil
   end
 
   -- Then, look for module/package.lua config file
-  if fs.existsSync(path.join(filepath, "package.lua")) then
-    local metadata = loadModule(path.join(filepath, "package.lua"))()
+  if exists(path.join(filepath, "package.lua")) then
+    local metadata = myloadfile(path.join(filepath, "package.lua"))()
     if metadata.main then
-      return loadModule(path.join(filepath, metadata.main))
+      return findModule(path.join(filepath, metadata.main))
     end
   end
 
   -- Try to load as either lua script or binary extension
-  local fn = myloadfile(filepath .. ".lua") or myloadfile(path.join(filepath, "init.lua"))
-          or myloadlib(filepath .. ".luvit") or myloadlib(path.join(filepath, "init.luvit"))
-  if fn then return fn end
-
-  return "\n\tCannot find module " .. filepath
+  local candidates = {
+    filepath .. ".lua", path.join(filepath, "init.lua"),
+    filepath .. ".luvit", path.join(filepath, "init.luvit")
+  }
+  for i = 1, #candidates do
+    if exists(candidates[i]) then return candidates[i] end
+  end
 end
 
 local builtinLoader = package.loaders[1]
 local base_path = process.cwd()
 local libpath = process.execPath:match('^(.*)' .. path.sep .. '[^' ..path.sep.. ']+' ..path.sep.. '[^' ..path.sep.. ']+$') ..path.sep.. 'lib' ..path.sep.. 'luvit' ..path.sep
 local bundled_paths = {"modules", "node_modules"}
-function module.require(filepath, dirname)
-  if not dirname then dirname = base_path end
-
-  -- Let module paths always use / even on windows
-  filepath = filepath:gsub("/", path.sep)
+-- Where the library modules live, for states that don't go through here
+module.libpath = libpath
 
+-- Works out which file require(filepath) from dirname means, returns nil
+-- and what was tried if nothing matches
+local function resolve(filepath, dirname)
   -- Absolute and relative required modules
   local absolute_path
   if filepath:sub(1, path.root:len()) == path.root then
@@ -142,56 +167,162 @@ function module.require(filepath, dirname)
     absolute_path = path.join(dirname, filepath)
   end
   if absolute_path then
-    local loader = loadModule(absolute_path)
-    if type(loader) == "function" then
-      return loader()
-    else
-      error("Failed to find module '" .. filepath .."'")
-    end
+    return findModule(absolute_path), ""
   end
 
   local errors = {}
 
-  -- Builtin modules
-  local module = package.loaded[filepath]
-  if module then return module end
-  if filepath:find("^[a-z_]+$") then
-    local loader = builtinLoader(filepath)
-    if type(loader) == "function" then
-      module = loader()
-      package.loaded[filepath] = module
-      return module
-    else
-      errors[#errors + 1] = loader
-    end
-  end
-
   -- Library modules
-
-  local loader = loadModule(libpath .. filepath)
-  if type(loader) == "function" then
-    return loader()
-  else
-    errors[#errors + 1] = loader
-  end
+  local found = findModule(libpath .. filepath)
+  if found then return found end
+  errors[#errors + 1] = "\n\tCannot find module " .. libpath .. filepath
 
   -- Bundled path modules
   local dir = dirname .. path.sep
   repeat
-    local loader
+    local full_path
     for _, bundled_path in ipairs(bundled_paths) do
-      local full_path = path.join(dir, bundled_path, filepath)
-      loader = loadModule(full_path)
-      if type(loader) == "function" then
-        return loader()
-      end
+      full_path = path.join(dir, bundled_path, filepath)
+      found = findModule(full_path)
+      if found then return found end
     end
-    errors[#errors + 1] = loader
+    errors[#errors + 1] = "\n\tCannot find module " .. full_path
     dir = path.dirname(dir)
   until dir == "."
 
-  error("Failed to find module '" .. filepath .."'" .. table.concat(errors, ""))
+  return nil, table.concat(errors, "")
+end
+
+local function resolveCached(filepath, dirname)
+  local byName = resolved[dirname]
+  if not byName then
+    byName = {}
+    resolved[dirname] = byName
+  end
+  local found = byName[filepath]
+  if found == false then
+    return nil, missing[dirname .. "\0" .. filepath]
+  end
+  local errors
+  if not found then
+    found, errors = resolve(filepath, dirname)
+    byName[filepath] = found or false
+    if not found then
+      missing[dirname .. "\0" .. filepath] = errors
+    end
+  end
+  return found, errors
+end
+
+function module.require(filepath, dirname)
+  if not dirname then dirname = base_path end
+
+  -- Let module paths always use / even on windows
+  filepath = filepath:gsub("/", path.sep)
 
+  local errors = ""
+
+  -- Builtin modules
+  local isPath = filepath:sub(1, path.root:len()) == path.root or filepath:sub(1, 1) == "."
+  if not isPath then
+    local module = package.loaded[filepath]
+    if module then return module end
+    if filepath:find("^[a-z_]+$") then
+      local loader = builtinLoader(filepath)
+      if type(loader) == "function" then
+        module = loader()
+        package.loaded[filepath] = module
+        return module
+      else
+        errors = loader
+      end
+    end
+  end
+
+  local found, tried = resolveCached(filepath, dirname)
+  local loader = found and loadFile(found)
+  if not loader and found then
+    -- Stale manifest or cache entry, the file went away
+    existsCache[found] = nil
+    resolved[dirname][filepath] = nil
+    found, tried = resolveCached(filepath, dirname)
+    loader = found and loadFile(found)
+  end
+  if loader then
+    return loader()
+  end
+
+  if isPath then
+    error("Failed to find module '" .. filepath .."'")
+  end
+  error("Failed to find module '" .. filepath .."'" .. errors .. (tried or ""))
+
+end
+
+-- Forget everything resolved so far, for when modules get added or removed
+-- while running
+function module.clearCache()
+  existsCache = {}
+  resolved = {}
+  missing = {}
+end
+
+--[[
+A manifest is the resolution cache written out as a lua file, loading one
+lets require skip the filesystem probing entirely.  Entries that no longer
+exist are resolved again.  With LUVIT_MODULE_MANIFEST set, the manifest at
+that path is loaded at startup, or written on exit if it doesn't exist yet.
+]]
+function module.saveManifest(filepath)
+  local out = { "return {\n" }
+  local dirs = {}
+  for dirname in pairs(resolved) do dirs[#dirs + 1] = dirname end
+  table.sort(dirs)
+  for _, dirname in ipairs(dirs) do
+    local names = {}
+    for name, found in pairs(resolved[dirname]) do
+      if found then names[#names + 1] = name end
+    end
+    if #names > 0 then
+      table.sort(names)
+      out[#out + 1] = string.format("  [%q] = {\n", dirname)
+      for _, name in ipairs(names) do
+        out[#out + 1] = string.format("    [%q] = %q,\n", name, resolved[dirname][name])
+      end
+      out[#out + 1] = "  },\n"
+    end
+  end
+  out[#out + 1] = "}\n"
+  fs.writeFileSync(filepath, table.concat(out, ""))
+end
+
+function module.loadManifest(filepath)
+  local fn = assert(loadstring(fs.readFileSync(filepath), '@' .. filepath))
+  setfenv(fn, {})
+  local manifest = fn()
+  for dirname, names in pairs(manifest) do
+    local byName = resolved[dirname]
+    if not byName then
+      byName = {}
+      resolved[dirname] = byName
+    end
+    for name, found in pairs(names) do
+      byName[name] = found
+    end
+  end
+end
+
+do
+  local manifest = require('env').get("LUVIT_MODULE_MANIFEST")
+  if manifest then
+    if fs.existsSync(manifest) then
+      module.loadManifest(manifest)
+    else
+      process:on('exit', function ()
+        module.saveManifest(manifest)
+      end)
+    end
+  end
 end
 
 -- Remove the cwd based loaders, we don't want them
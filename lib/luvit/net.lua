@@ -20,14 +20,171 @@ local native = require('uv_native')
 local dns = require('dns')
 local Tcp = require('uv').Tcp
 local Timer = require('uv').Timer
+local Check = require('uv').Check
+local Idle = require('uv').Idle
 local timer = require('timer')
 local utils = require('utils')
 local Emitter = require('core').Emitter
 local iStream = require('core').iStream
+local Error = require('core').Error
+local BufferList = require('buffer').BufferList
 local table = require('table')
+local mathFloor = require('math').floor
 
 local net = {}
 
+--[[ Happy Eyeballs ]]--
+
+-- How long an A answer waits for the AAAA one before connecting, RFC 8305
+local RESOLUTION_DELAY = 50
+
+--[[
+Connects to host the way RFC 8305 describes.  A and AAAA queries go out in
+parallel, addresses are tried alternating families starting with IPv6, and
+a new attempt starts every attemptDelay ms or as soon as one fails.  The
+first handle to connect wins and the others are closed.  Hosts DNS knows
+nothing about, like those in /etc/hosts, fall back to dns.lookup.
+
+    callback(err, handle, address, family)
+]]
+local function happyEyeballs(host, port, attemptDelay, callback)
+  local lists = { [6] = {}, [4] = {} }
+  local answered = { [6] = false, [4] = false }
+  local nextFamily = 6
+  local attempts = {}
+  local active = 0
+  local started = false
+  local finished = false
+  local lastErr
+  local attemptTimer, resolutionTimer
+
+  local function finish(err, winner, address, family)
+    if finished then return end
+    finished = true
+    if attemptTimer then timer.clearTimer(attemptTimer) end
+    if resolutionTimer then timer.clearTimer(resolutionTimer) end
+    for i = 1, #attempts do
+      local handle = attempts[i]
+      if handle ~= winner and not handle._closed then
+        handle:close()
+      end
+    end
+    callback(err, winner, address, family)
+  end
+
+  local function nextTarget()
+    local other = nextFamily == 6 and 4 or 6
+    local family = #lists[nextFamily] > 0 and nextFamily or other
+    local address = table.remove(lists[family], 1)
+    if not address then return end
+    nextFamily = family == 6 and 4 or 6
+    return address, family
+  end
+
+  local attempt
+
+  local function giveUpIfExhausted()
+    if active == 0 and answered[6] and answered[4]
+      and #lists[6] == 0 and #lists[4] == 0 then
+      finish(lastErr or Error:new('No addresses for ' .. host))
+    end
+  end
+
+  attempt = function ()
+    if finished then return end
+    if attemptTimer then
+      timer.clearTimer(attemptTimer)
+      attemptTimer = nil
+    end
+    local address, family = nextTarget()
+    if not address then
+      return giveUpIfExhausted()
+    end
+
+    local handle = Tcp:new()
+    local failed = false
+    attempts[#attempts + 1] = handle
+    active = active + 1
+
+    local function onFail(err)
+      if failed or finished then return end
+      failed = true
+      active = active - 1
+      lastErr = err
+      if not handle._closed then handle:close() end
+      attempt()
+    end
+
+    handle:on('connect', function ()
+      if failed or finished then return end
+      finish(nil, handle, address, family)
+    end)
+    handle:on('error', onFail)
+
+    local ok, err = pcall(family == 6 and handle.connect6 or handle.connect,
+      handle, address, port)
+    if not ok then
+      return onFail(Error:new(err))
+    end
+    if not finished and not failed then
+      attemptTimer = timer.setTimeout(attemptDelay, attempt)
+    end
+  end
+
+  local function start()
+    if started then return end
+    started = true
+    if resolutionTimer then
+      timer.clearTimer(resolutionTimer)
+      resolutionTimer = nil
+    end
+    attempt()
+  end
+
+  local function onAnswer(family, err, addresses)
+    if finished then return end
+    answered[family] = true
+    if not err and addresses then
+      for i = 1, #addresses do
+        lists[family][#lists[family] + 1] = addresses[i]
+      end
+    end
+
+    if answered[6] and answered[4] and #attempts == 0
+      and #lists[6] == 0 and #lists[4] == 0 then
+      -- Not in DNS, let getaddrinfo have a go
+      started = true
+      if resolutionTimer then
+        timer.clearTimer(resolutionTimer)
+        resolutionTimer = nil
+      end
+      return dns.lookup(host, function (err, ip, ipFamily)
+        if err then return finish(err) end
+        lists[ipFamily][1] = ip
+        attempt()
+      end)
+    end
+
+    if started then
+      -- Late addresses pick up where an idle connector left off
+      if active == 0 then attempt() end
+      giveUpIfExhausted()
+    elseif family == 6 or answered[6] then
+      start()
+    elseif not resolutionTimer then
+      resolutionTimer = timer.setTimeout(RESOLUTION_DELAY, start)
+    end
+  end
+
+  dns.resolve6(host, function (err, addresses)
+    onAnswer(6, err, addresses)
+  end)
+  dns.resolve4(host, function (err, addresses)
+    onAnswer(4, err, addresses)
+  end)
+end
+net.happyEyeballs = happyEyeballs
+
 --[[ Socket ]]--
 
 local Socket = iStream:extend()
@@ -77,43 +234,209 @@ function Socket:setTimeout(msecs, callback)
   end
 end
 
+-- Size of a write, which may be a string, a Buffer or a list of them
+local function byteLength(data)
+  if type(data) == 'table' and not data.ctype then
+    local length = 0
+    for i = 1, #data do
+      length = length + #data[i]
+    end
+    return length
+  end
+  return #data
+end
+
+--[[
+Queues data on the socket.  Returns false once the bytes waiting to go out
+reach highWaterMark, after which 'drain' is emitted when they are back down
+to lowWaterMark.  Producers should hold off writing in between, pipe() does
+that by pausing its source.
+]]
 function Socket:write(data, callback)
   if self.destroyed then
     return
   end
-  self.bytesWritten = self.bytesWritten + #data
+  local length = byteLength(data)
+  self.bytesWritten = self.bytesWritten + length
 
   if self._connecting == true then
-    self._connectQueueSize = self._connectQueueSize + #data 
+    self._connectQueueSize = self._connectQueueSize + length
     if self._connectQueue then
       table.insert(self._connectQueue, {data, callback})
     else
       self._connectQueue = { {data, callback} }
     end
+    if self._connectQueueSize < self.highWaterMark then
+      return true
+    end
+    self._needDrain = true
     return false
   end
 
   return self:_write(data, callback)
 end
 
+-- Sets the write queue sizes write() starts returning false at and 'drain'
+-- is emitted at, low defaults to a quarter of high
+function Socket:setWaterMarks(high, low)
+  self.highWaterMark = high
+  self.lowWaterMark = low or mathFloor(high / 4)
+end
+
+-- Hands a write to the native side, subclasses layering a protocol on the
+-- handle send through it here
+function Socket:_writeNative(data, callback)
+  self._handle:write(data, callback)
+end
+
+--[[ Write coalescing ]]--
+
+-- Sockets with corked writes to flush once this loop iteration is over.
+-- The check runs the flush, the idle only keeps the poll from blocking so
+-- writes made from timers and such don't wait for unrelated I/O.
+local corkedSockets = {}
+local corkCheck, corkIdle
+
+local function noop() end
+
+local function flushCorkedSockets()
+  local sockets = corkedSockets
+  corkedSockets = {}
+  corkCheck:stop()
+  corkIdle:stop()
+  for i = 1, #sockets do
+    local socket = sockets[i]
+    socket._corkScheduled = false
+    if not socket._corked then
+      socket:_flushCorked()
+    end
+  end
+end
+
+local function scheduleCorkFlush(socket)
+  if socket._corkScheduled then return end
+  socket._corkScheduled = true
+  if not corkCheck then
+    corkCheck = Check:new()
+    corkIdle = Idle:new()
+  end
+  if #corkedSockets == 0 then
+    corkCheck:start(flushCorkedSockets)
+    corkIdle:start(noop)
+  end
+  corkedSockets[#corkedSockets + 1] = socket
+end
+
+--[[
+Holds writes back until the matching uncork(), which sends them all with a
+single vectored write.  Corks nest.
+]]
+function Socket:cork()
+  self._corked = (self._corked or 0) + 1
+end
+
+function Socket:uncork()
+  if not self._corked then return end
+  self._corked = self._corked - 1
+  if self._corked > 0 then return end
+  self._corked = nil
+  self:_flushCorked()
+end
+
+--[[
+With auto cork on, the writes made during one loop iteration are gathered
+and go out as one vectored write at the end of it, for handlers that write
+lots of small pieces.  Socket.autoCork sets the default.
+]]
+function Socket:setAutoCork(enable)
+  self.autoCork = enable and true or false
+  if not self.autoCork and not self._corked then
+    self:_flushCorked()
+  end
+end
+
+Socket.autoCork = false
+
+function Socket:_flushCorked()
+  local queue = self._corkQueue
+  if not queue then return end
+  self._corkQueue = nil
+  self._corkQueueSize = 0
+
+  if self.destroyed then
+    local err = Error:new('socket destroyed before corked writes were sent')
+    for i = 1, #queue do
+      queue[i][2](err)
+    end
+    return
+  end
+
+  local chunks, callbacks = {}, {}
+  for i = 1, #queue do
+    local data = queue[i][1]
+    if type(data) == 'table' and not data.ctype then
+      for j = 1, #data do
+        chunks[#chunks + 1] = data[j]
+      end
+    else
+      chunks[#chunks + 1] = data
+    end
+    callbacks[#callbacks + 1] = queue[i][2]
+  end
+  self:_writeUncorked(chunks, function ()
+    for i = 1, #callbacks do
+      callbacks[i]()
+    end
+  end)
+end
+
 function Socket:_write(data, callback)
+  if self._corked or self.autoCork then
+    local queue = self._corkQueue
+    if not queue then
+      queue = {}
+      self._corkQueue = queue
+      self._corkQueueSize = 0
+    end
+    queue[#queue + 1] = {data, callback or function () end}
+    self._corkQueueSize = self._corkQueueSize + byteLength(data)
+    if not self._corked then
+      scheduleCorkFlush(self)
+    end
+    if self._corkQueueSize + self._handle:writeQueueSize() < self.highWaterMark then
+      return true
+    end
+    self._needDrain = true
+    return false
+  end
+  return self:_writeUncorked(data, callback)
+end
+
+function Socket:_writeUncorked(data, callback)
   timer.active(self)
   self._pendingWriteRequests = self._pendingWriteRequests + 1
-  self._handle:write(data, function(err)
+  self:_writeNative(data, function(err)
     if err then
       self:emit('error', err);
       return
     end
     timer.active(self)
     self._pendingWriteRequests = self._pendingWriteRequests - 1
-    if self._pendingWriteRequests == 0 then
+    if self._needDrain and (self._pendingWriteRequests == 0 or
+       self._handle:writeQueueSize() <= self.lowWaterMark) then
+      self._needDrain = false
       self:emit('drain');
     end
     if callback then
       callback()
     end
   end)
-  return self._handle:writeQueueSize() == 0
+  -- Only counts what the kernel didn't take right away
+  if self._handle:writeQueueSize() < self.highWaterMark then
+    return true
+  end
+  self._needDrain = true
+  return false
 end
 
 function Socket:shutdown(callback)
@@ -121,15 +444,83 @@ function Socket:shutdown(callback)
     return
   end
 
+  -- Corked writes still go out ahead of the FIN
+  self:_flushCorked()
   self._handle:shutdown(callback)
 end
 
 function Socket:pause()
+  self._reading = false
   self._handle:readStop()
 end
 
 function Socket:resume()
-  self._handle:readStart()
+  self:_readStart()
+end
+
+function Socket:_readStart()
+  self._reading = true
+  if self._bufferMode then
+    self._handle:readStart2()
+  else
+    self._handle:readStart()
+  end
+end
+
+--[[
+Opt in to receiving `buffer.Buffer` chunks instead of strings on 'data'. The
+buffers own the memory read from the socket, so nothing gets copied or
+interned. Useful for proxies and handlers that only forward or hash bytes.
+]]
+function Socket:setBufferMode(enable)
+  enable = enable and true or false
+  if self._bufferMode == enable then
+    return
+  end
+  self._bufferMode = enable
+  -- Switch native read modes on the fly
+  if self._reading and self._handle then
+    self._handle:readStop()
+    self:_readStart()
+  end
+end
+
+--[[
+For line based protocols, emit 'line' with each piece of the data that ends
+in delimiter, "\n" by default, without the delimiter.  'data' still comes
+too.  What's left when the other side ends is a last 'line'.  A line longer
+than maxLength, when given, is an 'error' and destroys the socket.
+]]
+function Socket:setLineMode(delimiter, maxLength)
+  delimiter = delimiter or "\n"
+  if self._lines then
+    self._lines.delimiter = delimiter
+    self._lines.maxLength = maxLength
+    return
+  end
+  local lines = BufferList:new()
+  lines.delimiter = delimiter
+  lines.maxLength = maxLength
+  self._lines = lines
+
+  self:on('data', function (data)
+    lines:push(data)
+    while true do
+      local line = lines:readUntil(lines.delimiter)
+      if not line then break end
+      self:emit('line', line)
+      -- A 'line' listener may have destroyed us
+      if self.destroyed then return end
+    end
+    if lines.maxLength and lines.length > lines.maxLength then
+      self:destroy(Error:new('line longer than ' .. lines.maxLength .. ' bytes'))
+    end
+  end)
+  self:once('end', function ()
+    if lines.length > 0 then
+      self:emit('line', lines:consume(lines.length))
+    end
+  end)
 end
 
 function Socket:_initEmitters()
@@ -150,9 +541,9 @@ function Socket:_initEmitters()
     self:done()
   end)
 
-  self._handle:on('data', function(data)
+  self._handle:on('data', function(data, length)
     timer.active(self)
-    self.bytesRead = self.bytesRead + #data
+    self.bytesRead = self.bytesRead + (length or #data)
     self:emit('data', data)
   end)
 
@@ -165,6 +556,16 @@ function Socket:_initEmitters()
   end)
 end
 
+-- Takes over a handle connected on our behalf, dropping the one we had
+function Socket:_adoptHandle(handle)
+  local old = self._handle
+  -- Closing it mustn't take the socket down with it
+  old:removeListener('close')
+  if not old._closed then old:close() end
+  self._handle = handle
+  self:_initEmitters()
+end
+
 function Socket:done()
   self.writable = false
 
@@ -200,7 +601,7 @@ function Socket:connect(...)
   timer.active(self)
   self._connecting = true
 
-  self._handle:on('connect', function()
+  local function onConnect()
     self._connecting = false
 
     if self._connectQueue then
@@ -208,6 +609,7 @@ function Socket:connect(...)
         self:_write(self._connectQueue[i][1], self._connectQueue[i][2])
       end
       self._connectQueue = nil
+      self._connectQueueSize = 0
     end
 
     if self._paused then
@@ -215,11 +617,38 @@ function Socket:connect(...)
       self:pause()
     end
 
-    self._handle:readStart()
+    self:_readStart()
     if callback then
       callback()
     end
-  end)
+  end
+
+  local useEyeballs = options.happyEyeballs
+  if useEyeballs == nil then useEyeballs = self.happyEyeballs end
+  if useEyeballs and native.dnsIsIp(options.host) == 0 then
+    local delay = options.connectionAttemptDelay or self.connectionAttemptDelay
+    happyEyeballs(options.host, options.port, delay, function (err, handle, ip, family)
+      if self.destroyed then
+        if handle then handle:close() end
+        return
+      end
+      if err then
+        self:emit('error', err)
+        self:destroy()
+        return
+      end
+      timer.active(self)
+      self.remotePort = options.port
+      self.remoteAddress = ip
+      self.remoteFamily = family
+      self:_adoptHandle(handle)
+      onConnect()
+      self:emit('connect')
+    end)
+    return self
+  end
+
+  self._handle:on('connect', onConnect)
 
   dns.lookup(options.host, function(err, ip, addressType)
     if err then
@@ -242,6 +671,8 @@ function Socket:destroy(exception)
   end
 
   self.destroyed = true
+  -- Fails whatever writes are still corked
+  self:_flushCorked()
 
   timer.unenroll(self)
   self.readable = false
@@ -259,6 +690,16 @@ function Socket:destroy(exception)
   end)
 end
 
+-- Race A and AAAA addresses when connecting to a hostname, see
+-- net.happyEyeballs.  connect's happyEyeballs option overrides this.
+Socket.happyEyeballs = false
+-- Milliseconds between starting connection attempts
+Socket.connectionAttemptDelay = 250
+-- Bytes waiting to be written at which write() returns false, and at which
+-- 'drain' follows, see Socket:write
+Socket.highWaterMark = 64 * 1024
+Socket.lowWaterMark = 16 * 1024
+
 function Socket:initialize(handle)
   self._onTimeout = utils.bind(Socket._onTimeoutReal, self)
   self._handle = handle or Tcp:new()
@@ -277,25 +718,59 @@ end
 --[[ Server ]]--
 
 local Server = Emitter:extend()
-function Server:listen(port, ... --[[ ip, callback --]] )
-  local args = {...}
-  local ip
-  local callback
+--[[
+Server:listen(port[, ip][, options][, callback])
+
+options are socket options for the listening socket:
+
+- reuseport: bind with SO_REUSEPORT so several processes listening on the
+  port get an even share of the connections
+- v6only: for an IPv6 ip, whether IPv4 clients are turned away
+- deferAccept: seconds TCP_DEFER_ACCEPT waits for the first data
+- fastOpen: length of the TCP_FASTOPEN queue
+- backlog: length of the accept queue, 128 by default
+]]
+function Server:listen(port, ...)
+  local ip, options, callback
 
   if not self._handle then
     self._handle = Tcp:new()
   end
 
-  -- Future proof
-  if type(args[1]) == 'function' then
-    callback = args[1]
-  else
-    ip = args[1]
-    callback = args[2]
+  for i = 1, select('#', ...) do
+    local arg = select(i, ...)
+    local kind = type(arg)
+    if kind == 'function' then
+      callback = arg
+    elseif kind == 'table' then
+      options = arg
+    elseif kind == 'string' then
+      ip = arg
+    end
   end
   ip = ip or '0.0.0.0'
 
-  self._handle:bind(ip, port)
+  -- Cluster workers get the socket, or its connections, from the master
+  if net._clusterListen then
+    net._clusterListen(self, port, ip, options, callback)
+    return self
+  end
+
+  -- With several loops every one of them accepts from the same socket
+  if process.loopCount > 1 then
+    self._handle:bindShared(ip, port, options)
+  elseif net.isIPv6(ip) == 6 then
+    self._handle:bind6(ip, port, options)
+  else
+    self._handle:bind(ip, port, options)
+  end
+  self:_listenHandle(callback, options and options.backlog)
+
+  return self
+end
+
+-- Starts accepting on the bound self._handle
+function Server:_listenHandle(callback, backlog)
   self._handle:on('listening', callback)
   self._handle:on('error', function(err)
     return self:emit("error", err)
@@ -309,16 +784,27 @@ function Server:listen(port, ... --[[ ip, callback --]] )
     end
     local client = Tcp:new()
     self._handle:accept(client)
-    local sock = Socket:new(client)
-    sock:on('end', function()
-      sock:destroy()
-    end)
-    sock:resume()
-    self:emit('connection', sock)
-    sock:emit('connect')
+    self:_onConnection(client)
+  end, backlog)
+end
+
+-- Takes on an accepted client handle
+function Server:_onConnection(client)
+  local sock = self:_createSocket(client)
+  sock:on('end', function()
+    sock:destroy()
   end)
+  if self.bufferMode then
+    sock:setBufferMode(true)
+  end
+  sock:resume()
+  self:emit('connection', sock)
+  sock:emit('connect')
+end
 
-  return self
+-- Wraps an accepted handle, servers of other protocols override this
+function Server:_createSocket(handle)
+  return Socket:new(handle)
 end
 
 function Server:_emitClosedIfDrained()
@@ -353,11 +839,16 @@ function Server:initialize(...)
   local options
   local connectionCallback
 
-  if #args == 1 then
-    connectionCallback = args[1]
-  elseif #args == 2 then
+  if type(args[1]) == 'table' then
     options = args[1]
     connectionCallback = args[2]
+  else
+    connectionCallback = args[1]
+  end
+
+  -- Deliver accepted sockets' data as buffer.Buffers
+  if options and options.buffer then
+    self.bufferMode = true
   end
 
   self:on('connection', connectionCallback)
@@ -388,13 +879,16 @@ net.createConnection = function(port, ... --[[ host, cb --]])
   end
 
   s = Socket:new()
+  if options then
+    return s:connect(options, callback)
+  end
   return s:connect(port, host, callback)
 end
 
 net.create = net.createConnection
 
-net.createServer = function(connectionCallback)
-  return Server:new(connectionCallback)
+net.createServer = function(options, connectionCallback)
+  return Server:new(options, connectionCallback)
 end
 
 net.isIP = function(ip)
@@ -0,0 +1,114 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local debugNative = require('_debug')
+local constants = require('constants')
+local fs = require('fs')
+local uv = require('uv')
+local osTime = require('os').time
+
+--[[
+Sampling CPU profiler for Lua code.  Every interval ms of CPU time the
+stack of whatever Lua is running gets recorded, keeping the most recent
+samples.  The result is in the collapsed stack format of flamegraph.pl.
+
+    local profiler = require('profiler')
+    profiler.start({ interval = 5 })
+    ...
+    profiler.stop()
+    profiler.writeFile("out.folded", callback)
+
+    $ flamegraph.pl out.folded > out.svg
+
+Time in JIT compiled code is charged to the function its trace leaves
+for the interpreter from, run with jit.off() for exact attribution.  Only
+one profile runs per process at a time.
+]]
+local profiler = {}
+
+-- Default ms of CPU time between samples
+profiler.INTERVAL = 10
+-- Default number of samples kept, the oldest are dropped past it
+profiler.SAMPLES = 16384
+
+local running = false
+
+function profiler.start(options)
+  options = options or {}
+  debugNative.profileStart(options.interval or profiler.INTERVAL,
+                           options.samples or profiler.SAMPLES)
+  running = true
+end
+
+function profiler.stop()
+  debugNative.profileStop()
+  running = false
+end
+
+function profiler.isRunning()
+  return running
+end
+
+-- Returns the collapsed stacks, the number of samples and how many were
+-- dropped
+function profiler.collapsed()
+  return debugNative.profileDump()
+end
+
+function profiler.writeFile(path, callback)
+  fs.writeFile(path, profiler.collapsed(), callback or function () end)
+end
+
+--[[
+Starts and stops the profiler each time the process gets signal, SIGUSR2 by
+default, for profiling a running server:
+
+    profiler.toggleOnSignal()
+    $ kill -USR2 <pid>  # start
+    $ kill -USR2 <pid>  # stop and write luvit-<pid>-<time>.folded
+
+options are passed to start, options.path(pid) names the output file.
+Returns the uv.Signal, which doesn't keep the process alive.
+]]
+function profiler.toggleOnSignal(signal, options)
+  options = options or {}
+  local signum = constants[signal or 'SIGUSR2']
+  local handle = uv.Signal:new()
+  handle:on('signal', function ()
+    if not running then
+      return profiler.start(options)
+    end
+    profiler.stop()
+    local path
+    if options.path then
+      path = options.path(process.pid)
+    else
+      path = 'luvit-' .. process.pid .. '-' .. osTime() .. '.folded'
+    end
+    profiler.writeFile(path, function (err)
+      if err then
+        process.stderr:write('profiler: ' .. tostring(err) .. '\n')
+      end
+    end)
+  end)
+  handle:start(signum)
+  handle:unref()
+  return handle
+end
+
+return profiler
@@ -21,22 +21,14 @@ limitations under the License.
 local querystring = {}
 
 local string = require('string')
-local find = string.find
+local native = require('http_parser')
 local gsub = string.gsub
-local char = string.char
 local byte = string.byte
 local format = string.format
-local match = string.match
-local gmatch = string.gmatch
 
-function querystring.urldecode(str)
-  str = gsub(str, '+', ' ')
-  str = gsub(str, '%%(%x%x)', function(h)
-    return char(tonumber(h, 16))
-  end)
-  str = gsub(str, '\r\n', '\n')
-  return str
-end
+-- + is a space, %XX a byte and CRLF becomes LF, in one pass in C
+querystring.urldecode = native.unescape
+querystring.unescape = native.unescape
 
 function querystring.urlencode(str)
   if str then
@@ -49,22 +41,13 @@ function querystring.urlencode(str)
   return str
 end
 
--- parse querystring into table. urldecode tokens
+--[[
+Parses a query string into a table of decoded keys and values.  Pairs are
+split on any of the characters in sep, '&' by default, and at eq, '='
+by default.  A key that comes more than once gets a list of its values.
+]]
 function querystring.parse(str, sep, eq)
-  if not sep then sep = '&' end
-  if not eq then eq = '=' end
-  local vars = {}
-  for pair in gmatch(tostring(str), '[^' .. sep .. ']+') do
-    if not find(pair, eq) then
-      vars[querystring.urldecode(pair)] = ''
-    else
-      local key, value = match(pair, '([^' .. eq .. ']*)' .. eq .. '(.*)')
-      if key then
-        vars[querystring.urldecode(key)] = querystring.urldecode(value)
-      end
-    end
-  end
-  return vars
+  return native.parseQuery(tostring(str), sep, eq)
 end
 
 -- module
@@ -0,0 +1,259 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local native = require('uv_native')
+local Emitter = require('core').Emitter
+local Buffer = require('buffer').Buffer
+local Pipe = require('uv').Pipe
+local fs = require('fs')
+local pathlib = require('path')
+local ffi = require('ffi')
+
+local bytePointer = ffi.typeof("unsigned char*")
+
+--[[
+One way message channels between processes on the same machine through a
+ring in shared memory.  Messages are written into the ring once and read
+back in place as Buffers, so big payloads skip serialization and the copy
+through a socket.  Named pipes carry only the wakeups, and only when the
+other side is asleep.
+
+    -- in one process
+    local sender = shm.Sender:new("render-cache", { create = true })
+    if not sender:write(fragment) then
+      sender:once('drain', ...)
+    end
+
+    -- in another
+    local receiver = shm.Receiver:new("render-cache")
+    receiver:on('message', function (buffer) ... end)
+
+A ring has one sender and one receiver, create one per direction.  The side
+passing create makes the ring, options.size bytes of it rounded up to a
+power of two, and removes it on close.  The other side opens it once it's
+there, so hand the name over after creating.
+]]
+local shm = {}
+
+-- Default ring size, messages can be up to half of it
+shm.size = 4 * 1024 * 1024
+
+-- Where the wakeup pipes go
+shm.dir = '/tmp'
+
+local function openRing(self, name, options)
+  options = options or {}
+  self.name = name:sub(1, 1) == '/' and name or '/' .. name
+  local base = pathlib.join(options.dir or shm.dir,
+    'luvit-shm' .. (self.name:gsub('/', '-')))
+  self.dataPath = base .. '.data'
+  self.spacePath = base .. '.space'
+  if options.create then
+    self.ring = native.shmCreate(self.name, options.size or shm.size)
+    native.mkfifo(self.dataPath)
+    native.mkfifo(self.spacePath)
+    self.owner = true
+  else
+    self.ring = native.shmAttach(self.name)
+  end
+end
+
+-- Opened for reading and writing, so it never waits for the other side
+local function openFifo(path)
+  local pipe = Pipe:new(false)
+  pipe:open(fs.openSync(path, 'r+'))
+  pipe:unref()
+  return pipe
+end
+
+local function closeRing(self)
+  if self.closed then return end
+  self.closed = true
+  self.ring:close()
+  if self.owner then
+    native.shmUnlink(self.name)
+    pcall(fs.unlinkSync, self.dataPath)
+    pcall(fs.unlinkSync, self.spacePath)
+  end
+end
+
+--------------------------------------------------------------------------------
+
+local Sender = Emitter:extend()
+shm.Sender = Sender
+
+function Sender:initialize(name, options)
+  openRing(self, name, options)
+  -- Written to once the receiver is asleep, read once it made room
+  self.wakeReceiver = openFifo(self.dataPath)
+  self.space = openFifo(self.spacePath)
+  self.space:on('data', function ()
+    self:_flush()
+  end)
+  -- Messages waiting for room in the ring
+  self.pending = {}
+  self.waiting = false
+  -- Bigger ones might never fit once the ring wraps
+  self.maxMessage = self.ring:stats().size / 2 - 8
+end
+
+--[[
+Copies chunk, a string or Buffer of at most half the ring, into the ring.
+Returns false when the ring is full, the message is kept and goes in once
+the receiver made room, followed by a 'drain' when nothing is held back
+anymore.
+]]
+function Sender:write(chunk)
+  if self.closed then
+    error("write on a closed shm channel")
+  end
+  if #chunk > self.maxMessage then
+    error("message bigger than half the ring")
+  end
+  if #self.pending == 0 then
+    local ok, wake = self.ring:write(chunk)
+    if ok then
+      if wake then self.wakeReceiver:write("x") end
+      return true
+    end
+  end
+  self.pending[#self.pending + 1] = chunk
+  if not self.waiting then
+    -- Held back messages keep the process alive until they're sent
+    self.waiting = true
+    self.space:ref()
+    self.space:readStart()
+  end
+  return false
+end
+
+function Sender:_flush()
+  if self.closed then return end
+  local pending = self.pending
+  local sent = 0
+  local wake = false
+  for i = 1, #pending do
+    local ok, woke = self.ring:write(pending[i])
+    if not ok then break end
+    sent = i
+    wake = wake or woke
+  end
+  if wake then self.wakeReceiver:write("x") end
+  if sent == 0 then return end
+  local rest = {}
+  for i = sent + 1, #pending do
+    rest[#rest + 1] = pending[i]
+  end
+  self.pending = rest
+  if #rest == 0 then
+    self.waiting = false
+    self.space:readStop()
+    self.space:unref()
+    self:emit('drain')
+  end
+end
+
+-- Messages held back because the ring was full
+function Sender:pendingCount()
+  return #self.pending
+end
+
+function Sender:stats()
+  local stats = self.ring:stats()
+  stats.pending = #self.pending
+  return stats
+end
+
+-- Drops what's held back, the receiver still gets what's in the ring
+function Sender:close()
+  if self.closed then return end
+  self.wakeReceiver:close()
+  self.space:close()
+  closeRing(self)
+end
+
+--------------------------------------------------------------------------------
+
+--[[
+Emits a 'message' for every message in the ring.  Its Buffer points into
+the ring and is only valid until the handlers return, the sender may
+overwrite it right after.  Copy out what's needed later, with toString()
+or Buffer:copy().
+]]
+local Receiver = Emitter:extend()
+shm.Receiver = Receiver
+
+function Receiver:initialize(name, options)
+  openRing(self, name, options)
+  self.wakeup = openFifo(self.dataPath)
+  self.wakeSender = openFifo(self.spacePath)
+  self.wakeup:on('data', function ()
+    self:_drain()
+  end)
+  -- A listening receiver keeps the process alive like a server does
+  self.wakeup:ref()
+  self.wakeup:readStart()
+  self.paused = false
+  -- What came before we were listening doesn't send a wakeup
+  process.nextTick(function ()
+    self:_drain()
+  end)
+end
+
+function Receiver:_drain()
+  local ring = self.ring
+  local wake = false
+  while not self.closed and not self.paused do
+    local pointer, length = ring:peek()
+    if not pointer then break end
+    local buffer = Buffer:create()
+    buffer.ctype = ffi.cast(bytePointer, pointer)
+    buffer.length = length
+    buffer.readonly = true
+    -- Keeps the mapping alive
+    buffer.parent = self
+    self:emit('message', buffer)
+    if self.closed then break end
+    wake = ring:consume() or wake
+  end
+  if wake then self.wakeSender:write("x") end
+end
+
+-- Stops taking messages off the ring, once it fills up the sender's writes
+-- return false
+function Receiver:pause()
+  self.paused = true
+end
+
+function Receiver:resume()
+  self.paused = false
+  self:_drain()
+end
+
+function Receiver:stats()
+  return self.ring:stats()
+end
+
+function Receiver:close()
+  if self.closed then return end
+  self.wakeup:close()
+  self.wakeSender:close()
+  closeRing(self)
+end
+
+return shm
@@ -17,6 +17,8 @@ limitations under the License.
 --]]
 
 local url = require('url')
+local math = require('math')
+local Object = require('core').Object
 local stack = {}
 
 function stack.stack(...)
@@ -85,6 +87,8 @@ function stack.mount(mountpoint, ...)
 
 end
 
+local parseUrl = url.parse
+
 function stack.translate(mountpoint, matchpoint, ...)
   local stack = stack.compose(...)
 
@@ -99,7 +103,7 @@ function stack.translate(mountpoint, matchpoint, ...)
 
     req.url = url:sub(#mountpoint + 1)
     -- We only want to set the parsed uri if there was already one there
-    if req.uri then req.uri = url.parse(req.url) end
+    if req.uri then req.uri = parseUrl(req.url) end
 
     stack(req, res, function (err)
       req.url = url
@@ -110,6 +114,276 @@ function stack.translate(mountpoint, matchpoint, ...)
   end
 end
 
+--[[ Compiled pipelines ]]--
+
+-- The layers of each compiled chain, so chains inside chains get flattened
+local chains = setmetatable({}, { __mode = "k" })
+
+local function flatten(layers, into)
+  for i = 1, #layers do
+    local inner = chains[layers[i]]
+    if inner then
+      flatten(inner, into)
+    else
+      into[#into + 1] = layers[i]
+    end
+  end
+  return into
+end
+
+-- Runs layers in turn with a single continuation per request.  Layers that
+-- continue synchronously run under the one pcall at the top, one that
+-- continues later gets a pcall of its own for the rest of the run.
+local function pipeline(layers, finish)
+  local count = #layers
+  return function (req, res, outer)
+    local index = 0
+    local protected = false
+    local continue
+    continue = function (err)
+      if not protected then
+        protected = true
+        local success, failure = pcall(continue, err)
+        protected = false
+        if not success and failure then
+          index = count
+          finish(req, res, failure, outer)
+        end
+        return
+      end
+      if err or index >= count then
+        index = count
+        return finish(req, res, err, outer)
+      end
+      index = index + 1
+      return layers[index](req, res, continue)
+    end
+    continue()
+  end
+end
+
+--[[
+Like stack.stack, but the layers are linked once up front instead of
+through a pair of closures each, so a request costs one continuation
+whatever the depth.  Chains from stack.chain among the layers are spliced
+in flat.
+
+    local app = stack.compile(logger, static, router)
+    http.createServer(app):listen(8080)
+]]
+function stack.compile(...)
+  local errorHandler = stack.errorHandler
+  return pipeline(flatten({...}, {}), function (req, res, err)
+    errorHandler(req, res, err)
+  end)
+end
+
+-- The compiled counterpart of stack.compose, a layer running layers
+function stack.chain(...)
+  local layers = flatten({...}, {})
+  local chain = pipeline(layers, function (req, res, err, continue)
+    continue(err)
+  end)
+  chains[chain] = layers
+  return chain
+end
+
+-- Like stack.mount, checking the prefix without making a string of it
+function stack.compiledMount(mountpoint, ...)
+  if mountpoint:sub(#mountpoint) == "/" then
+    mountpoint = mountpoint:sub(1, #mountpoint - 1)
+  end
+  local prefix = "^" .. mountpoint:gsub("%W", "%%%0") .. "/"
+  local cut = #mountpoint + 1
+  local chain = stack.chain(...)
+
+  return function (req, res, continue)
+    local url = req.url
+    if not url:find(prefix) then return continue() end
+    local uri = req.uri
+    if not req.real_url then req.real_url = url end
+    req.url = url:sub(cut)
+    if uri then req.uri = parseUrl(req.url) end
+    chain(req, res, function (err)
+      req.url = url
+      req.uri = uri
+      continue(err)
+    end)
+  end
+end
+
+--[[ Router ]]--
+
+local stringByte = require('string').byte
+
+local function newNode(prefix)
+  return { prefix = prefix, children = {} }
+end
+
+-- Length of the common start of a and b
+local function commonLength(a, b)
+  local n = math.min(#a, #b)
+  for i = 1, n do
+    if stringByte(a, i) ~= stringByte(b, i) then return i - 1 end
+  end
+  return n
+end
+
+-- Whether prefix is in path at pos, ending by last
+local function matchesAt(path, pos, last, prefix)
+  local size = #prefix
+  if pos + size - 1 > last then return false end
+  for i = 1, size do
+    if stringByte(path, pos + i - 1) ~= stringByte(prefix, i) then return false end
+  end
+  return true
+end
+
+-- Node at the end of static text s below node, splitting edges as needed
+local function insertStatic(node, s)
+  while #s > 0 do
+    local first = stringByte(s, 1)
+    local child = node.children[first]
+    if not child then
+      child = newNode(s)
+      node.children[first] = child
+      return child
+    end
+    local common = commonLength(child.prefix, s)
+    if common < #child.prefix then
+      local middle = newNode(child.prefix:sub(1, common))
+      child.prefix = child.prefix:sub(common + 1)
+      middle.children[stringByte(child.prefix, 1)] = child
+      node.children[first] = middle
+      child = middle
+    end
+    node = child
+    s = s:sub(common + 1)
+  end
+  return node
+end
+
+-- Finds the node for path[pos..last] below node, static edges before
+-- :params before *wildcards, filling in params on the way back out
+local function lookup(node, path, pos, last, params)
+  if pos > last then
+    if node.handlers then return node end
+    if node.wildcard and node.wildcard.node.handlers then
+      params[node.wildcard.name] = ""
+      return node.wildcard.node
+    end
+    return
+  end
+
+  local child = node.children[stringByte(path, pos)]
+  if child and matchesAt(path, pos, last, child.prefix) then
+    local found = lookup(child, path, pos + #child.prefix, last, params)
+    if found then return found end
+  end
+
+  local param = node.param
+  if param then
+    local stop = path:find("/", pos, true)
+    if not stop or stop > last then stop = last + 1 end
+    if stop > pos then
+      local found = lookup(param.node, path, stop, last, params)
+      if found then
+        params[param.name] = path:sub(pos, stop - 1)
+        return found
+      end
+    end
+  end
+
+  local wildcard = node.wildcard
+  if wildcard and wildcard.node.handlers then
+    params[wildcard.name] = path:sub(pos, last)
+    return wildcard.node
+  end
+end
+
+--[[
+Dispatches on method and path through a radix trie, so finding a route
+doesn't depend on how many there are.  Paths can have :name segments and
+end in a *name that takes the rest, both land in req.params.
+
+    local router = stack.Router:new()
+    router:get("/users/:id", function (req, res, continue)
+      res:finish("user " .. req.params.id)
+    end)
+    router:all("/static/*path", serveStatic)
+    app = stack.compile(logger, router)
+
+A router is a layer and requests nothing matches go on to the next one.
+Static text wins over a :param, which wins over a *wildcard.
+]]
+local Router = Object:extend()
+stack.Router = Router
+
+function Router:initialize()
+  self.root = newNode("")
+end
+
+function Router:route(method, path, handler)
+  local node = self.root
+  local pos = 1
+  while pos <= #path do
+    local marker = path:find("[:*]", pos)
+    if not marker then
+      node = insertStatic(node, path:sub(pos))
+      break
+    end
+    node = insertStatic(node, path:sub(pos, marker - 1))
+    local stop = path:find("/", marker, true) or #path + 1
+    local name = path:sub(marker + 1, stop - 1)
+    if path:sub(marker, marker) == "*" then
+      if stop <= #path then error("A wildcard must end the path: " .. path) end
+      node.wildcard = node.wildcard or { name = name, node = newNode("") }
+      if node.wildcard.name ~= name then
+        error("Conflicting wildcard names in " .. path)
+      end
+      node = node.wildcard.node
+    else
+      node.param = node.param or { name = name, node = newNode("") }
+      if node.param.name ~= name then
+        error("Conflicting parameter names in " .. path)
+      end
+      node = node.param.node
+    end
+    pos = stop
+  end
+  node.handlers = node.handlers or {}
+  node.handlers[method] = handler
+  return self
+end
+
+for _, method in ipairs({ "GET", "POST", "PUT", "DELETE", "PATCH", "HEAD", "OPTIONS" }) do
+  Router[method:lower()] = function (self, path, handler)
+    return self:route(method, path, handler)
+  end
+end
+
+-- Handles every method not given a handler of its own
+function Router:all(path, handler)
+  return self:route("*", path, handler)
+end
+
+-- Returns the handler and params for method and path, or nil
+function Router:match(method, path)
+  local last = (path:find("?", 1, true) or #path + 1) - 1
+  local params = {}
+  local node = lookup(self.root, path, 1, last, params)
+  if not node then return end
+  local handler = node.handlers[method] or node.handlers["*"]
+  if handler then return handler, params end
+end
+
+function Router.meta:__call(req, res, continue)
+  local handler, params = self:match(req.method, req.url)
+  if not handler then return continue() end
+  req.params = params
+  return handler(req, res, continue)
+end
+
 local Debug = require('debug')
 function stack.errorHandler(req, res, err)
   if err then
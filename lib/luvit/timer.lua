@@ -17,138 +17,42 @@ limitations under the License.
 --]]
 
 local Timer = require('uv').Timer
-local os = require('os')
-local table = require('table')
+local newWheelTimer = require('uv').newWheelTimer
 
 local TIMEOUT_MAX = 2147483647
 
-local lists = {}
-
-local function init(list)
-  list._idleNext = list
-  list._idlePrev = list
-end
-
-local function peek(list)
-  if list._idlePrev == list then
-    return nil
-  end
-  return list._idlePrev
-end
-
-local function remove(item)
-  if item._idleNext then
-    item._idleNext._idlePrev = item._idlePrev
-  end
-
-  if item._idlePrev then
-    item._idlePrev._idleNext = item._idleNext
-  end
-
-  item._idleNext = nil
-  item._idlePrev = nil
-end
-
-local function shift(list)
-  local elem = list._idlePrev
-  remove(elem)
-  return elem
-end
-
-local function append(list, item)
-  remove(item)
-  item._idleNext = list._idleNext
-  list._idleNext._idlePrev = item
-  item._idlePrev = list
-  list._idleNext = item
-end
-
-local function isEmpty(list)
-  return list._idleNext == list
-end
-
-local expiration
-expiration = function(timer, msecs)
-  return function()
-    local now = Timer.now()
-    while peek(timer) do
-      local elem = peek(timer)
-      local diff = now - elem._idleStart;
-      if ((diff + 1) < msecs) == true then
-        timer:start(msecs - diff, 0, expiration(timer, msecs))
-        return
-      else
-        remove(elem)
-        if elem._onTimeout then
-          elem._onTimeout()
-        end
-      end
-    end
-
-    -- Remove the timer if it wasn't already
-    -- removed by unenroll
-    local list = lists[msecs]
-    if list and isEmpty(list) then
-      list:stop()
-      list:close()
-      lists[msecs] = nil
-    end
-  end
-end
-
-
-local function _insert(item, msecs)
-  item._idleStart = Timer.now()
-  item._idleTimeout = msecs
-
-  if msecs < 0 then return end
-
-  local list
-
-  if lists[msecs] then
-    list = lists[msecs]
-  else
-    list = Timer:new()
-    init(list)
-    list:start(msecs, 0, expiration(list, msecs))
-    lists[msecs] = list
-  end
-
-  append(list, item)
-end
-
+-- Items on the timing wheel keep their wheel timer in _idleTimer, made the
+-- first time they become active
 local function unenroll(item)
-  remove(item)
-  local list = lists[item._idleTimeout]
-  if list and isEmpty(list) then
-    -- empty list
-    list:stop()
-    list:close()
-    lists[item._idleTimeout] = nil
+  if item._idleTimer then
+    item._idleTimer:stop()
   end
   item._idleTimeout = -1
 end
 
 -- does not start the timer, just initializes the item
 local function enroll(item, msecs)
-  if item._idleNext then
-    unenroll(item)
+  if item._idleTimer then
+    item._idleTimer:stop()
   end
   item._idleTimeout = msecs
-  init(item)
 end
 
 -- call this whenever the item is active (not idle)
 local function active(item)
   local msecs = item._idleTimeout
   if msecs and msecs >= 0 then
-    local list = lists[msecs]
-    if not list or isEmpty(list) then
-      _insert(item, msecs)
-    else
-      item._idleStart = Timer.now()
-      append(lists[msecs], item)
+    local idleTimer = item._idleTimer
+    if not idleTimer then
+      idleTimer = newWheelTimer(function ()
+        if item._onTimeout then
+          item._onTimeout()
+        end
+      end)
+      item._idleTimer = idleTimer
     end
+    item._idleStart = Timer.now()
+    idleTimer:start(msecs, item._idleSlack)
   end
 end
 
@@ -161,8 +65,6 @@ local function setTimeout(duration, callback, ...)
 
   local timer = {}
   timer._idleTimeout = duration
-  timer._idleNext = timer
-  timer._idlePrev = timer
   timer._onTimeout = function()
     callback(unpack(args))
   end
@@ -170,6 +72,30 @@ local function setTimeout(duration, callback, ...)
   return timer
 end
 
+-- Default slack of coarse timers, in ms
+local COARSE_SLACK = 50
+
+--[[
+Like setTimeout, but the callback may run up to slack ms late (50 by
+default).  Deadlines are rounded so coarse timers fire together, for
+polling and retries that don't need to be exact.
+
+    timer.coarse(1000, retry)
+    timer.coarse(30000, poll, 1000)
+]]
+local function coarse(duration, callback, slack)
+  if duration < 1 or duration > TIMEOUT_MAX then
+    duration = 1
+  end
+
+  local timer = {}
+  timer._idleTimeout = duration
+  timer._idleSlack = slack or COARSE_SLACK
+  timer._onTimeout = callback
+  active(timer)
+  return timer
+end
+
 local function setInterval(period, callback, ...)
   local args = {...}
   local timer = Timer:new()
@@ -197,9 +123,12 @@ end
 
 local exports = {}
 exports.setTimeout = setTimeout
+exports.coarse = coarse
+exports.COARSE_SLACK = COARSE_SLACK
 exports.setInterval = setInterval
 exports.clearTimer = clearTimer
 exports.unenroll = unenroll
 exports.enroll = enroll
 exports.active = active
+exports.newWheelTimer = newWheelTimer
 return exports
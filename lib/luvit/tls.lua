@@ -34,6 +34,12 @@ local fmt = string.format
 local END_OF_FILE = 42
 local DEBUG = false
 
+-- OpenSSL's own default, used when only a timeout is given
+local DEFAULT_SESSION_CACHE_SIZE = 20480
+
+-- Servers that verify clients refuse to resume without an id context
+local DEFAULT_SESSION_ID_CONTEXT = 'luvit'
+
 local function dbg(format, ...)
   if DEBUG == true then
     print(fmt(format, {...}))
@@ -112,9 +118,103 @@ local function createCredentials(options, context)
     c.context:setSessionIdContext(options.sessionIdContext)
   end
 
+  if options.sessionCacheSize or options.sessionTimeout then
+    dbg('Setting SessionCache')
+    c.context:setSessionCache(options.sessionCacheSize or DEFAULT_SESSION_CACHE_SIZE,
+      options.sessionTimeout)
+  end
+
+  if options.ticketKeys then
+    dbg('Setting TicketKeys')
+    c.context:setTicketKeys(options.ticketKeys)
+  end
+
+  -- false sends records as big as the writes, a table overrides the
+  -- defaults: { small = 1360, large = 16384, ramp = 1048576, idle = 1000 }
+  if options.recordSizing ~= nil then
+    dbg('Setting RecordSizing')
+    local sizing = options.recordSizing
+    if sizing then
+      c.context:setRecordSizing(sizing.small, sizing.large, sizing.ramp, sizing.idle)
+    else
+      c.context:setRecordSizing(0)
+    end
+  end
+
   return c
 end
 
+-- Client contexts without credentials of their own, by the options that
+-- shape them.  Building one means loading the root store and a fresh
+-- SSL_CTX, which each connection would otherwise pay for.
+local clientContexts = {}
+
+local function clientCredentials(options)
+  if options.key or options.cert or options.ca or options.crl or options.passphrase or
+    options.recordSizing ~= nil then
+    return createCredentials(options)
+  end
+  local key = (options.secureProtocol or '') .. '\0' .. (options.ciphers or '') ..
+    '\0' .. tostring(options.secureOptions or '')
+  local context = clientContexts[key]
+  if not context then
+    context = createCredentials(options).context
+    clientContexts[key] = context
+  end
+  return createCredentials(options, context)
+end
+
+--[[ SessionCache ]]--
+
+--[[
+Client sessions by host:port, so later connections to the same server resume
+instead of doing a full handshake.  Holds at most max sessions and forgets
+the oldest first.
+]]
+local SessionCache = Object:extend()
+
+SessionCache.max = 256
+
+function SessionCache:initialize(max)
+  self.max = max or SessionCache.max
+  self.sessions = {}
+  self.order = {}
+end
+
+function SessionCache:get(key)
+  return self.sessions[key]
+end
+
+function SessionCache:remove(key)
+  if not self.sessions[key] then
+    return
+  end
+  self.sessions[key] = nil
+  for i = 1, #self.order do
+    if self.order[i] == key then
+      table.remove(self.order, i)
+      break
+    end
+  end
+end
+
+function SessionCache:set(key, session)
+  if not session then
+    return self:remove(key)
+  end
+  if not self.sessions[key] then
+    local order = self.order
+    order[#order + 1] = key
+    if #order > self.max then
+      self.sessions[table.remove(order, 1)] = nil
+    end
+  end
+  self.sessions[key] = session
+end
+
+-- Used by connect unless told otherwise with options.sessionCache
+local defaultSessionCache = SessionCache:new()
+
 --[[ CryptoStream ]]--
 
 local CryptoStream = iStream:extend()
@@ -131,9 +231,22 @@ function CryptoStream:initialize(pair, typeString)
   self._type = typeString
 end
 
+-- The native side takes a string or a Buffer, so flatten chunk lists
+local function toBytes(data)
+  if type(data) ~= 'table' or data.ctype then
+    return data
+  end
+  local parts = {}
+  for i = 1, #data do
+    parts[i] = tostring(toBytes(data[i]))
+  end
+  return table.concat(parts)
+end
+
 function CryptoStream:write(data, ...)
   dbg('CryptoStream:write')
 
+  data = toBytes(data)
   if #data == 0 then
     return
   end
@@ -651,6 +764,128 @@ function SecurePair:err()
   end
 end
 
+--[[ TLSSocket ]]--
+
+--[[
+A net.Socket encrypted in C.  The TLS connection is attached to the socket's
+handle, so records are decrypted in the read callback and encrypted straight
+into the write queue with no Lua in between.  'data' carries cleartext and
+writes made before the handshake completes are held until it has.
+]]
+local TLSSocket = Socket:extend()
+
+function TLSSocket:initialize(ssl, handle)
+  Socket.initialize(self, handle)
+  self.ssl = ssl
+  -- Sockets from the SecurePair carry the transport they wrap, here it's us
+  self.socket = self
+  self.authorized = false
+  self._secureEstablished = false
+  self:_attach()
+end
+
+function TLSSocket:_attach()
+  local ssl = self.ssl
+  ssl:attach(self._handle)
+
+  self._handle:on('secure', function()
+    self._secureEstablished = true
+    self.serverName = ssl:getServerName()
+    self:emit('secure')
+    -- Nothing goes out before the peer has been verified
+    local queue = self._secureQueue
+    self._secureQueue = nil
+    if queue and not self.destroyed then
+      for i = 1, #queue do
+        self:_write(queue[i][1], queue[i][2])
+      end
+    end
+  end)
+
+  self._handle:on('tlsError', function(message, code)
+    local err = Error:new(message)
+    err.code = code
+    self:_tlsError(err)
+  end)
+
+  self._handle:once('end', function()
+    if not self._secureEstablished and not self.destroyed then
+      local err = Error:new('socket hang up')
+      err.code = 'ECONNRESET'
+      self:_tlsError(err)
+    end
+  end)
+end
+
+-- The connection moves along when a connect race picks another handle
+function TLSSocket:_adoptHandle(handle)
+  self.ssl:detach()
+  Socket._adoptHandle(self, handle)
+  self:_attach()
+end
+
+function TLSSocket:_tlsError(err)
+  -- Failed handshakes on a server are the server's business
+  if not self._secureEstablished and self.server then
+    self.server:emit('clientError', err, self)
+  else
+    self:emit('error', err)
+  end
+  self:destroy()
+end
+
+function TLSSocket:_write(data, callback)
+  if not self._secureEstablished then
+    local queue = self._secureQueue
+    if not queue then
+      queue = {}
+      self._secureQueue = queue
+    end
+    queue[#queue + 1] = {data, callback}
+    return false
+  end
+  return Socket._write(self, data, callback)
+end
+
+function TLSSocket:_writeNative(data, callback)
+  self.ssl:write(data, callback)
+end
+
+function TLSSocket:shutdown(callback)
+  if self.destroyed == true then
+    return
+  end
+  self:_flushCorked()
+  self.ssl:shutdown(callback)
+end
+
+function TLSSocket:pause()
+  self._reading = false
+  self.ssl:readStop()
+end
+
+function TLSSocket:_readStart()
+  self._reading = true
+  self.ssl:readStart()
+end
+
+-- Cleartext is always delivered as strings
+function TLSSocket:setBufferMode()
+end
+
+function TLSSocket:getCipher()
+  return self.ssl:getCurrentCipher()
+end
+
+function TLSSocket:getPeerCertificate()
+  local c = self.ssl:getPeerCertificate()
+  if c then
+    if c.issuer then c.issuer = parseCertString(c.issuer) end
+    if c.subject then c.subject = parseCertString(c.subject) end
+  end
+  return c
+end
+
 --[[ Private ]]--
 
 local function pipe(pair, socket)
@@ -711,42 +946,45 @@ function Server:initialize(...)
     ciphers = self.ciphers or 'RC4-SHA:AES128-SHA:AES256-SHA',
     secureProtocol = self.secureProtocol,
     secureOptions = self.secureOptions,
-    sessionIdContext = self.sessionIdContext
+    sessionIdContext = self.sessionIdContext or DEFAULT_SESSION_ID_CONTEXT,
+    sessionCacheSize = self.sessionCacheSize,
+    sessionTimeout = self.sessionTimeout,
+    ticketKeys = self.ticketKeys,
+    recordSizing = self.recordSizing
   })
 
+  self.credentials = sharedCreds
+
+  -- Keep forward secrecy for tickets by moving to fresh keys now and then
+  if self.ticketKeyRotation then
+    if not self.ticketKeys then
+      sharedCreds.context:rotateTicketKeys()
+    end
+    self._ticketTimer = timer.setInterval(self.ticketKeyRotation, function()
+      self:rotateTicketKeys()
+    end)
+    self._ticketTimer:unref()
+  end
+
   -- Constructor
   net.Server.initialize(self, function(socket)
-    local creds = createCredentials(nil, sharedCreds.context)
-    local pair = SecurePair:new(creds, true, self.requestCert, self.rejectUnauthorized, {
-      SNICallback = bind(Server.SNICallback, self)
-    })
-    local cleartext = pipe(pair, socket)
-    cleartext.socket = socket
-    pair:on('secure', function()
-      cleartext.serverName = pair.serverName
-      pair.cleartext.authorized = false
-      pair.cleartext.serverName = pair.serverName
-
+    socket:once('secure', function()
       if self.requestCert == false then
-        self:emit('secureConnection', cleartext, pair.encrypted)
+        self:emit('secureConnection', socket)
       else
-        local verifyError = pair.ssl:verifyError()
+        local verifyError = socket.ssl:verifyError()
         if verifyError then
-          pair.cleartext.authorizationError = verifyError
+          socket.authorizationError = verifyError
           if self.rejectUnauthorized == true then
-            pair:destroy()
+            socket:destroy()
           else
-            self:emit('secureConnection', cleartext, pair.encrypted)
+            self:emit('secureConnection', socket)
           end
         else
-          pair.cleartext.authorized = true
-          self:emit('secureConnection', cleartext, pair.encrypted)
+          socket.authorized = true
+          self:emit('secureConnection', socket)
         end
       end
-
-    end)
-    pair:on('error', function(err)
-      self:emit('clientError', err)
     end)
   end)
 
@@ -755,11 +993,51 @@ function Server:initialize(...)
   end
 end
 
+function Server:_createSocket(handle)
+  local ssl = tlsbinding.connection(self.credentials.context, true,
+    self.requestCert, self.rejectUnauthorized)
+  ssl:setSNICallback(bind(Server.SNICallback, self))
+  local socket = TLSSocket:new(ssl, handle)
+  socket.server = self
+  return socket
+end
+
 function Server:addContext(serverName, credentials)
   if not serverName then
     error('ServerName is a required parameter')
   end
-  self._contexts[serverName] = createCredentials(credentials).context
+  local context = createCredentials(credentials).context
+  self._contexts[serverName] = context
+  self:_shareTicketKeys(context)
+end
+
+-- Tickets are decrypted before SNI picks a context and issued after, so
+-- every context has to use the same keys
+function Server:_shareTicketKeys(context)
+  local keys = self.credentials.context.getTicketKeys and
+    self.credentials.context:getTicketKeys()
+  if keys and #keys > 0 then
+    context:setTicketKeys(keys)
+  end
+end
+
+--[[
+Issue session tickets under a new random key.  Tickets under the last few keys
+are still accepted and get reissued under the new one.
+]]
+function Server:rotateTicketKeys()
+  self.credentials.context:rotateTicketKeys()
+  for _, context in pairs(self._contexts) do
+    self:_shareTicketKeys(context)
+  end
+end
+
+function Server:close(callback)
+  if self._ticketTimer then
+    timer.clearTimer(self._ticketTimer)
+    self._ticketTimer = nil
+  end
+  net.Server.close(self, callback)
 end
 
 function Server:SNICallback(serverName)
@@ -825,6 +1103,20 @@ function Server:setOptions(options)
   if options.sessionIdContext then
     self.sessionIdContext = options.sessionIdContext
   end
+
+  -- Size of the session cache, 0 turns it off, and the lifetime of sessions
+  -- in seconds
+  self.sessionCacheSize = options.sessionCacheSize
+  self.sessionTimeout = options.sessionTimeout
+
+  -- Session ticket keys, a string of 48 byte keys newest first, and how
+  -- often to rotate to a fresh key in milliseconds
+  self.ticketKeys = options.ticketKeys
+  self.ticketKeyRotation = options.ticketKeyRotation
+
+  -- Records start small for a quick first byte and grow during a transfer,
+  -- see createCredentials
+  self.recordSizing = options.recordSizing
 end
 
 local function createServer(options, listener)
@@ -853,27 +1145,82 @@ local function connect(...)
     callback = args[#args]
   end
 
-  local socket = options.socket or Socket:new()
   local sslcontext
 
   if options.context then
     sslcontext = createCredentials(options, options.context)
   else
-    sslcontext = createCredentials(options)
+    sslcontext = clientCredentials(options)
   end
 
-  socket:connect(options.port, options.host)
-
   local servername = options.servername or options.host
   if not servername then
     error('host is a required parameter')
   end
+
+  -- Streams other than our own TCP sockets are pumped through a SecurePair
+  if not options.socket then
+    local ssl = tlsbinding.connection(sslcontext.context, false, servername,
+      options.rejectUnauthorized == true)
+
+    -- Resume the last session with this server when there is one
+    local sessionCache = options.sessionCache
+    if sessionCache == nil then
+      sessionCache = defaultSessionCache
+    end
+    local sessionKey = (options.host or servername) .. ':' .. tostring(options.port)
+    local session = options.session or (sessionCache and sessionCache:get(sessionKey))
+    if session then
+      ssl:setSession(session)
+    end
+
+    local socket = TLSSocket:new(ssl)
+    socket:connect({
+      port = options.port,
+      host = options.host,
+      happyEyeballs = options.happyEyeballs,
+      connectionAttemptDelay = options.connectionAttemptDelay
+    })
+
+    if callback then
+      socket:on('secureConnect', function()
+        callback(nil, socket)
+      end)
+    end
+
+    socket:once('secure', function()
+      local verifyError = ssl:verifyError()
+      if verifyError then
+        socket.authorizationError = verifyError
+        if options.rejectUnauthorized == true then
+          if sessionCache then
+            sessionCache:remove(sessionKey)
+          end
+          socket:emit('error', verifyError)
+          socket:destroy()
+          return
+        end
+      else
+        socket.authorized = true
+      end
+      if sessionCache and not ssl:isSessionReused() then
+        sessionCache:set(sessionKey, ssl:getSession())
+      end
+      socket:emit('secureConnect')
+    end)
+
+    return socket
+  end
+
+  local socket = options.socket
+  socket:connect(options.port, options.host)
+
   local pair = SecurePair:new(sslcontext, false, true, options.rejectUnauthorized == true, {
     servername = servername
   })
 
   if options.session then
-    pair.ssl.setSession(options.session)
+    pair.ssl:setSession(options.session)
   end
 
   local cleartext = pipe(pair, socket)
@@ -909,6 +1256,9 @@ end
 
 local exports = {}
 exports.Server = Server
+exports.TLSSocket = TLSSocket
+exports.SessionCache = SessionCache
+exports.sessionCache = defaultSessionCache
 exports.createServer = createServer
 exports.connect = connect
 exports.createCredentials = createCredentials
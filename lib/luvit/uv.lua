@@ -2,7 +2,11 @@ local native = require('uv_native')
 local Object = require('core').Object
 local Emitter = require('core').Emitter
 local iStream = require('core').iStream
+local Error = require('core').Error
+local Buffer = require('buffer').Buffer
 local fs = require('fs')
+local pathlib = require('path')
+local tableConcat = require('table').concat
 
 local uv = Object:extend()
 
@@ -14,6 +18,28 @@ uv.printAllHandles = native.printAllHandles
 -- Print all active handles
 uv.printActiveHandles = native.printActiveHandles
 
+-- Counters for the per-loop read buffer pool
+uv.bufferPoolStats = native.bufferPoolStats
+
+-- Cap the bytes the read buffer pool keeps around for reuse
+uv.bufferPoolSetLimit = native.bufferPoolSetLimit
+
+-- Counters for the per-loop write/shutdown/connect/send request freelist
+uv.reqPoolStats = native.reqPoolStats
+
+-- Live handles per type, requests in flight per kind and bytes waiting in
+-- stream write queues, for exporting as metrics
+uv.handleStats = native.handleStats
+
+-- Record where handles get created, LUVIT_DEBUG_HANDLES=1 does it from the
+-- start
+uv.handleStatsDebug = native.handleStatsDebug
+
+-- Live handles still referenced from Lua made at least minAge ms ago, with
+-- their creation traceback in debug mode
+-- uv.handleLeaks([minAge])
+uv.handleLeaks = native.handleLeaks
+
 --[[
 This class is never used directly, but is the inheritance chain of all libuv
 objects.
@@ -88,6 +114,28 @@ Stream.accept = native.accept
 -- Stream:readStart()
 Stream.readStart = native.readStart
 
+--[[
+Same as `Stream:readStart()`, but "data" events carry `buffer.Buffer`s that
+own the read memory instead of strings, which skips copying and interning
+every chunk.
+]]
+-- Stream:readStart2()
+Stream.readStart2 = native.readStart2
+
+-- Buffer mode reads arrive as raw pointers, wrap them before emitting
+function Stream:addHandlerType(name)
+  if name ~= 'data' then
+    return Handle.addHandlerType(self, name)
+  end
+  if not self.userdata then return end
+  self:setHandler(name, function (chunk, length)
+    if type(chunk) == 'userdata' then
+      chunk = Buffer:new(chunk, length)
+    end
+    self:emit(name, chunk, length)
+  end)
+end
+
 -- Stream:readStop()
 Stream.readStop = native.readStop
 
@@ -109,6 +157,15 @@ function Stream:resume()
   self:readStart()
 end
 
+-- Stream:fileno()
+-- The OS descriptor of the stream, nil on platforms without one
+Stream.fileno = native.streamFileno
+
+-- Stream:sendfile(fd, offset, length, callback)
+-- Sends part of a file straight to the stream's socket from the loop thread,
+-- callback gets nil and the bytes sent
+Stream.sendfile = native.streamSendfile
+
 -- Stream:write(chunk, callback)
 function Stream:write(chunk, callback)
   if self._closed then
@@ -135,12 +192,17 @@ Tcp.nodelay = native.tcpNodelay
 -- Tcp:keepalive(enable, delay)
 Tcp.keepalive = native.tcpKeepalive
 
--- Tcp:bind(host, port)
+-- Tcp:bind(host, port[, options]), options is a table with any of
+-- reuseport, v6only, deferAccept and fastOpen, see net Server:listen
 Tcp.bind = native.tcpBind
 
--- Tcp:bind6(host, port)
+-- Tcp:bind6(host, port[, options])
 Tcp.bind6 = native.tcpBind6
 
+-- Tcp:bindShared(host, port[, options]), joins the listening socket another loop of
+-- this process has on host:port or binds and listens on a new one
+Tcp.bindShared = native.tcpBindShared
+
 -- Tcp:getsockname()
 Tcp.getsockname = native.tcpGetsockname
 
@@ -189,6 +251,32 @@ Udp.recvStart = native.udpRecvStart
 -- Udp:recvStop()
 Udp.recvStop = native.udpRecvStop
 
+--[[
+Like `Udp:recvStart()`, but reads up to batch datagrams per wakeup and
+emits them together as "messages" (payloads, addresses, ports, count).
+Addresses are packed, `uv.Udp.addressToString` formats one.  Datagrams
+longer than size bytes are truncated.
+]]
+-- Udp:recvBatchStart([batch], [size])
+Udp.recvBatchStart = native.udpRecvBatchStart
+
+-- Udp:recvBatchStop()
+Udp.recvBatchStop = native.udpRecvBatchStop
+
+-- Udp.addressToString(packed)
+Udp.addressToString = native.udpAddressToString
+
+-- Udp.packAddress(ip, port)
+Udp.packAddress = native.udpPackAddress
+
+--[[
+Sends datagrams[i] to the packed destinations[i] without queueing,
+returning how many went out before the socket buffer filled and an error
+if one stopped it early.  Whatever is left goes through `Udp:send()`.
+]]
+-- Udp:sendBatch(datagrams, destinations)
+Udp.sendBatch = native.udpSendBatch
+
 -- Udp:setBroadcast(opt)
 Udp.setBroadcast = native.udpSetBroadcast
 
@@ -219,6 +307,25 @@ Pipe.bind = native.pipeBind
 -- Pipe:connect(name)
 Pipe.connect = native.pipeConnect
 
+--[[
+Writes chunk with handle's socket attached, over a pipe made with
+Pipe:new(true).  The reading side gets a "handle" event with the type of
+handle, "tcp", "udp" or "pipe", ahead of the "data" event for chunk, and
+must accept it into a new handle of that type from the listener:
+
+    channel:on('handle', function (kind)
+      local client = Tcp:new()
+      channel:accept(client)
+    end)
+]]
+-- Pipe:write2(chunk, handle, callback)
+function Pipe:write2(chunk, handle, callback)
+  if self._closed then
+    error("attempting to write to closed stream")
+  end
+  native.write2(self, chunk, handle, callback)
+end
+
 function Pipe:pause()
   self:unref()
   self:readStop()
@@ -331,6 +438,89 @@ Timer.getRepeat = native.timerGetRepeat
 -- Timer.now
 Timer.now = native.now
 
+--[[
+One shot timers on the loop's timing wheel, for large numbers of timeouts
+that are restarted all the time, like socket idle timeouts.  They are
+cheap to start, restart and stop and all share a single uv timer.
+
+    local timeout = uv.newWheelTimer(function () ... end)
+    timeout:start(5000) -- restarts it when already started
+    timeout:start(5000, 100) -- may be up to 100ms late, sharing a wakeup
+    timeout:stop()
+    timeout:isActive()
+]]
+-- uv.newWheelTimer(callback)
+uv.newWheelTimer = native.newWheelTimer
+
+-- uv.timerWheelStats()
+uv.timerWheelStats = native.timerWheelStats
+
+--------------------------------------------------------------------------------
+
+--[[
+Opt-in metrics of how long callbacks into Lua take and how far the loop
+falls behind, for finding the handlers that stall it.
+
+    uv.loopStatsEnable()
+    ...
+    local stats = uv.loopStats()
+    p(stats.lag.p99, stats.sources.data.max)
+
+lag is measured per loop iteration, from waking up until polling again.
+sources is keyed by the source of each callback, the event name like data
+or timeout, or fs_after and such for completions.  Each has count and, in
+ms, total, mean, max, p50, p90, p99 and p999.  idle is the ms spent waiting
+for something to happen and elapsed the ms since collection started or was
+reset.
+]]
+-- uv.loopStatsEnable([enable])
+uv.loopStatsEnable = native.loopStatsEnable
+
+-- uv.loopStatsReset()
+uv.loopStatsReset = native.loopStatsReset
+
+-- uv.loopStats()
+uv.loopStats = native.loopStats
+
+--------------------------------------------------------------------------------
+
+--[[
+Runs callback once every loop iteration, after the I/O callbacks of the
+iteration are done, until stopped.  A started check keeps the loop alive.
+]]
+local Check = Handle:extend()
+uv.Check = Check
+
+function Check:initialize()
+  self.userdata = native.newCheck()
+end
+
+-- Check:start(callback)
+Check.start = native.checkStart
+
+-- Check:stop()
+Check.stop = native.checkStop
+
+--------------------------------------------------------------------------------
+
+--[[
+Runs callback once every loop iteration, before the loop polls for I/O,
+until stopped.  The poll doesn't block while an idle is started, so the
+loop keeps going around.
+]]
+local Idle = Handle:extend()
+uv.Idle = Idle
+
+function Idle:initialize()
+  self.userdata = native.newIdle()
+end
+
+-- Idle:start(callback)
+Idle.start = native.idleStart
+
+-- Idle:stop()
+Idle.stop = native.idleStop
+
 --------------------------------------------------------------------------------
 
 local Process = Handle:extend()
@@ -354,6 +544,247 @@ uv.createWriteableStdioStream = function(fd)
   end
 end
 
+--[[
+A bounded, batching writer for logging to stdio without blocking the loop.
+Writes are queued and go out together as one vectored write every interval
+ms, through a Tty or Pipe handle, or a plain writev when the fd is a file,
+which the page cache takes right away.  A write that doesn't fit in maxBytes of queue is handled
+according to policy:
+
+    drop   it is thrown away and counted, write returns false
+    block  the queue is written out synchronously first, nothing is lost
+
+    local log = uv.LogStream:new(1, { interval = 10, policy = "drop" })
+    log:write("listening\n")
+    p(log:stats())
+
+block can't jump ahead of a vectored write that is still outstanding, the
+queue goes over maxBytes until that is done.  flushSync() writes out
+whatever is queued.  flushSync(true) also takes over the outstanding write,
+for when the loop won't run again: process.exit does that for
+process.stdout and stderr.
+]]
+local LogStream = iStream:extend()
+uv.LogStream = LogStream
+
+LogStream.interval = 10
+LogStream.maxBytes = 1024 * 1024
+LogStream.policy = "drop"
+
+-- options.handle is the Tty or Pipe to write to instead of opening fd
+function LogStream:initialize(fd, options)
+  options = options or {}
+  self.fd = fd
+  self.interval = options.interval or LogStream.interval
+  self.maxBytes = options.maxBytes or LogStream.maxBytes
+  self.policy = options.policy or LogStream.policy
+  if self.policy ~= "drop" and self.policy ~= "block" then
+    error("Unknown LogStream policy " .. tostring(self.policy))
+  end
+  local fd_type = native.handleType(fd)
+  if options.handle then
+    self.handle = options.handle
+  elseif fd_type == "TTY" then
+    self.handle = Tty:new(fd)
+    self.handle:unref()
+  elseif fd_type == "NAMED_PIPE" then
+    self.handle = Pipe:new(nil)
+    self.handle:open(fd)
+    self.handle:unref()
+  elseif fd_type ~= "FILE" then
+    error("Unknown stream file type " .. fd)
+  end
+  self.queue = {}
+  self.queued = 0
+  self.callbacks = {}
+  self.writing = false
+  self.scheduled = false
+  self.dropped = 0
+  self.droppedBytes = 0
+  self.written = 0
+  self.batches = 0
+  self.syncWrites = 0
+  self.errors = 0
+end
+
+function LogStream:_push(chunk, callback)
+  local queue = self.queue
+  queue[#queue + 1] = chunk
+  self.queued = self.queued + #chunk
+  if callback then
+    self.callbacks[#self.callbacks + 1] = callback
+  end
+end
+
+-- Hands over the queue and the callbacks waiting on it
+function LogStream:_take()
+  local queue, callbacks, bytes = self.queue, self.callbacks, self.queued
+  self.queue = {}
+  self.callbacks = {}
+  self.queued = 0
+  return queue, callbacks, bytes
+end
+
+function LogStream:_finished(bytes, callbacks, err)
+  if err then
+    self.errors = self.errors + 1
+    self.lastError = err
+  else
+    self.written = self.written + bytes
+  end
+  for i = 1, #callbacks do
+    callbacks[i](err)
+  end
+end
+
+-- Starts a vectored write of the queue unless one is outstanding
+function LogStream:_flush()
+  if self.writing or #self.queue == 0 then return end
+  local queue, callbacks, bytes = self:_take()
+  self.batches = self.batches + 1
+  if not self.handle then
+    local ok, err = pcall(fs.writevSync, self.fd, -1, queue)
+    return self:_finished(bytes, callbacks, not ok and err or nil)
+  end
+  local batch = { queue = queue, callbacks = callbacks, bytes = bytes }
+  self.writing = batch
+  self.handle:write(queue, function (err)
+    -- flushSync(true) took it over
+    if self.writing ~= batch then return end
+    self.writing = false
+    self:_finished(bytes, callbacks, err)
+    -- What came in meanwhile is a batch already
+    self:_flush()
+  end)
+end
+
+function LogStream:_schedule()
+  if self.scheduled then return end
+  self.scheduled = true
+  if not self.timer then
+    self.timer = Timer:new()
+    -- Queued lines alone don't keep the process running
+    self.timer:unref()
+    self.onTimer = function ()
+      self.scheduled = false
+      self:_flush()
+    end
+  end
+  self.timer:start(self.interval, 0, self.onTimer)
+end
+
+-- Writes data on the loop thread, sleeping in poll while the pipe is full
+local function writeAllSync(fd, data)
+  local offset, length = 0, #data
+  while offset < length do
+    local ok, written = pcall(fs.writeSync, fd, -1, data, offset, length - offset)
+    if ok then
+      offset = offset + written
+    elseif written.code == "EAGAIN" then
+      native.waitWritable(fd, 1000)
+    else
+      error(written)
+    end
+  end
+end
+
+local function joinChunks(queue)
+  for i = 1, #queue do
+    local chunk = queue[i]
+    if type(chunk) ~= "string" then
+      queue[i] = chunk:toString()
+    end
+  end
+  return tableConcat(queue)
+end
+
+--[[
+Writes out the queue before returning.  Normally that waits for an
+outstanding vectored write to finish first.  With takeover it writes what
+libuv hasn't sent of that write yet as well, and forgets the write.  That
+is for exiting, where the loop won't get to run the write.
+]]
+function LogStream:flushSync(takeover)
+  local batch = self.writing
+  if batch and not takeover then return end
+  if not batch and #self.queue == 0 then return end
+  local data = ""
+  local bytes, callbacks = 0, {}
+  if batch then
+    self.writing = false
+    data = joinChunks(batch.queue)
+    -- Only this stream writes to the handle, the rest of its queue is ours
+    local unsent = self.handle:writeQueueSize()
+    data = data:sub(#data - unsent + 1)
+    bytes, callbacks = batch.bytes, batch.callbacks
+  end
+  local queue, queued, queuedBytes = self:_take()
+  for i = 1, #queued do
+    callbacks[#callbacks + 1] = queued[i]
+  end
+  self.syncWrites = self.syncWrites + 1
+  local ok, err = pcall(writeAllSync, self.fd, data .. joinChunks(queue))
+  self:_finished(bytes + queuedBytes, callbacks, not ok and err or nil)
+end
+
+-- Queues a string or Buffer, callback(err) runs once it is written
+function LogStream:write(chunk, callback)
+  local length = #chunk
+  if self.queued + length > self.maxBytes then
+    if self.policy == "drop" then
+      self.dropped = self.dropped + 1
+      self.droppedBytes = self.droppedBytes + length
+      if callback then
+        local err = Error:new("log queue full")
+        err.code = "ENOBUFS"
+        callback(err)
+      end
+      return false
+    end
+    self:_push(chunk, callback)
+    self:flushSync()
+    return true
+  end
+  self:_push(chunk, callback)
+  -- Don't wait for the timer with half the room used up
+  if self.queued * 2 >= self.maxBytes then
+    self:_flush()
+  else
+    self:_schedule()
+  end
+  return true
+end
+
+function LogStream:finish(chunk)
+  if chunk ~= nil then
+    self:write(chunk)
+  end
+  self:flushSync()
+  self:emit("end")
+end
+
+-- Writes out the queue and stops the timer, the fd stays open
+function LogStream:close()
+  self:flushSync()
+  if self.timer then
+    self.timer:close()
+    self.timer = nil
+    self.scheduled = false
+  end
+end
+
+function LogStream:stats()
+  return {
+    queued = self.queued,
+    dropped = self.dropped,
+    droppedBytes = self.droppedBytes,
+    written = self.written,
+    batches = self.batches,
+    syncWrites = self.syncWrites,
+    errors = self.errors
+  }
+end
+
 uv.createReadableStdioStream = function(fd)
   local fd_type = native.handleType(fd);
   local stdin
@@ -371,14 +802,19 @@ uv.createReadableStdioStream = function(fd)
   return stdin
 end
 
+-- options.ipc opens an ipc pipe to the child as self.channel, which the
+-- child finds on fd 3
 function Process:initialize(command, args, options)
   self.stdin = Pipe:new(nil)
   self.stdout = Pipe:new(nil)
   self.stderr = Pipe:new(nil)
   args = args or {}
   options = options or {}
+  if options.ipc then
+    self.channel = Pipe:new(true)
+  end
 
-  self.userdata, self.pid = native.spawn(self.stdin, self.stdout, self.stderr, command, args, options)
+  self.userdata, self.pid = native.spawn(self.stdin, self.stdout, self.stderr, command, args, options, self.channel)
 
   if options.stdio ~= 'ignore' then
     self.stdout:readStart()
@@ -395,6 +831,9 @@ function Process:initialize(command, args, options)
     if self.stdin._closed ~= true then
       self.stdin:close()
     end
+    if self.channel and self.channel._closed ~= true then
+      self.channel:close()
+    end
     self:close()
   end)
 end
@@ -411,8 +850,132 @@ Process.hrtime = native.hrtime
 local Watcher = Handle:extend()
 uv.Watcher = Watcher
 
-function Watcher:initialize(path)
+-- options.coalesce turns on coalesce(window) right away
+function Watcher:initialize(path, options)
   self.userdata = native.newFsWatcher(path)
+  if options and options.coalesce then
+    self:coalesce(options.coalesce)
+  end
+end
+
+-- Watcher:ref()
+Watcher.ref = native.ref
+
+-- Watcher:unref()
+Watcher.unref = native.unref
+
+--[[
+Merges the raw events of each window ms into a single 'changes' event,
+a list of {event = "change" or "rename", filename = ...} without repeats,
+instead of a 'change' event for each.  0 turns it back off.
+]]
+-- Watcher:coalesce(window)
+Watcher.coalesce = native.fsWatcherCoalesce
+
+--------------------------------------------------------------------------------
+
+--[[
+Watches a whole directory tree.  Every directory under root gets a coalescing
+Watcher, kept in a registry by path, and watchers are added and dropped as
+directories come and go.  Emits 'changes' like Watcher:coalesce does, with
+full paths as filenames, at most once per window for each directory.
+]]
+local TreeWatcher = Emitter:extend()
+uv.TreeWatcher = TreeWatcher
+
+-- Default coalescing window in ms
+TreeWatcher.coalesce = 50
+
+function TreeWatcher:initialize(root, options)
+  options = options or {}
+  self.root = root
+  self.window = options.coalesce or TreeWatcher.coalesce
+  -- Directory path -> Watcher
+  self.watchers = {}
+  self.count = 0
+  self:_watch(root)
+  self:_watchTree(root)
+end
+
+function TreeWatcher:_watch(dir)
+  if self._closed or self.watchers[dir] then return end
+  -- It may be gone already, or we may be out of watches
+  local ok, watcher = pcall(Watcher.new, Watcher, dir, {coalesce = self.window})
+  if not ok then return end
+  if self._unref then watcher:unref() end
+  self.watchers[dir] = watcher
+  self.count = self.count + 1
+  watcher:on('changes', function (changes)
+    for i = 1, #changes do
+      local change = changes[i]
+      if change.filename then
+        change.filename = pathlib.join(dir, change.filename)
+        -- Something appeared or went away
+        if change.event == 'rename' then
+          self:_renamed(change.filename)
+        end
+      else
+        change.filename = dir
+      end
+    end
+    self:emit('changes', changes)
+  end)
+  watcher:on('error', function (err)
+    self:emit('error', err)
+  end)
+end
+
+function TreeWatcher:_watchTree(dir)
+  fs.walk(dir, function (err, entries)
+    if err then return end
+    for i = 1, #entries do
+      if entries[i].is_directory then
+        self:_watch(entries[i].path)
+      end
+    end
+  end)
+end
+
+function TreeWatcher:_renamed(path)
+  fs.lstat(path, function (err, stat)
+    if self._closed then return end
+    if err then
+      return self:_unwatch(path)
+    end
+    if stat.is_directory and not self.watchers[path] then
+      self:_watch(path)
+      self:_watchTree(path)
+    end
+  end)
+end
+
+-- Drops the watchers of path and everything under it
+function TreeWatcher:_unwatch(path)
+  local prefix = path .. pathlib.sep
+  for dir, watcher in pairs(self.watchers) do
+    if dir == path or dir:sub(1, #prefix) == prefix then
+      self.watchers[dir] = nil
+      self.count = self.count - 1
+      watcher:close()
+    end
+  end
+end
+
+-- Lets the process exit while the tree is still being watched
+function TreeWatcher:unref()
+  self._unref = true
+  for _, watcher in pairs(self.watchers) do
+    watcher:unref()
+  end
+end
+
+function TreeWatcher:close()
+  self._closed = true
+  for _, watcher in pairs(self.watchers) do
+    watcher:close()
+  end
+  self.watchers = {}
+  self.count = 0
 end
 
 return uv
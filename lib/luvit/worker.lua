@@ -0,0 +1,74 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local native = require('worker_native')
+local string = require('string')
+local libpath = require('module').libpath
+
+-- Workers load lib/luvit modules with the stock require
+native.setPath(libpath .. "?.lua;" .. libpath .. "?/init.lua")
+
+--[[
+Runs CPU heavy functions on a pool of threads, each with a Lua state of its
+own, so they don't hold up I/O on the loop.
+
+    worker.run(function (text, times)
+      local json = require('json')
+      ...
+      return result
+    end, text, 10, function (err, result)
+    end)
+
+The function is copied to the worker as bytecode, it can't see the caller's
+upvalues or globals.  Arguments and results are copied too: nil, booleans,
+numbers, strings, Buffers (as strings) and tables of them.  Worker states
+have the standard libraries, yajl, zlib_native and the lib/luvit modules
+that don't need a loop, like json.  There is a thread per CPU unless
+worker.setup(threads) said otherwise before the first job.  With several
+loops, only the one that ran the first job can use the pool.
+]]
+local worker = {}
+
+worker.setup = native.setup
+worker.stats = native.stats
+
+-- Dumped functions, so a function run over and over is dumped once
+local dumped = setmetatable({}, { __mode = 'k' })
+
+local function compile(fn)
+  if type(fn) == 'string' then return fn end
+  local code = dumped[fn]
+  if not code then
+    code = string.dump(fn)
+    dumped[fn] = code
+  end
+  return code
+end
+
+-- worker.run(fn, ..., callback) where fn is a function or a chunk of source
+function worker.run(fn, ...)
+  local n = select('#', ...)
+  local callback = n > 0 and select(n, ...)
+  if type(callback) ~= 'function' then
+    error('worker.run needs a callback')
+  end
+  local args = {...}
+  native.run(compile(fn), callback, unpack(args, 1, n - 1))
+end
+
+return worker
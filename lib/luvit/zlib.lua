@@ -17,12 +17,14 @@ limitations under the License.
 --]]
 
 local binding = require('zlib_native')
+local iStream = require('core').iStream
+local table = require('table')
 
 --
 -- generic zlib stream
 --
 
-local Zlib = require('core').iStream:extend()
+local Zlib = iStream:extend()
 
 function Zlib:initialize(what, ...)
   self.zlib = binding.new(what, ...)
@@ -52,10 +54,110 @@ function Zlib:close()
   self.zlib = nil
 end
 
+--
+-- thread pool backed stream
+--
+
+--[[
+A zlib stream whose inflate/deflate steps run on the thread pool, so big
+bodies don't stall the loop.  Chunks are queued and filtered one at a time
+in order.  write returns false once highWaterMark chunks are waiting and
+'drain' follows when the queue empties.  pause() and resume() hold the
+filtering back while whoever takes 'data' catches up.  done (or finish) flushes the
+stream and emits 'end' after the last 'data'.
+]]
+local Transform = iStream:extend()
+
+Transform.highWaterMark = 4
+
+function Transform:initialize(what, ...)
+  self.zlib = binding.new(what, ...)
+  self.queue = {}
+  self.busy = false
+end
+
+function Transform:write(chunk, flag)
+  local queue = self.queue
+  queue[#queue + 1] = { chunk or "", flag or "none" }
+  self:_process()
+  if #queue >= self.highWaterMark then
+    self.needDrain = true
+    return false
+  end
+  return true
+end
+
+function Transform:done(chunk)
+  self:write(chunk, "finish")
+end
+Transform.finish = Transform.done
+
+-- Holds back the next chunk until resume(), for a consumer that can't take
+-- more 'data' yet.  Writes keep queueing and report it through write.
+function Transform:pause()
+  self.paused = true
+end
+
+function Transform:resume()
+  if not self.paused then return end
+  self.paused = false
+  self:_process()
+end
+
+function Transform:_process()
+  if self.busy or self.paused or not self.zlib then return end
+  local item = table.remove(self.queue, 1)
+  if not item then
+    if self.needDrain then
+      self.needDrain = false
+      self:emit('drain')
+    end
+    return
+  end
+  self.busy = true
+  self.zlib:writeAsync(item[1], item[2], function (err, text)
+    self.busy = false
+    if err then
+      self.zlib = nil
+      return self:emit('error', err)
+    end
+    if #text > 0 then
+      self:emit('data', text)
+    end
+    if item[2] == "finish" then
+      self.zlib = nil
+      return self:emit('end')
+    end
+    self:_process()
+  end)
+end
+
+function Transform:close()
+  self.zlib = nil
+  self.queue = {}
+end
+
+-- Compresses to the gzip format, level defaults to zlib's default
+local Gzip = Transform:extend()
+
+function Gzip:initialize(level)
+  Transform.initialize(self, 'deflate', level, 31)
+end
+
+-- Inflates gzip or zlib data, the format is detected from the header
+local Gunzip = Transform:extend()
+
+function Gunzip:initialize()
+  Transform.initialize(self, 'inflate')
+end
+
 --
 -- module
 --
 
 return {
   Zlib = Zlib,
+  Transform = Transform,
+  Gzip = Gzip,
+  Gunzip = Gunzip,
 }
@@ -31,6 +31,7 @@
           'sources': [
             'src/luv_tls.c',
             'src/luv_tls_conn.c',
+            'src/luv_digest.c',
           ],
           'dependencies': [
             'deps/openssl/openssl.gyp:openssl'
@@ -48,30 +49,43 @@
        'src/lyajl.c',
        'src/los.c',
        'src/luv.c',
+       'src/luv_alloc.c',
+       'src/luv_buffer_pool.c',
+       'src/luv_check.c',
+       'src/luv_idle.c',
+       'src/luv_req_pool.c',
        'src/luv_fs.c',
        'src/luv_fs_watcher.c',
+       'src/luv_gc.c',
        'src/luv_dns.c',
        'src/luv_debug.c',
        'src/luv_handle.c',
+       'src/luv_handle_stats.c',
+       'src/luv_loop_stats.c',
        'src/luv_misc.c',
        'src/luv_pipe.c',
        'src/luv_process.c',
+       'src/luv_shm.c',
        'src/luv_signal.c',
        'src/luv_stream.c',
        'src/luv_tcp.c',
        'src/luv_timer.c',
+       'src/luv_timer_wheel.c',
        'src/luv_tty.c',
        'src/luv_udp.c',
+       'src/luv_worker.c',
        'src/luv_zlib.c',
        'src/luvit_init.c',
        'src/lyajl.c',
        'src/utils.c',
        'lib/luvit/buffer.lua',
        'lib/luvit/childprocess.lua',
+       'lib/luvit/cluster.lua',
        'lib/luvit/core.lua',
        'lib/luvit/dgram.lua',
        'lib/luvit/dns.lua',
        'lib/luvit/fiber.lua',
+       'lib/luvit/filecache.lua',
        'lib/luvit/fs.lua',
        'lib/luvit/http.lua',
        'lib/luvit/https.lua',
@@ -81,14 +95,17 @@
        'lib/luvit/module.lua',
        'lib/luvit/net.lua',
        'lib/luvit/path.lua',
+       'lib/luvit/profiler.lua',
        'lib/luvit/querystring.lua',
        'lib/luvit/repl.lua',
+       'lib/luvit/shm.lua',
        'lib/luvit/stack.lua',
        'lib/luvit/timer.lua',
        'lib/luvit/tls.lua',
        'lib/luvit/url.lua',
        'lib/luvit/utils.lua',
        'lib/luvit/uv.lua',
+       'lib/luvit/worker.lua',
        'lib/luvit/zlib.lua',
      ],
      'defines': [
@@ -149,7 +166,7 @@
           ],
         }],
         ['OS == "linux"', {
-          'libraries': ['-ldl'],
+          'libraries': ['-ldl', '-lrt'],
         }],
         ['OS=="linux" or OS=="freebsd" or OS=="openbsd" or OS=="solaris"', {
           'cflags': [ '--std=c89' ],
@@ -198,9 +215,11 @@
               'files': [
                 'lib/luvit/buffer.lua',
                 'lib/luvit/childprocess.lua',
+                'lib/luvit/cluster.lua',
                 'lib/luvit/core.lua',
                 'lib/luvit/dns.lua',
                 'lib/luvit/fiber.lua',
+                'lib/luvit/filecache.lua',
                 'lib/luvit/fs.lua',
                 'lib/luvit/http.lua',
                 'lib/luvit/https.lua',
@@ -210,14 +229,18 @@
                 'lib/luvit/module.lua',
                 'lib/luvit/net.lua',
                 'lib/luvit/path.lua',
+                'lib/luvit/profiler.lua',
+       'lib/luvit/profiler.lua',
                 'lib/luvit/querystring.lua',
                 'lib/luvit/repl.lua',
+                'lib/luvit/shm.lua',
                 'lib/luvit/stack.lua',
                 'lib/luvit/timer.lua',
                 'lib/luvit/tls.lua',
                 'lib/luvit/url.lua',
                 'lib/luvit/utils.lua',
                 'lib/luvit/uv.lua',
+                'lib/luvit/worker.lua',
                 'lib/luvit/zlib.lua'
               ]
             },
@@ -251,15 +274,23 @@
                 'src/lhttp_parser.h',
                 'src/los.h',
                 'src/luv.h',
+                'src/luv_alloc.h',
+                'src/luv_check.h',
                 'src/luv_debug.h',
+                'src/luv_digest.h',
                 'src/luv_dns.h',
                 'src/luv_fs.h',
                 'src/luv_fs_watcher.h',
+                'src/luv_gc.h',
                 'src/luv_handle.h',
+                'src/luv_handle_stats.h',
+                'src/luv_idle.h',
+                'src/luv_loop_stats.h',
                 'src/luv_misc.h',
                 'src/luv_pipe.h',
                 'src/luv_portability.h',
                 'src/luv_process.h',
+                'src/luv_shm.h',
                 'src/luv_stream.h',
                 'src/luv_tcp.h',
                 'src/luv_timer.h',
@@ -15,11 +15,80 @@
  *
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include "lhttp_parser.h"
 #include "http_parser.h"
 
+/* How headers reach Lua */
+typedef enum {
+  LHTTP_HEADERS_CALLBACKS = 0, /* onHeaderField/onHeaderValue per fragment */
+  LHTTP_HEADERS_MAP,           /* info.headers with lowercased keys */
+  LHTTP_HEADERS_ARRAY          /* info.headers as {field, value, field, ...} */
+} lhttp_headers_mode_t;
+
+/* Lua callbacks, also their slot in the parser's environment */
+typedef enum {
+  LHTTP_ON_MESSAGE_BEGIN = 1,
+  LHTTP_ON_URL,
+  LHTTP_ON_HEADER_FIELD,
+  LHTTP_ON_HEADER_VALUE,
+  LHTTP_ON_HEADERS_COMPLETE,
+  LHTTP_ON_BODY,
+  LHTTP_ON_MESSAGE_COMPLETE,
+  LHTTP_CALLBACK_MAX
+} lhttp_callback_t;
+
+/* Indexed by lhttp_callback_t */
+static const char* lhttp_callback_names[LHTTP_CALLBACK_MAX] = {
+  NULL,
+  "onMessageBegin",
+  "onUrl",
+  "onHeaderField",
+  "onHeaderValue",
+  "onHeadersComplete",
+  "onBody",
+  "onMessageComplete"
+};
+
+/* Which header callback ran last, as in http_parser's own examples */
+typedef enum {
+  LHTTP_HEADER_NONE = 0,
+  LHTTP_HEADER_FIELD,
+  LHTTP_HEADER_VALUE
+} lhttp_header_state_t;
+
+typedef struct {
+  http_parser parser;        /* must be first, callbacks cast back from it */
+  /* Only the callbacks that have something to do are set, so http_parser
+   * skips the rest without calling into C or Lua at all.
+   */
+  http_parser_settings settings;
+  unsigned int bound;        /* bitmask of lhttp_callback_t with a Lua function */
+  lhttp_headers_mode_t mode;
+  /* The header being collected, field bytes followed by value bytes.  Both
+   * can arrive in several fragments when they span packets.
+   */
+  char* buf;
+  size_t len;
+  size_t cap;
+  size_t field_len;
+  lhttp_header_state_t last;
+  /* The last field fragment ran up to the end of the chunk being executed,
+   * so the next field callback may continue it.  A field that ended within
+   * its chunk was followed by a ':' and an empty value, which http_parser
+   * doesn't always report, so the next field is a new header.
+   */
+  int field_open;
+  const char* chunk_end;
+  int headers_ref;           /* table being filled, kept for trailers */
+  int header_count;          /* slots used in array mode */
+} lhttp_parser_t;
+
+#define lhttp_parser_is_bound(lparser, cb) (((lparser)->bound & (1u << (cb))) != 0)
+
 static const char* method_to_str(unsigned short m) {
   switch (m) {
     case HTTP_DELETE:     return "DELETE";
@@ -53,149 +122,189 @@ static const char* method_to_str(unsigned short m) {
 
 /*****************************************************************************/
 
-static struct http_parser_settings lhttp_parser_settings;
+static int lhttp_parser_append(lhttp_parser_t* lparser, const char *at, size_t length) {
+  if (lparser->len + length > lparser->cap) {
+    size_t cap = lparser->cap ? lparser->cap : 256;
+    char* buf;
+    while (cap < lparser->len + length) {
+      cap *= 2;
+    }
+    buf = realloc(lparser->buf, cap);
+    if (!buf) {
+      return 1;
+    }
+    lparser->buf = buf;
+    lparser->cap = cap;
+  }
+  memcpy(lparser->buf + lparser->len, at, length);
+  lparser->len += length;
+  return 0;
+}
 
-static int lhttp_parser_on_message_begin(http_parser *p) {
-  lua_State *L = p->data;
+/* Pushes the table collecting this message's headers */
+static void lhttp_parser_push_headers(lua_State* L, lhttp_parser_t* lparser) {
+  if (lparser->headers_ref == LUA_NOREF) {
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lparser->headers_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lparser->header_count = 0;
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, lparser->headers_ref);
+}
 
-  /* Put the environment of the userdata on the top of the stack */
-  lua_getfenv(L, 1);
-  /* Get the onMessageBegin callback and put it on the stack */
-  lua_getfield(L, -1, "onMessageBegin");
-  /* See if it's a function */
-  if (lua_isfunction (L, -1) == 0) {
-    /* no function defined */
-    lua_pop(L, 2);
-    return 0;
-  };
-  lua_call(L, 0, 1);
+/* Moves the completed header out of buf into the headers table */
+static void lhttp_parser_flush_header(lua_State* L, lhttp_parser_t* lparser) {
+  size_t i;
 
-  lua_pop(L, 1); /* pop returned value */
-  lua_pop(L, 1); /* pop the userdata env */
-  return 0;
-}
+  if (lparser->last == LHTTP_HEADER_NONE) {
+    return;
+  }
 
-static int lhttp_parser_on_message_complete(http_parser *p) {
-  lua_State *L = p->data;
+  lhttp_parser_push_headers(L, lparser);
+  if (lparser->mode == LHTTP_HEADERS_MAP) {
+    for (i = 0; i < lparser->field_len; i++) {
+      lparser->buf[i] = tolower((unsigned char)lparser->buf[i]);
+    }
+    lua_pushlstring(L, lparser->buf, lparser->field_len);
+    lua_pushlstring(L, lparser->buf + lparser->field_len, lparser->len - lparser->field_len);
+    lua_rawset(L, -3);
+  } else {
+    lua_pushlstring(L, lparser->buf, lparser->field_len);
+    lua_rawseti(L, -2, ++lparser->header_count);
+    lua_pushlstring(L, lparser->buf + lparser->field_len, lparser->len - lparser->field_len);
+    lua_rawseti(L, -2, ++lparser->header_count);
+  }
+  lua_pop(L, 1);
 
-  /* Put the environment of the userdata on the top of the stack */
-  lua_getfenv(L, 1);
-  /* Get the onMessageComplete callback and put it on the stack */
-  lua_getfield(L, -1, "onMessageComplete");
-  /* See if it's a function */
-  if (lua_isfunction (L, -1) == 0) {
-    /* no function defined */
-    lua_pop(L, 2);
-    return 0;
-  };
-  lua_call(L, 0, 1);
+  lparser->len = 0;
+  lparser->field_len = 0;
+  lparser->last = LHTTP_HEADER_NONE;
+  lparser->field_open = 0;
+}
 
-  lua_pop(L, 2); /* pop returned value and the userdata env */
-  return 0;
+/* Forgets any collected headers */
+static void lhttp_parser_reset_headers(lua_State* L, lhttp_parser_t* lparser) {
+  luaL_unref(L, LUA_REGISTRYINDEX, lparser->headers_ref);
+  lparser->headers_ref = LUA_NOREF;
+  lparser->header_count = 0;
+  lparser->len = 0;
+  lparser->field_len = 0;
+  lparser->last = LHTTP_HEADER_NONE;
+  lparser->field_open = 0;
 }
 
+/* Push the bound Lua function for cb, the userdata is at index 1 */
+static void lhttp_parser_push_callback(lua_State *L, lhttp_callback_t cb) {
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, cb);
+  lua_remove(L, -2);
+}
 
-static int lhttp_parser_on_url(http_parser *p, const char *at, size_t length) {
+static int lhttp_parser_on_message_begin(http_parser *p) {
   lua_State *L = p->data;
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
 
-  /* Put the environment of the userdata on the top of the stack */
-  lua_getfenv(L, 1);
-  /* Get the onUrl callback and put it on the stack */
-  lua_getfield(L, -1, "onUrl");
-  /* See if it's a function */
-  if (lua_isfunction (L, -1) == 0) {
-    /* no function defined */
-    lua_pop(L, 2);
-    return 0;
-  };
-  /* Push the string argument */
-  lua_pushlstring(L, at, length);
-
-  lua_call(L, 1, 1);
+  if (lparser->mode != LHTTP_HEADERS_CALLBACKS) {
+    lhttp_parser_reset_headers(L, lparser);
+  }
 
-  lua_pop(L, 2); /* pop returned value and the userdata env */
+  if (lhttp_parser_is_bound(lparser, LHTTP_ON_MESSAGE_BEGIN)) {
+    lhttp_parser_push_callback(L, LHTTP_ON_MESSAGE_BEGIN);
+    lua_call(L, 0, 1);
+    lua_pop(L, 1); /* pop returned value */
+  }
   return 0;
 }
 
-static int lhttp_parser_on_header_field(http_parser *p, const char *at, size_t length) {
+static int lhttp_parser_on_message_complete(http_parser *p) {
   lua_State *L = p->data;
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
 
-  /* Put the environment of the userdata on the top of the stack */
-  lua_getfenv(L, 1);
-  /* Get the onHeaderField callback and put it on the stack */
-  lua_getfield(L, -1, "onHeaderField");
-  /* See if it's a function */
-  if (lua_isfunction (L, -1) == 0) {
-    /* no function defined */
-    lua_pop(L, 2);
-    return 0;
-  };
-  /* Push the string argument */
-  lua_pushlstring(L, at, length);
-
-  lua_call(L, 1, 1);
+  /* Trailers go into the same table onHeadersComplete got */
+  if (lparser->mode != LHTTP_HEADERS_CALLBACKS) {
+    lhttp_parser_flush_header(L, lparser);
+    lhttp_parser_reset_headers(L, lparser);
+  }
 
-  lua_pop(L, 2); /* pop returned value and the userdata env */
+  if (lhttp_parser_is_bound(lparser, LHTTP_ON_MESSAGE_COMPLETE)) {
+    lhttp_parser_push_callback(L, LHTTP_ON_MESSAGE_COMPLETE);
+    lua_call(L, 0, 1);
+    lua_pop(L, 1); /* pop returned value */
+  }
   return 0;
 }
 
-static int lhttp_parser_on_header_value(http_parser *p, const char *at, size_t length) {
+/* Shared by the data callbacks that just pass their bytes on */
+static int lhttp_parser_call_data(http_parser *p, lhttp_callback_t cb, const char *at, size_t length) {
   lua_State *L = p->data;
 
-  /* Put the environment of the userdata on the top of the stack */
-  lua_getfenv(L, 1);
-  /* Get the onHeaderValue callback and put it on the stack */
-  lua_getfield(L, -1, "onHeaderValue");
-  /* See if it's a function */
-  if (lua_isfunction (L, -1) == 0) {
-    /* no function defined */
-    lua_pop(L, 2);
-    return 0;
-  };
+  lhttp_parser_push_callback(L, cb);
   /* Push the string argument */
   lua_pushlstring(L, at, length);
 
   lua_call(L, 1, 1);
 
-  lua_pop(L, 2); /* pop returned value and the userdata env */
+  lua_pop(L, 1); /* pop returned value */
   return 0;
 }
 
+static int lhttp_parser_on_url(http_parser *p, const char *at, size_t length) {
+  return lhttp_parser_call_data(p, LHTTP_ON_URL, at, length);
+}
+
 static int lhttp_parser_on_body(http_parser *p, const char *at, size_t length) {
-  lua_State *L = p->data;
+  return lhttp_parser_call_data(p, LHTTP_ON_BODY, at, length);
+}
 
-  /* Put the environment of the userdata on the top of the stack */
-  lua_getfenv(L, 1);
-  /* Get the onBody callback and put it on the stack */
-  lua_getfield(L, -1, "onBody");
-  /* See if it's a function */
-  if (lua_isfunction (L, -1) == 0) {
-    /* no function defined */
-    lua_pop(L, 2);
-    return 0;
-  };
-  /* Push the string argument */
-  lua_pushlstring(L, at, length);
+static int lhttp_parser_on_header_field(http_parser *p, const char *at, size_t length) {
+  lua_State *L = p->data;
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
 
-  lua_call(L, 1, 1);
+  if (lparser->mode == LHTTP_HEADERS_CALLBACKS) {
+    return lhttp_parser_call_data(p, LHTTP_ON_HEADER_FIELD, at, length);
+  }
 
-  lua_pop(L, 2); /* pop returned value and the userdata env */
+  /* Anything but the continuation of a field cut off by the end of the last
+   * chunk starts the next header
+   */
+  if (lparser->last != LHTTP_HEADER_FIELD || !lparser->field_open) {
+    lhttp_parser_flush_header(L, lparser);
+  }
+  if (lhttp_parser_append(lparser, at, length)) {
+    return 1;
+  }
+  lparser->field_len = lparser->len;
+  lparser->last = LHTTP_HEADER_FIELD;
+  lparser->field_open = at + length == lparser->chunk_end;
   return 0;
 }
 
+static int lhttp_parser_on_header_value(http_parser *p, const char *at, size_t length) {
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
+
+  if (lparser->mode == LHTTP_HEADERS_CALLBACKS) {
+    return lhttp_parser_call_data(p, LHTTP_ON_HEADER_VALUE, at, length);
+  }
+
+  lparser->last = LHTTP_HEADER_VALUE;
+  lparser->field_open = 0;
+  return lhttp_parser_append(lparser, at, length);
+}
+
 static int lhttp_parser_on_headers_complete(http_parser *p) {
   lua_State *L = p->data;
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
 
-  /* Put the environment of the userdata on the top of the stack */
-  lua_getfenv(L, 1);
-  /* Get the onHeadersComplete callback and put it on the stack */
-  lua_getfield(L, -1, "onHeadersComplete");
-  /* See if it's a function */
-  if (lua_isfunction (L, -1) == 0) {
-    /* no function defined */
-    lua_pop(L, 2);
+  if (lparser->mode != LHTTP_HEADERS_CALLBACKS) {
+    lhttp_parser_flush_header(L, lparser);
+  }
+
+  if (!lhttp_parser_is_bound(lparser, LHTTP_ON_HEADERS_COMPLETE)) {
     return 0;
-  };
+  }
+
+  lhttp_parser_push_callback(L, LHTTP_ON_HEADERS_COMPLETE);
 
   /* Push a new table as the argument */
   lua_newtable (L);
@@ -225,38 +334,114 @@ static int lhttp_parser_on_headers_complete(http_parser *p) {
   lua_pushboolean(L, p->upgrade);
   lua_setfield(L, -2, "upgrade");
 
+  /* HEADERS */
+  if (lparser->mode != LHTTP_HEADERS_CALLBACKS) {
+    lhttp_parser_push_headers(L, lparser);
+    lua_setfield(L, -2, "headers");
+  }
 
   lua_call(L, 1, 1);
 
-  lua_pop(L, 2); /* pop returned value and the userdata env */
+  lua_pop(L, 1); /* pop returned value */
   return 0;
 }
 
+/* Resolves the callbacks table at index into the userdata's environment,
+ * which becomes {[lhttp_callback_t] = function, callbacks = table}, and
+ * builds the parser's settings from what was found.  The userdata must be on
+ * top of the stack.
+ */
+static void lhttp_parser_bind(lua_State *L, lhttp_parser_t* lparser, int index) {
+  int i;
+  int collect = lparser->mode != LHTTP_HEADERS_CALLBACKS;
+
+  lparser->bound = 0;
+  lua_createtable(L, LHTTP_CALLBACK_MAX, 1);
+  for (i = LHTTP_ON_MESSAGE_BEGIN; i < LHTTP_CALLBACK_MAX; i++) {
+    lua_getfield(L, index, lhttp_callback_names[i]);
+    if (lua_isfunction(L, -1)) {
+      lparser->bound |= 1u << i;
+      lua_rawseti(L, -2, i);
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+  lua_pushvalue(L, index);
+  lua_setfield(L, -2, "callbacks");
+  lua_setfenv(L, -2);
+
+  memset(&lparser->settings, 0, sizeof(lparser->settings));
+#define LHTTP_BIND(field, cb, needed)                               \
+  if ((needed) || lhttp_parser_is_bound(lparser, cb)) {             \
+    lparser->settings.field = lhttp_parser_##field;                 \
+  }
+  /* Collecting headers needs the message and header hooks regardless */
+  LHTTP_BIND(on_message_begin, LHTTP_ON_MESSAGE_BEGIN, collect);
+  LHTTP_BIND(on_url, LHTTP_ON_URL, 0);
+  LHTTP_BIND(on_header_field, LHTTP_ON_HEADER_FIELD, collect);
+  LHTTP_BIND(on_header_value, LHTTP_ON_HEADER_VALUE, collect);
+  LHTTP_BIND(on_headers_complete, LHTTP_ON_HEADERS_COMPLETE, collect);
+  LHTTP_BIND(on_body, LHTTP_ON_BODY, 0);
+  LHTTP_BIND(on_message_complete, LHTTP_ON_MESSAGE_COMPLETE, collect);
+#undef LHTTP_BIND
+}
+
 /******************************************************************************/
 
-/* Takes as arguments a string for type and a table for event callbacks */
+static lhttp_headers_mode_t lhttp_parser_check_mode(lua_State *L, int index) {
+  const char *mode = luaL_optstring(L, index, "callbacks");
+
+  if (0 == strcmp(mode, "callbacks")) {
+    return LHTTP_HEADERS_CALLBACKS;
+  } else if (0 == strcmp(mode, "map")) {
+    return LHTTP_HEADERS_MAP;
+  } else if (0 == strcmp(mode, "array")) {
+    return LHTTP_HEADERS_ARRAY;
+  }
+  luaL_argerror(L, index, "headers mode must be 'callbacks', 'map' or 'array'");
+  return LHTTP_HEADERS_CALLBACKS;
+}
+
+/* Takes as arguments a string for type, a table for event callbacks and an
+ * optional headers mode.  With "map" or "array" the headers are collected in
+ * C and handed to onHeadersComplete as info.headers instead of going through
+ * onHeaderField and onHeaderValue.  Callbacks are looked up once here, later
+ * changes to the table take effect on reinitialize.
+ */
 static int lhttp_parser_new (lua_State *L) {
 
   const char *type = luaL_checkstring(L, 1);
-  http_parser* parser;
+  lhttp_headers_mode_t mode;
+  lhttp_parser_t* lparser;
   luaL_checktype(L, 2, LUA_TTABLE);
+  mode = lhttp_parser_check_mode(L, 3);
 
-  parser = (http_parser*)lua_newuserdata(L, sizeof(http_parser));
+  lparser = (lhttp_parser_t*)lua_newuserdata(L, sizeof(lhttp_parser_t));
 
   if (0 == strcmp(type, "request")) {
-    http_parser_init(parser, HTTP_REQUEST);
+    http_parser_init(&lparser->parser, HTTP_REQUEST);
   } else if (0 == strcmp(type, "response")) {
-    http_parser_init(parser, HTTP_RESPONSE);
+    http_parser_init(&lparser->parser, HTTP_RESPONSE);
   } else {
     return luaL_argerror(L, 1, "type must be 'request' or 'response'");
   }
 
   /* Store the current lua state in the parser's data */
-  parser->data = L;
-
-  /* Set the callback table as the userdata's environment */
-  lua_pushvalue(L, 2);
-  lua_setfenv (L, -2);
+  lparser->parser.data = L;
+
+  lparser->mode = mode;
+  lparser->buf = NULL;
+  lparser->len = 0;
+  lparser->cap = 0;
+  lparser->field_len = 0;
+  lparser->last = LHTTP_HEADER_NONE;
+  lparser->field_open = 0;
+  lparser->chunk_end = NULL;
+  lparser->headers_ref = LUA_NOREF;
+  lparser->header_count = 0;
+
+  /* Resolve the callback table into the userdata's environment */
+  lhttp_parser_bind(L, lparser, 2);
 
   /* Set the type of the userdata as an lhttp_parser instance */
   luaL_getmetatable(L, "lhttp_parser");
@@ -268,7 +453,7 @@ static int lhttp_parser_new (lua_State *L) {
 
 /* execute(parser, buffer, offset, length) */
 static int lhttp_parser_execute (lua_State *L) {
-  http_parser* parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  lhttp_parser_t* lparser = (lhttp_parser_t *)luaL_checkudata(L, 1, "lhttp_parser");
   size_t chunk_len;
   const char *chunk;
   size_t offset;
@@ -284,26 +469,44 @@ static int lhttp_parser_execute (lua_State *L) {
   luaL_argcheck(L, offset < chunk_len, 3, "Offset is out of bounds");
   luaL_argcheck(L, offset + length <= chunk_len, 4,  "Length extends beyond end of chunk");
 
-  nparsed = http_parser_execute(parser, &lhttp_parser_settings, chunk + offset, length);
+  /* The callbacks work on the stack of whichever thread is executing */
+  lparser->parser.data = L;
+  lparser->chunk_end = chunk + offset + length;
+  nparsed = http_parser_execute(&lparser->parser, &lparser->settings, chunk + offset, length);
 
   lua_pushnumber(L, nparsed);
   return 1;
 }
 
 static int lhttp_parser_finish (lua_State *L) {
-  http_parser* parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  lhttp_parser_t* lparser = (lhttp_parser_t *)luaL_checkudata(L, 1, "lhttp_parser");
+  int rv;
 
-  int rv = http_parser_execute(parser, &lhttp_parser_settings, NULL, 0);
+  lparser->parser.data = L;
+  lparser->chunk_end = NULL;
+  rv = http_parser_execute(&lparser->parser, &lparser->settings, NULL, 0);
 
   if (rv != 0) {
-    return luaL_error(L, http_errno_description(HTTP_PARSER_ERRNO(parser)));
+    return luaL_error(L, http_errno_description(HTTP_PARSER_ERRNO(&lparser->parser)));
   }
 
   return 0;
 }
 
+/* pause(parser, paused) stops execute after the current callback, it then
+ * returns how far it got.  Parsing picks up from there once unpaused.
+ */
+static int lhttp_parser_pause (lua_State *L) {
+  lhttp_parser_t* lparser = (lhttp_parser_t *)luaL_checkudata(L, 1, "lhttp_parser");
+
+  http_parser_pause(&lparser->parser, lua_toboolean(L, 2));
+  return 0;
+}
+
+/* reinitialize(parser, type[, callbacks]) rebinds from the callbacks table */
 static int lhttp_parser_reinitialize (lua_State *L) {
-  http_parser* parser = (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  lhttp_parser_t* lparser = (lhttp_parser_t *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser* parser = &lparser->parser;
 
   const char *type = luaL_checkstring(L, 2);
 
@@ -315,6 +518,28 @@ static int lhttp_parser_reinitialize (lua_State *L) {
     return luaL_argerror(L, 1, "type must be 'request' or 'response'");
   }
 
+  lhttp_parser_reset_headers(L, lparser);
+
+  if (lua_isnoneornil(L, 3)) {
+    lua_getfenv(L, 1);
+    lua_getfield(L, -1, "callbacks");
+    lua_replace(L, 3);
+    lua_pop(L, 1);
+  }
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+  lua_pushvalue(L, 1);
+  lhttp_parser_bind(L, lparser, 3);
+
+  return 0;
+}
+
+static int lhttp_parser_gc (lua_State *L) {
+  lhttp_parser_t* lparser = (lhttp_parser_t *)lua_touserdata(L, 1);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, lparser->headers_ref);
+  free(lparser->buf);
+
   return 0;
 }
 
@@ -358,32 +583,217 @@ static int lhttp_parser_parse_url (lua_State *L) {
   return 1;
 }
 
+static int lhttp_hex_value(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/* Pushes s decoded the way querystring.urldecode always has: + is a space,
+ * %XX a byte and a decoded CRLF becomes LF.  The output is never longer
+ * than the input, so it's built in one pass over a buffer of that size.
+ */
+static void lhttp_push_unescaped(lua_State *L, const char *s, size_t len) {
+  char stack[256];
+  char *out;
+  size_t i, n = 0;
+
+  for (i = 0; i < len; i++) {
+    if (s[i] == '+' || s[i] == '%' || s[i] == '\r') break;
+  }
+  if (i == len) {
+    lua_pushlstring(L, s, len);
+    return;
+  }
+
+  out = len <= sizeof(stack) ? stack : malloc(len);
+  if (!out) {
+    luaL_error(L, "unescape: out of memory");
+    return;
+  }
+  memcpy(out, s, i);
+  n = i;
+  for (; i < len; i++) {
+    int c = (unsigned char)s[i];
+    if (c == '+') {
+      c = ' ';
+    } else if (c == '%' && i + 2 < len && lhttp_hex_value(s[i + 1]) >= 0 &&
+               lhttp_hex_value(s[i + 2]) >= 0) {
+      c = lhttp_hex_value(s[i + 1]) * 16 + lhttp_hex_value(s[i + 2]);
+      i += 2;
+    }
+    if (c == '\n' && n > 0 && out[n - 1] == '\r') {
+      n--;
+    }
+    out[n++] = (char)c;
+  }
+  lua_pushlstring(L, out, n);
+  if (out != stack) {
+    free(out);
+  }
+}
+
+/* unescape(s) */
+static int lhttp_parser_unescape (lua_State *L) {
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  lhttp_push_unescaped(L, s, len);
+  return 1;
+}
+
+/* Sets t[key] = value for the pair on top of the stack, turning repeated
+ * keys into lists of their values in order
+ */
+static void lhttp_query_set(lua_State *L, int t) {
+  lua_pushvalue(L, -2);
+  lua_rawget(L, t);
+  switch (lua_type(L, -1)) {
+    case LUA_TNIL:
+      lua_pop(L, 1);
+      lua_rawset(L, t);
+      break;
+    case LUA_TTABLE:
+      lua_insert(L, -2);
+      lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+      lua_pop(L, 2);
+      break;
+    default:
+      /* key value old -> key {old, value} */
+      lua_createtable(L, 2, 0);
+      lua_insert(L, -2);
+      lua_rawseti(L, -2, 1);
+      lua_insert(L, -2);
+      lua_rawseti(L, -2, 2);
+      lua_rawset(L, t);
+      break;
+  }
+}
+
+/* parseQuery(s, [sep], [eq]) splits s on any of the bytes in sep, '&' by
+ * default, and each pair at its first eq, '=' by default, decoding keys
+ * and values.  Empty pairs are skipped and a pair without eq gets "".
+ */
+static int lhttp_parser_parse_query (lua_State *L) {
+  size_t len, sep_len, eq_len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  const char *sep = luaL_optlstring(L, 2, "&", &sep_len);
+  const char *eq = luaL_optlstring(L, 3, "=", &eq_len);
+  size_t start = 0, i;
+  int t;
+
+  luaL_argcheck(L, sep_len > 0, 2, "separator must not be empty");
+  luaL_argcheck(L, eq_len == 1, 3, "expected a single character");
+  lua_newtable(L);
+  t = lua_gettop(L);
+
+  while (start < len) {
+    const char *pair = s + start;
+    const char *split = NULL;
+    size_t pair_len = 0;
+
+    for (i = start; i < len; i++) {
+      if (memchr(sep, s[i], sep_len)) break;
+      if (!split && s[i] == eq[0]) split = s + i;
+    }
+    pair_len = i - start;
+    start = i + 1;
+    if (pair_len == 0) {
+      continue;
+    }
+
+    if (split) {
+      lhttp_push_unescaped(L, pair, split - pair);
+      lhttp_push_unescaped(L, split + 1, pair + pair_len - split - 1);
+    } else {
+      lhttp_push_unescaped(L, pair, pair_len);
+      lua_pushliteral(L, "");
+    }
+    lhttp_query_set(L, t);
+  }
+  return 1;
+}
+
+/* chunkFrame(chunks, [last], [trailer]) frames a string, Buffer or list of
+ * them as one chunk of a chunked body and returns the frame as a list for a
+ * vectored write: the size line, the chunks themselves and the CRLF after
+ * them.  With last it also ends the body, with trailer holding any trailer
+ * header lines.  Nothing gets copied, the only new string is the size line.
+ */
+static int lhttp_parser_chunk_frame (lua_State *L) {
+  char header[20];
+  size_t total = 0, len;
+  int is_list = lua_istable(L, 1) && !luv_isbuffer(L, 1);
+  int count = is_list ? (int)lua_objlen(L, 1) : 1;
+  int last = lua_toboolean(L, 2);
+  int has_trailer = !lua_isnoneornil(L, 3);
+  int i, n = 0;
+
+  if (is_list) {
+    for (i = 1; i <= count; i++) {
+      lua_rawgeti(L, 1, i);
+      luv_checkbuffer(L, -1, &len);
+      total += len;
+      lua_pop(L, 1);
+    }
+  } else {
+    luv_checkbuffer(L, 1, &total);
+  }
+  if (has_trailer) {
+    luaL_checkstring(L, 3);
+  }
+
+  lua_createtable(L, count + 2 + (last ? 2 + has_trailer : 0), 0);
+  /* An empty chunk would end the body early, just leave it out */
+  if (total > 0) {
+    lua_pushlstring(L, header, sprintf(header, "%lx\r\n", (unsigned long)total));
+    lua_rawseti(L, -2, ++n);
+    for (i = 1; i <= count; i++) {
+      if (is_list) {
+        lua_rawgeti(L, 1, i);
+      } else {
+        lua_pushvalue(L, 1);
+      }
+      lua_rawseti(L, -2, ++n);
+    }
+    lua_pushliteral(L, "\r\n");
+    lua_rawseti(L, -2, ++n);
+  }
+  if (last) {
+    lua_pushliteral(L, "0\r\n");
+    lua_rawseti(L, -2, ++n);
+    if (has_trailer) {
+      lua_pushvalue(L, 3);
+      lua_rawseti(L, -2, ++n);
+    }
+    lua_pushliteral(L, "\r\n");
+    lua_rawseti(L, -2, ++n);
+  }
+  return 1;
+}
+
 /******************************************************************************/
 
 static const luaL_reg lhttp_parser_m[] = {
   {"execute", lhttp_parser_execute},
   {"finish", lhttp_parser_finish},
+  {"pause", lhttp_parser_pause},
   {"reinitialize", lhttp_parser_reinitialize},
+  {"__gc", lhttp_parser_gc},
   {NULL, NULL}
 };
 
 static const luaL_reg lhttp_parser_f[] = {
   {"new", lhttp_parser_new},
   {"parseUrl", lhttp_parser_parse_url},
+  {"parseQuery", lhttp_parser_parse_query},
+  {"unescape", lhttp_parser_unescape},
+  {"chunkFrame", lhttp_parser_chunk_frame},
   {NULL, NULL}
 };
 
 LUALIB_API int luaopen_http_parser (lua_State *L) {
 
-  /* This needs to be done sometime? */
-  lhttp_parser_settings.on_message_begin    = lhttp_parser_on_message_begin;
-  lhttp_parser_settings.on_url              = lhttp_parser_on_url;
-  lhttp_parser_settings.on_header_field     = lhttp_parser_on_header_field;
-  lhttp_parser_settings.on_header_value     = lhttp_parser_on_header_value;
-  lhttp_parser_settings.on_headers_complete = lhttp_parser_on_headers_complete;
-  lhttp_parser_settings.on_body             = lhttp_parser_on_body;
-  lhttp_parser_settings.on_message_complete = lhttp_parser_on_message_complete;
-
   /* Create a metatable for the lhttp_parser userdata type */
   luaL_newmetatable(L, "lhttp_parser");
   lua_pushvalue(L, -1);
@@ -26,6 +26,10 @@
 #include "luv_udp.h"
 #include "luv_fs_watcher.h"
 #include "luv_timer.h"
+#include "luv_check.h"
+#include "luv_idle.h"
+#include "luv_timer_wheel.h"
+#include "luv_shm.h"
 #include "luv_process.h"
 #include "luv_signal.h"
 #include "luv_stream.h"
@@ -33,6 +37,12 @@
 #include "luv_pipe.h"
 #include "luv_tty.h"
 #include "luv_misc.h"
+#include "luv_buffer_pool.h"
+#include "luv_req_pool.h"
+#include "luv_loop_stats.h"
+#include "luv_handle_stats.h"
+#include "luv_alloc.h"
+#include "luv_gc.h"
 
 static const luaL_reg luv_f[] = {
 
@@ -52,6 +62,11 @@ static const luaL_reg luv_f[] = {
   {"udpSend6", luv_udp_send6},
   {"udpRecvStart", luv_udp_recv_start},
   {"udpRecvStop", luv_udp_recv_stop},
+  {"udpRecvBatchStart", luv_udp_recv_batch_start},
+  {"udpRecvBatchStop", luv_udp_recv_batch_stop},
+  {"udpAddressToString", luv_udp_address_to_string},
+  {"udpPackAddress", luv_udp_pack_address},
+  {"udpSendBatch", luv_udp_send_batch},
   {"udpSetBroadcast", luv_udp_set_broadcast},
   {"udpSetTTL", luv_udp_set_ttl},
   {"udpSetMulticastTTL", luv_udp_set_multicast_ttl},
@@ -59,6 +74,7 @@ static const luaL_reg luv_f[] = {
 
   /* FS Watcher functions */
   {"newFsWatcher", luv_new_fs_watcher},
+  {"fsWatcherCoalesce", luv_fs_watcher_coalesce},
 
   /* Timer functions */
   {"newTimer", luv_new_timer},
@@ -68,6 +84,22 @@ static const luaL_reg luv_f[] = {
   {"timerSetRepeat", luv_timer_set_repeat},
   {"timerGetRepeat", luv_timer_get_repeat},
   {"timerGetActive", luv_timer_get_active},
+  /* Check functions */
+  {"newCheck", luv_new_check},
+  {"checkStart", luv_check_start},
+  {"checkStop", luv_check_stop},
+  /* Idle functions */
+  {"newIdle", luv_new_idle},
+  {"idleStart", luv_idle_start},
+  {"idleStop", luv_idle_stop},
+  {"newWheelTimer", luv_new_wheel_timer},
+  {"timerWheelStats", luv_timer_wheel_stats},
+
+  /* Shared memory rings */
+  {"shmCreate", luv_shm_create},
+  {"shmAttach", luv_shm_attach},
+  {"shmUnlink", luv_shm_unlink},
+  {"mkfifo", luv_mkfifo},
 
   /* Process functions */
   {"spawn", luv_spawn},
@@ -90,6 +122,8 @@ static const luaL_reg luv_f[] = {
   {"readStop", luv_read_stop},
   {"readStopNoRef", luv_read_stop_noref},
   {"writeQueueSize", luv_write_queue_size},
+  {"streamFileno", luv_stream_fileno},
+  {"streamSendfile", luv_stream_sendfile},
   {"write", luv_write},
   {"write2", luv_write2},
 
@@ -97,6 +131,7 @@ static const luaL_reg luv_f[] = {
   {"newTcp", luv_new_tcp},
   {"tcpBind", luv_tcp_bind},
   {"tcpBind6", luv_tcp_bind6},
+  {"tcpBindShared", luv_tcp_bind_shared},
   {"tcpNodelay", luv_tcp_nodelay},
   {"tcpGetsockname", luv_tcp_getsockname},
   {"tcpGetpeername", luv_tcp_getpeername},
@@ -160,6 +195,11 @@ static const luaL_reg luv_f[] = {
   {"fsFchmod", luv_fs_fchmod},
   {"fsChown", luv_fs_chown},
   {"fsFchown", luv_fs_fchown},
+  {"fsReadFile", luv_fs_read_file},
+#ifndef _WIN32
+  {"fsWritev", luv_fs_writev},
+  {"fsWalk", luv_fs_walk},
+#endif
 
   /* Misc functions */
   {"run", luv_run},
@@ -180,6 +220,20 @@ static const luaL_reg luv_f[] = {
   {"getProcessTitle", luv_get_process_title},
   {"setProcessTitle", luv_set_process_title},
   {"handleType", luv_handle_type},
+  {"waitWritable", luv_wait_writable},
+  {"bufferPoolStats", luv_buffer_pool_stats},
+  {"bufferPoolSetLimit", luv_buffer_pool_set_limit},
+  {"reqPoolStats", luv_req_pool_stats},
+  {"loopStatsEnable", luv_loop_stats_enable},
+  {"loopStatsReset", luv_loop_stats_reset},
+  {"loopStats", luv_loop_stats},
+  {"handleStats", luv_handle_stats},
+  {"handleStatsDebug", luv_handle_stats_debug},
+  {"handleLeaks", luv_handle_leaks},
+  {"memoryStats", luv_memory_stats},
+  {"setMemoryLimit", luv_set_memory_limit},
+  {"gcSchedule", luv_gc_schedule},
+  {"gcStats", luv_gc_stats},
   {NULL, NULL}
 };
 
@@ -190,6 +244,8 @@ static int luv_handle_gc(lua_State* L) {
   /* If the handle is still there, they forgot to close */
   if (lhandle->handle) {
     fprintf(stderr, "WARNING: forgot to close %s lhandle=%p handle=%p\n", lhandle->type, lhandle, lhandle->handle);
+    /* The userdata is going away, so it can't stay on the live list */
+    luv_handle_stats_remove(lhandle);
     uv_close(lhandle->handle, luv_on_close);
   }
   return 0;
@@ -203,6 +259,9 @@ LUALIB_API int luaopen_uv_native (lua_State* L) {
   lua_setfield(L, -2, "__gc");
   lua_pop(L, 1);
 
+  luv_timer_wheel_open(L);
+  luv_shm_open(L);
+
   /* Create a new exports table with functions and constants */
   lua_newtable (L);
 
@@ -0,0 +1,328 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "luv_alloc.h"
+#include "uv.h"
+
+struct luv_alloc_block_s {
+  luv_alloc_block_t* next;
+};
+
+struct luv_alloc_slab_s {
+  luv_alloc_slab_t* next;
+};
+
+/* Slabs start with their link, blocks follow suitably aligned */
+#define LUV_ALLOC_SLAB_HEADER \
+  ((sizeof(luv_alloc_slab_t) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+static const size_t luv_alloc_class_sizes[LUV_ALLOC_CLASSES] = {
+  16, 24, 32, 48, 64, 80, 96, 128, 160, 192, 224, 256
+};
+
+/* Size class for each multiple of 8 bytes up to LUV_ALLOC_MAX_SMALL */
+static signed char luv_alloc_class_of[LUV_ALLOC_MAX_SMALL / 8 + 1];
+static uv_once_t luv_alloc_classes_once = UV_ONCE_INIT;
+
+static void luv_alloc_init_classes(void) {
+  int size_class = 0;
+  int i;
+
+  for (i = 0; i <= LUV_ALLOC_MAX_SMALL / 8; i++) {
+    while ((size_t)i * 8 > luv_alloc_class_sizes[size_class]) {
+      size_class++;
+    }
+    luv_alloc_class_of[i] = (signed char)size_class;
+  }
+}
+
+static int luv_alloc_class(size_t size) {
+  return luv_alloc_class_of[(size + 7) / 8];
+}
+
+static void* luv_alloc_small(luv_alloc_t* a, int size_class) {
+  size_t size = luv_alloc_class_sizes[size_class];
+  luv_alloc_block_t* block = a->free[size_class];
+  luv_alloc_slab_t* slab;
+  void* ptr;
+
+  if (block) {
+    a->free[size_class] = block->next;
+    a->pooled -= size;
+    return block;
+  }
+
+  if (a->slab_left < size) {
+    /* Whatever is left of the old slab goes to the freelists */
+    while (a->slab_left >= luv_alloc_class_sizes[0]) {
+      int c = luv_alloc_class(a->slab_left);
+      if (luv_alloc_class_sizes[c] > a->slab_left) {
+        c--;
+      }
+      block = (luv_alloc_block_t*)a->slab_next;
+      block->next = a->free[c];
+      a->free[c] = block;
+      a->pooled += luv_alloc_class_sizes[c];
+      a->slab_next += luv_alloc_class_sizes[c];
+      a->slab_left -= luv_alloc_class_sizes[c];
+    }
+    slab = malloc(LUV_ALLOC_SLAB_SIZE);
+    if (!slab) {
+      return NULL;
+    }
+    slab->next = a->slabs;
+    a->slabs = slab;
+    a->slab_bytes += LUV_ALLOC_SLAB_SIZE;
+    a->slab_next = (char*)slab + LUV_ALLOC_SLAB_HEADER;
+    a->slab_left = LUV_ALLOC_SLAB_SIZE - LUV_ALLOC_SLAB_HEADER;
+  }
+
+  ptr = a->slab_next;
+  a->slab_next += size;
+  a->slab_left -= size;
+  return ptr;
+}
+
+static void luv_alloc_small_free(luv_alloc_t* a, void* ptr, int size_class) {
+  luv_alloc_block_t* block = ptr;
+  block->next = a->free[size_class];
+  a->free[size_class] = block;
+  a->pooled += luv_alloc_class_sizes[size_class];
+}
+
+/* Frees go to the freelist of their size class and a block is reused in
+ * place when it's resized within its class, Lua always tells us the old
+ * size so blocks need no header.
+ */
+static void* luv_alloc_pooled(luv_alloc_t* a, void* ptr, size_t osize, size_t nsize) {
+  int oclass = ptr && osize <= LUV_ALLOC_MAX_SMALL ? luv_alloc_class(osize) : -1;
+  int nclass = nsize && nsize <= LUV_ALLOC_MAX_SMALL ? luv_alloc_class(nsize) : -1;
+  void* block;
+
+  if (nsize == 0) {
+    if (oclass >= 0) {
+      luv_alloc_small_free(a, ptr, oclass);
+    } else {
+      a->large_bytes -= osize;
+      free(ptr);
+    }
+    return NULL;
+  }
+
+  if (oclass >= 0 && oclass == nclass) {
+    return ptr;
+  }
+  if (oclass < 0 && nclass < 0) {
+    block = realloc(ptr, nsize);
+    if (block) {
+      a->large_bytes += nsize - (ptr ? osize : 0);
+    }
+    return block;
+  }
+
+  /* Moving between a class and realloc, or between classes */
+  if (nclass >= 0) {
+    block = luv_alloc_small(a, nclass);
+  } else {
+    block = malloc(nsize);
+    if (block) {
+      a->large_bytes += nsize;
+    }
+  }
+  if (!block) {
+    return NULL;
+  }
+  if (ptr) {
+    memcpy(block, ptr, osize < nsize ? osize : nsize);
+    if (oclass >= 0) {
+      luv_alloc_small_free(a, ptr, oclass);
+    } else {
+      a->large_bytes -= osize;
+      free(ptr);
+    }
+  }
+  return block;
+}
+
+static void* luv_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+  luv_alloc_t* a = ud;
+  void* block;
+
+  /* Lua passes garbage as osize for new blocks */
+  if (!ptr) {
+    osize = 0;
+  }
+
+  /* Only growth can fail, Lua doesn't expect shrinking to */
+  if (a->limit && nsize > osize && a->live + (nsize - osize) > a->limit) {
+    a->refused++;
+    return NULL;
+  }
+
+  if (a->base) {
+    block = a->base(a->base_ud, ptr, osize, nsize);
+  } else {
+    block = luv_alloc_pooled(a, ptr, osize, nsize);
+  }
+
+  if (nsize == 0) {
+    if (ptr) {
+      a->live -= osize;
+      a->frees++;
+    }
+    return NULL;
+  }
+  if (!block) {
+    return NULL;
+  }
+  if (!ptr) {
+    a->allocs++;
+  }
+  a->live += nsize;
+  a->live -= osize;
+  if (a->live > a->peak) {
+    a->peak = a->live;
+  }
+  return block;
+}
+
+static size_t luv_alloc_parse_size(const char* value) {
+  char* end;
+  double size = strtod(value, &end);
+
+  switch (*end) {
+    case 'k': case 'K': size *= 1024; break;
+    case 'm': case 'M': size *= 1024 * 1024; break;
+    case 'g': case 'G': size *= 1024.0 * 1024 * 1024; break;
+  }
+  return size > 0 ? (size_t)size : 0;
+}
+
+lua_State* luv_newstate(void) {
+  luv_alloc_t* a = calloc(1, sizeof(luv_alloc_t));
+  const char* limit = getenv("LUVIT_MEMORY_LIMIT");
+  lua_State* L;
+
+  if (!a) {
+    return NULL;
+  }
+  /* Loop threads and worker states all come through here */
+  uv_once(&luv_alloc_classes_once, luv_alloc_init_classes);
+
+#if LUV_ALLOC_POOLED
+  L = lua_newstate(luv_alloc, a);
+#else
+  L = NULL;
+#endif
+  if (!L) {
+    /* The VM needs memory it allocates itself, account for it from here */
+    L = luaL_newstate();
+    if (!L) {
+      free(a);
+      return NULL;
+    }
+    a->base = lua_getallocf(L, &a->base_ud);
+    a->live = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+    a->peak = a->live;
+    lua_setallocf(L, luv_alloc, a);
+  }
+
+  if (limit) {
+    a->limit = luv_alloc_parse_size(limit);
+  }
+  return L;
+}
+
+static luv_alloc_t* luv_alloc_get(lua_State* L) {
+  void* ud;
+  if (lua_getallocf(L, &ud) != luv_alloc) {
+    return NULL;
+  }
+  return ud;
+}
+
+void luv_close_state(lua_State* L) {
+  luv_alloc_t* a = luv_alloc_get(L);
+  luv_alloc_slab_t* slab;
+
+  lua_close(L);
+  if (!a) {
+    return;
+  }
+  while ((slab = a->slabs)) {
+    a->slabs = slab->next;
+    free(slab);
+  }
+  free(a);
+}
+
+/* memoryStats() gives the Lua heap figures of this state */
+int luv_memory_stats(lua_State* L) {
+  luv_alloc_t* a = luv_alloc_get(L);
+  size_t rss = 0;
+
+  lua_newtable(L);
+  if (uv_resident_set_memory(&rss).code == UV_OK) {
+    lua_pushnumber(L, rss);
+    lua_setfield(L, -2, "rss");
+  }
+  if (!a) {
+    lua_pushnumber(L, lua_gc(L, LUA_GCCOUNT, 0) * 1024.0 + lua_gc(L, LUA_GCCOUNTB, 0));
+    lua_setfield(L, -2, "heapUsed");
+    return 1;
+  }
+
+  lua_pushnumber(L, a->live);
+  lua_setfield(L, -2, "heapUsed");
+  lua_pushnumber(L, a->peak);
+  lua_setfield(L, -2, "heapPeak");
+  lua_pushnumber(L, a->limit);
+  lua_setfield(L, -2, "heapLimit");
+  lua_pushboolean(L, a->base == NULL);
+  lua_setfield(L, -2, "pooled");
+  if (!a->base) {
+    /* What the allocator holds from malloc, in use or not */
+    lua_pushnumber(L, a->slab_bytes + a->large_bytes);
+    lua_setfield(L, -2, "heapTotal");
+    lua_pushnumber(L, a->pooled);
+    lua_setfield(L, -2, "freeListBytes");
+  }
+  lua_pushnumber(L, a->allocs);
+  lua_setfield(L, -2, "allocations");
+  lua_pushnumber(L, a->frees);
+  lua_setfield(L, -2, "frees");
+  lua_pushnumber(L, a->refused);
+  lua_setfield(L, -2, "refused");
+  return 1;
+}
+
+/* setMemoryLimit(bytes) caps the Lua heap, 0 removes the cap.  Past it
+ * allocations fail with a "not enough memory" error pcall can catch.
+ */
+int luv_set_memory_limit(lua_State* L) {
+  luv_alloc_t* a = luv_alloc_get(L);
+  lua_Number limit = luaL_checknumber(L, 1);
+
+  if (!a) {
+    return luaL_error(L, "setMemoryLimit: this state doesn't use the luvit allocator");
+  }
+  a->limit = limit > 0 ? (size_t)limit : 0;
+  return 0;
+}
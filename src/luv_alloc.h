@@ -0,0 +1,78 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_ALLOC
+#define LUV_ALLOC
+
+#include "lua.h"
+#include "lauxlib.h"
+
+/* Blocks of up to LUV_ALLOC_MAX_SMALL bytes come from size class freelists
+ * carved out of LUV_ALLOC_SLAB_SIZE slabs, bigger ones go to realloc.
+ */
+#define LUV_ALLOC_MAX_SMALL 256
+#define LUV_ALLOC_SLAB_SIZE (64 * 1024)
+#define LUV_ALLOC_CLASSES 12
+
+/* LuaJIT 2.0 on x64 keeps its heap below 2GB and refuses allocators other
+ * than its own, so the pools are never tried there.
+ */
+#if defined(__x86_64__) || defined(_M_X64)
+# define LUV_ALLOC_POOLED 0
+#else
+# define LUV_ALLOC_POOLED 1
+#endif
+
+typedef struct luv_alloc_block_s luv_alloc_block_t;
+typedef struct luv_alloc_slab_s luv_alloc_slab_t;
+
+typedef struct {
+  /* The allocator we forward to when the VM won't take ours, see
+   * luv_newstate.  Nothing is pooled then.
+   */
+  lua_Alloc base;
+  void* base_ud;
+  luv_alloc_block_t* free[LUV_ALLOC_CLASSES];
+  luv_alloc_slab_t* slabs;
+  char* slab_next;     /* unused part of the newest slab */
+  size_t slab_left;
+  size_t live;         /* bytes Lua has allocated and not freed */
+  size_t peak;
+  size_t limit;        /* live may not grow past this, 0 for no limit */
+  size_t pooled;       /* bytes sitting in the freelists */
+  size_t slab_bytes;
+  size_t large_bytes;  /* live bytes of blocks bigger than a class */
+  double allocs;
+  double frees;
+  double refused;      /* allocations failed because of the limit */
+} luv_alloc_t;
+
+/* Creates a state using the luvit allocator.  Without LUV_ALLOC_POOLED, or
+ * when the VM turns it down anyway, LuaJIT's own allocator is wrapped for
+ * the accounting and the limit only.
+ * LUVIT_MEMORY_LIMIT sets the initial limit in bytes, k, m and g suffixes
+ * are understood.
+ */
+lua_State* luv_newstate(void);
+
+/* lua_close, then frees the allocator and its slabs */
+void luv_close_state(lua_State* L);
+
+int luv_memory_stats(lua_State* L);
+int luv_set_memory_limit(lua_State* L);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "luv_buffer_pool.h"
+#include "utils.h"
+
+/* Every buffer is preceded by a small header so release knows which
+ * freelist it belongs to regardless of what the caller did with buf.len.
+ */
+struct luv_buffer_block_s {
+  luv_buffer_block_t* next;
+  int size_class;      /* -1 for oversized, unpooled buffers */
+  size_t size;         /* usable bytes after the header */
+};
+
+/* Keep the payload suitably aligned for any type */
+#define LUV_BUFFER_HEADER_SIZE \
+  ((sizeof(luv_buffer_block_t) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+#define LUV_BUFFER_BLOCK(base) \
+  ((luv_buffer_block_t*)((char*)(base) - LUV_BUFFER_HEADER_SIZE))
+
+#define LUV_BUFFER_DATA(block) \
+  ((char*)(block) + LUV_BUFFER_HEADER_SIZE)
+
+static size_t luv_buffer_class_size(int size_class) {
+  /* 1k, 4k, 16k, 64k */
+  return (size_t)LUV_BUFFER_POOL_MIN_SIZE << (2 * size_class);
+}
+
+static int luv_buffer_class_for(size_t size) {
+  int i;
+  for (i = 0; i < LUV_BUFFER_POOL_CLASSES; i++) {
+    if (size <= luv_buffer_class_size(i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void luv_buffer_pool_init(luv_buffer_pool_t* pool) {
+  memset(pool, 0, sizeof(*pool));
+  pool->limit = LUV_BUFFER_POOL_DEFAULT_LIMIT;
+}
+
+uv_buf_t luv_buffer_pool_alloc(luv_buffer_pool_t* pool, size_t size) {
+  luv_buffer_block_t* block;
+  int size_class = luv_buffer_class_for(size);
+
+  if (size_class >= 0 && pool->free[size_class]) {
+    block = pool->free[size_class];
+    pool->free[size_class] = block->next;
+    pool->free_count[size_class]--;
+    pool->retained -= block->size;
+    pool->hits++;
+  } else {
+    size_t capacity = size_class >= 0 ? luv_buffer_class_size(size_class) : size;
+    block = malloc(LUV_BUFFER_HEADER_SIZE + capacity);
+    if (!block) {
+      return uv_buf_init(NULL, 0);
+    }
+    block->size_class = size_class;
+    block->size = capacity;
+    if (size_class < 0) {
+      pool->oversized++;
+    }
+    pool->misses++;
+  }
+
+  block->next = NULL;
+  pool->in_use++;
+  return uv_buf_init(LUV_BUFFER_DATA(block), block->size);
+}
+
+void luv_buffer_pool_release(luv_buffer_pool_t* pool, uv_buf_t buf) {
+  luv_buffer_block_t* block;
+
+  if (!buf.base) {
+    return;
+  }
+
+  block = LUV_BUFFER_BLOCK(buf.base);
+  assert(pool->in_use > 0);
+  pool->in_use--;
+
+  if (block->size_class < 0 || pool->retained + block->size > pool->limit) {
+    if (block->size_class >= 0) {
+      pool->dropped++;
+    }
+    free(block);
+    return;
+  }
+
+  block->next = pool->free[block->size_class];
+  pool->free[block->size_class] = block;
+  pool->free_count[block->size_class]++;
+  pool->retained += block->size;
+}
+
+void luv_buffer_pool_trim(luv_buffer_pool_t* pool) {
+  int i;
+  luv_buffer_block_t* block;
+
+  for (i = 0; i < LUV_BUFFER_POOL_CLASSES; i++) {
+    while ((block = pool->free[i])) {
+      pool->free[i] = block->next;
+      free(block);
+    }
+    pool->free_count[i] = 0;
+  }
+  pool->retained = 0;
+}
+
+int luv_buffer_pool_stats(lua_State* L) {
+  luv_buffer_pool_t* pool = &luv_loop_data(luv_get_loop(L))->buffer_pool;
+  int i;
+
+  lua_newtable(L);
+  lua_pushnumber(L, pool->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, pool->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, pool->dropped);
+  lua_setfield(L, -2, "dropped");
+  lua_pushnumber(L, pool->oversized);
+  lua_setfield(L, -2, "oversized");
+  lua_pushnumber(L, pool->in_use);
+  lua_setfield(L, -2, "inUse");
+  lua_pushnumber(L, pool->retained);
+  lua_setfield(L, -2, "retained");
+  lua_pushnumber(L, pool->limit);
+  lua_setfield(L, -2, "limit");
+
+  /* free buffers per size class, keyed by class size */
+  lua_newtable(L);
+  for (i = 0; i < LUV_BUFFER_POOL_CLASSES; i++) {
+    lua_pushnumber(L, pool->free_count[i]);
+    lua_rawseti(L, -2, luv_buffer_class_size(i));
+  }
+  lua_setfield(L, -2, "free");
+
+  return 1;
+}
+
+int luv_buffer_pool_set_limit(lua_State* L) {
+  luv_buffer_pool_t* pool = &luv_loop_data(luv_get_loop(L))->buffer_pool;
+  lua_Number limit = luaL_checknumber(L, 1);
+
+  luaL_argcheck(L, limit >= 0, 1, "limit must not be negative");
+  pool->limit = (size_t)limit;
+  /* Shrinking the cap drops whatever no longer fits */
+  if (pool->retained > pool->limit) {
+    luv_buffer_pool_trim(pool);
+  }
+  return 0;
+}
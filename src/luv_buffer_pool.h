@@ -0,0 +1,64 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_BUFFER_POOL
+#define LUV_BUFFER_POOL
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "uv.h"
+
+/* Read buffers are handed out in a few fixed size classes.  Anything larger
+ * than the biggest class is malloc'd and freed directly.
+ */
+#define LUV_BUFFER_POOL_CLASSES 4
+#define LUV_BUFFER_POOL_MIN_SIZE 1024
+
+/* Default cap on the bytes kept in the freelists of a single loop */
+#define LUV_BUFFER_POOL_DEFAULT_LIMIT (4 * 1024 * 1024)
+
+typedef struct luv_buffer_block_s luv_buffer_block_t;
+
+typedef struct {
+  luv_buffer_block_t* free[LUV_BUFFER_POOL_CLASSES];
+  size_t free_count[LUV_BUFFER_POOL_CLASSES];
+  size_t limit;      /* max bytes retained in the freelists */
+  size_t retained;   /* bytes currently sitting in the freelists */
+  size_t in_use;     /* buffers handed out and not yet released */
+  double hits;       /* allocations served from a freelist */
+  double misses;     /* allocations that had to malloc */
+  double dropped;    /* releases freed because the pool was full */
+  double oversized;  /* requests bigger than the largest class */
+} luv_buffer_pool_t;
+
+void luv_buffer_pool_init(luv_buffer_pool_t* pool);
+
+/* Hand out a buffer of at least size bytes.  buf.len is the usable size. */
+uv_buf_t luv_buffer_pool_alloc(luv_buffer_pool_t* pool, size_t size);
+
+/* Give a buffer obtained from luv_buffer_pool_alloc back to the pool.
+ * buf.base may be NULL.
+ */
+void luv_buffer_pool_release(luv_buffer_pool_t* pool, uv_buf_t buf);
+
+/* Free everything sitting in the freelists */
+void luv_buffer_pool_trim(luv_buffer_pool_t* pool);
+
+int luv_buffer_pool_stats(lua_State* L);
+int luv_buffer_pool_set_limit(lua_State* L);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "luv_check.h"
+#include "utils.h"
+
+int luv_new_check(lua_State* L) {
+  uv_check_t* handle = luv_create_check(L);
+  uv_check_init(luv_get_loop(L), handle);
+  return 1;
+}
+
+static void luv_on_check(uv_check_t* handle, int status) {
+  /* load the lua state and put the userdata on the stack */
+  lua_State* L = luv_handle_get_lua(handle->data);
+  luv_emit_event(L, "check", 0);
+}
+
+int luv_check_start(lua_State* L) {
+  uv_check_t* handle = (uv_check_t*)luv_checkudata(L, 1, "check");
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+
+  luv_register_event(L, 1, "check", 2);
+
+  if (uv_is_active((uv_handle_t*)handle)) {
+    return 0;
+  }
+  if (uv_check_start(handle, luv_on_check)) {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    return luaL_error(L, "check_start: %s", uv_strerror(err));
+  }
+  luv_handle_ref(L, handle->data, 1);
+
+  return 0;
+}
+
+int luv_check_stop(lua_State* L) {
+  uv_check_t* handle = (uv_check_t*)luv_checkudata(L, 1, "check");
+
+  if (!uv_is_active((uv_handle_t*)handle)) {
+    return 0;
+  }
+  if (uv_check_stop(handle)) {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    return luaL_error(L, "check_stop: %s", uv_strerror(err));
+  }
+  luv_handle_unref(L, handle->data);
+
+  return 0;
+}
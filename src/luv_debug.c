@@ -42,6 +42,10 @@
 #include "lauxlib.h"
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
 
 /* TODO: real logging subsystem */
 #define logErr(format, ...)  do { \
@@ -418,10 +422,296 @@ luahook_stackdump(lua_State *L)
   return 0;
 }
 
+/* Sampling profiler.  SIGPROF arrives every interval of CPU time and its
+ * handler sets a count hook, about the only thing a signal handler may do
+ * to a lua_State.  The hook runs at the next instruction the interpreter
+ * executes, removes itself and records the stack into a ring of samples,
+ * overwriting the oldest once it's full.  Compiled traces don't call hooks,
+ * so their time goes to wherever they leave for the interpreter.  There's
+ * one profiler per process, profiling the state that started it.
+ */
+
+#define LUV_PROFILE_DEPTH 64
+#define LUV_PROFILE_DEFAULT_SAMPLES 16384
+#define LUV_PROFILE_NAME_SIZE 256
+
+typedef struct {
+  int depth;
+  unsigned frames[LUV_PROFILE_DEPTH]; /* ids of frame names, innermost first */
+} luv_profile_sample_t;
+
+static luv_profile_sample_t *profile_samples = NULL;
+static size_t profile_capacity = 0;
+static size_t profile_next = 0;  /* slot the next sample goes in */
+static size_t profile_count = 0; /* samples in the ring */
+static double profile_dropped = 0; /* samples overwritten */
+static lua_State *profile_L = NULL;
+static volatile sig_atomic_t profile_running = 0;
+
+/* Frame names are interned, the table maps their hash to an id + 1 */
+static char **profile_names = NULL;
+static unsigned profile_name_count = 0;
+static unsigned profile_name_size = 0;
+static unsigned *profile_name_table = NULL;
+static unsigned profile_table_size = 0;
+
+static unsigned
+profile_hash(const char *name)
+{
+  unsigned hash = 5381;
+  while (*name)
+    hash = (hash * 33) ^ (unsigned char)*name++;
+  return hash;
+}
+
+static void
+profile_names_clear(void)
+{
+  unsigned i;
+  for (i = 0; i < profile_name_count; i++)
+    free(profile_names[i]);
+  free(profile_names);
+  free(profile_name_table);
+  profile_names = NULL;
+  profile_name_table = NULL;
+  profile_name_count = profile_name_size = profile_table_size = 0;
+}
+
+static void
+profile_table_insert(unsigned id)
+{
+  unsigned i = profile_hash(profile_names[id]) & (profile_table_size - 1);
+  while (profile_name_table[i])
+    i = (i + 1) & (profile_table_size - 1);
+  profile_name_table[i] = id + 1;
+}
+
+static unsigned
+profile_intern(const char *name)
+{
+  unsigned i, id;
+
+  if (profile_table_size) {
+    i = profile_hash(name) & (profile_table_size - 1);
+    while (profile_name_table[i]) {
+      id = profile_name_table[i] - 1;
+      if (strcmp(profile_names[id], name) == 0)
+        return id;
+      i = (i + 1) & (profile_table_size - 1);
+    }
+  }
+
+  if (profile_name_count == profile_name_size) {
+    profile_name_size = profile_name_size ? profile_name_size * 2 : 256;
+    profile_names = realloc(profile_names, profile_name_size * sizeof(char *));
+  }
+  id = profile_name_count++;
+  profile_names[id] = malloc(strlen(name) + 1);
+  strcpy(profile_names[id], name);
+
+  /* Kept at most half full */
+  if (profile_name_count * 2 > profile_table_size) {
+    profile_table_size = profile_table_size ? profile_table_size * 2 : 512;
+    free(profile_name_table);
+    profile_name_table = calloc(profile_table_size, sizeof(unsigned));
+    for (i = 0; i < profile_name_count; i++)
+      profile_table_insert(i);
+  } else {
+    profile_table_insert(id);
+  }
+  return id;
+}
+
+/* "name source:line" for Lua functions, "name [C]" for C ones.  ';' is the
+ * frame separator of collapsed stacks so it mustn't appear in names.
+ */
+static void
+profile_frame_name(lua_Debug *ar, char *buf, size_t len)
+{
+  const char *name = ar->name;
+  char *c;
+
+  if (!name || !name[0])
+    name = strcmp(ar->what, "main") == 0 ? "main" : "?";
+  if (strcmp(ar->what, "C") == 0)
+    snprintf(buf, len, "%s [C]", name);
+  else
+    snprintf(buf, len, "%s %s:%d", name, ar->short_src, ar->linedefined);
+  for (c = buf; *c; c++) {
+    if (*c == ';' || *c == '\n')
+      *c = ' ';
+  }
+}
+
+static void
+profile_hook(lua_State *L, lua_Debug *ar)
+{
+  luv_profile_sample_t *sample;
+  lua_Debug frame;
+  char name[LUV_PROFILE_NAME_SIZE];
+  int level;
+
+  lua_sethook(L, NULL, 0, 0);
+  if (!profile_running)
+    return;
+
+  sample = &profile_samples[profile_next];
+  sample->depth = 0;
+  for (level = 0; sample->depth < LUV_PROFILE_DEPTH &&
+       lua_getstack(L, level, &frame); level++) {
+    if (!lua_getinfo(L, "Sn", &frame))
+      continue;
+    profile_frame_name(&frame, name, sizeof(name));
+    sample->frames[sample->depth++] = profile_intern(name);
+  }
+  if (!sample->depth)
+    return;
+
+  profile_next = (profile_next + 1) % profile_capacity;
+  if (profile_count < profile_capacity)
+    profile_count++;
+  else
+    profile_dropped++;
+}
+
+#ifndef _WIN32
+static void
+profile_on_signal(int signum)
+{
+  if (profile_running)
+    lua_sethook(profile_L, profile_hook, LUA_MASKCOUNT, 1);
+}
+
+static void
+profile_set_timer(double interval)
+{
+  struct itimerval timer;
+  long usec = (long)(interval * 1000);
+  timer.it_interval.tv_sec = usec / 1000000;
+  timer.it_interval.tv_usec = usec % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+#endif
+
+/* profileStart([interval_ms], [samples]) */
+static int
+luahook_profile_start(lua_State *L)
+{
+#ifdef _WIN32
+  return luaL_error(L, "profileStart: SIGPROF is not available on this platform");
+#else
+  double interval = luaL_optnumber(L, 1, 10);
+  lua_Integer capacity = luaL_optinteger(L, 2, LUV_PROFILE_DEFAULT_SAMPLES);
+  struct sigaction sa;
+
+  if (profile_running)
+    return luaL_error(L, "profileStart: the profiler is already running");
+  if (lua_gethook(L))
+    return luaL_error(L, "profileStart: a debug hook is already set");
+  if (interval < 0.001 || capacity < 1)
+    return luaL_error(L, "profileStart: interval and samples must be positive");
+
+  free(profile_samples);
+  profile_samples = malloc((size_t)capacity * sizeof(luv_profile_sample_t));
+  if (!profile_samples) {
+    profile_capacity = 0;
+    return luaL_error(L, "profileStart: can't allocate %d samples", (int)capacity);
+  }
+  profile_capacity = (size_t)capacity;
+  profile_next = profile_count = 0;
+  profile_dropped = 0;
+  profile_names_clear();
+  profile_L = L;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = profile_on_signal;
+  sigemptyset(&sa.sa_mask);
+  /* Let interrupted syscalls carry on so the loop doesn't notice us */
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, NULL);
+
+  profile_running = 1;
+  profile_set_timer(interval);
+  return 0;
+#endif
+}
+
+static int
+luahook_profile_stop(lua_State *L)
+{
+#ifndef _WIN32
+  if (!profile_running)
+    return 0;
+  profile_running = 0;
+  profile_set_timer(0);
+  /* A signal still in flight mustn't take the default action and kill us */
+  signal(SIGPROF, SIG_IGN);
+  if (lua_gethook(profile_L) == profile_hook)
+    lua_sethook(profile_L, NULL, 0, 0);
+#endif
+  return 0;
+}
+
+/* Returns the samples as collapsed stacks, one "root;...;leaf count" line
+ * per distinct stack as flamegraph.pl reads them, then the number of
+ * samples and of samples lost to the ring wrapping around.
+ */
+static int
+luahook_profile_dump(lua_State *L)
+{
+  luaL_Buffer b;
+  size_t i, slot;
+  int frame, counts, lines, n;
+
+  lua_newtable(L);
+  counts = lua_gettop(L);
+  slot = profile_count < profile_capacity ? 0 : profile_next;
+  for (i = 0; i < profile_count; i++) {
+    luv_profile_sample_t *sample = &profile_samples[(slot + i) % profile_capacity];
+    luaL_buffinit(L, &b);
+    for (frame = sample->depth - 1; frame >= 0; frame--) {
+      luaL_addstring(&b, profile_names[sample->frames[frame]]);
+      if (frame)
+        luaL_addchar(&b, ';');
+    }
+    luaL_pushresult(&b);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, counts);
+    lua_pushnumber(L, lua_tonumber(L, -1) + 1);
+    lua_remove(L, -2);
+    lua_rawset(L, counts);
+  }
+
+  /* Lines go in a list first, lua_next and a buffer don't mix */
+  lua_newtable(L);
+  lines = lua_gettop(L);
+  n = 0;
+  lua_pushnil(L);
+  while (lua_next(L, counts)) {
+    lua_pushfstring(L, "%s %d\n", lua_tostring(L, -2), (int)lua_tonumber(L, -1));
+    lua_rawseti(L, lines, ++n);
+    lua_pop(L, 1);
+  }
+
+  luaL_buffinit(L, &b);
+  for (frame = 1; frame <= n; frame++) {
+    lua_rawgeti(L, lines, frame);
+    luaL_addvalue(&b);
+  }
+  luaL_pushresult(&b);
+  lua_pushnumber(L, (lua_Number)profile_count);
+  lua_pushnumber(L, profile_dropped);
+  return 3;
+}
+
 static const luaL_reg debug_lib[] = {
   {"stackdump", luahook_stackdump},
   {"debugger", luahook_debugger},
   {"stackwalk", luahook_stackwalk},
+  {"profileStart", luahook_profile_start},
+  {"profileStop", luahook_profile_stop},
+  {"profileDump", luahook_profile_dump},
   {NULL, NULL}
 };
 
@@ -0,0 +1,497 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/evp.h>
+
+#include "uv.h"
+#include "utils.h"
+#include "luv_digest.h"
+
+/* Bytes hashFile reads at a time */
+#define LUV_DIGEST_READ_SIZE (256 * 1024)
+
+enum {
+  LUV_DIGEST_UPDATE,
+  LUV_DIGEST_FINAL,     /* final, hex encoded */
+  LUV_DIGEST_FINAL_RAW
+};
+
+/* An update or final waiting its turn, each pins its chunk, its callback and
+ * the digest itself until it's done
+ */
+typedef struct luv_digest_op_s {
+  struct luv_digest_op_s* next;
+  int kind;
+  const char* data;
+  size_t len;
+  luv_io_ctx_t cbs;
+} luv_digest_op_t;
+
+/* Ops run on the thread pool one at a time, in the order they were queued */
+typedef struct {
+  EVP_MD_CTX* ctx;
+  EVP_PKEY* key;       /* set for an HMAC */
+  lua_State* L;
+  uv_work_t work;
+  luv_digest_op_t* head;
+  luv_digest_op_t* tail;
+  int busy;            /* head is running on the thread pool */
+  int finalized;       /* a final has been done or queued */
+  int ok;              /* how the last op went */
+  unsigned char md[EVP_MAX_MD_SIZE];
+  size_t md_len;
+} luv_digest_t;
+
+static void luv_digest_push_result(lua_State* L, const unsigned char* md,
+                                   size_t len, int raw) {
+  static const char hex[] = "0123456789abcdef";
+  char out[EVP_MAX_MD_SIZE * 2];
+  size_t i;
+
+  if (raw) {
+    lua_pushlstring(L, (const char*)md, len);
+    return;
+  }
+  for (i = 0; i < len; i++) {
+    out[i * 2] = hex[md[i] >> 4];
+    out[i * 2 + 1] = hex[md[i] & 0xf];
+  }
+  lua_pushlstring(L, out, len * 2);
+}
+
+static int luv_digest_update_ctx(luv_digest_t* d, const char* data, size_t len) {
+  if (d->key) {
+    return EVP_DigestSignUpdate(d->ctx, data, len);
+  }
+  return EVP_DigestUpdate(d->ctx, data, len);
+}
+
+static int luv_digest_final_ctx(luv_digest_t* d) {
+  unsigned int len;
+  if (d->key) {
+    d->md_len = sizeof(d->md);
+    return EVP_DigestSignFinal(d->ctx, d->md, &d->md_len);
+  }
+  if (!EVP_DigestFinal_ex(d->ctx, d->md, &len)) {
+    return 0;
+  }
+  d->md_len = len;
+  return 1;
+}
+
+static luv_digest_t* luv_digest_check(lua_State* L) {
+  return (luv_digest_t*)luaL_checkudata(L, 1, "luv_digest");
+}
+
+/* The synchronous methods would overtake what's queued */
+static luv_digest_t* luv_digest_check_idle(lua_State* L) {
+  luv_digest_t* d = luv_digest_check(L);
+  if (d->head) {
+    luaL_error(L, "digest: asynchronous updates are pending");
+  }
+  if (d->finalized) {
+    luaL_error(L, "digest: already finalized");
+  }
+  return d;
+}
+
+static const EVP_MD* luv_digest_check_md(lua_State* L, int index) {
+  const char* name = luaL_checkstring(L, index);
+  const EVP_MD* md = EVP_get_digestbyname(name);
+  if (!md) {
+    luaL_error(L, "digest: unknown algorithm %s", name);
+  }
+  return md;
+}
+
+static luv_digest_t* luv_digest_create(lua_State* L) {
+  luv_digest_t* d = (luv_digest_t*)lua_newuserdata(L, sizeof(luv_digest_t));
+  memset(d, 0, sizeof(luv_digest_t));
+  luaL_getmetatable(L, "luv_digest");
+  lua_setmetatable(L, -2);
+  d->L = luv_get_main_thread(L);
+  d->ctx = EVP_MD_CTX_create();
+  if (!d->ctx) {
+    luaL_error(L, "digest: out of memory");
+  }
+  return d;
+}
+
+/* crypto.newDigest(alg) */
+static int luv_new_digest(lua_State* L) {
+  const EVP_MD* md = luv_digest_check_md(L, 1);
+  luv_digest_t* d = luv_digest_create(L);
+  if (!EVP_DigestInit_ex(d->ctx, md, NULL)) {
+    return luaL_error(L, "digest: init failed");
+  }
+  return 1;
+}
+
+/* crypto.newHmac(alg, key) */
+static int luv_new_hmac(lua_State* L) {
+  const EVP_MD* md = luv_digest_check_md(L, 1);
+  size_t key_len;
+  const char* key = luv_checkbuffer(L, 2, &key_len);
+  luv_digest_t* d = luv_digest_create(L);
+  d->key = EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, NULL,
+                                (const unsigned char*)key, key_len);
+  if (!d->key || !EVP_DigestSignInit(d->ctx, NULL, md, NULL, d->key)) {
+    return luaL_error(L, "digest: hmac init failed");
+  }
+  return 1;
+}
+
+/* digest:update(chunk) */
+static int luv_digest_update(lua_State* L) {
+  luv_digest_t* d = luv_digest_check_idle(L);
+  size_t len;
+  const char* data = luv_checkbuffer(L, 2, &len);
+  if (!luv_digest_update_ctx(d, data, len)) {
+    return luaL_error(L, "digest: update failed");
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* digest:final([raw]) returns the digest, hex encoded unless raw */
+static int luv_digest_final(lua_State* L) {
+  luv_digest_t* d = luv_digest_check_idle(L);
+  d->finalized = 1;
+  if (!luv_digest_final_ctx(d)) {
+    return luaL_error(L, "digest: final failed");
+  }
+  luv_digest_push_result(L, d->md, d->md_len, lua_toboolean(L, 2));
+  return 1;
+}
+
+/* Runs in the thread pool */
+static void luv_digest_work(uv_work_t* work) {
+  luv_digest_t* d = (luv_digest_t*)work->data;
+  luv_digest_op_t* op = d->head;
+  if (op->kind == LUV_DIGEST_UPDATE) {
+    d->ok = luv_digest_update_ctx(d, op->data, op->len);
+  } else {
+    d->ok = luv_digest_final_ctx(d);
+  }
+}
+
+static void luv_digest_after_work(uv_work_t* work, int status);
+
+/* Calls back every queued op with err, nothing would run them otherwise */
+static void luv_digest_fail(luv_digest_t* d, uv_err_t err) {
+  lua_State* L = d->L;
+  luv_digest_op_t* op = d->head;
+  luv_digest_op_t* next;
+
+  /* Callbacks may queue more, those start over on a list of their own */
+  d->head = d->tail = NULL;
+  for (; op; op = next) {
+    next = op->next;
+    luv_io_ctx_callback_rawgeti(L, &op->cbs);
+    luv_push_async_error(L, err, "digest", NULL);
+    luv_io_ctx_unref(L, &op->cbs);
+    free(op);
+    if (lua_isfunction(L, -2)) {
+      luv_acall(L, 1, 0, "digest_fail");
+    } else {
+      lua_pop(L, 2);
+    }
+  }
+}
+
+static void luv_digest_start(luv_digest_t* d, uv_loop_t* loop) {
+  if (d->busy || !d->head) return;
+  d->busy = 1;
+  d->work.data = d;
+  if (uv_queue_work(loop, &d->work, luv_digest_work, luv_digest_after_work)) {
+    d->busy = 0;
+    luv_digest_fail(d, uv_last_error(loop));
+  }
+}
+
+static void luv_digest_after_work(uv_work_t* work, int status) {
+  luv_digest_t* d = (luv_digest_t*)work->data;
+  luv_digest_op_t* op = d->head;
+  lua_State* L = d->L;
+  int nargs = 1;
+
+  d->head = op->next;
+  if (!d->head) d->tail = NULL;
+  d->busy = 0;
+
+  luv_io_ctx_callback_rawgeti(L, &op->cbs);
+  if (!d->ok) {
+    luv_push_async_error_raw(L, "EINVAL", op->kind == LUV_DIGEST_UPDATE ?
+      "digest update failed" : "digest final failed", "digest", NULL);
+  } else {
+    lua_pushnil(L);
+    if (op->kind != LUV_DIGEST_UPDATE) {
+      luv_digest_push_result(L, d->md, d->md_len,
+                             op->kind == LUV_DIGEST_FINAL_RAW);
+      nargs = 2;
+    }
+  }
+
+  /* Get the next one going before running the callback */
+  luv_digest_start(d, work->loop);
+  luv_io_ctx_unref(L, &op->cbs);
+  free(op);
+
+  if (lua_isfunction(L, -nargs - 1)) {
+    luv_acall(L, nargs, 0, "digest_after_work");
+  } else {
+    lua_pop(L, nargs + 1);
+  }
+}
+
+static void luv_digest_queue(lua_State* L, luv_digest_t* d, int kind,
+                             int chunk_index, int cb_index) {
+  luv_digest_op_t* op;
+  const char* data = NULL;
+  size_t len = 0;
+
+  if (chunk_index) {
+    data = luv_checkbuffer(L, chunk_index, &len);
+  }
+  op = (luv_digest_op_t*)malloc(sizeof(luv_digest_op_t));
+  if (!op) {
+    luaL_error(L, "digest: out of memory");
+  }
+  op->next = NULL;
+  op->kind = kind;
+  op->data = data;
+  op->len = len;
+  luv_io_ctx_init(&op->cbs);
+  luv_io_ctx_add(L, &op->cbs, 1);
+  if (chunk_index) {
+    luv_io_ctx_add(L, &op->cbs, chunk_index);
+  }
+  luv_io_ctx_callback_add(L, &op->cbs, cb_index);
+
+  if (d->tail) {
+    d->tail->next = op;
+  } else {
+    d->head = op;
+  }
+  d->tail = op;
+  luv_digest_start(d, luv_get_loop(L));
+}
+
+/* digest:updateAsync(chunk, [callback]) hashes chunk, a string or Buffer,
+ * on the thread pool without copying it.  Updates are applied in the order
+ * they're made, callback(err) runs once this one is.
+ */
+static int luv_digest_update_async(lua_State* L) {
+  luv_digest_t* d = luv_digest_check(L);
+  if (d->finalized) {
+    return luaL_error(L, "digest: already finalized");
+  }
+  luv_digest_queue(L, d, LUV_DIGEST_UPDATE, 2, 3);
+  return 0;
+}
+
+/* digest:finalAsync([raw], callback) calls back with (err, digest) after
+ * the updates queued before it
+ */
+static int luv_digest_final_async(lua_State* L) {
+  luv_digest_t* d = luv_digest_check(L);
+  int raw = 0;
+  int cb_index = 2;
+  if (lua_type(L, 2) != LUA_TFUNCTION) {
+    raw = lua_toboolean(L, 2);
+    cb_index = 3;
+  }
+  luaL_checktype(L, cb_index, LUA_TFUNCTION);
+  if (d->finalized) {
+    return luaL_error(L, "digest: already finalized");
+  }
+  d->finalized = 1;
+  luv_digest_queue(L, d, raw ? LUV_DIGEST_FINAL_RAW : LUV_DIGEST_FINAL, 0,
+                   cb_index);
+  return 0;
+}
+
+/* Number of queued updates and finals */
+static int luv_digest_pending(lua_State* L) {
+  luv_digest_t* d = luv_digest_check(L);
+  luv_digest_op_t* op;
+  int n = 0;
+  for (op = d->head; op; op = op->next) n++;
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+static int luv_digest_gc(lua_State* L) {
+  luv_digest_t* d = luv_digest_check(L);
+  /* Queued ops pin the digest, so nothing can be running here */
+  if (d->ctx) EVP_MD_CTX_destroy(d->ctx);
+  if (d->key) EVP_PKEY_free(d->key);
+  d->ctx = NULL;
+  d->key = NULL;
+  return 0;
+}
+
+typedef struct {
+  uv_work_t work;
+  luv_io_ctx_t cbs;
+  lua_State* L;
+  const EVP_MD* md;
+  char* path;
+  int err;             /* errno of what went wrong */
+  unsigned char md_value[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  double size;
+} luv_hash_file_t;
+
+static void luv_hash_file_push_error(lua_State* L, luv_hash_file_t* h) {
+  uv_err_t err;
+  memset(&err, 0, sizeof err);
+#ifndef _WIN32
+  err.code = uv_translate_sys_error(h->err);
+#else
+  err.code = UV_EIO;
+#endif
+  err.sys_errno_ = h->err;
+  luv_push_async_error(L, err, "hashFile", h->path);
+}
+
+/* Runs in the thread pool, reading and hashing the whole file */
+static void luv_hash_file_work(uv_work_t* work) {
+  luv_hash_file_t* h = (luv_hash_file_t*)work->data;
+  EVP_MD_CTX* ctx = NULL;
+  char* buf = NULL;
+  FILE* file;
+  size_t n;
+
+  file = fopen(h->path, "rb");
+  if (!file) {
+    h->err = errno;
+    return;
+  }
+  buf = malloc(LUV_DIGEST_READ_SIZE);
+  ctx = EVP_MD_CTX_create();
+  if (!buf || !ctx || !EVP_DigestInit_ex(ctx, h->md, NULL)) {
+    h->err = ENOMEM;
+    goto done;
+  }
+  while ((n = fread(buf, 1, LUV_DIGEST_READ_SIZE, file)) > 0) {
+    EVP_DigestUpdate(ctx, buf, n);
+    h->size += n;
+  }
+  if (ferror(file)) {
+    h->err = errno ? errno : EIO;
+    goto done;
+  }
+  EVP_DigestFinal_ex(ctx, h->md_value, &h->md_len);
+
+done:
+  if (ctx) EVP_MD_CTX_destroy(ctx);
+  free(buf);
+  fclose(file);
+}
+
+static void luv_hash_file_after_work(uv_work_t* work, int status) {
+  luv_hash_file_t* h = (luv_hash_file_t*)work->data;
+  lua_State* L = h->L;
+
+  luv_io_ctx_callback_rawgeti(L, &h->cbs);
+  luv_io_ctx_unref(L, &h->cbs);
+  if (h->err) {
+    luv_hash_file_push_error(L, h);
+    lua_pushnil(L);
+    lua_pushnil(L);
+  } else {
+    lua_pushnil(L);
+    luv_digest_push_result(L, h->md_value, h->md_len, 0);
+    lua_pushnumber(L, h->size);
+  }
+  free(h->path);
+  free(h);
+  luv_acall(L, 3, 0, "hash_file_after_work");
+}
+
+/* crypto.hashFile(path, alg, callback) reads and hashes path on the thread
+ * pool and calls back with (err, hexdigest, size)
+ */
+static int luv_hash_file(lua_State* L) {
+  size_t path_len;
+  const char* path = luaL_checklstring(L, 1, &path_len);
+  const EVP_MD* md = luv_digest_check_md(L, 2);
+  uv_loop_t* loop = luv_get_loop(L);
+  luv_hash_file_t* h;
+
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  h = (luv_hash_file_t*)malloc(sizeof(luv_hash_file_t));
+  if (!h) {
+    return luaL_error(L, "hashFile: out of memory");
+  }
+  memset(h, 0, sizeof(luv_hash_file_t));
+  h->path = malloc(path_len + 1);
+  if (!h->path) {
+    free(h);
+    return luaL_error(L, "hashFile: out of memory");
+  }
+  memcpy(h->path, path, path_len + 1);
+  h->md = md;
+  h->L = luv_get_main_thread(L);
+  h->work.data = h;
+  luv_io_ctx_init(&h->cbs);
+  luv_io_ctx_callback_add(L, &h->cbs, 3);
+
+  if (uv_queue_work(loop, &h->work, luv_hash_file_work,
+                    luv_hash_file_after_work)) {
+    luv_io_ctx_unref(L, &h->cbs);
+    free(h->path);
+    free(h);
+    return luaL_error(L, "hashFile: uv_queue_work: %s",
+      uv_strerror(uv_last_error(loop)));
+  }
+  return 0;
+}
+
+static const luaL_Reg luv_digest_methods[] = {
+  {"update", luv_digest_update},
+  {"final", luv_digest_final},
+  {"updateAsync", luv_digest_update_async},
+  {"finalAsync", luv_digest_final_async},
+  {"pending", luv_digest_pending},
+  {NULL, NULL}
+};
+
+void luv_digest_open(lua_State *L, int index) {
+  index = index < 0 ? lua_gettop(L) + index + 1 : index;
+
+  luaL_newmetatable(L, "luv_digest");
+  lua_newtable(L);
+  luaL_register(L, NULL, luv_digest_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, luv_digest_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  lua_pushcfunction(L, luv_new_digest);
+  lua_setfield(L, index, "newDigest");
+  lua_pushcfunction(L, luv_new_hmac);
+  lua_setfield(L, index, "newHmac");
+  lua_pushcfunction(L, luv_hash_file);
+  lua_setfield(L, index, "hashFile");
+}
@@ -0,0 +1,29 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_DIGEST
+#define LUV_DIGEST
+
+#include "lua.h"
+#include "lauxlib.h"
+
+/* Adds newDigest, newHmac and hashFile to the _crypto table at index.  They
+ * hash on the thread pool so big inputs don't hold up the loop.
+ */
+void luv_digest_open(lua_State *L, int index);
+
+#endif
@@ -25,22 +25,48 @@
 #include "tree.h"
 #include "utils.h"
 
-static ares_channel luv_ares_channel;
-static uv_timer_t ares_timer;
+
+/* Most TTLs reported for a single A or AAAA reply */
+#define LUV_DNS_MAX_TTLS 32
 
 typedef struct {
   lua_State* L;
+  uv_loop_t* loop;
   int r;
   uv_getaddrinfo_t handle;
 } luv_dns_ref_t;
 
+typedef struct luv_ares_s luv_ares_t;
+
 typedef struct ares_task_t {
   UV_HANDLE_FIELDS
   ares_socket_t sock;
   uv_poll_t poll_watcher;
+  luv_ares_t* ares;
   RB_ENTRY(ares_task_t) node;
 } ares_task_t;
 
+RB_HEAD(ares_task_list, ares_task_t);
+
+/* Each loop that makes queries gets a channel of its own, with the timer
+ * and the sockets it polls for it.
+ */
+struct luv_ares_s {
+  ares_channel channel;
+  uv_timer_t timer;
+  struct ares_task_list tasks;
+  uv_loop_t* loop;
+};
+
+/* ares_library_init isn't thread safe, loops on other threads share it */
+static uv_once_t luv_ares_library_once = UV_ONCE_INIT;
+
+static void luv_ares_library_init(void) {
+  int r = ares_library_init(ARES_LIB_INIT_ALL);
+  assert(r == ARES_SUCCESS);
+  (void)r;
+}
+
 #ifndef offset_of
 # define offset_of(type, member) \
   ((intptr_t)( \
@@ -53,9 +79,6 @@ typedef struct ares_task_t {
                            offset_of(type, member)))
 #endif
 
-/* ares tree task list */
-static RB_HEAD(ares_task_list, ares_task_t) ares_tasks;
-
 /* ares_tasks tree sort */
 static int cmp_ares_tasks(const ares_task_t* a, const ares_task_t* b) {
   if (a->sock < b->sock) return -1;
@@ -70,26 +93,28 @@ RB_GENERATE_STATIC(ares_task_list, ares_task_t, node, cmp_ares_tasks);
 /* This is called once per second by loop->timer. It is used to constantly */
 /* call back into c-ares for possibly processing timeouts. */
 static void luv_ares_timeout(uv_timer_t* handle, int status) {
-  assert(!RB_EMPTY(&ares_tasks));
-  ares_process_fd(luv_ares_channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+  luv_ares_t* ares = handle->data;
+  assert(!RB_EMPTY(&ares->tasks));
+  ares_process_fd(ares->channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
 }
 
 
 static void luv_ares_poll_cb(uv_poll_t* watcher, int status, int events) {
   ares_task_t* task = container_of(watcher, ares_task_t, poll_watcher);
+  luv_ares_t* ares = task->ares;
 
   /* Reset the idle timer */
-  uv_timer_again(&ares_timer);
+  uv_timer_again(&ares->timer);
 
   if (status < 0) {
     /* An error happened. Just pretend that the socket is both readable and */
     /* writable. */
-    ares_process_fd(luv_ares_channel, task->sock, task->sock);
+    ares_process_fd(ares->channel, task->sock, task->sock);
     return;
   }
 
   /* Process DNS responses */
-  ares_process_fd(luv_ares_channel,
+  ares_process_fd(ares->channel,
                   events & UV_READABLE ? task->sock : ARES_SOCKET_BAD,
                   events & UV_WRITABLE ? task->sock : ARES_SOCKET_BAD);
 }
@@ -102,7 +127,7 @@ static void ares_poll_close_cb(uv_handle_t* watcher) {
 
 
 /* Allocates and returns a new ares_task_t */
-static ares_task_t* ares_task_create(uv_loop_t* loop, ares_socket_t sock) {
+static ares_task_t* ares_task_create(luv_ares_t* ares, ares_socket_t sock) {
   ares_task_t* task = (ares_task_t*)(malloc(sizeof(*task)));
 
   if (task == NULL) {
@@ -110,10 +135,11 @@ static ares_task_t* ares_task_create(uv_loop_t* loop, ares_socket_t sock) {
     return NULL;
   }
 
-  task->loop = loop;
+  task->loop = ares->loop;
   task->sock = sock;
+  task->ares = ares;
 
-  if (uv_poll_init_socket(loop, &task->poll_watcher, sock) < 0) {
+  if (uv_poll_init_socket(ares->loop, &task->poll_watcher, sock) < 0) {
     /* This should never happen. */
     free(task);
     return NULL;
@@ -128,24 +154,24 @@ static void ares_sockstate_cb(void* data,
                               ares_socket_t sock,
                               int read,
                               int write) {
-  uv_loop_t* loop = (uv_loop_t*)(data);
+  luv_ares_t* ares = (luv_ares_t*)(data);
   ares_task_t* task;
 
   ares_task_t lookup_task;
   lookup_task.sock = sock;
-  task = RB_FIND(ares_task_list, &ares_tasks, &lookup_task);
+  task = RB_FIND(ares_task_list, &ares->tasks, &lookup_task);
 
   if (read || write) {
     if (!task) {
       /* New socket */
 
       /* If this is the first socket then start the timer. */
-      if (!uv_is_active((uv_handle_t*)(&ares_timer))) {
-        assert(RB_EMPTY(&ares_tasks));
-        uv_timer_start(&ares_timer, luv_ares_timeout, 1000, 1000);
+      if (!uv_is_active((uv_handle_t*)(&ares->timer))) {
+        assert(RB_EMPTY(&ares->tasks));
+        uv_timer_start(&ares->timer, luv_ares_timeout, 1000, 1000);
       }
 
-      task = ares_task_create(loop, sock);
+      task = ares_task_create(ares, sock);
       if (task == NULL) {
         /* This should never happen unless we're out of memory or something */
         /* is seriously wrong. The socket won't be polled, but the the query */
@@ -153,7 +179,7 @@ static void ares_sockstate_cb(void* data,
         return;
       }
 
-      RB_INSERT(ares_task_list, &ares_tasks, task);
+      RB_INSERT(ares_task_list, &ares->tasks, task);
     }
 
     /* This should never fail. If it fails anyway, the query will eventually */
@@ -169,12 +195,12 @@ static void ares_sockstate_cb(void* data,
     assert(task &&
            "When an ares socket is closed we should have a handle for it");
 
-    RB_REMOVE(ares_task_list, &ares_tasks, task);
+    RB_REMOVE(ares_task_list, &ares->tasks, task);
     uv_close((uv_handle_t*)(&task->poll_watcher),
              ares_poll_close_cb);
 
-    if (RB_EMPTY(&ares_tasks)) {
-      uv_timer_stop(&ares_timer);
+    if (RB_EMPTY(&ares->tasks)) {
+      uv_timer_stop(&ares->timer);
     }
   }
 }
@@ -185,27 +211,32 @@ void luv_dns_initialize(lua_State *L) {
   int r;
   struct ares_options options;
   uv_loop_t* loop = luv_get_loop(L);
+  luv_ares_t* ares;
 
-  r = ares_library_init(ARES_LIB_INIT_ALL);
-  assert(r == ARES_SUCCESS);
+  uv_once(&luv_ares_library_once, luv_ares_library_init);
+
+  ares = calloc(1, sizeof(*ares));
+  ares->loop = loop;
+  RB_INIT(&ares->tasks);
 
   memset(&options, 0, sizeof(options));
   options.flags = ARES_FLAG_NOCHECKRESP;
   options.sock_state_cb = ares_sockstate_cb;
-  options.sock_state_cb_data = loop;
+  options.sock_state_cb_data = ares;
 
   /* We do the call to ares_init_option for caller. */
-  r = ares_init_options(&luv_ares_channel,
+  r = ares_init_options(&ares->channel,
                         &options,
                         ARES_OPT_FLAGS | ARES_OPT_SOCK_STATE_CB);
   assert(r == ARES_SUCCESS);
 
   /* store channel */
-  luv_set_ares_channel(L, luv_ares_channel);
+  luv_set_ares_channel(L, ares->channel);
 
   /* Initialize the timeout timer. The timer won't be started until the */
   /* first socket is opened. */
-  uv_timer_init(loop, &ares_timer);
+  uv_timer_init(loop, &ares->timer);
+  ares->timer.data = ares;
 }
 
 
@@ -215,6 +246,8 @@ static luv_dns_ref_t* luv_dns_store_callback(lua_State* L, int index) {
 
   ref = calloc(1, sizeof(luv_dns_ref_t));
   ref->L = L;
+  ref->loop = luv_get_loop(L);
+  luv_req_stats_start(ref->loop, LUV_REQ_DNS);
   if (lua_isfunction(L, index)) {
     lua_pushvalue(L, index); /* Store the callback */
     ref->r = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -225,6 +258,7 @@ static luv_dns_ref_t* luv_dns_store_callback(lua_State* L, int index) {
 static void luv_dns_ref_cleanup(luv_dns_ref_t *ref)
 {
   assert(ref != NULL);
+  luv_req_stats_end(ref->loop, LUV_REQ_DNS);
   free(ref);
 }
 
@@ -259,6 +293,17 @@ static void luv_aliases_to_array(lua_State *L, struct hostent *host)
 }
 
 /* From NodeJS */
+/* The TTL of each address in a reply, in seconds */
+static void luv_ttls_to_array(lua_State *L, const int *ttls, int count)
+{
+  int i;
+  lua_createtable(L, count, 0);
+  for (i = 0; i < count; i++) {
+    lua_pushnumber(L, ttls[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
 static const char* ares_errno_string(int errorno)
 {
   switch (errorno) {
@@ -301,6 +346,18 @@ static void luv_push_gai_async_error(lua_State *L, int status, const char* sourc
   snprintf(code_str, sizeof(code_str), "%i", status);
   /* NOTE: gai_strerror() is _not_ threadsafe on Windows */
   luv_push_async_error_raw(L, code_str, gai_strerror(status), source, NULL);
+  /* Worth asking again soon, as opposed to a name that doesn't exist */
+  switch (status) {
+    case EAI_AGAIN:
+    case EAI_FAIL:
+    case EAI_MEMORY:
+#ifdef EAI_SYSTEM
+    case EAI_SYSTEM:
+#endif
+      lua_pushboolean(L, 1);
+      lua_setfield(L, -2, "transient");
+      break;
+  }
   if (lua_isfunction(L, 3) == 1) {
     luv_acall(L, 1, 0, "dns_after");
   }
@@ -312,6 +369,19 @@ static void luv_push_ares_async_error(lua_State* L, int rc, const char* source)
   char code_str[32];
   snprintf(code_str, sizeof(code_str), "%i", rc);
   luv_push_async_error_raw(L, code_str, ares_errno_string(rc), source, NULL);
+  /* Worth asking again soon, as opposed to a name that doesn't exist */
+  switch (rc) {
+    case ARES_ESERVFAIL:
+    case ARES_EREFUSED:
+    case ARES_ECONNREFUSED:
+    case ARES_ETIMEOUT:
+    case ARES_ENOMEM:
+    case ARES_EDESTRUCTION:
+    case ARES_ECANCELLED:
+      lua_pushboolean(L, 1);
+      lua_setfield(L, -2, "transient");
+      break;
+  }
   luv_acall(L, 1, 0, "dns_after");
 }
 
@@ -320,7 +390,10 @@ static void queryA_callback(void *arg, int status, int timeouts,
 {
   luv_dns_ref_t *ref = arg;
   struct hostent* host;
-  int rc;
+  struct ares_addrttl addrttls[LUV_DNS_MAX_TTLS];
+  int ttls[LUV_DNS_MAX_TTLS];
+  int naddrttls = LUV_DNS_MAX_TTLS;
+  int rc, i;
 
   luv_dns_get_callback(ref);
 
@@ -333,15 +406,20 @@ static void queryA_callback(void *arg, int status, int timeouts,
     goto cleanup;
   }
 
-  rc = ares_parse_a_reply(buf, len, &host, NULL, NULL);
+  rc = ares_parse_a_reply(buf, len, &host, addrttls, &naddrttls);
   if (rc != ARES_SUCCESS) {
     luv_push_ares_async_error(ref->L, rc, "queryA");
     goto cleanup;
   }
 
+  for (i = 0; i < naddrttls; i++) {
+    ttls[i] = addrttls[i].ttl;
+  }
+
   lua_pushnil(ref->L);
   luv_addresses_to_array(ref->L, host);
-  luv_acall(ref->L, 2, 0, "dns_after");
+  luv_ttls_to_array(ref->L, ttls, naddrttls);
+  luv_acall(ref->L, 3, 0, "dns_after");
   ares_free_hostent(host);
 
 cleanup:
@@ -362,7 +440,10 @@ static void queryAaaa_callback(void *arg, int status, int timeouts,
 {
   luv_dns_ref_t *ref = arg;
   struct hostent* host;
-  int rc;
+  struct ares_addr6ttl addrttls[LUV_DNS_MAX_TTLS];
+  int ttls[LUV_DNS_MAX_TTLS];
+  int naddrttls = LUV_DNS_MAX_TTLS;
+  int rc, i;
 
   luv_dns_get_callback(ref);
 
@@ -375,15 +456,20 @@ static void queryAaaa_callback(void *arg, int status, int timeouts,
     goto cleanup;
   }
 
-  rc = ares_parse_aaaa_reply(buf, len, &host, NULL, NULL);
+  rc = ares_parse_aaaa_reply(buf, len, &host, addrttls, &naddrttls);
   if (rc != ARES_SUCCESS) {
     luv_push_ares_async_error(ref->L, rc, "queryAaaa");
     goto cleanup;
   }
 
+  for (i = 0; i < naddrttls; i++) {
+    ttls[i] = addrttls[i].ttl;
+  }
+
   lua_pushnil(ref->L);
   luv_addresses_to_array(ref->L, host);
-  luv_acall(ref->L, 2, 0, "dns_after");
+  luv_ttls_to_array(ref->L, ttls, naddrttls);
+  luv_acall(ref->L, 3, 0, "dns_after");
   ares_free_hostent(host);
 
 cleanup:
@@ -23,6 +23,12 @@
 #include <sys/stat.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #endif
 
 #include "luv_fs.h"
@@ -141,10 +147,16 @@ int luv_process_fs_result(lua_State* L, uv_fs_t* req) {
         break;
 
       case UV_FS_READ:
-        argc = 2;
-        lua_pushlstring(L, ref->buf, req->result);
-        lua_pushinteger(L, req->result);
-        free(ref->buf);
+        if (ref->buf) {
+          argc = 2;
+          lua_pushlstring(L, ref->buf, req->result);
+          lua_pushinteger(L, req->result);
+          free(ref->buf);
+        } else {
+          /* Read into a Buffer that's already the caller's */
+          argc = 1;
+          lua_pushinteger(L, req->result);
+        }
         break;
 
       case UV_FS_READDIR:
@@ -185,6 +197,7 @@ void luv_after_fs(uv_fs_t* req) {
 
   argc = luv_process_fs_result(L, req);
 
+  luv_req_stats_end(req->loop, LUV_REQ_FS);
   luv_acall(L, argc + 1, 0, "fs_after");
 
   uv_fs_req_cleanup(req);
@@ -216,6 +229,7 @@ uv_fs_t* luv_fs_store_callback(lua_State* L, int index) {
         luv_push_async_error(L, err, #func, path);                            \
         return lua_error(L);                                                  \
       }                                                                       \
+      luv_req_stats_start(luv_get_loop(L), LUV_REQ_FS);                       \
       return 0;                                                               \
     }                                                                         \
     if (uv_fs_##func(luv_get_loop(L), req, __VA_ARGS__, NULL) < 0) {        \
@@ -243,6 +257,10 @@ int luv_fs_close(lua_State* L) {
   FS_CALL(close, 2, NULL, file);
 }
 
+/* fsRead(fd, position, length, [callback]) reads into a new string.
+ * fsRead(fd, position, buffer, offset, length, [callback]) reads into the
+ * Buffer at offset, a zero based byte index, and only gives back the count.
+ */
 int luv_fs_read(lua_State* L) {
   uv_file file = luaL_checkint(L, 1);
   int offset = -1;
@@ -252,6 +270,27 @@ int luv_fs_read(lua_State* L) {
   if (!lua_isnil(L, 2)) {
     offset = luaL_checkint(L, 2);
   }
+  if (luv_isbuffer(L, 3)) {
+    size_t cap;
+    char* base = luv_checkwritablebuffer(L, 3, &cap);
+    int buf_offset = luaL_checkint(L, 4);
+    luv_fs_ref_t* ref;
+    length = luaL_checkint(L, 5);
+    luaL_argcheck(L, buf_offset >= 0 && (size_t)buf_offset <= cap, 4,
+                  "offset out of bounds");
+    luaL_argcheck(L, length >= 0 && (size_t)length <= cap - buf_offset, 5,
+                  "length out of bounds");
+    ref = luv_fs_ref_alloc(L);
+    luv_io_ctx_init(&ref->cbs);
+    /* The Buffer must outlive a read in the thread pool */
+    if (lua_isfunction(L, 6)) {
+      luv_io_ctx_add(L, &ref->cbs, 3);
+    }
+    luv_io_ctx_callback_add(L, &ref->cbs, 6);
+    ref->buf = NULL;
+    req = &ref->fs_req;
+    FS_CALL(read, 6, NULL, file, base + buf_offset, length, offset);
+  }
   length = luaL_checkint(L, 3);
   req = luv_fs_store_callback(L, 4);
   buf = malloc(length);
@@ -259,20 +298,220 @@ int luv_fs_read(lua_State* L) {
   FS_CALL(read, 4, NULL, file, buf, length, offset);
 }
 
+/* fsWrite(fd, position, data, [callback]) writes a string or Buffer.
+ * fsWrite(fd, position, data, offset, length, [callback]) writes length bytes
+ * of it from the zero based offset, without making a substring.
+ */
 int luv_fs_write(lua_State* L) {
   uv_file file = luaL_checkint(L, 1);
   off_t offset = luaL_checkint(L, 2);
   size_t length;
   uv_fs_t* req;
-  void* chunk = (void*)luaL_checklstring(L, 3, &length);
-  luv_fs_ref_t* ref = luv_fs_ref_alloc(L);
+  const char* chunk = luv_checkbuffer(L, 3, &length);
+  int cb_index = 4;
+  luv_fs_ref_t* ref;
+  if (lua_type(L, 4) == LUA_TNUMBER) {
+    int src_offset = luaL_checkint(L, 4);
+    int src_length = luaL_checkint(L, 5);
+    luaL_argcheck(L, src_offset >= 0 && (size_t)src_offset <= length, 4,
+                  "offset out of bounds");
+    luaL_argcheck(L, src_length >= 0 && (size_t)src_length <= length - src_offset, 5,
+                  "length out of bounds");
+    chunk += src_offset;
+    length = src_length;
+    cb_index = 6;
+  }
+  ref = luv_fs_ref_alloc(L);
   luv_io_ctx_init(&ref->cbs);
   luv_io_ctx_add(L, &ref->cbs, 3);
-  luv_io_ctx_callback_add(L, &ref->cbs, 4);
+  luv_io_ctx_callback_add(L, &ref->cbs, cb_index);
   req = &ref->fs_req;
-  FS_CALL(write, 4, NULL, file, chunk, length, offset);
+  FS_CALL(write, cb_index, NULL, file, (void*)chunk, length, offset);
+}
+
+#ifndef _WIN32
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* fsWritev state, the iovecs follow it in the same allocation */
+typedef struct {
+  lua_State* L;
+  uv_file fd;
+  double position;      /* -1 writes at the current position */
+  struct iovec* iov;
+  int iovcnt;
+  double written;
+  int errorno;          /* errno of a failed write, 0 if none */
+} luv_fs_writev_t;
+
+/* Writes everything, picking up after short writes.  Runs in the thread
+ * pool, or right away without a callback.
+ */
+static void luv_fs_writev_run(luv_fs_writev_t* w) {
+  struct iovec* iov = w->iov;
+  int cnt = w->iovcnt;
+  ssize_t n;
+
+  while (cnt > 0) {
+    int batch = cnt < IOV_MAX ? cnt : IOV_MAX;
+    if (w->position < 0) {
+      n = writev(w->fd, iov, batch);
+    } else {
+#ifdef __linux__
+      n = pwritev(w->fd, iov, batch, (off_t)(w->position + w->written));
+#else
+      n = pwrite(w->fd, iov->iov_base, iov->iov_len, (off_t)(w->position + w->written));
+#endif
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      w->errorno = errno;
+      return;
+    }
+    w->written += n;
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+static int luv_fs_writev_push(lua_State* L, luv_fs_writev_t* w) {
+  if (w->errorno) {
+    uv_err_t err;
+    memset(&err, 0, sizeof err);
+    err.code = uv_translate_sys_error(w->errorno);
+    luv_push_async_error(L, err, "writev", NULL);
+    return 1;
+  }
+  lua_pushnil(L);
+  lua_pushnumber(L, w->written);
+  return 2;
+}
+
+static void luv_fs_writev_work(uv_work_t* work) {
+  luv_fs_writev_run(work->data);
+}
+
+static void luv_fs_writev_after(uv_work_t* work, int status) {
+  luv_req_t* req = (luv_req_t*)work;
+  luv_fs_writev_t* w = work->data;
+  lua_State* L = w->L;
+  int argc;
+
+  luv_io_ctx_callback_rawgeti(L, &req->cbs);
+  argc = luv_fs_writev_push(L, w);
+  /* Let go of the chunks only once they're written */
+  luv_io_ctx_unref(L, &req->cbs);
+  luv_req_release(work->loop, req);
+  free(w);
+
+  luv_acall(L, argc, 0, "fs_after");
+}
+
+/* fsWritev(fd, position, chunks, [callback]) writes a list of strings and
+ * Buffers with as few syscalls as it can, as a single thread pool request.
+ * Gives back the total written.
+ */
+int luv_fs_writev(lua_State* L) {
+  uv_file file = luaL_checkint(L, 1);
+  double position = luaL_checknumber(L, 2);
+  uv_loop_t* loop = luv_get_loop(L);
+  int count, i, argc;
+  luv_fs_writev_t* w;
+  luv_req_t* req;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 5);
+  count = lua_objlen(L, 3);
+  w = malloc(sizeof(*w) + count * sizeof(struct iovec));
+  if (!w) {
+    return luaL_error(L, "writev: out of memory");
+  }
+  memset(w, 0, sizeof(*w));
+  w->L = luv_get_main_thread(L);
+  w->fd = file;
+  w->position = position;
+  w->iov = (struct iovec*)(w + 1);
+  w->iovcnt = count;
+
+  /* A queued write pins its chunks in the req, numbers as the strings they
+   * are converted to.  A blocking write only needs those strings kept, in
+   * a table at 5, and leaves the caller's list as it was.
+   */
+  if (lua_isfunction(L, 4)) {
+    req = luv_req_alloc(loop, LUV_REQ_FS);
+    if (!req) {
+      free(w);
+      luv_push_async_error(L, uv_last_error(loop), "writev", NULL);
+      return lua_error(L);
+    }
+  } else {
+    req = NULL;
+  }
+  for (i = 0; i < count; i++) {
+    size_t len;
+    int is_number;
+    lua_rawgeti(L, 3, i + 1);
+    is_number = lua_type(L, -1) == LUA_TNUMBER;
+    if (!lua_isstring(L, -1) && !luv_isbuffer(L, -1)) {
+      free(w);
+      if (req) {
+        luv_io_ctx_unref(L, &req->cbs);
+        luv_req_release(loop, req);
+      }
+      return luaL_argerror(L, 3, "chunks must be strings or Buffers");
+    }
+    w->iov[i].iov_base = (void*)luv_checkbuffer(L, -1, &len);
+    w->iov[i].iov_len = len;
+    if (req) {
+      luv_io_ctx_add(L, &req->cbs, -1);
+    } else if (is_number) {
+      if (lua_isnil(L, 5)) {
+        lua_newtable(L);
+        lua_replace(L, 5);
+      }
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, 5, i + 1);
+    }
+    lua_pop(L, 1);
+  }
+
+  if (!req) {
+    luv_fs_writev_run(w);
+    argc = luv_fs_writev_push(L, w);
+    free(w);
+    if (argc == 1) {
+      return lua_error(L);
+    }
+    lua_remove(L, -argc);
+    return argc - 1;
+  }
+
+  luv_io_ctx_callback_add(L, &req->cbs, 4);
+  req->uv.work.data = w;
+  if (uv_queue_work(loop, &req->uv.work, luv_fs_writev_work, luv_fs_writev_after)) {
+    uv_err_t err = uv_last_error(loop);
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_req_release(loop, req);
+    free(w);
+    luv_push_async_error(L, err, "writev", NULL);
+    return lua_error(L);
+  }
+  return 0;
 }
 
+#endif
+
 int luv_fs_unlink(lua_State* L) {
   const char* path = luaL_checkstring(L, 1);
   uv_fs_t* req = luv_fs_store_callback(L, 2);
@@ -340,8 +579,8 @@ int luv_fs_ftruncate(lua_State* L) {
 int luv_fs_sendfile(lua_State* L) {
   uv_file out_fd = luaL_checkint(L, 1);
   uv_file in_fd = luaL_checkint(L, 2);
-  off_t in_offset = luaL_checkint(L, 3);
-  size_t length = luaL_checkint(L, 4);
+  off_t in_offset = (off_t)luaL_checknumber(L, 3);
+  size_t length = (size_t)luaL_checknumber(L, 4);
   uv_fs_t* req = luv_fs_store_callback(L, 5);
   FS_CALL(sendfile, 5, NULL, out_fd, in_fd, in_offset, length);
 }
@@ -419,3 +658,565 @@ int luv_fs_fchown(lua_State* L) {
   FS_CALL(fchown, 4, NULL, file, uid, gid);
 }
 
+
+/* Chunk size for reading files whose size fstat doesn't tell, like pipes */
+#define LUV_READ_FILE_CHUNK 65536
+
+/* fsReadFile state.  The file is opened, fstat'd and read into a single
+ * allocation sized from the stat, or mapped, then closed.  The same steps
+ * run with or without a callback.
+ */
+typedef struct {
+  lua_State* L;
+  uv_fs_t req;
+  luv_io_ctx_t cbs;
+  char* path;
+  int async;
+  int use_mmap;
+  uv_file fd;
+  int regular;          /* a short read means EOF */
+  char* buf;
+  size_t cap;
+  size_t len;
+  void* map;            /* the file mapped read-only, instead of buf */
+  int errorno;          /* first error, 0 while all is well */
+  const char* syscall;  /* what failed */
+  int done;
+} luv_read_file_t;
+
+static void luv_read_file_after(uv_fs_t* req);
+
+/* Called after each uv_fs call.  Without a callback the call already ran,
+ * so handle it right away.
+ */
+static void luv_read_file_issued(luv_read_file_t* rf, int r) {
+  if (rf->async && r >= 0) {
+    return;
+  }
+  if (rf->async) {
+    /* It never got queued */
+    rf->req.result = -1;
+    rf->req.errorno = uv_last_error(luv_get_loop(rf->L)).code;
+  }
+  luv_read_file_after(&rf->req);
+}
+
+static void luv_read_file_read(luv_read_file_t* rf) {
+  int r = uv_fs_read(luv_get_loop(rf->L), &rf->req, rf->fd, rf->buf + rf->len,
+    rf->cap - rf->len, rf->len, rf->async ? luv_read_file_after : NULL);
+  luv_read_file_issued(rf, r);
+}
+
+static int luv_read_file_push(lua_State* L, luv_read_file_t* rf) {
+  if (rf->errorno) {
+    uv_err_t err;
+    memset(&err, 0, sizeof err);
+    err.code = (uv_err_code)rf->errorno;
+    luv_push_async_error(L, err, rf->syscall, rf->path);
+    return 1;
+  }
+  lua_pushnil(L);
+  if (rf->map) {
+    /* The mapping is Lua's to unmap from now on */
+    lua_pushlightuserdata(L, rf->map);
+    lua_pushnumber(L, rf->len);
+    rf->map = NULL;
+    return 3;
+  }
+  lua_pushlstring(L, rf->buf ? rf->buf : "", rf->len);
+  return 2;
+}
+
+static void luv_read_file_free(luv_read_file_t* rf) {
+#ifndef _WIN32
+  if (rf->map) {
+    munmap(rf->map, rf->len);
+  }
+#endif
+  free(rf->buf);
+  free(rf->path);
+  free(rf);
+}
+
+static void luv_read_file_finish(luv_read_file_t* rf) {
+  lua_State* L = rf->L;
+  int argc;
+
+  rf->done = 1;
+  if (!rf->async) {
+    return;
+  }
+
+  luv_io_ctx_callback_rawgeti(L, &rf->cbs);
+  luv_io_ctx_unref(L, &rf->cbs);
+  argc = luv_read_file_push(L, rf);
+  luv_read_file_free(rf);
+  luv_req_stats_end(luv_get_loop(L), LUV_REQ_FS);
+  luv_acall(L, argc, 0, "fs_after");
+}
+
+static void luv_read_file_close(luv_read_file_t* rf) {
+  uv_file fd = rf->fd;
+  int r;
+
+  if (fd < 0) {
+    luv_read_file_finish(rf);
+    return;
+  }
+  rf->fd = -1;
+  r = uv_fs_close(luv_get_loop(rf->L), &rf->req, fd,
+    rf->async ? luv_read_file_after : NULL);
+  luv_read_file_issued(rf, r);
+}
+
+static void luv_read_file_fail(luv_read_file_t* rf, int errorno, const char* syscall) {
+  if (!rf->errorno) {
+    rf->errorno = errorno;
+    rf->syscall = syscall;
+  }
+  luv_read_file_close(rf);
+}
+
+static void luv_read_file_after(uv_fs_t* req) {
+  luv_read_file_t* rf = req->data;
+  uv_fs_type type = req->fs_type;
+  ssize_t result = req->result;
+  uv_statbuf_t* s;
+  size_t size;
+  int r;
+
+  if (result == -1) {
+    int errorno = req->errorno;
+    uv_fs_req_cleanup(req);
+    luv_read_file_fail(rf, errorno,
+      type == UV_FS_OPEN ? "open" :
+      type == UV_FS_FSTAT ? "fstat" :
+      type == UV_FS_READ ? "read" : "close");
+    return;
+  }
+
+  switch (type) {
+    case UV_FS_OPEN:
+      uv_fs_req_cleanup(req);
+      rf->fd = result;
+      r = uv_fs_fstat(luv_get_loop(rf->L), req, rf->fd,
+        rf->async ? luv_read_file_after : NULL);
+      luv_read_file_issued(rf, r);
+      return;
+
+    case UV_FS_FSTAT:
+      s = req->ptr;
+      rf->regular = S_ISREG(s->st_mode);
+      size = s->st_size;
+      uv_fs_req_cleanup(req);
+#ifndef _WIN32
+      if (rf->use_mmap && rf->regular && size > 0) {
+        rf->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, rf->fd, 0);
+        if (rf->map != MAP_FAILED) {
+          rf->len = size;
+          luv_read_file_close(rf);
+          return;
+        }
+        /* Fall back to reading it */
+        rf->map = NULL;
+      }
+#endif
+      /* One byte over the size, so a single read both fills the buffer and
+       * shows whether the file grew since the stat */
+      rf->cap = rf->regular && size > 0 ? size + 1 : LUV_READ_FILE_CHUNK;
+      rf->buf = malloc(rf->cap);
+      if (!rf->buf) {
+        luv_read_file_fail(rf, UV_ENOMEM, "read");
+        return;
+      }
+      luv_read_file_read(rf);
+      return;
+
+    case UV_FS_READ:
+      uv_fs_req_cleanup(req);
+      rf->len += result;
+      if (result == 0 || (rf->regular && rf->len < rf->cap)) {
+        luv_read_file_close(rf);
+        return;
+      }
+      if (rf->len == rf->cap) {
+        /* It grew, keep going until EOF */
+        char* buf = realloc(rf->buf, rf->cap * 2);
+        if (!buf) {
+          luv_read_file_fail(rf, UV_ENOMEM, "read");
+          return;
+        }
+        rf->buf = buf;
+        rf->cap *= 2;
+      }
+      luv_read_file_read(rf);
+      return;
+
+    case UV_FS_CLOSE:
+      uv_fs_req_cleanup(req);
+      luv_read_file_finish(rf);
+      return;
+
+    default:
+      assert(0 && "Unexpected fs request in readFile");
+  }
+}
+
+/* fsReadFile(path, [mmap, callback]) gives back the file as a string.  With
+ * mmap it's mapped read-only instead where possible, and comes back as a
+ * pointer and length for Lua to wrap in a Buffer and unmap.
+ */
+int luv_fs_read_file(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  luv_read_file_t* rf = malloc(sizeof(luv_read_file_t));
+  int argc, r;
+
+  memset(rf, 0, sizeof(*rf));
+  rf->L = L;
+  rf->path = strdup(path);
+  rf->use_mmap = lua_toboolean(L, 2);
+  rf->async = lua_isfunction(L, 3);
+  rf->fd = -1;
+  rf->req.data = rf;
+  luv_io_ctx_init(&rf->cbs);
+  if (rf->async) {
+    luv_io_ctx_callback_add(L, &rf->cbs, 3);
+    luv_req_stats_start(luv_get_loop(L), LUV_REQ_FS);
+  }
+
+  r = uv_fs_open(luv_get_loop(L), &rf->req, rf->path, O_RDONLY, 0,
+    rf->async ? luv_read_file_after : NULL);
+  luv_read_file_issued(rf, r);
+  if (rf->async) {
+    return 0;
+  }
+
+  assert(rf->done);
+  argc = luv_read_file_push(L, rf);
+  luv_read_file_free(rf);
+  if (argc == 1) {
+    return lua_error(L);
+  }
+  lua_remove(L, -argc);
+  return argc - 1;
+}
+
+#ifndef _WIN32
+
+/* Entries handed back per callback unless told otherwise */
+#define LUV_WALK_BATCH_SIZE 1024
+
+typedef struct luv_walk_dir_s luv_walk_dir_t;
+
+/* A directory being read, the stack of them is the walk's position */
+struct luv_walk_dir_s {
+  DIR* dir;
+  char* path;
+  int depth;
+  dev_t dev;
+  ino_t ino;
+  luv_walk_dir_t* parent;
+};
+
+typedef struct {
+  char* path;
+  const char* name;   /* points into path */
+  struct stat st;
+} luv_walk_entry_t;
+
+/* fsWalk state, kept across the thread pool jobs that make up a walk */
+typedef struct {
+  lua_State* L;
+  char* root;
+  int started;
+  luv_walk_dir_t* top;
+  int max_depth;      /* -1 for no limit */
+  int follow;         /* stat symlinks and descend into linked directories */
+  char* glob;
+  char** extensions;
+  int extension_count;
+  luv_walk_entry_t* entries;
+  int batch_size;
+  int count;
+  int errorno;        /* the root couldn't be opened */
+} luv_walk_t;
+
+static int luv_walk_push_dir(luv_walk_t* w, char* path, int depth, struct stat* st) {
+  luv_walk_dir_t* d;
+  DIR* dir = opendir(path);
+
+  if (!dir) {
+    return -1;
+  }
+  d = malloc(sizeof(*d));
+  d->dir = dir;
+  d->path = path;
+  d->depth = depth;
+  d->dev = st->st_dev;
+  d->ino = st->st_ino;
+  d->parent = w->top;
+  w->top = d;
+  return 0;
+}
+
+static void luv_walk_pop_dir(luv_walk_t* w) {
+  luv_walk_dir_t* d = w->top;
+  w->top = d->parent;
+  closedir(d->dir);
+  free(d->path);
+  free(d);
+}
+
+/* Whether a linked directory is one we're already inside of */
+static int luv_walk_is_cycle(luv_walk_t* w, struct stat* st) {
+  luv_walk_dir_t* d;
+  for (d = w->top; d; d = d->parent) {
+    if (d->dev == st->st_dev && d->ino == st->st_ino) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int luv_walk_matches(luv_walk_t* w, const char* name) {
+  size_t len;
+  int i;
+
+  if (w->glob && fnmatch(w->glob, name, 0) != 0) {
+    return 0;
+  }
+  if (w->extension_count == 0) {
+    return 1;
+  }
+  len = strlen(name);
+  for (i = 0; i < w->extension_count; i++) {
+    size_t ext_len = strlen(w->extensions[i]);
+    if (len >= ext_len && strcmp(name + len - ext_len, w->extensions[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Reads directories until a batch is full or the walk is over.  Runs in
+ * the thread pool, and only ever one job per walk at a time.
+ */
+static void luv_walk_run(luv_walk_t* w) {
+  struct dirent* ent;
+  struct stat st;
+
+  w->count = 0;
+
+  if (!w->started) {
+    w->started = 1;
+    if (stat(w->root, &st) != 0) {
+      w->errorno = errno;
+      return;
+    }
+    if (luv_walk_push_dir(w, strdup(w->root), 0, &st) != 0) {
+      w->errorno = errno;
+      return;
+    }
+  }
+
+  while (w->top && w->count < w->batch_size) {
+    luv_walk_dir_t* d = w->top;
+    size_t dir_len, name_len;
+    char* path;
+    int descend;
+
+    ent = readdir(d->dir);
+    if (!ent) {
+      luv_walk_pop_dir(w);
+      continue;
+    }
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    dir_len = strlen(d->path);
+    name_len = strlen(ent->d_name);
+    path = malloc(dir_len + name_len + 2);
+    memcpy(path, d->path, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, ent->d_name, name_len + 1);
+
+    if ((w->follow ? stat(path, &st) : -1) != 0 && lstat(path, &st) != 0) {
+      /* Gone since the readdir */
+      free(path);
+      continue;
+    }
+
+    descend = S_ISDIR(st.st_mode) &&
+      (w->max_depth < 0 || d->depth < w->max_depth) &&
+      !(w->follow && luv_walk_is_cycle(w, &st));
+
+    if (luv_walk_matches(w, ent->d_name)) {
+      luv_walk_entry_t* entry = &w->entries[w->count++];
+      entry->path = path;
+      entry->name = path + dir_len + 1;
+      entry->st = st;
+      if (descend) {
+        path = strdup(path);
+      }
+    } else if (!descend) {
+      free(path);
+    }
+
+    /* Directories we can't read are skipped */
+    if (descend && luv_walk_push_dir(w, path, d->depth + 1, &st) != 0) {
+      free(path);
+    }
+  }
+}
+
+static void luv_walk_free(luv_walk_t* w) {
+  int i;
+
+  while (w->top) {
+    luv_walk_pop_dir(w);
+  }
+  for (i = 0; i < w->extension_count; i++) {
+    free(w->extensions[i]);
+  }
+  free(w->extensions);
+  free(w->entries);
+  free(w->glob);
+  free(w->root);
+  free(w);
+}
+
+static void luv_walk_work(uv_work_t* work) {
+  luv_walk_run(work->data);
+}
+
+static void luv_walk_after(uv_work_t* work, int status) {
+  luv_req_t* req = (luv_req_t*)work;
+  luv_walk_t* w = work->data;
+  lua_State* L = w->L;
+  int i, done;
+
+  luv_io_ctx_callback_rawgeti(L, &req->cbs);
+
+  if (w->errorno) {
+    uv_err_t err;
+    memset(&err, 0, sizeof err);
+    err.code = uv_translate_sys_error(w->errorno);
+    luv_push_async_error(L, err, "walk", w->root);
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_req_release(work->loop, req);
+    luv_walk_free(w);
+    luv_acall(L, 1, 0, "fs_walk");
+    return;
+  }
+
+  lua_pushnil(L);
+  lua_createtable(L, w->count, 0);
+  for (i = 0; i < w->count; i++) {
+    luv_walk_entry_t* entry = &w->entries[i];
+    luv_push_stats_table(L, &entry->st);
+    lua_pushstring(L, entry->path);
+    lua_setfield(L, -2, "path");
+    lua_pushstring(L, entry->name);
+    lua_setfield(L, -2, "name");
+    lua_rawseti(L, -2, i + 1);
+    free(entry->path);
+  }
+  done = w->top == NULL;
+  lua_pushboolean(L, done);
+
+  if (done) {
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_req_release(work->loop, req);
+    luv_walk_free(w);
+  } else if (uv_queue_work(work->loop, work, luv_walk_work, luv_walk_after)) {
+    /* Can't go on, so this is the last batch */
+    lua_pop(L, 1);
+    lua_pushboolean(L, 1);
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_req_release(work->loop, req);
+    luv_walk_free(w);
+  }
+  /* The next batch is read while this one is handled */
+  luv_acall(L, 3, 0, "fs_walk");
+}
+
+/* fsWalk(root, options, callback) walks the tree under root in the thread
+ * pool, calling back with (err, entries, done) for each batch of entries.
+ * Entries are stat tables plus path and name.  options are maxDepth (0 is
+ * just root's entries), glob and extensions to filter what's reported,
+ * followSymlinks and batchSize.  Filters don't stop the walk from going into
+ * directories.
+ */
+int luv_fs_walk(lua_State* L) {
+  const char* root = luaL_checkstring(L, 1);
+  uv_loop_t* loop = luv_get_loop(L);
+  luv_walk_t* w;
+  luv_req_t* req;
+  size_t len;
+  int i;
+
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  w = malloc(sizeof(*w));
+  memset(w, 0, sizeof(*w));
+  w->L = luv_get_main_thread(L);
+  w->root = strdup(root);
+  /* Paths are joined with a slash, so don't end up with two */
+  len = strlen(w->root);
+  while (len > 1 && w->root[len - 1] == '/') {
+    w->root[--len] = '\0';
+  }
+  w->max_depth = -1;
+  w->batch_size = LUV_WALK_BATCH_SIZE;
+
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "maxDepth");
+    if (lua_isnumber(L, -1)) {
+      w->max_depth = lua_tointeger(L, -1);
+    }
+    lua_getfield(L, 2, "batchSize");
+    if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) {
+      w->batch_size = lua_tointeger(L, -1);
+    }
+    lua_getfield(L, 2, "followSymlinks");
+    w->follow = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "glob");
+    if (lua_isstring(L, -1)) {
+      w->glob = strdup(lua_tostring(L, -1));
+    }
+    lua_getfield(L, 2, "extensions");
+    if (lua_istable(L, -1)) {
+      int count = lua_objlen(L, -1);
+      w->extensions = malloc(count * sizeof(char*));
+      for (i = 0; i < count; i++) {
+        lua_rawgeti(L, -1, i + 1);
+        if (lua_isstring(L, -1)) {
+          w->extensions[w->extension_count++] = strdup(lua_tostring(L, -1));
+        }
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 5);
+  }
+  w->entries = malloc(w->batch_size * sizeof(luv_walk_entry_t));
+
+  req = luv_req_alloc(loop, LUV_REQ_FS);
+  if (!req) {
+    luv_walk_free(w);
+    luv_push_async_error(L, uv_last_error(loop), "walk", root);
+    return lua_error(L);
+  }
+  luv_io_ctx_callback_add(L, &req->cbs, 3);
+  req->uv.work.data = w;
+  if (uv_queue_work(loop, &req->uv.work, luv_walk_work, luv_walk_after)) {
+    uv_err_t err = uv_last_error(loop);
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_req_release(loop, req);
+    luv_walk_free(w);
+    luv_push_async_error(L, err, "walk", root);
+    return lua_error(L);
+  }
+  return 0;
+}
+
+#endif
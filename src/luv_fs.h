@@ -59,6 +59,11 @@ int luv_fs_readlink(lua_State* L);
 int luv_fs_fchmod(lua_State* L);
 int luv_fs_chown(lua_State* L);
 int luv_fs_fchown(lua_State* L);
+int luv_fs_read_file(lua_State* L);
+#ifndef _WIN32
+int luv_fs_writev(lua_State* L);
+int luv_fs_walk(lua_State* L);
+#endif
 
 typedef struct {
   lua_State* L;
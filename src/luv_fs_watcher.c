@@ -16,25 +16,185 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "luv_fs_watcher.h"
 #include "luv_fs.h"
 
+/* Coalescing, see luv_fs_watcher_coalesce.  Raw events are collected for a
+ * window and handed to Lua as one 'changes' table, with repeats of the same
+ * (filename, event) pair left out.
+ */
+typedef struct {
+  char* filename;
+  int events;
+  unsigned int hash;
+} luv_fs_change_t;
+
+typedef struct {
+  uv_timer_t timer;           /* must stay first, it's what gets freed */
+  luv_handle_t* lhandle;
+  int window;                 /* ms */
+  luv_fs_change_t* changes;   /* in the order they came in */
+  int count;
+  int cap;
+  int* slots;                 /* open addressing into changes, -1 is empty */
+  int slot_count;             /* a power of two */
+} luv_fs_coalescer_t;
+
+static unsigned int luv_fs_change_hash(const char* filename, int events) {
+  unsigned int hash = 5381;
+  if (filename) {
+    while (*filename) {
+      hash = hash * 33 + (unsigned char)*filename++;
+    }
+  }
+  return hash ^ (unsigned int)events;
+}
+
+static int luv_fs_change_equal(luv_fs_change_t* change, const char* filename, int events) {
+  if (change->events != events) {
+    return 0;
+  }
+  if (!change->filename || !filename) {
+    return change->filename == filename;
+  }
+  return strcmp(change->filename, filename) == 0;
+}
+
+static void luv_fs_coalescer_rehash(luv_fs_coalescer_t* c, int slot_count) {
+  int i;
+  free(c->slots);
+  c->slots = malloc(slot_count * sizeof(int));
+  c->slot_count = slot_count;
+  for (i = 0; i < slot_count; i++) {
+    c->slots[i] = -1;
+  }
+  for (i = 0; i < c->count; i++) {
+    int slot = c->changes[i].hash & (slot_count - 1);
+    while (c->slots[slot] != -1) {
+      slot = (slot + 1) & (slot_count - 1);
+    }
+    c->slots[slot] = i;
+  }
+}
+
+/* Records a change unless it's already pending */
+static void luv_fs_coalescer_add(luv_fs_coalescer_t* c, const char* filename, int events) {
+  unsigned int hash = luv_fs_change_hash(filename, events);
+  luv_fs_change_t* change;
+  int slot;
+
+  if ((c->count + 1) * 2 > c->slot_count) {
+    luv_fs_coalescer_rehash(c, c->slot_count ? c->slot_count * 2 : 16);
+  }
+
+  slot = hash & (c->slot_count - 1);
+  while (c->slots[slot] != -1) {
+    if (c->changes[c->slots[slot]].hash == hash &&
+        luv_fs_change_equal(&c->changes[c->slots[slot]], filename, events)) {
+      return;
+    }
+    slot = (slot + 1) & (c->slot_count - 1);
+  }
+
+  if (c->count == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 16;
+    c->changes = realloc(c->changes, c->cap * sizeof(luv_fs_change_t));
+  }
+  change = &c->changes[c->count];
+  change->filename = filename ? strdup(filename) : NULL;
+  change->events = events;
+  change->hash = hash;
+  c->slots[slot] = c->count++;
+}
+
+static void luv_fs_coalescer_clear(luv_fs_coalescer_t* c) {
+  int i;
+  for (i = 0; i < c->count; i++) {
+    free(c->changes[i].filename);
+  }
+  c->count = 0;
+  for (i = 0; i < c->slot_count; i++) {
+    c->slots[i] = -1;
+  }
+}
+
+static void luv_push_fs_event_name(lua_State* L, int events) {
+  switch (events) {
+    case UV_RENAME: lua_pushstring(L, "rename"); break;
+    case UV_CHANGE: lua_pushstring(L, "change"); break;
+    default: lua_pushnil(L); break;
+  }
+}
+
+/* Emits what's pending as 'changes', a list of {event, filename} */
+static void luv_fs_coalescer_flush(luv_fs_coalescer_t* c) {
+  lua_State* L;
+  int i;
+
+  if (!c->count) {
+    return;
+  }
+  L = luv_handle_get_lua(c->lhandle);
+  lua_createtable(L, c->count, 0);
+  for (i = 0; i < c->count; i++) {
+    lua_createtable(L, 0, 2);
+    luv_push_fs_event_name(L, c->changes[i].events);
+    lua_setfield(L, -2, "event");
+    if (c->changes[i].filename) {
+      lua_pushstring(L, c->changes[i].filename);
+      lua_setfield(L, -2, "filename");
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  luv_fs_coalescer_clear(c);
+  luv_emit_event(L, "changes", 1);
+}
+
+static void luv_fs_coalescer_on_timer(uv_timer_t* timer, int status) {
+  luv_fs_coalescer_flush(timer->data);
+}
+
+static void luv_fs_coalescer_on_close(uv_handle_t* handle) {
+  free(handle);
+}
+
+/* The watcher is closing, so is the coalescer.  Pending changes are
+ * dropped. */
+static void luv_fs_coalescer_close(luv_handle_t* lhandle) {
+  luv_fs_coalescer_t* c = lhandle->layer;
+
+  lhandle->layer = NULL;
+  lhandle->layer_close = NULL;
+  luv_fs_coalescer_clear(c);
+  free(c->changes);
+  free(c->slots);
+  uv_close((uv_handle_t*)&c->timer, luv_fs_coalescer_on_close);
+}
+
 void luv_on_fs_event(uv_fs_event_t* handle, const char* filename, int events, int status) {
+  luv_handle_t* lhandle = handle->data;
+  luv_fs_coalescer_t* c = lhandle->layer;
+  lua_State *L;
+
+  if (c && status != -1) {
+    luv_fs_coalescer_add(c, filename, events);
+    if (!uv_is_active((uv_handle_t*)&c->timer)) {
+      uv_timer_start(&c->timer, luv_fs_coalescer_on_timer, c->window, 0);
+    }
+    return;
+  }
 
   /* load the lua state and the userdata */
-  lua_State *L = luv_handle_get_lua(handle->data);
+  L = luv_handle_get_lua(lhandle);
 
   if (status == -1) {
     luv_push_async_error(L, uv_last_error(luv_get_loop(L)), "on_fs_event", NULL);
-    luv_emit_event(L, "error", 1);
+    luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
   } else {
 
-    switch (events) {
-      case UV_RENAME: lua_pushstring(L, "rename"); break;
-      case UV_CHANGE: lua_pushstring(L, "change"); break;
-      default: lua_pushnil(L); break;
-    }
+    luv_push_fs_event_name(L, events);
 
     if (filename) {
       lua_pushstring(L, filename);
@@ -42,7 +202,7 @@ void luv_on_fs_event(uv_fs_event_t* handle, const char* filename, int events, in
       lua_pushnil(L);
     }
 
-    luv_emit_event(L, "change", 2);
+    luv_emit_event_slot(L, LUV_EVENT_CHANGE, 2);
 
   }
 
@@ -57,4 +217,46 @@ int luv_new_fs_watcher (lua_State* L) {
   return 1;
 }
 
+/* watcher:coalesce(window) merges the raw events of each window ms into a
+ * single 'changes' event instead of one 'change' per event.  A window of 0
+ * goes back to plain 'change' events, after delivering what's pending.
+ */
+int luv_fs_watcher_coalesce(lua_State* L) {
+  uv_fs_event_t* handle = (uv_fs_event_t*)luv_checkudata(L, 1, "fs_watcher");
+  luv_handle_t* lhandle = handle->data;
+  int window = luaL_checkint(L, 2);
+  luv_fs_coalescer_t* c = lhandle->layer;
+
+  luaL_argcheck(L, handle->type == UV_FS_EVENT, 1, "fs watcher expected");
+  luaL_argcheck(L, window >= 0, 2, "window must not be negative");
+
+  if (window == 0) {
+    if (c) {
+      uv_timer_stop(&c->timer);
+      luv_fs_coalescer_flush(c);
+      /* The 'changes' handlers may have closed the watcher or dropped
+       * coalescing themselves already */
+      if (lhandle->layer == c) {
+        luv_fs_coalescer_close(lhandle);
+      }
+    }
+    return 0;
+  }
 
+  if (!c) {
+    c = malloc(sizeof(*c));
+    if (!c) {
+      return luaL_error(L, "coalesce: out of memory");
+    }
+    memset(c, 0, sizeof(*c));
+    uv_timer_init(handle->loop, &c->timer);
+    /* Whether the process stays up is the watcher's call */
+    uv_unref((uv_handle_t*)&c->timer);
+    c->timer.data = c;
+    c->lhandle = lhandle;
+    lhandle->layer = c;
+    lhandle->layer_close = luv_fs_coalescer_close;
+  }
+  c->window = window;
+  return 0;
+}
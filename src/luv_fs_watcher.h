@@ -27,5 +27,6 @@
 void luv_on_fs_event(uv_fs_event_t* handle, const char* filename, int events, int status);
 
 int luv_new_fs_watcher (lua_State* L);
+int luv_fs_watcher_coalesce(lua_State* L);
 
 #endif
@@ -0,0 +1,280 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <string.h>
+
+#include "luv_gc.h"
+#include "utils.h"
+
+/* Lua collects incrementally, but its steps run inside whatever allocates,
+ * which is usually a request handler.  The scheduler moves that work to
+ * the gaps between callbacks.
+ *
+ * Lua's own pause is raised to a backstop so it rarely starts a cycle by
+ * itself.  Instead, once the heap has grown to pause% of what was live
+ * after the last cycle, the prepare handle starts an idle handle.  Each
+ * idle callback then steps the collector until the cycle finishes or the
+ * slice is used up.  An active idle handle makes poll return at once, so
+ * slices run while there's nothing to wait for and I/O still gets in
+ * between them.
+ *
+ * If the backstop is left to us it gets enough headroom above the trigger
+ * for the measured allocation rate over a cycle's duration.  A cycle that
+ * lets the heap eat half of that headroom raises stepmul, so the
+ * collector's steps during allocation do more work.  Calmer cycles let
+ * it decay back.
+ */
+
+#define LUV_GC_MAX_PAUSE 1000
+#define LUV_GC_MIN_STEPMUL 100
+#define LUV_GC_MAX_STEPMUL 1000
+
+static size_t luv_gc_heap_kb(lua_State* L) {
+  return (size_t)lua_gc(L, LUA_GCCOUNT, 0);
+}
+
+static void luv_gc_apply(luv_gc_sched_t* gc) {
+  int pause = gc->backstop ? gc->backstop : gc->lua_pause;
+  int stepmul = gc->stepmul ? gc->stepmul : gc->lua_stepmul;
+
+  if (pause < gc->pause + 50) {
+    pause = gc->pause + 50;
+  }
+  gc->lua_pause = pause;
+  gc->lua_stepmul = stepmul;
+  lua_gc(gc->L, LUA_GCSETPAUSE, pause);
+  lua_gc(gc->L, LUA_GCSETSTEPMUL, stepmul);
+}
+
+static void luv_gc_tune(luv_gc_sched_t* gc, double cycle_ms) {
+  double headroom;
+  double growth;
+  double pause;
+
+  if (gc->estimate == 0) {
+    return;
+  }
+  headroom = (double)gc->estimate * (gc->lua_pause - gc->pause) / 100;
+  growth = gc->cycle_peak > gc->cycle_kb ? (double)(gc->cycle_peak - gc->cycle_kb) : 0;
+
+  if (!gc->stepmul) {
+    if (growth > headroom / 2) {
+      gc->lua_stepmul = gc->lua_stepmul * 3 / 2;
+    } else {
+      gc->lua_stepmul = gc->lua_stepmul * 9 / 10;
+    }
+    if (gc->lua_stepmul < LUV_GC_MIN_STEPMUL) gc->lua_stepmul = LUV_GC_MIN_STEPMUL;
+    if (gc->lua_stepmul > LUV_GC_MAX_STEPMUL) gc->lua_stepmul = LUV_GC_MAX_STEPMUL;
+  }
+
+  if (!gc->backstop) {
+    /* Twice what's allocated over a cycle, on top of the trigger */
+    pause = gc->pause + 200 * gc->alloc_rate * cycle_ms / gc->estimate;
+    if (pause > LUV_GC_MAX_PAUSE) pause = LUV_GC_MAX_PAUSE;
+    gc->lua_pause = (int)pause;
+  }
+  luv_gc_apply(gc);
+}
+
+static void luv_gc_on_idle(uv_idle_t* handle, int status) {
+  luv_gc_sched_t* gc = handle->data;
+  luv_loop_stats_t* stats = &luv_loop_data(handle->loop)->loop_stats;
+  uint64_t start = stats->enabled ? luv_loop_stats_call_start(stats) : uv_hrtime();
+  uint64_t deadline = start + (uint64_t)(gc->slice * 1000);
+  uint64_t now;
+  int done;
+
+  do {
+    done = lua_gc(gc->L, LUA_GCSTEP, 0);
+    gc->steps++;
+    now = uv_hrtime();
+  } while (!done && now < deadline);
+
+  gc->slices++;
+  luv_histogram_record(&gc->slice_time, (now - start) / 1000);
+  if (stats->enabled) {
+    luv_loop_stats_call_end(stats, "gc_idle", start);
+  }
+  if (!done) {
+    return;
+  }
+
+  uv_idle_stop(&gc->idle);
+  gc->running = 0;
+  gc->cycles++;
+  luv_histogram_record(&gc->cycle_time, (now - gc->cycle_start) / 1000);
+  gc->estimate = luv_gc_heap_kb(gc->L);
+  gc->last_kb = gc->estimate;
+  gc->last_time = now;
+  luv_gc_tune(gc, (double)(now - gc->cycle_start) / 1e6);
+}
+
+static void luv_gc_on_prepare(uv_prepare_t* handle, int status) {
+  luv_gc_sched_t* gc = handle->data;
+  size_t kb = luv_gc_heap_kb(gc->L);
+  uint64_t now = uv_hrtime();
+  double elapsed = (double)(now - gc->last_time) / 1e6;
+
+  if (gc->running) {
+    if (kb > gc->cycle_peak) {
+      gc->cycle_peak = kb;
+    }
+  } else if (kb < gc->last_kb) {
+    /* Only a sweep shrinks the heap, so Lua collected without us */
+    if (!gc->dropping) {
+      gc->inline_cycles++;
+      gc->dropping = 1;
+    }
+    gc->estimate = kb;
+  } else {
+    gc->dropping = 0;
+    if (elapsed > 0) {
+      gc->alloc_rate = 0.8 * gc->alloc_rate + 0.2 * (double)(kb - gc->last_kb) / elapsed;
+    }
+  }
+  gc->last_kb = kb;
+  gc->last_time = now;
+
+  if (!gc->running && kb * 100 >= gc->estimate * gc->pause) {
+    gc->running = 1;
+    gc->cycle_kb = kb;
+    gc->cycle_peak = kb;
+    gc->cycle_start = now;
+    uv_idle_start(&gc->idle, luv_gc_on_idle);
+  }
+}
+
+void luv_gc_sched_init(luv_gc_sched_t* gc) {
+  memset(gc, 0, sizeof(*gc));
+  gc->slice = 1000;
+  gc->pause = 150;
+}
+
+static int luv_gc_opt(lua_State* L, int index, const char* name, int def) {
+  int value;
+  lua_getfield(L, index, name);
+  if (lua_isnil(L, -1)) {
+    value = def;
+  } else if (lua_isstring(L, -1) && !lua_isnumber(L, -1) && !strcmp(lua_tostring(L, -1), "auto")) {
+    value = 0;
+  } else {
+    value = (int)luaL_checknumber(L, -1);
+  }
+  lua_pop(L, 1);
+  return value;
+}
+
+/* gcSchedule(options) turns the scheduler on with sliceMs, pause, backstop
+ * and stepmul options, gcSchedule(false) turns it off and gives Lua its
+ * own settings back
+ */
+int luv_gc_schedule(lua_State* L) {
+  uv_loop_t* loop = luv_get_loop(L);
+  luv_gc_sched_t* gc = &luv_loop_data(loop)->gc_sched;
+  int enable = lua_gettop(L) == 0 || lua_toboolean(L, 1);
+
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "sliceMs");
+    if (!lua_isnil(L, -1)) {
+      gc->slice = luaL_checknumber(L, -1) * 1000;
+    }
+    lua_pop(L, 1);
+    gc->pause = luv_gc_opt(L, 1, "pause", gc->pause);
+    gc->backstop = luv_gc_opt(L, 1, "backstop", gc->backstop);
+    gc->stepmul = luv_gc_opt(L, 1, "stepmul", gc->stepmul);
+    if (gc->pause < 100) {
+      return luaL_error(L, "gcSchedule: pause must be at least 100");
+    }
+    lua_getfield(L, 1, "enabled");
+    if (!lua_isnil(L, -1)) {
+      enable = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+
+  if (enable && !gc->enabled) {
+    gc->L = luv_get_main_thread(L);
+    if (!gc->initialized) {
+      uv_prepare_init(loop, &gc->prepare);
+      uv_idle_init(loop, &gc->idle);
+      gc->prepare.data = gc;
+      gc->idle.data = gc;
+      /* Collecting garbage is no reason to keep the loop running */
+      uv_unref((uv_handle_t*)&gc->prepare);
+      uv_unref((uv_handle_t*)&gc->idle);
+      gc->initialized = 1;
+    }
+    /* Setting a value returns the previous one */
+    gc->saved_pause = lua_gc(gc->L, LUA_GCSETPAUSE, 200);
+    gc->saved_stepmul = lua_gc(gc->L, LUA_GCSETSTEPMUL, 200);
+    gc->lua_pause = gc->pause * 2;
+    gc->lua_stepmul = gc->saved_stepmul;
+    gc->estimate = luv_gc_heap_kb(gc->L);
+    gc->last_kb = gc->estimate;
+    gc->last_time = uv_hrtime();
+    gc->running = 0;
+    gc->dropping = 0;
+    luv_gc_apply(gc);
+    uv_prepare_start(&gc->prepare, luv_gc_on_prepare);
+    gc->enabled = 1;
+  } else if (!enable && gc->enabled) {
+    uv_prepare_stop(&gc->prepare);
+    uv_idle_stop(&gc->idle);
+    gc->running = 0;
+    lua_gc(gc->L, LUA_GCSETPAUSE, gc->saved_pause);
+    lua_gc(gc->L, LUA_GCSETSTEPMUL, gc->saved_stepmul);
+    gc->enabled = 0;
+  } else if (gc->enabled) {
+    luv_gc_apply(gc);
+  }
+  return 0;
+}
+
+int luv_gc_stats(lua_State* L) {
+  luv_gc_sched_t* gc = &luv_loop_data(luv_get_loop(L))->gc_sched;
+
+  lua_newtable(L);
+  lua_pushboolean(L, gc->enabled);
+  lua_setfield(L, -2, "enabled");
+  lua_pushboolean(L, gc->running);
+  lua_setfield(L, -2, "running");
+  lua_pushnumber(L, gc->slice / 1000);
+  lua_setfield(L, -2, "sliceMs");
+  lua_pushinteger(L, gc->pause);
+  lua_setfield(L, -2, "pause");
+  lua_pushinteger(L, gc->lua_pause);
+  lua_setfield(L, -2, "backstop");
+  lua_pushinteger(L, gc->lua_stepmul);
+  lua_setfield(L, -2, "stepmul");
+  lua_pushnumber(L, (double)gc->estimate * gc->pause / 100 * 1024);
+  lua_setfield(L, -2, "heapTarget");
+  lua_pushnumber(L, gc->alloc_rate * 1024 * 1000);
+  lua_setfield(L, -2, "allocRate");
+  lua_pushnumber(L, gc->cycles);
+  lua_setfield(L, -2, "cycles");
+  lua_pushnumber(L, gc->inline_cycles);
+  lua_setfield(L, -2, "inlineCycles");
+  lua_pushnumber(L, gc->slices);
+  lua_setfield(L, -2, "slices");
+  lua_pushnumber(L, gc->steps);
+  lua_setfield(L, -2, "steps");
+  luv_push_histogram(L, &gc->slice_time);
+  lua_setfield(L, -2, "sliceTime");
+  luv_push_histogram(L, &gc->cycle_time);
+  lua_setfield(L, -2, "cycleTime");
+  return 1;
+}
@@ -0,0 +1,65 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_GC
+#define LUV_GC
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "uv.h"
+#include "luv_loop_stats.h"
+
+/* Incremental collection driven by the loop, see luv_gc.c */
+typedef struct {
+  int enabled;
+  int initialized;     /* prepare and idle below are set up */
+  int running;         /* a cycle is being stepped from the idle handle */
+  int dropping;        /* the heap is shrinking without us, Lua is sweeping */
+  lua_State* L;        /* main thread */
+  uv_prepare_t prepare;
+  uv_idle_t idle;
+  /* Settings, backstop and stepmul are tuned when they're 0 */
+  double slice;        /* us a slice may take */
+  int pause;           /* start a cycle when the heap reaches this % of estimate */
+  int backstop;
+  int stepmul;
+  /* What Lua had before we took over, restored when disabled */
+  int saved_pause;
+  int saved_stepmul;
+  int lua_pause;       /* the setpause and setstepmul in effect */
+  int lua_stepmul;
+  size_t estimate;     /* KB live after the last cycle */
+  size_t last_kb;      /* heap at the previous prepare */
+  uint64_t last_time;  /* ns */
+  double alloc_rate;   /* KB per ms, moving average */
+  size_t cycle_kb;     /* heap when the running cycle started */
+  size_t cycle_peak;
+  uint64_t cycle_start;
+  double cycles;
+  double inline_cycles; /* collections Lua finished on its own */
+  double slices;
+  double steps;
+  luv_histogram_t slice_time;
+  luv_histogram_t cycle_time;
+} luv_gc_sched_t;
+
+void luv_gc_sched_init(luv_gc_sched_t* gc);
+
+int luv_gc_schedule(lua_State* L);
+int luv_gc_stats(lua_State* L);
+
+#endif
@@ -16,18 +16,87 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "luv_handle.h"
 
+/* Indexed by luv_event_t */
+static const char* luv_event_names[LUV_EVENT_MAX] = {
+  NULL,
+  "data",
+  "end",
+  "error",
+  "close",
+  "connect",
+  "connection",
+  "listening",
+  "timeout",
+  "message",
+  "exit",
+  "signal",
+  "change"
+};
+
+luv_event_t luv_event_from_name(const char* name) {
+  int i;
+  for (i = LUV_EVENT_CUSTOM + 1; i < LUV_EVENT_MAX; i++) {
+    if (strcmp(name, luv_event_names[i]) == 0) {
+      return (luv_event_t)i;
+    }
+  }
+  return LUV_EVENT_CUSTOM;
+}
+
 /* Registers a callback, callback_index can't be negative */
 void luv_register_event(lua_State* L, int userdata_index, const char* name, int callback_index) {
+  luv_handle_t* lhandle = lua_touserdata(L, userdata_index);
+  luv_event_t event = luv_event_from_name(name);
+
   lua_getfenv(L, userdata_index);
   lua_pushvalue(L, callback_index);
   lua_setfield(L, -2, name);
+
+  /* Mirror known events into their slot */
+  if (event != LUV_EVENT_CUSTOM) {
+    lua_pushvalue(L, callback_index);
+    lua_rawseti(L, -2, event);
+    if (lua_isfunction(L, callback_index)) {
+      lhandle->events |= 1u << event;
+    } else {
+      lhandle->events &= ~(1u << event);
+    }
+  }
   lua_pop(L, 1);
 }
 
+void luv_emit_event_slot(lua_State* L, luv_event_t event, int nargs) {
+  luv_handle_t* lhandle = lua_touserdata(L, -nargs - 1);
+
+  /* Nobody is listening, drop the args and the userdata */
+  if (!luv_has_event(lhandle, event)) {
+    lua_pop(L, nargs + 1);
+    return;
+  }
+
+  /* Load the callback from its slot */
+  lua_getfenv(L, -nargs - 1);
+  lua_rawgeti(L, -1, event);
+  /* remove the userdata environment */
+  lua_remove(L, -2);
+  /* Remove the userdata */
+  lua_remove(L, -nargs - 2);
+
+  if (lua_isfunction (L, -1) == 0) {
+    lua_pop(L, 1 + nargs);
+    return;
+  }
+
+  /* move the function below the args */
+  lua_insert(L, -nargs - 1);
+  luv_acall(L, nargs, 0, luv_event_names[event]);
+}
+
 /* Emit an event of the current userdata consuming nargs
  * Assumes userdata is right below args
  */
@@ -52,10 +121,11 @@ void luv_emit_event(lua_State* L, const char* name, int nargs) {
 }
 
 uv_buf_t luv_on_alloc(uv_handle_t* handle, size_t suggested_size) {
-  uv_buf_t buf;
-  buf.base = malloc(suggested_size);
-  buf.len = suggested_size;
-  return buf;
+  return luv_buffer_pool_alloc(&luv_loop_data(handle->loop)->buffer_pool, suggested_size);
+}
+
+void luv_on_alloc_release(uv_handle_t* handle, uv_buf_t buf) {
+  luv_buffer_pool_release(&luv_loop_data(handle->loop)->buffer_pool, buf);
 }
 
 void luv_on_close(uv_handle_t* handle) {
@@ -65,7 +135,7 @@ void luv_on_close(uv_handle_t* handle) {
   lua_State *L = lhandle->L;
   lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->ref);
 
-  luv_emit_event(L, "close", 0);
+  luv_emit_event_slot(L, LUV_EVENT_CLOSE, 0);
 
   luv_handle_unref(L, handle->data);
 
@@ -76,6 +146,7 @@ void luv_on_close(uv_handle_t* handle) {
     luv_handle_unref(L, handle->data);
   }
   assert(lhandle->ref == LUA_NOREF);
+  luv_handle_stats_remove(lhandle);
   /* This handle is no longer valid, clean up memory */
   lhandle->handle = 0;
   free(handle);
@@ -83,11 +154,19 @@ void luv_on_close(uv_handle_t* handle) {
 
 int luv_close (lua_State* L) {
   uv_handle_t* handle = luv_checkudata(L, 1, "handle");
+  luv_handle_t* lhandle = handle->data;
 /*  printf("close   \tlhandle=%p handle=%p\n", handle->data, handle);*/
   if (uv_is_closing(handle)) {
     fprintf(stderr, "WARNING: Handle already closing \tlhandle=%p handle=%p\n", handle->data, handle);
     return 0;
   }
+  if (lhandle->layer_close) {
+    lhandle->layer_close(lhandle);
+    /* A layer calling back may have closed the handle already */
+    if (uv_is_closing(handle)) {
+      return 0;
+    }
+  }
   uv_close(handle, luv_on_close);
   luv_handle_ref(L, handle->data, 1);
   return 0;
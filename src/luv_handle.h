@@ -24,6 +24,34 @@
 #include "utils.h"
 
 
+/* Events emitted from C get a numbered slot in the handle's environment so
+ * dispatching them is a rawgeti instead of a string lookup.  Any other name
+ * is a custom event and goes through the environment by name.
+ */
+typedef enum {
+  LUV_EVENT_CUSTOM = 0,
+  LUV_EVENT_DATA,
+  LUV_EVENT_END,
+  LUV_EVENT_ERROR,
+  LUV_EVENT_CLOSE,
+  LUV_EVENT_CONNECT,
+  LUV_EVENT_CONNECTION,
+  LUV_EVENT_LISTENING,
+  LUV_EVENT_TIMEOUT,
+  LUV_EVENT_MESSAGE,
+  LUV_EVENT_EXIT,
+  LUV_EVENT_SIGNAL,
+  LUV_EVENT_CHANGE,
+  LUV_EVENT_MAX
+} luv_event_t;
+
+/* Returns the slot for name, LUV_EVENT_CUSTOM if it doesn't have one */
+luv_event_t luv_event_from_name(const char* name);
+
+/* Whether a handler is registered for a slotted event */
+#define luv_has_event(lhandle, event) \
+  (((lhandle)->events & (1u << (event))) != 0)
+
 /* Registers a callback, callback_index can't be negative */
 void luv_register_event(lua_State* L, int userdata_index, const char* name, int callback_index);
 
@@ -32,7 +60,14 @@ void luv_register_event(lua_State* L, int userdata_index, const char* name, int
  */
 void luv_emit_event(lua_State* L, const char* name, int nargs);
 
+/* Same as luv_emit_event for events that have a slot */
+void luv_emit_event_slot(lua_State* L, luv_event_t event, int nargs);
+
+/* Read buffers come from the loop's buffer pool.  Callbacks that receive
+ * one must hand it back with luv_on_alloc_release once they're done.
+ */
 uv_buf_t luv_on_alloc(uv_handle_t* handle, size_t suggested_size);
+void luv_on_alloc_release(uv_handle_t* handle, uv_buf_t buf);
 
 void luv_on_close(uv_handle_t* handle);
 
@@ -0,0 +1,228 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "luv_handle_stats.h"
+#include "utils.h"
+
+static const char* luv_req_kind_names[LUV_REQ_KINDS] = {
+  "write",
+  "shutdown",
+  "connect",
+  "udpSend",
+  "fs",
+  "dns",
+  "work"
+};
+
+void luv_handle_stats_init(luv_handle_stats_t* stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->types[LUV_HANDLE_STATS_TYPES].type = "other";
+  /* Handles made before handleStatsDebug can be called get tracebacks too */
+  stats->debug = getenv("LUVIT_DEBUG_HANDLES") != NULL;
+}
+
+/* Types are string literals, compared by pointer first */
+static int luv_handle_stats_type(luv_handle_stats_t* stats, const char* type) {
+  int i;
+
+  for (i = 0; i < stats->type_count; i++) {
+    if (stats->types[i].type == type || strcmp(stats->types[i].type, type) == 0) {
+      return i;
+    }
+  }
+  if (stats->type_count == LUV_HANDLE_STATS_TYPES) {
+    return LUV_HANDLE_STATS_TYPES;
+  }
+  stats->types[i].type = type;
+  stats->type_count++;
+  return i;
+}
+
+void luv_handle_stats_add(lua_State* L, luv_handle_t* lhandle) {
+  uv_loop_t* loop = luv_get_loop(L);
+  luv_handle_stats_t* stats = &luv_loop_data(loop)->handle_stats;
+  luv_handle_type_stats_t* type;
+
+  lhandle->loop = loop;
+  lhandle->stats_type = luv_handle_stats_type(stats, lhandle->type);
+  lhandle->created = uv_hrtime();
+  lhandle->traceback = LUA_NOREF;
+  if (stats->debug) {
+    luaL_traceback(L, L, NULL, 1);
+    lhandle->traceback = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  lhandle->stats_prev = NULL;
+  lhandle->stats_next = stats->live;
+  if (stats->live) {
+    stats->live->stats_prev = lhandle;
+  }
+  stats->live = lhandle;
+
+  type = &stats->types[lhandle->stats_type];
+  type->live++;
+  type->created++;
+}
+
+void luv_handle_stats_remove(luv_handle_t* lhandle) {
+  luv_handle_stats_t* stats;
+  luv_handle_type_stats_t* type;
+
+  if (!lhandle->loop) {
+    return;
+  }
+  stats = &luv_loop_data(lhandle->loop)->handle_stats;
+  lhandle->loop = NULL;
+
+  if (lhandle->stats_prev) {
+    lhandle->stats_prev->stats_next = lhandle->stats_next;
+  } else {
+    stats->live = lhandle->stats_next;
+  }
+  if (lhandle->stats_next) {
+    lhandle->stats_next->stats_prev = lhandle->stats_prev;
+  }
+  lhandle->stats_prev = lhandle->stats_next = NULL;
+
+  if (lhandle->traceback != LUA_NOREF) {
+    luaL_unref(lhandle->L, LUA_REGISTRYINDEX, lhandle->traceback);
+    lhandle->traceback = LUA_NOREF;
+  }
+
+  type = &stats->types[lhandle->stats_type];
+  type->live--;
+  type->closed++;
+}
+
+void luv_req_stats_start(uv_loop_t* loop, luv_req_kind_t kind) {
+  luv_loop_data(loop)->handle_stats.requests[kind]++;
+}
+
+void luv_req_stats_end(uv_loop_t* loop, luv_req_kind_t kind) {
+  luv_loop_data(loop)->handle_stats.requests[kind]--;
+}
+
+/* "luv_tcp" is reported as tcp */
+static const char* luv_handle_stats_name(const char* type) {
+  return strncmp(type, "luv_", 4) == 0 ? type + 4 : type;
+}
+
+static int luv_handle_is_stream(uv_handle_t* handle) {
+  return handle->type == UV_TCP || handle->type == UV_NAMED_PIPE ||
+    handle->type == UV_TTY;
+}
+
+int luv_handle_stats(lua_State* L) {
+  luv_handle_stats_t* stats = &luv_loop_data(luv_get_loop(L))->handle_stats;
+  luv_handle_type_stats_t* type;
+  luv_handle_t* lhandle;
+  double live = 0, queued = 0;
+  int i;
+
+  lua_newtable(L);
+
+  /* live, created and closed per type */
+  lua_newtable(L);
+  for (i = 0; i <= LUV_HANDLE_STATS_TYPES; i++) {
+    type = &stats->types[i];
+    if (i >= stats->type_count && i < LUV_HANDLE_STATS_TYPES) {
+      continue;
+    }
+    if (i == LUV_HANDLE_STATS_TYPES && type->created == 0) {
+      continue;
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, type->live);
+    lua_setfield(L, -2, "live");
+    lua_pushnumber(L, type->created);
+    lua_setfield(L, -2, "created");
+    lua_pushnumber(L, type->closed);
+    lua_setfield(L, -2, "closed");
+    lua_setfield(L, -2, luv_handle_stats_name(type->type));
+    live += type->live;
+  }
+  lua_setfield(L, -2, "handles");
+  lua_pushnumber(L, live);
+  lua_setfield(L, -2, "live");
+
+  /* in flight per kind */
+  lua_newtable(L);
+  for (i = 0; i < LUV_REQ_KINDS; i++) {
+    lua_pushnumber(L, stats->requests[i]);
+    lua_setfield(L, -2, luv_req_kind_names[i]);
+  }
+  lua_setfield(L, -2, "requests");
+
+  /* bytes waiting in the write queues of streams */
+  for (lhandle = stats->live; lhandle; lhandle = lhandle->stats_next) {
+    if (lhandle->handle && luv_handle_is_stream(lhandle->handle)) {
+      queued += ((uv_stream_t*)lhandle->handle)->write_queue_size;
+    }
+  }
+  lua_pushnumber(L, queued);
+  lua_setfield(L, -2, "writeQueueSize");
+
+  return 1;
+}
+
+/* handleStatsDebug(enable) records where handles created from now on are
+ * created.  LUVIT_DEBUG_HANDLES in the environment turns it on at startup.
+ */
+int luv_handle_stats_debug(lua_State* L) {
+  luv_loop_data(luv_get_loop(L))->handle_stats.debug = lua_toboolean(L, 1);
+  return 0;
+}
+
+/* handleLeaks([min_age_ms]) lists the live handles holding a reference,
+ * which keeps them from being collected, made at least min_age_ms ago.
+ * Each has type, age in ms, refCount, active and, in debug mode, the
+ * traceback of where it was created.
+ */
+int luv_handle_leaks(lua_State* L) {
+  luv_handle_stats_t* stats = &luv_loop_data(luv_get_loop(L))->handle_stats;
+  double min_age = luaL_optnumber(L, 1, 0);
+  uint64_t now = uv_hrtime();
+  luv_handle_t* lhandle;
+  double age;
+  int n = 0;
+
+  lua_newtable(L);
+  for (lhandle = stats->live; lhandle; lhandle = lhandle->stats_next) {
+    age = (double)(now - lhandle->created) / 1e6;
+    if (lhandle->refCount <= 0 || age < min_age) {
+      continue;
+    }
+    lua_newtable(L);
+    lua_pushstring(L, luv_handle_stats_name(lhandle->type));
+    lua_setfield(L, -2, "type");
+    lua_pushnumber(L, age);
+    lua_setfield(L, -2, "age");
+    lua_pushnumber(L, lhandle->refCount);
+    lua_setfield(L, -2, "refCount");
+    lua_pushboolean(L, lhandle->handle && uv_is_active(lhandle->handle));
+    lua_setfield(L, -2, "active");
+    if (lhandle->traceback != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->traceback);
+      lua_setfield(L, -2, "traceback");
+    }
+    lua_rawseti(L, -2, ++n);
+  }
+  return 1;
+}
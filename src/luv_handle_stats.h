@@ -0,0 +1,72 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_HANDLE_STATS
+#define LUV_HANDLE_STATS
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "uv.h"
+
+/* Kinds of requests counted while in flight */
+typedef enum {
+  LUV_REQ_WRITE,
+  LUV_REQ_SHUTDOWN,
+  LUV_REQ_CONNECT,
+  LUV_REQ_UDP_SEND,
+  LUV_REQ_FS,
+  LUV_REQ_DNS,
+  LUV_REQ_WORK,
+  LUV_REQ_KINDS
+} luv_req_kind_t;
+
+/* Handle types past this many are counted together as "other" */
+#define LUV_HANDLE_STATS_TYPES 16
+
+typedef struct {
+  const char* type; /* lhandle->type, eg. "luv_tcp" */
+  double live;
+  double created;
+  double closed;
+} luv_handle_type_stats_t;
+
+/* Live handles and in-flight requests of a loop.  Every luv handle is on
+ * the live list from luv_handle_create until it's closed or collected.
+ */
+typedef struct {
+  struct luv_handle_s* live;
+  luv_handle_type_stats_t types[LUV_HANDLE_STATS_TYPES + 1];
+  int type_count;
+  double requests[LUV_REQ_KINDS];
+  int debug; /* record where handles are created, for handleLeaks */
+} luv_handle_stats_t;
+
+void luv_handle_stats_init(luv_handle_stats_t* stats);
+
+/* Called by luv_handle_create with the new userdata on top of the stack */
+void luv_handle_stats_add(lua_State* L, struct luv_handle_s* lhandle);
+/* Called once the handle is closed or collected, does nothing the second time */
+void luv_handle_stats_remove(struct luv_handle_s* lhandle);
+
+void luv_req_stats_start(uv_loop_t* loop, luv_req_kind_t kind);
+void luv_req_stats_end(uv_loop_t* loop, luv_req_kind_t kind);
+
+int luv_handle_stats(lua_State* L);
+int luv_handle_stats_debug(lua_State* L);
+int luv_handle_leaks(lua_State* L);
+
+#endif
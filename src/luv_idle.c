@@ -0,0 +1,66 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "luv_idle.h"
+#include "utils.h"
+
+int luv_new_idle(lua_State* L) {
+  uv_idle_t* handle = luv_create_idle(L);
+  uv_idle_init(luv_get_loop(L), handle);
+  return 1;
+}
+
+static void luv_on_idle(uv_idle_t* handle, int status) {
+  /* load the lua state and put the userdata on the stack */
+  lua_State* L = luv_handle_get_lua(handle->data);
+  luv_emit_event(L, "idle", 0);
+}
+
+int luv_idle_start(lua_State* L) {
+  uv_idle_t* handle = (uv_idle_t*)luv_checkudata(L, 1, "idle");
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+
+  luv_register_event(L, 1, "idle", 2);
+
+  if (uv_is_active((uv_handle_t*)handle)) {
+    return 0;
+  }
+  if (uv_idle_start(handle, luv_on_idle)) {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    return luaL_error(L, "idle_start: %s", uv_strerror(err));
+  }
+  luv_handle_ref(L, handle->data, 1);
+
+  return 0;
+}
+
+int luv_idle_stop(lua_State* L) {
+  uv_idle_t* handle = (uv_idle_t*)luv_checkudata(L, 1, "idle");
+
+  if (!uv_is_active((uv_handle_t*)handle)) {
+    return 0;
+  }
+  if (uv_idle_stop(handle)) {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    return luaL_error(L, "idle_stop: %s", uv_strerror(err));
+  }
+  luv_handle_unref(L, handle->data);
+
+  return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_IDLE
+#define LUV_IDLE
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "uv.h"
+#include "utils.h"
+#include "luv_handle.h"
+
+/* Idle handles run their callback once per loop iteration, before it
+ * polls for I/O.  While one is active the poll doesn't block, so they also
+ * serve to make sure the loop comes around again soon.
+ */
+int luv_new_idle(lua_State* L);
+int luv_idle_start(lua_State* L);
+int luv_idle_stop(lua_State* L);
+
+#endif
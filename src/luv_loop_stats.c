@@ -0,0 +1,291 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "luv_loop_stats.h"
+#include "utils.h"
+
+/* Loop lag is the time from the loop waking up in poll, noticed by the
+ * first callback or the check handle, until the prepare handle sees it go
+ * back to poll.  That's how late anything that became ready meanwhile got
+ * to run.
+ */
+
+int luv_loop_stats_used = 0;
+
+static int luv_histogram_index(uint64_t value) {
+  int msb = 0;
+  uint64_t v = value;
+
+  if (value < LUV_HIST_SUB) {
+    return (int)value;
+  }
+  while (v >>= 1) {
+    msb++;
+  }
+  if (msb >= LUV_HIST_BITS) {
+    return LUV_HIST_BUCKETS - 1;
+  }
+  return (msb - LUV_HIST_SUB_BITS + 1) * LUV_HIST_SUB +
+    (int)((value >> (msb - LUV_HIST_SUB_BITS)) & (LUV_HIST_SUB - 1));
+}
+
+/* The largest value that lands in a bucket */
+static uint64_t luv_histogram_upper(int index) {
+  int shift;
+
+  if (index < LUV_HIST_SUB) {
+    return index;
+  }
+  shift = index / LUV_HIST_SUB - 1;
+  return (((uint64_t)(LUV_HIST_SUB + index % LUV_HIST_SUB) + 1) << shift) - 1;
+}
+
+void luv_histogram_record(luv_histogram_t* h, uint64_t value) {
+  h->counts[luv_histogram_index(value)]++;
+  h->count++;
+  h->total += (double)value;
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+/* Smallest bucket bound at or above the q quantile, in us */
+static double luv_histogram_quantile(luv_histogram_t* h, double q) {
+  double target = q * h->count;
+  double seen = 0;
+  uint64_t upper;
+  int i;
+
+  if (h->count == 0) {
+    return 0;
+  }
+  for (i = 0; i < LUV_HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= target && seen > 0) {
+      break;
+    }
+  }
+  upper = luv_histogram_upper(i < LUV_HIST_BUCKETS ? i : LUV_HIST_BUCKETS - 1);
+  return (double)(upper < h->max ? upper : h->max);
+}
+
+void luv_push_histogram(lua_State* L, luv_histogram_t* h) {
+  lua_newtable(L);
+  lua_pushnumber(L, h->count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, h->total / 1000);
+  lua_setfield(L, -2, "total");
+  lua_pushnumber(L, h->count ? h->total / h->count / 1000 : 0);
+  lua_setfield(L, -2, "mean");
+  lua_pushnumber(L, (double)h->max / 1000);
+  lua_setfield(L, -2, "max");
+  lua_pushnumber(L, luv_histogram_quantile(h, 0.5) / 1000);
+  lua_setfield(L, -2, "p50");
+  lua_pushnumber(L, luv_histogram_quantile(h, 0.9) / 1000);
+  lua_setfield(L, -2, "p90");
+  lua_pushnumber(L, luv_histogram_quantile(h, 0.99) / 1000);
+  lua_setfield(L, -2, "p99");
+  lua_pushnumber(L, luv_histogram_quantile(h, 0.999) / 1000);
+  lua_setfield(L, -2, "p999");
+}
+
+static luv_source_stats_t* luv_source_stats_new(const char* source) {
+  luv_source_stats_t* entry = malloc(sizeof(luv_source_stats_t));
+  entry->source = source;
+  entry->name = malloc(strlen(source) + 1);
+  strcpy(entry->name, source);
+  memset(&entry->latency, 0, sizeof(entry->latency));
+  return entry;
+}
+
+static void luv_source_stats_free(luv_source_stats_t* entry) {
+  free(entry->name);
+  free(entry);
+}
+
+static unsigned luv_source_hash(const char* source) {
+  unsigned hash = 5381;
+  while (*source) {
+    hash = (hash * 33) ^ (unsigned char)*source++;
+  }
+  return hash;
+}
+
+/* Sources are string literals, so the pointer usually matches and the
+ * comparison only happens for the first call from each call site
+ */
+static luv_source_stats_t* luv_source_stats(luv_loop_stats_t* stats, const char* source) {
+  unsigned i = luv_source_hash(source) % LUV_STATS_TABLE_SIZE;
+  luv_source_stats_t* entry;
+
+  while ((entry = stats->sources[i])) {
+    if (entry->source == source || strcmp(entry->name, source) == 0) {
+      entry->source = source;
+      return entry;
+    }
+    i = (i + 1) % LUV_STATS_TABLE_SIZE;
+  }
+  if (stats->source_count >= LUV_STATS_MAX_SOURCES) {
+    if (!stats->other) {
+      stats->other = luv_source_stats_new("other");
+    }
+    return stats->other;
+  }
+  entry = luv_source_stats_new(source);
+  stats->sources[i] = entry;
+  stats->source_count++;
+  return entry;
+}
+
+static void luv_loop_stats_woke(luv_loop_stats_t* stats, uint64_t now) {
+  if (stats->poll_start) {
+    stats->idle += (double)(now - stats->poll_start) / 1000;
+  }
+  stats->woke = now;
+}
+
+static void luv_loop_stats_on_prepare(uv_prepare_t* handle, int status) {
+  luv_loop_stats_t* stats = handle->data;
+  uint64_t now = uv_hrtime();
+
+  if (stats->woke) {
+    luv_histogram_record(&stats->lag, (now - stats->woke) / 1000);
+    stats->iterations++;
+  }
+  stats->poll_start = now;
+  stats->woke = 0;
+}
+
+static void luv_loop_stats_on_check(uv_check_t* handle, int status) {
+  luv_loop_stats_t* stats = handle->data;
+
+  if (!stats->woke) {
+    luv_loop_stats_woke(stats, uv_hrtime());
+  }
+}
+
+void luv_loop_stats_init(luv_loop_stats_t* stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+uint64_t luv_loop_stats_call_start(luv_loop_stats_t* stats) {
+  uint64_t now = uv_hrtime();
+  if (!stats->woke) {
+    luv_loop_stats_woke(stats, now);
+  }
+  return now;
+}
+
+void luv_loop_stats_call_end(luv_loop_stats_t* stats, const char* source, uint64_t start) {
+  uint64_t elapsed = uv_hrtime() - start;
+  luv_histogram_record(&luv_source_stats(stats, source)->latency, elapsed / 1000);
+}
+
+static void luv_loop_stats_clear(luv_loop_stats_t* stats) {
+  int i;
+
+  for (i = 0; i < LUV_STATS_TABLE_SIZE; i++) {
+    if (stats->sources[i]) {
+      luv_source_stats_free(stats->sources[i]);
+      stats->sources[i] = NULL;
+    }
+  }
+  if (stats->other) {
+    luv_source_stats_free(stats->other);
+    stats->other = NULL;
+  }
+  stats->source_count = 0;
+  stats->iterations = 0;
+  stats->idle = 0;
+  memset(&stats->lag, 0, sizeof(stats->lag));
+  stats->since = uv_hrtime();
+}
+
+/* loopStatsEnable([enable]) turns collection on, or off when enable is false */
+int luv_loop_stats_enable(lua_State* L) {
+  uv_loop_t* loop = luv_get_loop(L);
+  luv_loop_stats_t* stats = &luv_loop_data(loop)->loop_stats;
+  int enable = lua_gettop(L) == 0 || lua_toboolean(L, 1);
+
+  if (enable && !stats->enabled) {
+    if (!stats->initialized) {
+      uv_prepare_init(loop, &stats->prepare);
+      uv_check_init(loop, &stats->check);
+      stats->prepare.data = stats;
+      stats->check.data = stats;
+      /* Measuring the loop mustn't keep it running */
+      uv_unref((uv_handle_t*)&stats->prepare);
+      uv_unref((uv_handle_t*)&stats->check);
+      stats->initialized = 1;
+    }
+    if (!stats->since) {
+      stats->since = uv_hrtime();
+    }
+    uv_prepare_start(&stats->prepare, luv_loop_stats_on_prepare);
+    uv_check_start(&stats->check, luv_loop_stats_on_check);
+    /* We're in a callback, so the loop is awake */
+    stats->woke = uv_hrtime();
+    stats->poll_start = 0;
+    stats->enabled = 1;
+    luv_loop_stats_used = 1;
+  } else if (!enable && stats->enabled) {
+    uv_prepare_stop(&stats->prepare);
+    uv_check_stop(&stats->check);
+    stats->enabled = 0;
+  }
+  return 0;
+}
+
+int luv_loop_stats_reset(lua_State* L) {
+  luv_loop_stats_clear(&luv_loop_data(luv_get_loop(L))->loop_stats);
+  return 0;
+}
+
+int luv_loop_stats(lua_State* L) {
+  luv_loop_stats_t* stats = &luv_loop_data(luv_get_loop(L))->loop_stats;
+  int i;
+
+  lua_newtable(L);
+  lua_pushboolean(L, stats->enabled);
+  lua_setfield(L, -2, "enabled");
+  lua_pushnumber(L, stats->since ? (double)(uv_hrtime() - stats->since) / 1e6 : 0);
+  lua_setfield(L, -2, "elapsed");
+  lua_pushnumber(L, stats->iterations);
+  lua_setfield(L, -2, "iterations");
+  lua_pushnumber(L, stats->idle / 1000);
+  lua_setfield(L, -2, "idle");
+  luv_push_histogram(L, &stats->lag);
+  lua_setfield(L, -2, "lag");
+
+  lua_newtable(L);
+  for (i = 0; i < LUV_STATS_TABLE_SIZE; i++) {
+    if (stats->sources[i]) {
+      luv_push_histogram(L, &stats->sources[i]->latency);
+      lua_setfield(L, -2, stats->sources[i]->name);
+    }
+  }
+  if (stats->other) {
+    luv_push_histogram(L, &stats->other->latency);
+    lua_setfield(L, -2, "other");
+  }
+  lua_setfield(L, -2, "sources");
+
+  return 1;
+}
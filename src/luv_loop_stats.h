@@ -0,0 +1,94 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_LOOP_STATS
+#define LUV_LOOP_STATS
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "uv.h"
+
+/* Latencies are kept in log-linear histograms of microseconds, in the
+ * manner of HdrHistogram: values below LUV_HIST_SUB are exact and every
+ * power of two above is split in LUV_HIST_SUB buckets, so any value is
+ * within 1/LUV_HIST_SUB of its bucket's bounds.  Values of 2^LUV_HIST_BITS
+ * us (about 12 days) and up land in the last bucket.
+ */
+#define LUV_HIST_SUB_BITS 3
+#define LUV_HIST_SUB (1 << LUV_HIST_SUB_BITS)
+#define LUV_HIST_BITS 40
+#define LUV_HIST_BUCKETS ((LUV_HIST_BITS - LUV_HIST_SUB_BITS + 1) * LUV_HIST_SUB)
+
+typedef struct {
+  double counts[LUV_HIST_BUCKETS];
+  double count;
+  double total;   /* us */
+  uint64_t max;   /* us */
+} luv_histogram_t;
+
+void luv_histogram_record(luv_histogram_t* h, uint64_t value);
+
+/* Pushes count and, in ms, total, mean, max and percentiles */
+void luv_push_histogram(lua_State* L, luv_histogram_t* h);
+
+/* Sources past this many share a single "other" entry */
+#define LUV_STATS_MAX_SOURCES 64
+/* Open addressing table of sources, kept at most half full */
+#define LUV_STATS_TABLE_SIZE (2 * LUV_STATS_MAX_SOURCES)
+
+typedef struct {
+  const char* source; /* pointer last passed to luv_acall, checked first */
+  char* name;
+  luv_histogram_t latency;
+} luv_source_stats_t;
+
+/* Opt-in callback and loop lag metrics of a loop, see luv_loop_stats.c */
+typedef struct {
+  int enabled;
+  int initialized;     /* prepare and check below are set up */
+  uv_prepare_t prepare;
+  uv_check_t check;
+  uint64_t since;      /* ns, when collection started or was last reset */
+  uint64_t poll_start; /* ns, when the loop last went to poll */
+  uint64_t woke;       /* ns, when it last woke up, 0 while polling */
+  int depth;           /* luv_acall calls in progress */
+  double iterations;
+  double idle;         /* us spent waiting in poll */
+  luv_histogram_t lag; /* per iteration, from waking to polling again */
+  luv_source_stats_t* sources[LUV_STATS_TABLE_SIZE];
+  luv_source_stats_t* other;
+  int source_count;
+} luv_loop_stats_t;
+
+void luv_loop_stats_init(luv_loop_stats_t* stats);
+
+/* Set once any loop has collected stats, until then luv_acall doesn't
+ * look up its loop's
+ */
+extern int luv_loop_stats_used;
+
+/* Called by luv_acall around each callback with its loop's stats, start
+ * returns the time to hand to end
+ */
+uint64_t luv_loop_stats_call_start(luv_loop_stats_t* stats);
+void luv_loop_stats_call_end(luv_loop_stats_t* stats, const char* source, uint64_t start);
+
+int luv_loop_stats_enable(lua_State* L);
+int luv_loop_stats_reset(lua_State* L);
+int luv_loop_stats(lua_State* L);
+
+#endif
@@ -18,6 +18,11 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
 
 #include "uv.h"
 #include "luv_misc.h"
@@ -192,6 +197,30 @@ int luv_handle_type(lua_State* L) {
   return 1;
 }
 
+/* waitWritable(fd, timeout) blocks until fd can take more data or timeout
+ * ms have passed, for sync writes to a non-blocking pipe that would
+ * otherwise spin on EAGAIN.  Returns whether fd is writable.
+ */
+int luv_wait_writable(lua_State* L) {
+  int fd = luaL_checkint(L, 1);
+  int timeout = luaL_optint(L, 2, -1);
+#ifdef _WIN32
+  lua_pushboolean(L, 1);
+#else
+  struct pollfd p;
+  int r;
+
+  p.fd = fd;
+  p.events = POLLOUT;
+  p.revents = 0;
+  do {
+    r = poll(&p, 1, timeout);
+  } while (r < 0 && errno == EINTR);
+  lua_pushboolean(L, r > 0);
+#endif
+  return 1;
+}
+
 #ifndef NDEBUG
 extern void uv_print_active_handles(uv_loop_t *loop);
 extern void uv_print_all_handles(uv_loop_t *loop);
@@ -38,6 +38,7 @@ int luv_execpath(lua_State* L);
 int luv_get_process_title(lua_State* L);
 int luv_set_process_title(lua_State* L);
 int luv_handle_type(lua_State* L);
+int luv_wait_writable(lua_State* L);
 
 #ifndef NDEBUG
 int luv_print_active_handles(lua_State* L);
@@ -56,9 +56,12 @@ int luv_pipe_connect(lua_State* L) {
   uv_pipe_t* handle = (uv_pipe_t*)luv_checkudata(L, 1, "pipe");
   const char* name = luaL_checkstring(L, 2);
 
-  uv_connect_t* req = (uv_connect_t*)malloc(sizeof(uv_connect_t));
+  luv_req_t* req = luv_req_alloc(handle->loop, LUV_REQ_CONNECT);
 
-  uv_pipe_connect(req, handle, name, luv_after_connect);
+  if (!req) {
+    return luaL_error(L, "pipe_connect: %s", uv_strerror(uv_last_error(handle->loop)));
+  }
+  uv_pipe_connect(&req->uv.connect, handle, name, luv_after_connect);
 
   return 0;
 }
@@ -35,7 +35,7 @@ void luv_process_on_exit(uv_process_t* handle, int exit_status, int term_signal)
 
   lua_pushinteger(L, exit_status);
   lua_pushinteger(L, term_signal);
-  luv_emit_event(L, "exit", 2);
+  luv_emit_event_slot(L, LUV_EVENT_EXIT, 2);
   luv_handle_unref(L, handle->data);
 
 }
@@ -89,7 +89,9 @@ int luv_spawn(lua_State* L) {
   uv_stream_t* stdout_stream = (uv_stream_t*)luv_checkudata(L, 2, "pipe");
   uv_stream_t* stderr_stream = (uv_stream_t*)luv_checkudata(L, 3, "pipe");
   const char* command = luaL_checkstring(L, 4);
+  uv_stream_t* ipc_stream = NULL;
   size_t argc;
+  size_t envc;
   char** args;
   size_t i;
   int ignore_stdio;
@@ -97,12 +99,16 @@ int luv_spawn(lua_State* L) {
   char** env;
   const char* stdio_str;
   uv_process_options_t options;
-  uv_stdio_container_t stdio[3];
+  uv_stdio_container_t stdio[4];
   uv_process_t* handle;
   int r;
 
   luaL_checktype(L, 5, LUA_TTABLE); /* args */
   luaL_checktype(L, 6, LUA_TTABLE); /* options */
+  if (!lua_isnoneornil(L, 7)) {
+    /* IPC channel, an ipc pipe that becomes the child's fd 3 */
+    ipc_stream = (uv_stream_t*)luv_checkudata(L, 7, "pipe");
+  }
 
   memset(&options, 0, sizeof(uv_process_options_t));
   memset(stdio, 0, sizeof(stdio));
@@ -135,6 +141,12 @@ int luv_spawn(lua_State* L) {
     options.stdio[2].data.stream = stderr_stream;
   }
 
+  if (ipc_stream) {
+    options.stdio[3].flags = UV_CREATE_PIPE | UV_READABLE_PIPE | UV_WRITABLE_PIPE;
+    options.stdio[3].data.stream = ipc_stream;
+    options.stdio_count = 4;
+  }
+
   /*
   TODO: Handle creating pipes
   options.stdio[0].flags = UV_INHERIT_STREAM;
@@ -142,9 +154,21 @@ int luv_spawn(lua_State* L) {
   options.stdio[2].flags = UV_INHERIT_STREAM;
   */
 
-  /* Parse the args array */
+  /* Get the cwd */
+  lua_getfield(L, 6, "cwd");
+  cwd = (char*)lua_tostring(L, -1);
+  lua_pop(L, 1);
+
+  /* args and env share a single allocation, the strings themselves stay
+   * owned by the tables on the stack until uv_spawn is done with them */
   argc = lua_objlen(L, 5) + 1;
-  args = malloc((argc + 1) * sizeof(char*));
+  lua_getfield(L, 6, "envPairs");
+  envc = lua_type(L, -1) == LUA_TTABLE ? lua_objlen(L, -1) : 0;
+  args = malloc((argc + 1 + envc + 1) * sizeof(char*));
+  if (args == NULL) {
+    return luaL_error(L, "spawn: out of memory");
+  }
+
   args[0] = (char*)command;
   for (i = 1; i < argc; i++) {
     lua_rawgeti(L, 5, i);
@@ -153,23 +177,15 @@ int luv_spawn(lua_State* L) {
   }
   args[argc] = NULL;
 
-  /* Get the cwd */
-  lua_getfield(L, 6, "cwd");
-  cwd = (char*)lua_tostring(L, -1);
-  lua_pop(L, 1);
-
-  /* Get the env */
-  lua_getfield(L, 6, "envPairs");
   env = NULL;
   if (lua_type(L, -1) == LUA_TTABLE) {
-    argc = lua_objlen(L, -1);
-    env = malloc((argc + 1) * sizeof(char*));
-    for (i = 0; i < argc; i++) {
+    env = args + argc + 1;
+    for (i = 0; i < envc; i++) {
       lua_rawgeti(L, -1, i + 1);
       env[i] = (char*)lua_tostring(L, -1);
       lua_pop(L, 1);
     }
-    env[argc] = NULL;
+    env[envc] = NULL;
   }
   lua_pop(L, 1);
 
@@ -192,7 +208,6 @@ int luv_spawn(lua_State* L) {
   luv_handle_ref(L, handle->data, -1);
   r = uv_spawn(luv_get_loop(L), handle, options);
   free(args);
-  if (env) free(env);
   if (r) {
     uv_err_t err = uv_last_error(luv_get_loop(L));
     return luaL_error(L, "spawn: %s", uv_strerror(err));
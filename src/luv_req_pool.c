@@ -0,0 +1,104 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "luv_req_pool.h"
+#include "utils.h"
+
+void luv_req_pool_init(luv_req_pool_t* pool) {
+  memset(pool, 0, sizeof(*pool));
+  pool->limit = LUV_REQ_POOL_DEFAULT_LIMIT;
+}
+
+void luv_req_pool_trim(luv_req_pool_t* pool) {
+  luv_req_t* req;
+
+  while ((req = pool->free)) {
+    pool->free = req->next;
+    free(req);
+  }
+  pool->free_count = 0;
+}
+
+luv_req_t* luv_req_alloc(uv_loop_t* loop, luv_req_kind_t kind) {
+  luv_req_pool_t* pool = &luv_loop_data(loop)->req_pool;
+  luv_req_t* req;
+
+  if (pool->free) {
+    req = pool->free;
+    pool->free = req->next;
+    pool->free_count--;
+    pool->hits++;
+  } else {
+    req = malloc(sizeof(luv_req_t));
+    if (!req) {
+      loop->last_err.code = UV_ENOMEM;
+      loop->last_err.sys_errno_ = ENOMEM;
+      return NULL;
+    }
+    pool->misses++;
+  }
+
+  req->next = NULL;
+  req->kind = kind;
+  luv_io_ctx_init(&req->cbs);
+  pool->in_use++;
+  luv_req_stats_start(loop, kind);
+  return req;
+}
+
+void luv_req_release(uv_loop_t* loop, luv_req_t* req) {
+  luv_req_pool_t* pool = &luv_loop_data(loop)->req_pool;
+
+  assert(pool->in_use > 0);
+  pool->in_use--;
+  luv_req_stats_end(loop, req->kind);
+
+  if (pool->free_count >= pool->limit) {
+    pool->dropped++;
+    free(req);
+    return;
+  }
+
+  req->next = pool->free;
+  pool->free = req;
+  pool->free_count++;
+}
+
+int luv_req_pool_stats(lua_State* L) {
+  luv_req_pool_t* pool = &luv_loop_data(luv_get_loop(L))->req_pool;
+
+  lua_newtable(L);
+  lua_pushnumber(L, pool->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, pool->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, pool->dropped);
+  lua_setfield(L, -2, "dropped");
+  lua_pushnumber(L, pool->in_use);
+  lua_setfield(L, -2, "inUse");
+  lua_pushnumber(L, pool->free_count);
+  lua_setfield(L, -2, "free");
+  lua_pushnumber(L, pool->limit);
+  lua_setfield(L, -2, "limit");
+
+  return 1;
+}
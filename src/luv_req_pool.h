@@ -0,0 +1,48 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_REQ_POOL
+#define LUV_REQ_POOL
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "uv.h"
+
+/* Default cap on the requests kept in the freelist of a single loop */
+#define LUV_REQ_POOL_DEFAULT_LIMIT 1024
+
+/* Defined in utils.h next to luv_io_ctx_t, which it embeds */
+typedef struct luv_req_s luv_req_t;
+
+typedef struct {
+  luv_req_t* free;
+  size_t free_count; /* requests currently sitting in the freelist */
+  size_t limit;      /* max requests retained in the freelist */
+  size_t in_use;     /* requests handed out and not yet released */
+  double hits;       /* allocations served from the freelist */
+  double misses;     /* allocations that had to malloc */
+  double dropped;    /* releases freed because the pool was full */
+} luv_req_pool_t;
+
+void luv_req_pool_init(luv_req_pool_t* pool);
+
+/* Free everything sitting in the freelist */
+void luv_req_pool_trim(luv_req_pool_t* pool);
+
+int luv_req_pool_stats(lua_State* L);
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#include "luv_shm.h"
+#include "utils.h"
+
+#ifndef _WIN32
+
+#define LUV_SHM_MAGIC 0x4c534852 /* "LSHR" */
+
+/* Marks the rest of the ring as unused, the next message is at the start */
+#define LUV_SHM_WRAP 0xffffffff
+
+/* Messages start on 8 byte boundaries */
+#define LUV_SHM_ALIGN(n) (((n) + 7) & ~(uint32_t)7)
+
+/* head and tail count bytes, wrapping past 4G, and the ring size is a power
+ * of two so their difference is always the bytes in use.  They sit on
+ * their own cache lines.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t size;
+  volatile uint32_t reader_waiting;
+  volatile uint32_t writer_waiting;
+  char pad0[48];
+  volatile uint32_t head;
+  char pad1[60];
+  volatile uint32_t tail;
+  char pad2[60];
+} luv_shm_header_t;
+
+typedef struct {
+  luv_shm_header_t* header;
+  unsigned char* data;
+  size_t map_len;
+  uint32_t peeked;     /* record size of the message peek handed out */
+  double messages;     /* written or read through this side */
+} luv_shm_t;
+
+static luv_shm_t* luv_shm_check(lua_State* L) {
+  luv_shm_t* ring = (luv_shm_t*)luaL_checkudata(L, 1, "luv_shm");
+  if (!ring->header) {
+    luaL_error(L, "shm: ring is closed");
+  }
+  return ring;
+}
+
+static luv_shm_t* luv_shm_map(lua_State* L, int fd, size_t map_len) {
+  void* addr;
+  luv_shm_t* ring;
+
+  addr = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    luaL_error(L, "shm mmap: %s", strerror(errno));
+  }
+  ring = (luv_shm_t*)lua_newuserdata(L, sizeof(luv_shm_t));
+  memset(ring, 0, sizeof(luv_shm_t));
+  ring->header = (luv_shm_header_t*)addr;
+  ring->data = (unsigned char*)addr + sizeof(luv_shm_header_t);
+  ring->map_len = map_len;
+  luaL_getmetatable(L, "luv_shm");
+  lua_setmetatable(L, -2);
+  return ring;
+}
+
+/* shmCreate(name, size) makes a new ring of at least size bytes */
+int luv_shm_create(lua_State* L) {
+  const char* name = luaL_checkstring(L, 1);
+  uint32_t want = (uint32_t)luaL_checknumber(L, 2);
+  uint32_t size = 4096;
+  size_t map_len;
+  luv_shm_t* ring;
+  int fd;
+
+  luaL_argcheck(L, want <= 0x40000000, 2, "ring too big");
+  while (size < want) size <<= 1;
+  map_len = sizeof(luv_shm_header_t) + size;
+
+  fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    return luaL_error(L, "shm_open %s: %s", name, strerror(errno));
+  }
+  if (ftruncate(fd, map_len)) {
+    int err = errno;
+    close(fd);
+    shm_unlink(name);
+    return luaL_error(L, "shm ftruncate: %s", strerror(err));
+  }
+  ring = luv_shm_map(L, fd, map_len);
+  ring->header->size = size;
+  ring->header->head = 0;
+  ring->header->tail = 0;
+  /* The other side checks magic before reading anything else */
+  __sync_synchronize();
+  ring->header->magic = LUV_SHM_MAGIC;
+  return 1;
+}
+
+/* shmAttach(name) maps a ring another process made */
+int luv_shm_attach(lua_State* L) {
+  const char* name = luaL_checkstring(L, 1);
+  struct stat st;
+  luv_shm_t* ring;
+  int fd;
+
+  fd = shm_open(name, O_RDWR, 0600);
+  if (fd < 0) {
+    return luaL_error(L, "shm_open %s: %s", name, strerror(errno));
+  }
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(luv_shm_header_t)) {
+    close(fd);
+    return luaL_error(L, "shm %s: not a ring", name);
+  }
+  ring = luv_shm_map(L, fd, st.st_size);
+  __sync_synchronize();
+  if (ring->header->magic != LUV_SHM_MAGIC ||
+      sizeof(luv_shm_header_t) + ring->header->size != ring->map_len) {
+    munmap(ring->header, ring->map_len);
+    ring->header = NULL;
+    return luaL_error(L, "shm %s: not a ring", name);
+  }
+  return 1;
+}
+
+/* shmUnlink(name) removes the name, mappings stay valid until closed */
+int luv_shm_unlink(lua_State* L) {
+  const char* name = luaL_checkstring(L, 1);
+  if (shm_unlink(name) && errno != ENOENT) {
+    return luaL_error(L, "shm_unlink %s: %s", name, strerror(errno));
+  }
+  return 0;
+}
+
+/* mkfifo(path, [mode]) makes the named pipe rings send wakeups over */
+int luv_mkfifo(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  int mode = luaL_optint(L, 2, 0600);
+  if (mkfifo(path, mode) && errno != EEXIST) {
+    return luaL_error(L, "mkfifo %s: %s", path, strerror(errno));
+  }
+  return 0;
+}
+
+/* ring:write(chunk) copies a string or Buffer in as one message.  Returns
+ * false when it doesn't fit yet, the reader then wakes us once it frees
+ * space.  The second result says the reader is asleep and needs a wakeup.
+ */
+static int luv_shm_write(lua_State* L) {
+  luv_shm_t* ring = luv_shm_check(L);
+  luv_shm_header_t* header = ring->header;
+  uint32_t size = header->size;
+  size_t len;
+  const char* chunk = luv_checkbuffer(L, 2, &len);
+  uint32_t head = header->head;
+  uint32_t offset = head & (size - 1);
+  uint32_t record = LUV_SHM_ALIGN(4 + (uint32_t)len);
+  uint32_t gap = 0;
+  int wake = 0;
+
+  /* Wrapping could need up to half the ring on top of the message */
+  luaL_argcheck(L, len <= size / 2 - 8, 2, "message bigger than half the ring");
+  if (offset + record > size) {
+    gap = size - offset;
+  }
+
+  if (size - (head - header->tail) < gap + record) {
+    header->writer_waiting = 1;
+    __sync_synchronize();
+    if (size - (head - header->tail) < gap + record) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+    header->writer_waiting = 0;
+  }
+
+  if (gap) {
+    *(uint32_t*)(ring->data + offset) = LUV_SHM_WRAP;
+    head += gap;
+    offset = 0;
+  }
+  *(uint32_t*)(ring->data + offset) = (uint32_t)len;
+  memcpy(ring->data + offset + 4, chunk, len);
+  __sync_synchronize();
+  header->head = head + record;
+  ring->messages++;
+
+  /* Pairs with the barrier in peek between flagging and looking again */
+  __sync_synchronize();
+  if (header->reader_waiting) {
+    header->reader_waiting = 0;
+    wake = 1;
+  }
+  lua_pushboolean(L, 1);
+  lua_pushboolean(L, wake);
+  return 2;
+}
+
+/* ring:peek() returns a pointer to the next message and its length without
+ * taking it off the ring, nil when there's none.  consume() takes it off,
+ * the memory may be reused by the writer right away.
+ */
+static int luv_shm_peek(lua_State* L) {
+  luv_shm_t* ring = luv_shm_check(L);
+  luv_shm_header_t* header = ring->header;
+  uint32_t size = header->size;
+  uint32_t tail = header->tail;
+  uint32_t head;
+  uint32_t len;
+
+  for (;;) {
+    head = header->head;
+    if (head == tail) {
+      header->reader_waiting = 1;
+      __sync_synchronize();
+      head = header->head;
+      if (head == tail) {
+        return 0;
+      }
+      header->reader_waiting = 0;
+    }
+    __sync_synchronize();
+    len = *(uint32_t*)(ring->data + (tail & (size - 1)));
+    if (len != LUV_SHM_WRAP) break;
+    /* Skip the unused end, handing it back to the writer */
+    tail += size - (tail & (size - 1));
+    header->tail = tail;
+  }
+
+  ring->peeked = LUV_SHM_ALIGN(4 + len);
+  lua_pushlightuserdata(L, ring->data + (tail & (size - 1)) + 4);
+  lua_pushinteger(L, len);
+  return 2;
+}
+
+/* ring:consume() returns true when the writer is waiting for space */
+static int luv_shm_consume(lua_State* L) {
+  luv_shm_t* ring = luv_shm_check(L);
+  luv_shm_header_t* header = ring->header;
+  int wake = 0;
+
+  if (!ring->peeked) {
+    return luaL_error(L, "shm: nothing to consume");
+  }
+  /* Done reading the message before the writer may reuse it */
+  __sync_synchronize();
+  header->tail = header->tail + ring->peeked;
+  ring->peeked = 0;
+  ring->messages++;
+  __sync_synchronize();
+  if (header->writer_waiting) {
+    header->writer_waiting = 0;
+    wake = 1;
+  }
+  lua_pushboolean(L, wake);
+  return 1;
+}
+
+static int luv_shm_stats(lua_State* L) {
+  luv_shm_t* ring = luv_shm_check(L);
+  luv_shm_header_t* header = ring->header;
+  lua_newtable(L);
+  lua_pushnumber(L, header->size);
+  lua_setfield(L, -2, "size");
+  lua_pushnumber(L, header->head - header->tail);
+  lua_setfield(L, -2, "used");
+  lua_pushnumber(L, ring->messages);
+  lua_setfield(L, -2, "messages");
+  return 1;
+}
+
+/* ring:close() unmaps it, messages handed out by peek are gone with it */
+static int luv_shm_close(lua_State* L) {
+  luv_shm_t* ring = (luv_shm_t*)luaL_checkudata(L, 1, "luv_shm");
+  if (ring->header) {
+    munmap(ring->header, ring->map_len);
+    ring->header = NULL;
+  }
+  return 0;
+}
+
+void luv_shm_open(lua_State* L) {
+  luaL_newmetatable(L, "luv_shm");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, luv_shm_close);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, luv_shm_write);
+  lua_setfield(L, -2, "write");
+  lua_pushcfunction(L, luv_shm_peek);
+  lua_setfield(L, -2, "peek");
+  lua_pushcfunction(L, luv_shm_consume);
+  lua_setfield(L, -2, "consume");
+  lua_pushcfunction(L, luv_shm_stats);
+  lua_setfield(L, -2, "stats");
+  lua_pushcfunction(L, luv_shm_close);
+  lua_setfield(L, -2, "close");
+  lua_pop(L, 1);
+}
+
+#else
+
+static int luv_shm_unsupported(lua_State* L) {
+  return luaL_error(L, "shm: shared memory rings need POSIX shm_open");
+}
+
+int luv_shm_create(lua_State* L) { return luv_shm_unsupported(L); }
+int luv_shm_attach(lua_State* L) { return luv_shm_unsupported(L); }
+int luv_shm_unlink(lua_State* L) { return luv_shm_unsupported(L); }
+int luv_mkfifo(lua_State* L) { return luv_shm_unsupported(L); }
+
+void luv_shm_open(lua_State* L) {
+}
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_SHM
+#define LUV_SHM
+
+#include "lua.h"
+#include "lauxlib.h"
+
+/* Single producer, single consumer rings of length prefixed messages in
+ * POSIX shared memory, for moving big payloads between processes on one
+ * machine without copying them through a socket.  Only the reader writes
+ * tail and only the writer writes head, each side flags when it waits on
+ * the other so wakeups are only sent when someone is asleep.
+ */
+
+/* Registers the metatable of ring userdata */
+void luv_shm_open(lua_State* L);
+
+int luv_shm_create(lua_State* L);
+int luv_shm_attach(lua_State* L);
+int luv_shm_unlink(lua_State* L);
+int luv_mkfifo(lua_State* L);
+
+#endif
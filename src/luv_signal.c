@@ -5,7 +5,7 @@ static void _luv_on_signal(uv_signal_t* handle, int signum)
   /* load the lua state and put the userdata on the stack */
   lua_State* L = luv_handle_get_lua(handle->data);
   lua_pushnumber(L, signum);
-  luv_emit_event(L, "signal", 1);
+  luv_emit_event_slot(L, LUV_EVENT_SIGNAL, 1);
 }
 
 int luv_new_signal(lua_State* L)
@@ -16,6 +16,11 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "luv_stream.h"
 
@@ -25,9 +30,9 @@ void luv_on_connection(uv_stream_t* handle, int status) {
 
   if (status == -1) {
     luv_push_async_error(L, uv_last_error(luv_get_loop(L)), "on_connection", NULL);
-    luv_emit_event(L, "error", 1);
+    luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
   } else {
-    luv_emit_event(L, "connection", 0);
+    luv_emit_event_slot(L, LUV_EVENT_CONNECTION, 0);
   }
 }
 
@@ -37,40 +42,114 @@ void luv_on_read(uv_stream_t* handle, ssize_t nread, uv_buf_t buf) {
 
   if (nread >= 0) {
 
-    lua_pushlstring (L, buf.base, nread);
-    lua_pushinteger (L, nread);
-    luv_emit_event(L, "data", 2);
+    /* Don't bother building the string if nobody wants it */
+    if (!luv_has_event((luv_handle_t*)handle->data, LUV_EVENT_DATA)) {
+      lua_pop(L, 1);
+    } else {
+      lua_pushlstring (L, buf.base, nread);
+      lua_pushinteger (L, nread);
+      luv_emit_event_slot(L, LUV_EVENT_DATA, 2);
+    }
 
   } else {
     uv_err_t err = uv_last_error(luv_get_loop(L));
     if (err.code == UV_EOF) {
-      luv_emit_event(L, "end", 0);
+      luv_emit_event_slot(L, LUV_EVENT_END, 0);
     } else {
       luv_push_async_error(L, uv_last_error(luv_get_loop(L)), "on_read", NULL);
-      luv_emit_event(L, "error", 1);
+      luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
+    }
+  }
+
+  luv_on_alloc_release((uv_handle_t*)handle, buf);
+}
+
+/* IPC pipes can carry a handle along with the data.  It's announced with a
+ * "handle" event naming its type, whose listener must accept it into a new
+ * handle of that type right away, before the data is emitted.
+ */
+static void luv_on_read2(uv_pipe_t* handle, ssize_t nread, uv_buf_t buf,
+                         uv_handle_type pending) {
+  if (pending != UV_UNKNOWN_HANDLE) {
+    lua_State* L = luv_handle_get_lua(handle->data);
+    const char* type;
+    switch (pending) {
+      case UV_TCP: type = "tcp"; break;
+      case UV_UDP: type = "udp"; break;
+      default: type = "pipe"; break;
     }
+    lua_pushstring(L, type);
+    luv_emit_event(L, "handle", 1);
+  }
+  luv_on_read((uv_stream_t*)handle, nread, buf);
+}
+
+/* Buffer mode reads get a plain malloc'd buffer that is handed over to Lua,
+ * which wraps it in a buffer.Buffer that frees it on gc.
+ */
+static uv_buf_t luv_on_alloc_owned(uv_handle_t* handle, size_t suggested_size) {
+  return uv_buf_init(malloc(suggested_size), suggested_size);
+}
+
+void luv_on_read_buffer(uv_stream_t* handle, ssize_t nread, uv_buf_t buf) {
+  /* load the lua state and the userdata */
+  lua_State* L = luv_handle_get_lua(handle->data);
+
+  if (nread > 0) {
+    char* base;
+
+    /* Nobody would take ownership of the memory */
+    if (!luv_has_event((luv_handle_t*)handle->data, LUV_EVENT_DATA)) {
+      lua_pop(L, 1);
+      free(buf.base);
+      return;
+    }
+
+    /* Give back the unused tail of the read buffer */
+    base = (size_t)nread < buf.len ? realloc(buf.base, nread) : buf.base;
+    if (!base) {
+      base = buf.base;
+    }
+
+    lua_pushlightuserdata(L, base);
+    lua_pushinteger(L, nread);
+    luv_emit_event_slot(L, LUV_EVENT_DATA, 2);
+    return;
   }
 
   free(buf.base);
+
+  if (nread == 0) {
+    lua_pop(L, 1);
+  } else {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    if (err.code == UV_EOF) {
+      luv_emit_event_slot(L, LUV_EVENT_END, 0);
+    } else {
+      luv_push_async_error(L, err, "on_read", NULL);
+      luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
+    }
+  }
 }
 
 void luv_after_connect(uv_connect_t* req, int status) {
+  uv_loop_t* loop = req->handle->loop;
   /* load the lua state and the userdata */
   lua_State* L = luv_handle_get_lua(req->handle->data);
 
   if (status == -1) {
     luv_push_async_error(L, uv_last_error(luv_get_loop(L)), "after_connect", NULL);
-    luv_emit_event(L, "error", 1);
+    luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
   } else {
-    luv_emit_event(L, "connect", 0);
+    luv_emit_event_slot(L, LUV_EVENT_CONNECT, 0);
   }
-  free(req);
+  luv_req_release(loop, (luv_req_t*)req);
 
 }
 
 
 void luv_after_shutdown(uv_shutdown_t* req, int status) {
-  luv_io_ctx_t *cbs = req->data;
+  luv_io_ctx_t *cbs = &((luv_req_t*)req)->cbs;
 
   /* load the lua state and the userdata */
   lua_State *L = luv_handle_get_lua(req->handle->data);
@@ -92,12 +171,11 @@ void luv_after_shutdown(uv_shutdown_t* req, int status) {
   }
 
   luv_handle_unref(L, req->handle->data);
-  free(req->data);
-  free(req);
+  luv_req_release(req->handle->loop, (luv_req_t*)req);
 }
 
 void luv_after_write(uv_write_t* req, int status) {
-  luv_io_ctx_t *cbs = req->data;
+  luv_io_ctx_t *cbs = &((luv_req_t*)req)->cbs;
 
   /* load the lua state and the userdata */
   lua_State *L = luv_handle_get_lua(req->handle->data);
@@ -119,25 +197,22 @@ void luv_after_write(uv_write_t* req, int status) {
   }
 
   luv_handle_unref(L, req->handle->data);
-  free(req->data);
-  free(req);
+  luv_req_release(req->handle->loop, (luv_req_t*)req);
 }
 
 int luv_shutdown(lua_State* L) {
-  luv_io_ctx_t *cbs;
   uv_stream_t* handle = (uv_stream_t*)luv_checkudata(L, 1, "stream");
+  luv_req_t* req = luv_req_alloc(handle->loop, LUV_REQ_SHUTDOWN);
 
-  uv_shutdown_t* req = (uv_shutdown_t*)malloc(sizeof(uv_shutdown_t));
-  cbs = malloc(sizeof(luv_io_ctx_t));
-  luv_io_ctx_init(cbs);
-
+  if (!req) {
+    return luaL_error(L, "shutdown: %s", uv_strerror(uv_last_error(handle->loop)));
+  }
   /* Store a reference to the callback */
-  luv_io_ctx_callback_add(L, cbs, 2);
-  req->data = (void*)cbs;
+  luv_io_ctx_callback_add(L, &req->cbs, 2);
 
   luv_handle_ref(L, handle->data, 1);
 
-  uv_shutdown(req, handle, luv_after_shutdown);
+  uv_shutdown(&req->uv.shutdown, handle, luv_after_shutdown);
 
   return 0;
 }
@@ -156,7 +231,7 @@ int luv_listen (lua_State* L) {
   }
 
   lua_pushvalue(L, 1);
-  luv_emit_event(L, "listening", 0);
+  luv_emit_event_slot(L, LUV_EVENT_LISTENING, 0);
 
   luv_handle_ref(L, handle->data, 1);
 
@@ -176,13 +251,24 @@ int luv_accept (lua_State* L) {
 
 int luv_read_start (lua_State* L) {
   uv_stream_t* handle = (uv_stream_t*)luv_checkudata(L, 1, "stream");
-  uv_read_start(handle, luv_on_alloc, luv_on_read);
+  if (handle->type == UV_NAMED_PIPE && ((uv_pipe_t*)handle)->ipc) {
+    uv_read2_start(handle, luv_on_alloc, luv_on_read2);
+  } else {
+    uv_read_start(handle, luv_on_alloc, luv_on_read);
+  }
   luv_handle_ref(L, handle->data, 1);
   return 0;
 }
 
+/* Like luv_read_start, but "data" receives a lightuserdata pointer to a
+ * malloc'd chunk and its length instead of a string.  The receiver owns the
+ * memory and must free it.  uv.Stream wraps it in a buffer.Buffer.
+ */
 int luv_read_start2(lua_State* L) {
-  return luaL_error(L, "TODO: Implement luv_read_start2");
+  uv_stream_t* handle = (uv_stream_t*)luv_checkudata(L, 1, "stream");
+  uv_read_start(handle, luv_on_alloc_owned, luv_on_read_buffer);
+  luv_handle_ref(L, handle->data, 1);
+  return 0;
 }
 
 int luv_read_stop(lua_State* L) {
@@ -207,32 +293,294 @@ int luv_write_queue_size(lua_State* L) {
   return 1;
 }
 
+/* Chunk lists up to this size are collected on the C stack */
+#define LUV_WRITE_STACK_BUFS 16
+
+/* Accepts a string, a Buffer or a list of strings and Buffers.  Lists are
+ * submitted as a single uv_write so they go out with one writev.
+ */
 int luv_write(lua_State* L) {
-  uv_buf_t buf;
+  uv_buf_t stack_bufs[LUV_WRITE_STACK_BUFS];
+  uv_buf_t* bufs = stack_bufs;
   uv_stream_t* handle = (uv_stream_t*)luv_checkudata(L, 1, "stream");
   size_t len;
-  luv_io_ctx_t *cbs;
-  const char* chunk = luaL_checklstring(L, 2, &len);
+  int count = 1;
+  int is_list = lua_istable(L, 2) && !luv_isbuffer(L, 2);
+  int i;
+  luv_req_t* req;
+
+  req = luv_req_alloc(handle->loop, LUV_REQ_WRITE);
+  if (!req) {
+    return luaL_error(L, "write: %s", uv_strerror(uv_last_error(handle->loop)));
+  }
 
-  uv_write_t* req = (uv_write_t*)malloc(sizeof(uv_write_t));
-  cbs = malloc(sizeof(luv_io_ctx_t));
-  luv_io_ctx_init(cbs);
+  /* Every chunk is pinned in the req until the write completes, numbers as
+   * the strings they are converted to */
+  if (is_list) {
+    count = lua_objlen(L, 2);
+    if (count > LUV_WRITE_STACK_BUFS) {
+      /* uv_write copies the buf list, the scratch userdata stays on the
+       * stack until then so a collection meanwhile can't free it */
+      bufs = lua_newuserdata(L, sizeof(uv_buf_t) * count);
+    }
+    for (i = 0; i < count; i++) {
+      const char* chunk;
+      lua_rawgeti(L, 2, i + 1);
+      if (!lua_isstring(L, -1) && !luv_isbuffer(L, -1)) {
+        luv_io_ctx_unref(L, &req->cbs);
+        luv_req_release(handle->loop, req);
+        return luaL_argerror(L, 2, "chunks must be strings or Buffers");
+      }
+      chunk = luv_checkbuffer(L, -1, &len);
+      luv_io_ctx_add(L, &req->cbs, -1);
+      bufs[i] = uv_buf_init((char*)chunk, len);
+      lua_pop(L, 1);
+    }
+    /* libuv wants at least one buffer */
+    if (count == 0) {
+      bufs[0] = uv_buf_init("", 0);
+      count = 1;
+    }
+  } else {
+    const char* chunk;
+    if (!lua_isstring(L, 2) && !luv_isbuffer(L, 2)) {
+      luv_req_release(handle->loop, req);
+      return luaL_typerror(L, 2, "string or Buffer");
+    }
+    chunk = luv_checkbuffer(L, 2, &len);
+    luv_io_ctx_add(L, &req->cbs, 2);
+    bufs[0] = uv_buf_init((char*)chunk, len);
+  }
 
   /* Store a reference to the callback */
-  luv_io_ctx_add(L, cbs, 2);
-  luv_io_ctx_callback_add(L, cbs, 3);
-
-  req->data = (void*)cbs;
+  luv_io_ctx_callback_add(L, &req->cbs, 3);
 
   luv_handle_ref(L, handle->data, 1);
-  buf = uv_buf_init((char*)chunk, len);
 
-  uv_write(req, handle, &buf, 1, luv_after_write);
+  if (uv_write(&req->uv.write, handle, bufs, count, luv_after_write)) {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_handle_unref(L, handle->data);
+    luv_req_release(handle->loop, req);
+    return luaL_error(L, "write: %s", uv_strerror(err));
+  }
   return 0;
 }
 
+/* pipe:write2(chunk, send_handle, callback) writes chunk over an IPC pipe
+ * with send_handle's socket attached.  The other side sees it as a "handle"
+ * event, the sender may close send_handle once the callback runs.
+ */
 int luv_write2(lua_State* L) {
-  return luaL_error(L, "TODO: Implement luv_write2");
+  uv_stream_t* handle = (uv_stream_t*)luv_checkudata(L, 1, "pipe");
+  uv_stream_t* send_handle = (uv_stream_t*)luv_checkudata(L, 3, "stream");
+  size_t len;
+  const char* chunk = luv_checkbuffer(L, 2, &len);
+  uv_buf_t buf = uv_buf_init((char*)chunk, len);
+  luv_req_t* req;
+
+  if (!((uv_pipe_t*)handle)->ipc) {
+    return luaL_error(L, "write2: not an ipc pipe");
+  }
+
+  req = luv_req_alloc(handle->loop, LUV_REQ_WRITE);
+  if (!req) {
+    return luaL_error(L, "write2: %s", uv_strerror(uv_last_error(handle->loop)));
+  }
+
+  /* Keep the chunk and the handle being sent alive until the write is done */
+  luv_io_ctx_add(L, &req->cbs, 2);
+  luv_io_ctx_add(L, &req->cbs, 3);
+
+  /* Store a reference to the callback */
+  luv_io_ctx_callback_add(L, &req->cbs, 4);
+
+  luv_handle_ref(L, handle->data, 1);
+
+  if (uv_write2(&req->uv.write, handle, &buf, 1, send_handle, luv_after_write)) {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_handle_unref(L, handle->data);
+    luv_req_release(handle->loop, req);
+    return luaL_error(L, "write2: %s", uv_strerror(err));
+  }
+  return 0;
 }
 
+/* The OS descriptor behind a stream, for pushing file data at it with
+ * sendfile.  Returns nil where streams aren't backed by one.
+ */
+int luv_stream_fileno(lua_State* L) {
+  uv_stream_t* handle = (uv_stream_t*)luv_checkudata(L, 1, "stream");
+#ifdef _WIN32
+  (void)handle;
+  lua_pushnil(L);
+#else
+  lua_pushinteger(L, handle->io_watcher.fd);
+#endif
+  return 1;
+}
+
+#ifndef _WIN32
+/* A file going out on a stream's socket with sendfile, from the loop thread.
+ * It polls its own dup of the socket for writability so libuv's watcher for
+ * the stream is left alone, and is the stream's layer meanwhile so closing
+ * the stream cancels it.
+ */
+typedef struct {
+  uv_poll_t poll;
+  luv_handle_t* lhandle;
+  luv_io_ctx_t cbs;
+  int out_fd;
+  int in_fd;
+  off_t offset;
+  size_t remaining;
+  double sent;
+} luv_sendfile_t;
+
+/* Bytes sent per wakeup before the rest of the loop gets a turn */
+#define LUV_SENDFILE_SLICE (1024 * 1024)
+
+static void luv_sendfile_on_close(uv_handle_t* poll) {
+  luv_sendfile_t* s = poll->data;
+  close(s->out_fd);
+  free(s);
+}
+
+/* Calls back with err, or with nil and the bytes sent */
+static void luv_sendfile_finish(luv_sendfile_t* s, uv_err_t* err) {
+  luv_handle_t* lhandle = s->lhandle;
+  lua_State* L = luv_handle_get_lua(lhandle);
+  lua_pop(L, 1); /* We don't need the userdata */
 
+  lhandle->layer = NULL;
+  lhandle->layer_close = NULL;
+  luv_io_ctx_callback_rawgeti(L, &s->cbs);
+  luv_io_ctx_unref(L, &s->cbs);
+  uv_close((uv_handle_t*)&s->poll, luv_sendfile_on_close);
+
+  if (lua_isfunction(L, -1)) {
+    if (err) {
+      luv_push_async_error(L, *err, "sendfile", NULL);
+      luv_acall(L, 1, 0, "sendfile");
+    } else {
+      lua_pushnil(L);
+      lua_pushnumber(L, s->sent);
+      luv_acall(L, 2, 0, "sendfile");
+    }
+  } else {
+    lua_pop(L, 1);
+  }
+
+  luv_handle_unref(L, lhandle);
+}
+
+/* The stream is being closed, the rest isn't sent */
+static void luv_sendfile_close(luv_handle_t* lhandle) {
+  uv_err_t err;
+  memset(&err, 0, sizeof err);
+  err.code = UV_ECANCELED;
+  luv_sendfile_finish(lhandle->layer, &err);
+}
+
+static void luv_sendfile_on_poll(uv_poll_t* poll, int status, int events) {
+  luv_sendfile_t* s = poll->data;
+  uv_loop_t* loop = poll->loop;
+  size_t slice = 0;
+
+  if (status == -1) {
+    uv_err_t err = uv_last_error(loop);
+    luv_sendfile_finish(s, &err);
+    return;
+  }
+  /* Send until the socket is full, the file is done or the slice is used */
+  while (s->remaining > 0 && slice < LUV_SENDFILE_SLICE) {
+    uv_fs_t req;
+    int r = uv_fs_sendfile(loop, &req, s->out_fd, s->in_fd, s->offset, s->remaining, NULL);
+    uv_fs_req_cleanup(&req);
+    if (r < 0) {
+      uv_err_t err = uv_last_error(loop);
+      if (err.code == UV_EAGAIN) {
+        /* Keep polling, the socket wakes us when it takes more */
+        return;
+      }
+      luv_sendfile_finish(s, &err);
+      return;
+    }
+    /* The file got shorter under us */
+    if (r == 0) {
+      s->remaining = 0;
+      break;
+    }
+    s->offset += r;
+    s->remaining -= r;
+    s->sent += r;
+    slice += r;
+  }
+
+  if (s->remaining == 0) {
+    luv_sendfile_finish(s, NULL);
+  }
+}
+#endif
+
+/* stream:sendfile(fd, offset, length, callback) sends length bytes of the
+ * file at offset straight to the stream's socket.  It waits for the socket
+ * to be writable rather than holding a thread pool thread, and the callback
+ * gets nil and the bytes sent, fewer if the file ended early.  The stream
+ * must have nothing else queued meanwhile, sendfile writes behind its back.
+ */
+int luv_stream_sendfile(lua_State* L) {
+  uv_stream_t* handle = (uv_stream_t*)luv_checkudata(L, 1, "stream");
+#ifdef _WIN32
+  (void)handle;
+  return luaL_error(L, "sendfile: not supported on this platform");
+#else
+  luv_handle_t* lhandle = handle->data;
+  int in_fd = luaL_checkint(L, 2);
+  off_t offset = (off_t)luaL_checknumber(L, 3);
+  size_t length = (size_t)luaL_checknumber(L, 4);
+  luv_sendfile_t* s;
+  int fd;
+
+  luaL_checktype(L, 5, LUA_TFUNCTION);
+  if (handle->io_watcher.fd < 0) {
+    return luaL_error(L, "sendfile: stream is not open");
+  }
+  if (handle->write_queue_size > 0) {
+    return luaL_error(L, "sendfile: stream has writes queued");
+  }
+  if (lhandle->layer) {
+    return luaL_error(L, "sendfile: stream is busy");
+  }
+
+  fd = dup(handle->io_watcher.fd);
+  if (fd < 0) {
+    return luaL_error(L, "sendfile: %s", strerror(errno));
+  }
+  s = malloc(sizeof(*s));
+  if (!s) {
+    close(fd);
+    return luaL_error(L, "sendfile: out of memory");
+  }
+  memset(s, 0, sizeof(*s));
+  s->lhandle = lhandle;
+  s->out_fd = fd;
+  s->in_fd = in_fd;
+  s->offset = offset;
+  s->remaining = length;
+  luv_io_ctx_init(&s->cbs);
+  luv_io_ctx_callback_add(L, &s->cbs, 5);
+
+  /* Sockets are usually writable already, so the first piece goes out on
+   * the next poll and the callback is never called from in here */
+  uv_poll_init(handle->loop, &s->poll, fd);
+  s->poll.data = s;
+  uv_poll_start(&s->poll, UV_WRITABLE, luv_sendfile_on_poll);
+
+  lhandle->layer = s;
+  lhandle->layer_close = luv_sendfile_close;
+  luv_handle_ref(L, lhandle, 1);
+  return 0;
+#endif
+}
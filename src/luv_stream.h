@@ -26,6 +26,7 @@
 
 void luv_on_connection(uv_stream_t* handle, int status);
 void luv_on_read(uv_stream_t* handle, ssize_t nread, uv_buf_t buf);
+void luv_on_read_buffer(uv_stream_t* handle, ssize_t nread, uv_buf_t buf);
 void luv_after_shutdown(uv_shutdown_t* req, int status);
 void luv_after_write(uv_write_t* req, int status);
 void luv_after_connect(uv_connect_t* req, int status);
@@ -40,5 +41,7 @@ int luv_read_stop_noref(lua_State* L);
 int luv_write (lua_State* L);
 int luv_write2(lua_State* L);
 int luv_write_queue_size(lua_State* L);
+int luv_stream_fileno(lua_State* L);
+int luv_stream_sendfile(lua_State* L);
 
 #endif
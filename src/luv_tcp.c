@@ -16,7 +16,16 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
 #include <assert.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
 #include "luv_portability.h"
 #include "luv_tcp.h"
@@ -53,13 +62,154 @@ int luv_tcp_keepalive (lua_State* L) {
 }
 
 
+#ifndef _WIN32
+static int luv_tcp_sys_error(lua_State* L, const char* source, int errorno) {
+  uv_err_t err;
+  memset(&err, 0, sizeof err);
+  err.code = uv_translate_sys_error(errorno);
+  return luaL_error(L, "%s: %s", source, uv_strerror(err));
+}
+#endif
+
+/* Socket options for a listening socket, the optional table after host and
+ * port in tcp:bind, tcp:bind6 and tcp:bindShared.
+ */
+typedef struct {
+  int reuseport;    /* SO_REUSEPORT, the kernel spreads accepts over every
+                       socket bound to the port */
+  int v6only;       /* IPV6_V6ONLY, -1 leaves the system default */
+  int defer_accept; /* TCP_DEFER_ACCEPT, seconds to wait for data */
+  int fastopen;     /* TCP_FASTOPEN queue length */
+} luv_tcp_bind_options_t;
+
+/* Fills options from the table at index, returns 0 when there is none */
+static int luv_tcp_bind_options(lua_State* L, int index,
+                                luv_tcp_bind_options_t* options) {
+  options->reuseport = 0;
+  options->v6only = -1;
+  options->defer_accept = 0;
+  options->fastopen = 0;
+  if (lua_isnoneornil(L, index)) {
+    return 0;
+  }
+  luaL_checktype(L, index, LUA_TTABLE);
+
+  lua_getfield(L, index, "reuseport");
+  options->reuseport = lua_toboolean(L, -1);
+  lua_getfield(L, index, "v6only");
+  if (!lua_isnil(L, -1)) {
+    options->v6only = lua_toboolean(L, -1);
+  }
+  lua_getfield(L, index, "deferAccept");
+  options->defer_accept = lua_tointeger(L, -1);
+  lua_getfield(L, index, "fastOpen");
+  options->fastopen = lua_tointeger(L, -1);
+  lua_pop(L, 4);
+  return 1;
+}
+
+#ifndef _WIN32
+static int luv_tcp_setsockopt(int sock, int level, int name, int value) {
+  return setsockopt(sock, level, name, &value, sizeof(value));
+}
+
+/* Makes a bound socket with options applied, uv_tcp_bind can't set
+ * anything before it binds.  Returns the socket, or -1 with errno set.
+ */
+static int luv_tcp_bind_socket(struct sockaddr* address, socklen_t length,
+                               luv_tcp_bind_options_t* options) {
+  int sock = socket(address->sa_family, SOCK_STREAM, 0);
+  if (sock < 0) {
+    return -1;
+  }
+
+  if (luv_tcp_setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 1)) {
+    goto error;
+  }
+  if (options->reuseport) {
+#ifdef SO_REUSEPORT
+    if (luv_tcp_setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, 1)) {
+      goto error;
+    }
+#else
+    errno = ENOPROTOOPT;
+    goto error;
+#endif
+  }
+  if (options->v6only >= 0 && address->sa_family == AF_INET6 &&
+      luv_tcp_setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, options->v6only)) {
+    goto error;
+  }
+
+  if (bind(sock, address, length)) {
+    goto error;
+  }
+
+  /* These two only tune the listen queue, they are left off quietly where
+   * the platform doesn't have them.
+   */
+#ifdef TCP_DEFER_ACCEPT
+  if (options->defer_accept > 0 &&
+      luv_tcp_setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                         options->defer_accept)) {
+    goto error;
+  }
+#endif
+#ifdef TCP_FASTOPEN
+  if (options->fastopen > 0 &&
+      luv_tcp_setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, options->fastopen)) {
+    goto error;
+  }
+#endif
+
+  return sock;
+
+error:
+  {
+    int errorno = errno;
+    close(sock);
+    errno = errorno;
+  }
+  return -1;
+}
+#endif
+
+/* Binds handle per the options table at index 4 */
+static int luv_tcp_bind_with_options(lua_State* L, uv_tcp_t* handle,
+                                     struct sockaddr* address,
+                                     socklen_t length,
+                                     luv_tcp_bind_options_t* options,
+                                     const char* source) {
+#ifdef _WIN32
+  return luaL_error(L, "%s: bind options are not supported on this platform",
+                    source);
+#else
+  int sock = luv_tcp_bind_socket(address, length, options);
+  if (sock < 0) {
+    return luv_tcp_sys_error(L, source, errno);
+  }
+  if (uv_tcp_open(handle, sock)) {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    close(sock);
+    return luaL_error(L, "%s: %s", source, uv_strerror(err));
+  }
+  return 0;
+#endif
+}
+
 int luv_tcp_bind (lua_State* L) {
   uv_tcp_t* handle = (uv_tcp_t*)luv_checkudata(L, 1, "tcp");
   const char* host = luaL_checkstring(L, 2);
   int port = luaL_checkint(L, 3);
+  luv_tcp_bind_options_t options;
 
   struct sockaddr_in address = uv_ip4_addr(host, port);
 
+  if (luv_tcp_bind_options(L, 4, &options)) {
+    return luv_tcp_bind_with_options(L, handle, (struct sockaddr*)&address,
+                                     sizeof(address), &options, "tcp_bind");
+  }
+
   if (uv_tcp_bind(handle, address)) {
     uv_err_t err = uv_last_error(luv_get_loop(L));
     return luaL_error(L, "tcp_bind: %s", uv_strerror(err));
@@ -72,9 +222,15 @@ int luv_tcp_bind6(lua_State* L) {
   uv_tcp_t* handle = (uv_tcp_t*)luv_checkudata(L, 1, "tcp");
   const char* host = luaL_checkstring(L, 2);
   int port = luaL_checkint(L, 3);
+  luv_tcp_bind_options_t options;
 
   struct sockaddr_in6 address = uv_ip6_addr(host, port);
 
+  if (luv_tcp_bind_options(L, 4, &options)) {
+    return luv_tcp_bind_with_options(L, handle, (struct sockaddr*)&address,
+                                     sizeof(address), &options, "tcp_bind6");
+  }
+
   if (uv_tcp_bind6(handle, address)) {
     uv_err_t err = uv_last_error(luv_get_loop(L));
     return luaL_error(L, "tcp_bind6: %s", uv_strerror(err));
@@ -83,6 +239,142 @@ int luv_tcp_bind6(lua_State* L) {
   return 0;
 }
 
+#ifndef _WIN32
+/* Listening sockets shared between the loops of one process.  Each entry
+ * keeps its own dup of the socket so later loops can join after the first
+ * one has closed its server.
+ */
+typedef struct luv_tcp_shared_s {
+  struct luv_tcp_shared_s* next;
+  char key[INET6_ADDRSTRLEN + 8];
+  int fd;
+  int refs;
+} luv_tcp_shared_t;
+
+static luv_tcp_shared_t* luv_tcp_shared_list;
+static uv_mutex_t luv_tcp_shared_mutex;
+static uv_once_t luv_tcp_shared_once = UV_ONCE_INIT;
+
+static void luv_tcp_shared_init(void) {
+  uv_mutex_init(&luv_tcp_shared_mutex);
+}
+
+/* layer_close hook, the last server out closes the shared socket */
+static void luv_tcp_shared_release(luv_handle_t* lhandle) {
+  luv_tcp_shared_t* entry = lhandle->layer;
+  luv_tcp_shared_t** link;
+
+  lhandle->layer = NULL;
+  lhandle->layer_close = NULL;
+
+  uv_mutex_lock(&luv_tcp_shared_mutex);
+  if (--entry->refs == 0) {
+    for (link = &luv_tcp_shared_list; *link; link = &(*link)->next) {
+      if (*link == entry) {
+        *link = entry->next;
+        break;
+      }
+    }
+    close(entry->fd);
+    free(entry);
+  }
+  uv_mutex_unlock(&luv_tcp_shared_mutex);
+}
+#endif
+
+/* tcp:bindShared(host, port[, options]) binds like tcp:bind, except that
+ * when another loop of this process already listens on host:port this
+ * handle takes a dup of that socket instead.  All of them accept from the
+ * one queue.  options only apply to the loop that creates the socket.
+ */
+int luv_tcp_bind_shared(lua_State* L) {
+#ifdef _WIN32
+  return luaL_error(L, "tcp_bind_shared: not supported on this platform");
+#else
+  uv_tcp_t* handle = (uv_tcp_t*)luv_checkudata(L, 1, "tcp");
+  luv_handle_t* lhandle = handle->data;
+  const char* host = luaL_checkstring(L, 2);
+  int port = luaL_checkint(L, 3);
+  luv_tcp_bind_options_t options;
+  luv_tcp_shared_t* entry;
+  char key[INET6_ADDRSTRLEN + 8];
+  int sock, fd;
+
+  luv_tcp_bind_options(L, 4, &options);
+  if (lhandle->layer) {
+    return luaL_error(L, "tcp_bind_shared: handle is already bound");
+  }
+  snprintf(key, sizeof(key), "%.*s:%d", INET6_ADDRSTRLEN - 1, host, port);
+
+  uv_once(&luv_tcp_shared_once, luv_tcp_shared_init);
+  uv_mutex_lock(&luv_tcp_shared_mutex);
+  for (entry = luv_tcp_shared_list; entry; entry = entry->next) {
+    if (!strcmp(entry->key, key)) {
+      break;
+    }
+  }
+
+  fd = -1;
+  if (entry) {
+    sock = dup(entry->fd);
+  } else {
+    /* Listening right away rather than going through uv_tcp_bind, which
+     * holds EADDRINUSE back until uv_listen, so the error shows up now
+     * and the loops that join find a listening socket.
+     */
+    if (strchr(host, ':')) {
+      struct sockaddr_in6 address = uv_ip6_addr(host, port);
+      sock = luv_tcp_bind_socket((struct sockaddr*)&address, sizeof(address),
+                                 &options);
+    } else {
+      struct sockaddr_in address = uv_ip4_addr(host, port);
+      sock = luv_tcp_bind_socket((struct sockaddr*)&address, sizeof(address),
+                                 &options);
+    }
+    if (sock >= 0 && (listen(sock, SOMAXCONN) || (fd = dup(sock)) < 0)) {
+      int errorno = errno;
+      close(sock);
+      sock = -1;
+      errno = errorno;
+    }
+  }
+  if (sock < 0) {
+    int errorno = errno;
+    uv_mutex_unlock(&luv_tcp_shared_mutex);
+    return luv_tcp_sys_error(L, "tcp_bind_shared", errorno);
+  }
+
+  if (uv_tcp_open(handle, sock)) {
+    uv_err_t err = uv_last_error(luv_get_loop(L));
+    uv_mutex_unlock(&luv_tcp_shared_mutex);
+    close(sock);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return luaL_error(L, "tcp_bind_shared: %s", uv_strerror(err));
+  }
+
+  if (!entry) {
+    entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+      uv_mutex_unlock(&luv_tcp_shared_mutex);
+      close(fd);
+      return luaL_error(L, "tcp_bind_shared: out of memory");
+    }
+    strcpy(entry->key, key);
+    entry->fd = fd;
+    entry->next = luv_tcp_shared_list;
+    luv_tcp_shared_list = entry;
+  }
+  entry->refs++;
+  uv_mutex_unlock(&luv_tcp_shared_mutex);
+
+  lhandle->layer = entry;
+  lhandle->layer_close = luv_tcp_shared_release;
+  return 0;
+#endif
+}
+
 int luv_tcp_getsockname(lua_State* L) {
   uv_tcp_t* handle = (uv_tcp_t*)luv_checkudata(L, 1, "tcp");
   int port = 0;
@@ -163,11 +455,14 @@ int luv_tcp_connect(lua_State* L) {
 
   struct sockaddr_in address = uv_ip4_addr(ip_address, port);
 
-  uv_connect_t* req = (uv_connect_t*)malloc(sizeof(uv_connect_t));
+  luv_req_t* req = luv_req_alloc(handle->loop, LUV_REQ_CONNECT);
 
-  if (uv_tcp_connect(req, handle, address, luv_after_connect)) {
+  if (!req) {
+    return luaL_error(L, "tcp_connect: %s", uv_strerror(uv_last_error(handle->loop)));
+  }
+  if (uv_tcp_connect(&req->uv.connect, handle, address, luv_after_connect)) {
     uv_err_t err;
-    free(req);
+    luv_req_release(handle->loop, req);
     err = uv_last_error(luv_get_loop(L));
     return luaL_error(L, "tcp_connect: %s", uv_strerror(err));
   }
@@ -185,11 +480,14 @@ int luv_tcp_connect6(lua_State* L) {
 
   struct sockaddr_in6 address = uv_ip6_addr(ip_address, port);
 
-  uv_connect_t* req = (uv_connect_t*)malloc(sizeof(uv_connect_t));
+  luv_req_t* req = luv_req_alloc(handle->loop, LUV_REQ_CONNECT);
 
-  if (uv_tcp_connect6(req, handle, address, luv_after_connect)) {
+  if (!req) {
+    return luaL_error(L, "tcp_connect6: %s", uv_strerror(uv_last_error(handle->loop)));
+  }
+  if (uv_tcp_connect6(&req->uv.connect, handle, address, luv_after_connect)) {
     uv_err_t err;
-    free(req);
+    luv_req_release(handle->loop, req);
     err = uv_last_error(luv_get_loop(L));
     return luaL_error(L, "tcp_connect6: %s", uv_strerror(err));
   }
@@ -32,9 +32,9 @@ void luv_on_timer(uv_timer_t* handle, int status) {
 
   if (status == -1) {
     luv_push_async_error(L, uv_last_error(luv_get_loop(L)), "on_timer", NULL);
-    luv_emit_event(L, "error", 1);
+    luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
   } else {
-    luv_emit_event(L, "timeout", 0);
+    luv_emit_event_slot(L, LUV_EVENT_TIMEOUT, 0);
   }
 
 }
@@ -0,0 +1,355 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "luv_timer_wheel.h"
+#include "utils.h"
+
+/* A timer on the wheel.  The userdata's environment holds its callback. */
+typedef struct {
+  luv_wheel_link_t link; /* must stay first, a link is its timer */
+  uint64_t expires;
+  int level;             /* -1 when stopped, LUV_WHEEL_LEVELS while firing */
+  int ref;               /* keeps the userdata alive while it's started */
+  luv_timer_wheel_t* wheel;
+} luv_wheel_timer_t;
+
+static void luv_wheel_on_timer(uv_timer_t* handle, int status);
+
+static void luv_wheel_link_init(luv_wheel_link_t* link) {
+  link->next = link;
+  link->prev = link;
+}
+
+static void luv_wheel_link_append(luv_wheel_link_t* head, luv_wheel_link_t* link) {
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+static void luv_wheel_link_remove(luv_wheel_link_t* link) {
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  luv_wheel_link_init(link);
+}
+
+void luv_timer_wheel_init(luv_timer_wheel_t* wheel, uv_loop_t* loop) {
+  int level, slot;
+
+  memset(wheel, 0, sizeof(*wheel));
+  uv_timer_init(loop, &wheel->timer);
+  wheel->timer.data = wheel;
+  for (level = 0; level < LUV_WHEEL_LEVELS; level++) {
+    for (slot = 0; slot < LUV_WHEEL_SLOTS; slot++) {
+      luv_wheel_link_init(&wheel->slots[level][slot]);
+    }
+  }
+  luv_wheel_link_init(&wheel->firing);
+}
+
+/* Files a timer in the finest level that reaches its expiry and returns
+ * when the wheel has to run for it: the expiry itself on level 0, the start
+ * of its slot higher up, where it gets moved down a level.
+ */
+static uint64_t luv_wheel_insert(luv_timer_wheel_t* w, luv_wheel_timer_t* t) {
+  uint64_t expires = t->expires < w->current ? w->current : t->expires;
+  uint64_t block = expires;
+  int level, shift = 0;
+
+  for (level = 0; level < LUV_WHEEL_LEVELS; level++) {
+    shift = level * LUV_WHEEL_BITS;
+    block = expires >> shift;
+    if (block - (w->current >> shift) < LUV_WHEEL_SLOTS) {
+      break;
+    }
+  }
+  if (level == LUV_WHEEL_LEVELS) {
+    /* Too far out, park it in the last slot of the top level */
+    level = LUV_WHEEL_LEVELS - 1;
+    shift = level * LUV_WHEEL_BITS;
+    block = (w->current >> shift) + LUV_WHEEL_SLOTS - 1;
+  }
+
+  luv_wheel_link_append(&w->slots[level][block & LUV_WHEEL_MASK], &t->link);
+  w->counts[level]++;
+  t->level = level;
+  return level == 0 ? expires : block << shift;
+}
+
+static void luv_wheel_unlink(luv_timer_wheel_t* w, luv_wheel_timer_t* t) {
+  if (t->level < LUV_WHEEL_LEVELS) {
+    w->counts[t->level]--;
+  }
+  luv_wheel_link_remove(&t->link);
+  t->level = -1;
+}
+
+static void luv_wheel_cascade(luv_timer_wheel_t* w, int level, int slot) {
+  luv_wheel_link_t* head = &w->slots[level][slot];
+
+  while (head->next != head) {
+    luv_wheel_timer_t* t = (luv_wheel_timer_t*)head->next;
+    luv_wheel_unlink(w, t);
+    luv_wheel_insert(w, t);
+    w->cascaded++;
+  }
+}
+
+/* Earliest time the wheel has something to do */
+static uint64_t luv_wheel_next_due(luv_timer_wheel_t* w) {
+  uint64_t due = 0;
+  int level, i;
+
+  for (level = 0; level < LUV_WHEEL_LEVELS; level++) {
+    int shift = level * LUV_WHEEL_BITS;
+    uint64_t base = w->current >> shift;
+    if (!w->counts[level]) {
+      continue;
+    }
+    for (i = 0; i < LUV_WHEEL_SLOTS; i++) {
+      luv_wheel_link_t* head = &w->slots[level][(base + i) & LUV_WHEEL_MASK];
+      if (head->next != head) {
+        uint64_t start = (base + i) << shift;
+        if (start < w->current) {
+          start = w->current;
+        }
+        if (!due || start < due) {
+          due = start;
+        }
+        break;
+      }
+    }
+  }
+  return due;
+}
+
+/* Makes sure the uv timer fires by due */
+static void luv_wheel_schedule(luv_timer_wheel_t* w, uint64_t due) {
+  uint64_t now = uv_now(w->timer.loop);
+
+  if (w->scheduled && w->scheduled <= due) {
+    return;
+  }
+  w->scheduled = due;
+  uv_timer_start(&w->timer, luv_wheel_on_timer, due > now ? due - now : 0, 0);
+}
+
+static void luv_wheel_fire(luv_timer_wheel_t* w) {
+  lua_State* L = w->L;
+
+  while (w->firing.next != &w->firing) {
+    luv_wheel_timer_t* t = (luv_wheel_timer_t*)w->firing.next;
+    int ref = t->ref;
+
+    luv_wheel_unlink(w, t);
+    t->ref = LUA_NOREF;
+    w->active--;
+    w->fired++;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    lua_getfenv(L, -1);
+    lua_rawgeti(L, -1, 1);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    if (lua_isfunction(L, -1)) {
+      luv_acall(L, 0, 0, "on_wheel_timer");
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+}
+
+static void luv_wheel_on_timer(uv_timer_t* handle, int status) {
+  luv_timer_wheel_t* w = handle->data;
+  uint64_t now = uv_now(handle->loop);
+
+  w->scheduled = 0;
+  w->wakeups++;
+  /* Whatever was left over when a callback threw */
+  luv_wheel_fire(w);
+
+  while (w->active && w->current <= now) {
+    uint64_t cur = w->current;
+    luv_wheel_link_t* head = &w->slots[0][cur & LUV_WHEEL_MASK];
+    int level;
+
+    /* Slots of the coarser levels that start now move down a level */
+    for (level = 1; level < LUV_WHEEL_LEVELS; level++) {
+      if ((cur >> ((level - 1) * LUV_WHEEL_BITS)) & LUV_WHEEL_MASK) {
+        break;
+      }
+      luv_wheel_cascade(w, level, (cur >> (level * LUV_WHEEL_BITS)) & LUV_WHEEL_MASK);
+    }
+
+    while (head->next != head) {
+      luv_wheel_timer_t* t = (luv_wheel_timer_t*)head->next;
+      luv_wheel_unlink(w, t);
+      luv_wheel_link_append(&w->firing, &t->link);
+      t->level = LUV_WHEEL_LEVELS;
+    }
+    w->current = cur + 1;
+    luv_wheel_fire(w);
+
+    /* With level 0 empty, skip to where the lowest level in use moves
+     * down next, rather than stepping through every millisecond.
+     */
+    if (!w->counts[0]) {
+      level = 1;
+      while (level < LUV_WHEEL_LEVELS && !w->counts[level]) {
+        level++;
+      }
+      if (level < LUV_WHEEL_LEVELS) {
+        int shift = level * LUV_WHEEL_BITS;
+        uint64_t next = ((w->current + ((uint64_t)1 << shift) - 1) >> shift) << shift;
+        w->current = next < now + 1 ? next : now + 1;
+      }
+    }
+  }
+
+  if (w->active) {
+    luv_wheel_schedule(w, luv_wheel_next_due(w));
+  }
+}
+
+static luv_wheel_timer_t* luv_check_wheel_timer(lua_State* L, int index) {
+  return (luv_wheel_timer_t*)luaL_checkudata(L, index, "luv_wheel_timer");
+}
+
+/* newWheelTimer(callback) makes a one shot timer on the loop's wheel */
+int luv_new_wheel_timer(lua_State* L) {
+  luv_wheel_timer_t* t;
+
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  t = (luv_wheel_timer_t*)lua_newuserdata(L, sizeof(*t));
+  luv_wheel_link_init(&t->link);
+  t->expires = 0;
+  t->level = -1;
+  t->ref = LUA_NOREF;
+  t->wheel = &luv_loop_data(luv_get_loop(L))->timer_wheel;
+  luaL_getmetatable(L, "luv_wheel_timer");
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/* timer:start(timeout, [slack]) (re)starts the timer to fire in timeout ms.
+ * With slack it may fire up to slack ms late: the deadline is rounded up to
+ * a multiple of slack, so timers that don't need to be exact end up in the
+ * same slot and share a wakeup.
+ */
+static int luv_wheel_timer_start(lua_State* L) {
+  luv_wheel_timer_t* t = luv_check_wheel_timer(L, 1);
+  lua_Number timeout = luaL_checknumber(L, 2);
+  lua_Number slack = luaL_optnumber(L, 3, 0);
+  luv_timer_wheel_t* w = t->wheel;
+  uint64_t now = uv_now(w->timer.loop);
+
+  luaL_argcheck(L, timeout >= 0, 2, "timeout must not be negative");
+  luaL_argcheck(L, slack >= 0, 3, "slack must not be negative");
+  if (!w->L) {
+    w->L = luv_get_main_thread(L);
+  }
+
+  if (t->level >= 0) {
+    luv_wheel_unlink(w, t);
+  } else {
+    if (!w->active) {
+      w->current = now;
+    }
+    lua_pushvalue(L, 1);
+    t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    w->active++;
+  }
+
+  t->expires = now + (uint64_t)timeout;
+  if (slack >= 1) {
+    uint64_t step = (uint64_t)slack;
+    t->expires = (t->expires + step - 1) / step * step;
+  }
+  luv_wheel_schedule(w, luv_wheel_insert(w, t));
+  return 0;
+}
+
+static int luv_wheel_timer_stop(lua_State* L) {
+  luv_wheel_timer_t* t = luv_check_wheel_timer(L, 1);
+  luv_timer_wheel_t* w = t->wheel;
+
+  if (t->level < 0) {
+    return 0;
+  }
+  luv_wheel_unlink(w, t);
+  luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+  t->ref = LUA_NOREF;
+  w->active--;
+  if (!w->active) {
+    uv_timer_stop(&w->timer);
+    w->scheduled = 0;
+  }
+  return 0;
+}
+
+static int luv_wheel_timer_is_active(lua_State* L) {
+  luv_wheel_timer_t* t = luv_check_wheel_timer(L, 1);
+  lua_pushboolean(L, t->level >= 0);
+  return 1;
+}
+
+int luv_timer_wheel_stats(lua_State* L) {
+  luv_timer_wheel_t* w = &luv_loop_data(luv_get_loop(L))->timer_wheel;
+  int level;
+
+  lua_newtable(L);
+  lua_pushnumber(L, w->active);
+  lua_setfield(L, -2, "active");
+  lua_pushnumber(L, w->fired);
+  lua_setfield(L, -2, "fired");
+  lua_pushnumber(L, w->wakeups);
+  lua_setfield(L, -2, "wakeups");
+  lua_pushnumber(L, w->cascaded);
+  lua_setfield(L, -2, "cascaded");
+
+  /* timers waiting on each level, finest first */
+  lua_newtable(L);
+  for (level = 0; level < LUV_WHEEL_LEVELS; level++) {
+    lua_pushnumber(L, w->counts[level]);
+    lua_rawseti(L, -2, level + 1);
+  }
+  lua_setfield(L, -2, "levels");
+
+  return 1;
+}
+
+void luv_timer_wheel_open(lua_State* L) {
+  luaL_newmetatable(L, "luv_wheel_timer");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, luv_wheel_timer_start);
+  lua_setfield(L, -2, "start");
+  lua_pushcfunction(L, luv_wheel_timer_stop);
+  lua_setfield(L, -2, "stop");
+  lua_pushcfunction(L, luv_wheel_timer_is_active);
+  lua_setfield(L, -2, "isActive");
+  lua_pop(L, 1);
+}
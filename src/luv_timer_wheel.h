@@ -0,0 +1,62 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef LUV_TIMER_WHEEL
+#define LUV_TIMER_WHEEL
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "uv.h"
+
+/* Idle timeouts live in a hierarchical timing wheel driven by one uv timer
+ * per loop.  Level 0 has a slot per millisecond, every level above it has
+ * slots LUV_WHEEL_SLOTS times as wide.  Timers further out than the top
+ * level wait in its last slot and get placed again when it comes up.
+ */
+#define LUV_WHEEL_BITS 6
+#define LUV_WHEEL_SLOTS (1 << LUV_WHEEL_BITS)
+#define LUV_WHEEL_MASK (LUV_WHEEL_SLOTS - 1)
+#define LUV_WHEEL_LEVELS 4
+
+typedef struct luv_wheel_link_s {
+  struct luv_wheel_link_s* next;
+  struct luv_wheel_link_s* prev;
+} luv_wheel_link_t;
+
+typedef struct {
+  uv_timer_t timer;
+  lua_State* L;        /* main thread, set when the first timer starts */
+  uint64_t current;    /* the next millisecond to be processed */
+  uint64_t scheduled;  /* when the uv timer fires, 0 when it's stopped */
+  luv_wheel_link_t slots[LUV_WHEEL_LEVELS][LUV_WHEEL_SLOTS];
+  size_t counts[LUV_WHEEL_LEVELS];
+  luv_wheel_link_t firing; /* expired timers whose callbacks are running */
+  size_t active;       /* timers started and not yet fired or stopped */
+  double fired;
+  double wakeups;      /* times the uv timer fired */
+  double cascaded;     /* timers moved down a level */
+} luv_timer_wheel_t;
+
+void luv_timer_wheel_init(luv_timer_wheel_t* wheel, uv_loop_t* loop);
+
+/* Registers the metatable of wheel timer userdata */
+void luv_timer_wheel_open(lua_State* L);
+
+int luv_new_wheel_timer(lua_State* L);
+int luv_timer_wheel_stats(lua_State* L);
+
+#endif
@@ -15,7 +15,8 @@
  *
  */
 #include <openssl/ssl.h>
-
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
 
 #include "luv.h"
 #include "luv_tls.h"
@@ -91,8 +92,13 @@ newSC(lua_State *L)
 {
   tls_sc_t *ctx = lua_newuserdata(L, sizeof(tls_sc_t));
   ctx->ctx = NULL;
-  /* TODO: reference gloabl CA-store */
   ctx->ca_store = NULL;
+  ctx->ca_store_shared = 0;
+  ctx->ticket_key_count = 0;
+  ctx->record_sizing.small = TLS_RECORD_SIZE_SMALL;
+  ctx->record_sizing.large = TLS_RECORD_SIZE_LARGE;
+  ctx->record_sizing.ramp = TLS_RECORD_RAMP_BYTES;
+  ctx->record_sizing.idle = TLS_RECORD_IDLE_MS;
   luaL_getmetatable(L, TLS_SECURE_CONTEXT_HANDLE);
   lua_setmetatable(L, -2);
   return ctx;
@@ -136,7 +142,9 @@ tls_sc_create(lua_State *L) {
 
   ctx = newSC(L);
   ctx->ctx = SSL_CTX_new(method);
-  /* TODO: customize Session cache */
+  /* The ticket callback finds the keys through the context */
+  SSL_CTX_set_app_data(ctx->ctx, ctx);
+  /* Servers cache sessions by default, see setSessionCache */
   SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_SERVER);
 
   return 1;
@@ -329,6 +337,110 @@ X509_STORE_load_bio(X509_STORE *ca_store, BIO *in) {
   return ret;
 }
 
+/**
+ * The bundled root certificates are parsed once per process into a store
+ * that every context trusting them shares.  Contexts hold a reference while
+ * they use it, and it's freed when the last one lets go.  Contexts that add
+ * their own CAs or CRLs get a private copy instead of changing it for all.
+ */
+static X509_STORE *root_cert_store = NULL;
+static int root_cert_store_refs = 0;
+static uv_once_t root_cert_once = UV_ONCE_INIT;
+static uv_mutex_t root_cert_mutex;
+
+static void
+tls_root_store_init_once(void) {
+  uv_mutex_init(&root_cert_mutex);
+}
+
+static int
+tls_load_root_certs(X509_STORE *store) {
+  int i;
+
+  for (i = 0; root_certs[i]; i++) {
+    BIO *bp = BIO_new(BIO_s_mem());
+    X509 *x509;
+
+    if (!BIO_write(bp, root_certs[i], strlen(root_certs[i]))) {
+      BIO_free(bp);
+      return 0;
+    }
+
+    x509 = PEM_read_bio_X509(bp, NULL, 0, NULL);
+    BIO_free(bp);
+    if (x509 == NULL) {
+      return 0;
+    }
+
+    X509_STORE_add_cert(store, x509);
+    X509_free(x509);
+  }
+  return 1;
+}
+
+static X509_STORE*
+tls_root_store_acquire(void) {
+  X509_STORE *store;
+
+  uv_once(&root_cert_once, tls_root_store_init_once);
+  uv_mutex_lock(&root_cert_mutex);
+  if (!root_cert_store) {
+    root_cert_store = X509_STORE_new();
+    if (root_cert_store && !tls_load_root_certs(root_cert_store)) {
+      X509_STORE_free(root_cert_store);
+      root_cert_store = NULL;
+    }
+  }
+  if (root_cert_store) {
+    root_cert_store_refs++;
+  }
+  store = root_cert_store;
+  uv_mutex_unlock(&root_cert_mutex);
+  return store;
+}
+
+static void
+tls_root_store_release(void) {
+  uv_mutex_lock(&root_cert_mutex);
+  if (--root_cert_store_refs == 0) {
+    X509_STORE_free(root_cert_store);
+    root_cert_store = NULL;
+  }
+  uv_mutex_unlock(&root_cert_mutex);
+}
+
+/* Takes the shared root store away from a context without freeing it */
+static void
+tls_sc_detach_root_store(tls_sc_t *sc) {
+  if (!sc->ca_store_shared) {
+    return;
+  }
+  if (sc->ctx && sc->ctx->cert_store == sc->ca_store) {
+    sc->ctx->cert_store = NULL;
+  }
+  sc->ca_store = NULL;
+  sc->ca_store_shared = 0;
+  tls_root_store_release();
+}
+
+/* The context's own store, seeded with the roots if it trusted those */
+static X509_STORE*
+tls_sc_private_store(tls_sc_t *sc) {
+  X509_STORE *store;
+
+  if (sc->ca_store && !sc->ca_store_shared) {
+    return sc->ca_store;
+  }
+  store = X509_STORE_new();
+  if (sc->ca_store_shared) {
+    tls_load_root_certs(store);
+    tls_sc_detach_root_store(sc);
+  }
+  sc->ca_store = store;
+  SSL_CTX_set_cert_store(sc->ctx, store);
+  return store;
+}
+
 static int
 tls_sc_set_cert(lua_State *L) {
   tls_sc_t *ctx;
@@ -369,12 +481,7 @@ tls_sc_add_trusted_cert(lua_State *L) {
   int rv;
 
   ctx = getSC(L);
-
-  if (ctx->ca_store == NULL) {
-    /* TODO: better handling of global CA cert list */
-    ctx->ca_store = X509_STORE_new();
-    SSL_CTX_set_cert_store(ctx->ctx, ctx->ca_store);
-  }
+  tls_sc_private_store(ctx);
 
   certstr = luaL_checklstring(L, 2, &clen);
 
@@ -433,64 +540,203 @@ tls_sc_set_options(lua_State *L) {
   return 0;
 }
 
-static X509_STORE *root_cert_store = NULL;
+/**
+ * Session resumption
+ */
 
+/* sc:setSessionCache(size, [timeout]) sizes the server's session cache, a
+ * size of 0 turns it off.  timeout is in seconds.
+ */
 static int
-tls_sc_close(lua_State *L) {
-  tls_sc_t *sc = getSC(L);
+tls_sc_set_session_cache(lua_State *L) {
+  tls_sc_t *ctx = getSC(L);
+  long size = luaL_checklong(L, 2);
+  long timeout = luaL_optlong(L, 3, 0);
+
+  if (size > 0) {
+    SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx->ctx, size);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_OFF);
+  }
+  if (timeout > 0) {
+    SSL_CTX_set_timeout(ctx->ctx, timeout);
+  }
+  return 0;
+}
 
-  if (sc->ctx) {
-    if (sc->ctx->cert_store == root_cert_store) {
-      sc->ctx->cert_store = NULL;
-    }
-    SSL_CTX_free(sc->ctx);
-    sc->ctx = NULL;
+/* Sessions are only resumed within the same id context, and servers
+ * that verify clients refuse to resume without one */
+static int
+tls_sc_set_session_id_context(lua_State *L) {
+  tls_sc_t *ctx = getSC(L);
+  size_t len;
+  const char *sid_ctx = luaL_checklstring(L, 2, &len);
+
+  if (len > SSL_MAX_SID_CTX_LENGTH) {
+    len = SSL_MAX_SID_CTX_LENGTH;
+  }
+  ERR_clear_error();
+  if (!SSL_CTX_set_session_id_context(ctx->ctx, (const unsigned char*)sid_ctx, len)) {
+    return tls_fatal_error(L);
   }
+  return 0;
+}
 
+/* sc:setRecordSizing([small, large, ramp, idle]) for connections made from
+ * now on.  Records carry at most small bytes until ramp bytes went out, then
+ * up to large, and start small again after idle ms without a write.  A small
+ * of 0 leaves record sizes to OpenSSL.
+ */
+static int
+tls_sc_set_record_sizing(lua_State *L) {
+  tls_sc_t *ctx = getSC(L);
+  int small = luaL_optint(L, 2, TLS_RECORD_SIZE_SMALL);
+  int large = luaL_optint(L, 3, TLS_RECORD_SIZE_LARGE);
+  long ramp = luaL_optlong(L, 4, TLS_RECORD_RAMP_BYTES);
+  long idle = luaL_optlong(L, 5, TLS_RECORD_IDLE_MS);
+
+  luaL_argcheck(L, small >= 0 && small <= SSL3_RT_MAX_PLAIN_LENGTH, 2,
+                "record size out of range");
+  luaL_argcheck(L, large >= small && large <= SSL3_RT_MAX_PLAIN_LENGTH, 3,
+                "record size out of range");
+  luaL_argcheck(L, ramp >= 0, 4, "ramp must not be negative");
+  luaL_argcheck(L, idle >= 0, 5, "idle timeout must not be negative");
+
+  ctx->record_sizing.small = small;
+  ctx->record_sizing.large = large;
+  ctx->record_sizing.ramp = ramp;
+  ctx->record_sizing.idle = idle;
   return 0;
 }
 
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+
 static int
-tls_sc_add_root_certs(lua_State *L) {
+tls_sc_ticket_key_cb(SSL *s, unsigned char *name, unsigned char *iv,
+                     EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc) {
+  tls_sc_t *ctx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(s));
+  tls_ticket_key_t *key;
   int i;
+
+  if (!ctx || ctx->ticket_key_count == 0) {
+    return enc ? -1 : 0;
+  }
+
+  if (enc) {
+    key = &ctx->ticket_keys[0];
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0) {
+      return -1;
+    }
+    memcpy(name, key->name, sizeof(key->name));
+    EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key->aes, iv);
+    HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), NULL);
+    return 1;
+  }
+
+  for (i = 0; i < ctx->ticket_key_count; i++) {
+    key = &ctx->ticket_keys[i];
+    if (memcmp(name, key->name, sizeof(key->name)) == 0) {
+      HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), NULL);
+      EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key->aes, iv);
+      /* Tickets under a retired key are accepted and reissued */
+      return i == 0 ? 1 : 2;
+    }
+  }
+
+  /* Unknown key, fall back to a full handshake */
+  return 0;
+}
+
+/* sc:setTicketKeys(keys) takes the keys as one string of 48 byte keys,
+ * newest first.  Servers sharing keys resume each other's tickets.
+ */
+static int
+tls_sc_set_ticket_keys(lua_State *L) {
   tls_sc_t *ctx = getSC(L);
+  size_t len;
+  const char *keys = luaL_checklstring(L, 2, &len);
+  int count = len / TLS_TICKET_KEY_SIZE;
 
-  ERR_clear_error();
+  luaL_argcheck(L, len % TLS_TICKET_KEY_SIZE == 0 && count > 0, 2,
+                "expected a multiple of 48 bytes");
+  if (count > TLS_TICKET_KEYS_MAX) {
+    count = TLS_TICKET_KEYS_MAX;
+  }
+  memcpy(ctx->ticket_keys, keys, count * TLS_TICKET_KEY_SIZE);
+  ctx->ticket_key_count = count;
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx->ctx, tls_sc_ticket_key_cb);
+  return 0;
+}
 
-  if (!root_cert_store) {
-    root_cert_store = X509_STORE_new();
+static int
+tls_sc_get_ticket_keys(lua_State *L) {
+  tls_sc_t *ctx = getSC(L);
+  lua_pushlstring(L, (const char*)ctx->ticket_keys,
+                  ctx->ticket_key_count * TLS_TICKET_KEY_SIZE);
+  return 1;
+}
 
-    for (i = 0; root_certs[i]; i++) {
-      BIO *bp = BIO_new(BIO_s_mem());
-      X509 *x509;
+/* sc:rotateTicketKeys() starts issuing tickets under a fresh random key.
+ * The previous keys are still accepted until they fall off the end.
+ */
+static int
+tls_sc_rotate_ticket_keys(lua_State *L) {
+  tls_sc_t *ctx = getSC(L);
+  int count = ctx->ticket_key_count;
 
-      if (!BIO_write(bp, root_certs[i], strlen(root_certs[i]))) {
-        printf("error writing cert %s\n", root_certs[i]);
-        BIO_free(bp);
-        lua_pushboolean(L, 0);
-        return 1;
-      }
+  if (count == TLS_TICKET_KEYS_MAX) {
+    count--;
+  }
+  memmove(&ctx->ticket_keys[1], &ctx->ticket_keys[0], count * TLS_TICKET_KEY_SIZE);
+  if (RAND_bytes((unsigned char*)&ctx->ticket_keys[0], TLS_TICKET_KEY_SIZE) <= 0) {
+    return tls_fatal_error(L);
+  }
+  ctx->ticket_key_count = count + 1;
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx->ctx, tls_sc_ticket_key_cb);
+  return 0;
+}
 
-      x509 = PEM_read_bio_X509(bp, NULL, 0, NULL);
-      if (x509 == NULL) {
-        char buf[1024];
-        ERR_error_string(ERR_get_error(), buf);
+#endif
 
-        printf("error writing x509 cert %s\n", buf);
-        BIO_free(bp);
-        lua_pushboolean(L, 0);
-        return 1;
-      }
+static int
+tls_sc_close(lua_State *L) {
+  tls_sc_t *sc = getSC(L);
 
-      X509_STORE_add_cert(root_cert_store, x509);
+  if (sc->ctx) {
+    tls_sc_detach_root_store(sc);
+    SSL_CTX_free(sc->ctx);
+    sc->ctx = NULL;
+  }
 
-      BIO_free(bp);
-      X509_free(x509);
-    }
+  return 0;
+}
+
+static int
+tls_sc_add_root_certs(lua_State *L) {
+  tls_sc_t *ctx = getSC(L);
+  X509_STORE *store;
+
+  if (ctx->ca_store_shared) {
+    lua_pushboolean(L, 1);
+    return 1;
   }
 
-  ctx->ca_store = root_cert_store;
-  SSL_CTX_set_cert_store(ctx->ctx, ctx->ca_store);
+  ERR_clear_error();
+
+  store = tls_root_store_acquire();
+  if (!store) {
+    char buf[256];
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    fprintf(stderr, "error loading root certs %s\n", buf);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  /* A store of the context's own is freed by SSL_CTX_set_cert_store */
+  ctx->ca_store = store;
+  ctx->ca_store_shared = 1;
+  SSL_CTX_set_cert_store(ctx->ctx, store);
 
   lua_pushboolean(L, 1);
   return 1;
@@ -516,6 +762,7 @@ tls_sc_add_crl(lua_State *L) {
     return 1;
   }
 
+  tls_sc_private_store(ctx);
   X509_STORE_add_crl(ctx->ca_store, x509);
   X509_STORE_set_flags(ctx->ca_store,
                        X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
@@ -531,12 +778,6 @@ int tls_sc_add_ca_cert(lua_State *L)
 {
   tls_sc_t *ctx = getSC(L);
   X509 *x509;
-  int newCAStore = FALSE;
-
-  if (!ctx->ca_store) {
-    ctx->ca_store = X509_STORE_new();
-    newCAStore = TRUE;
-  }
 
   x509 = _lua_load_x509(L, 2);
   if (!x509) {
@@ -544,14 +785,10 @@ int tls_sc_add_ca_cert(lua_State *L)
     return 1;
   }
 
-  X509_STORE_add_cert(ctx->ca_store, x509);
+  X509_STORE_add_cert(tls_sc_private_store(ctx), x509);
   SSL_CTX_add_client_CA(ctx->ctx, x509);
   X509_free(x509);
 
-  if (newCAStore) {
-    SSL_CTX_set_cert_store(ctx->ctx, ctx->ca_store);
-  }
-
   lua_pushboolean(L, 1);
   return 1;
 }
@@ -571,6 +808,14 @@ static const luaL_reg tls_sc_lib[] = {
   {"addTrustedCert", tls_sc_add_trusted_cert},
   {"addRootCerts", tls_sc_add_root_certs},
   {"addCRL", tls_sc_add_crl},
+  {"setSessionCache", tls_sc_set_session_cache},
+  {"setSessionIdContext", tls_sc_set_session_id_context},
+  {"setRecordSizing", tls_sc_set_record_sizing},
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+  {"setTicketKeys", tls_sc_set_ticket_keys},
+  {"getTicketKeys", tls_sc_get_ticket_keys},
+  {"rotateTicketKeys", tls_sc_rotate_ticket_keys},
+#endif
   {"close", tls_sc_close},
   {"__gc", tls_sc_gc},
   {NULL, NULL}
@@ -36,10 +36,47 @@
 
 /* TLS Connection class info, cross file */
 
+/* Session ticket keys, laid out like SSL_CTX_set_tlsext_ticket_keys wants
+ * them: name, HMAC secret, AES key */
+#define TLS_TICKET_KEY_SIZE 48
+#define TLS_TICKET_KEYS_MAX 4
+
+typedef struct tls_ticket_key_t {
+  unsigned char name[16];
+  unsigned char hmac[16];
+  unsigned char aes[16];
+} tls_ticket_key_t;
+
+/* Dynamic record sizing.  A fresh or idle connection sends small records,
+ * each fitting a single TCP segment with room for the record header, IV, MAC
+ * and padding, so the peer can decrypt what arrives without waiting on a
+ * full 16k record.  Once ramp bytes went out without a pause it switches to
+ * large records for throughput.
+ */
+#define TLS_RECORD_SIZE_SMALL 1360
+#define TLS_RECORD_SIZE_LARGE 16384
+#define TLS_RECORD_RAMP_BYTES (1024 * 1024)
+#define TLS_RECORD_IDLE_MS 1000
+
+typedef struct tls_record_sizing_t {
+  int small;   /* cleartext bytes per record while ramping up, 0 disables */
+  int large;   /* cleartext bytes per record after that */
+  long ramp;   /* bytes sent in small records before going large */
+  long idle;   /* ms without writes after which records start small again */
+} tls_record_sizing_t;
+
 /* SecureContext used to configure multiple connections */
 typedef struct tls_sc_t {
   SSL_CTX *ctx;
   X509_STORE *ca_store;
+  int ca_store_shared; /* ca_store is the process wide root store */
+
+  /* Newest first, the first one issues tickets and all of them are accepted */
+  tls_ticket_key_t ticket_keys[TLS_TICKET_KEYS_MAX];
+  int ticket_key_count;
+
+  /* Copied into each connection made from this context */
+  tls_record_sizing_t record_sizing;
 } tls_sc_t;
 
 tls_sc_t* luvit__lua_tls_sc_get(lua_State *L, int index);
@@ -17,6 +17,8 @@
 
 #include "luv.h"
 #include "luv_tls.h"
+#include "luv_handle.h"
+#include "luv_stream.h"
 
 #include <assert.h>
 
@@ -58,6 +60,16 @@ typedef struct tls_conn_t {
   /* SNI Support */
   char *server_name;
   int sni_callback_ref;
+
+  /* Native stream mode, see tls_conn_attach */
+  luv_handle_t *lhandle;
+  int reading;
+  int ended;
+
+  /* Dynamic record sizing, see tls_conn_write_records */
+  tls_record_sizing_t record_sizing;
+  double record_sent;  /* cleartext bytes written since the last idle spell */
+  double last_write;   /* loop time of the last write */
 } tls_conn_t;
 
 static const int X509_NAME_FLAGS = ASN1_STRFLGS_ESC_CTRL
@@ -78,9 +90,9 @@ static int
 sni_context_callback(SSL *s, int *ad, void *arg) {
   const char *server_name = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
   tls_conn_t *tc = SSL_get_app_data(s);
-  lua_State *L = tc->L;
-
-  lua_pop(L, 1);
+  /* In stream mode this runs from a read callback, not a call from Lua, so
+   * leave the stack as it was found. */
+  lua_State *L = tc->lhandle ? tc->lhandle->L : tc->L;
 
   if (server_name) {
     if (tc->server_name) {
@@ -90,13 +102,14 @@ sni_context_callback(SSL *s, int *ad, void *arg) {
     if (tc->sni_callback_ref) {
       lua_rawgeti(L, LUA_REGISTRYINDEX, tc->sni_callback_ref);
       luaL_unref(L, LUA_REGISTRYINDEX, tc->sni_callback_ref);
-      lua_pushstring(tc->L, server_name);
-      lua_pcall(L, 1, 1, 0);
-      if (lua_touserdata(L, 1)) {
-        tls_sc_t *sc = luvit__lua_tls_sc_get(L, 1);
+      tc->sni_callback_ref = 0;
+      lua_pushstring(L, server_name);
+      if (lua_pcall(L, 1, 1, 0) == 0 && lua_touserdata(L, -1)) {
+        tls_sc_t *sc = luvit__lua_tls_sc_get(L, -1);
         SSL_set_SSL_CTX(s, sc->ctx);
-        lua_pop(L, 1);
+        tc->record_sizing = sc->record_sizing;
       }
+      lua_pop(L, 1);
     }
   }
 
@@ -146,6 +159,13 @@ newCONN(lua_State *L)
   tc->ssl = SSL_new(sc->ctx);
   tc->is_server = is_server;
   tc->server_name = NULL;
+  tc->sni_callback_ref = 0;
+  tc->lhandle = NULL;
+  tc->reading = 0;
+  tc->ended = 0;
+  tc->record_sizing = sc->record_sizing;
+  tc->record_sent = 0;
+  tc->last_write = 0;
   tc->error = 0;
   strncpy(tc->error_buf, "No error", sizeof(tc->error_buf));
 
@@ -306,7 +326,7 @@ static int
 tls_conn_enc_in(lua_State *L) {
   size_t len;
   tls_conn_t *tc = getCONN(L, 1);
-  const char *data = luaL_checklstring(L, 2, &len);
+  const char *data = luv_checkbuffer(L, 2, &len);
   int bytes_written = BIO_write(tc->bio_read, data, len);
   tls_handle_bio_error(tc, tc->bio_read, tc->ssl, bytes_written, "BIO_write");
   lua_pushnumber(L, bytes_written);
@@ -372,11 +392,49 @@ tls_conn_clear_out(lua_State *L) {
   return 2;
 }
 
+/* SSL_write for len bytes of cleartext, cut into records as sized by the
+ * context, see tls_record_sizing_t.  Returns the bytes written, or what
+ * SSL_write returned when nothing was.
+ */
+static int
+tls_conn_write_records(lua_State *L, tls_conn_t *tc, const char *data, size_t len) {
+  tls_record_sizing_t *rs = &tc->record_sizing;
+  double now;
+  size_t written = 0;
+  size_t chunk;
+  int rv;
+
+  if (rs->small == 0) {
+    return SSL_write(tc->ssl, data, len);
+  }
+
+  now = (double)uv_now(luv_get_loop(L));
+  if (now - tc->last_write >= rs->idle) {
+    /* The congestion window has likely shrunk, start over */
+    tc->record_sent = 0;
+  }
+  tc->last_write = now;
+
+  while (written < len) {
+    chunk = tc->record_sent < rs->ramp ? rs->small : rs->large;
+    if (chunk > len - written) {
+      chunk = len - written;
+    }
+    rv = SSL_write(tc->ssl, data + written, chunk);
+    if (rv <= 0) {
+      return written > 0 ? (int)written : rv;
+    }
+    written += rv;
+    tc->record_sent += rv;
+  }
+  return (int)written;
+}
+
 static int
 tls_conn_clear_in(lua_State *L) {
   size_t len;
   tls_conn_t *tc = getCONN(L, 1);
-  const char *data = luaL_checklstring(L, 2, &len);
+  const char *data = luv_checkbuffer(L, 2, &len);
   int bytes_written;
 
   if (!SSL_is_init_finished(tc->ssl)) {
@@ -395,7 +453,7 @@ tls_conn_clear_in(lua_State *L) {
     }
   }
 
-  bytes_written = SSL_write(tc->ssl, data, len);
+  bytes_written = tls_conn_write_records(L, tc, data, len);
   DBG("bytes_written = %d, len = %ld\n", bytes_written, len);
   tls_handle_ssl_error(tc, tc->ssl, bytes_written, "SSL_write:ClearIn");
   lua_pushnumber(L, bytes_written);
@@ -410,10 +468,406 @@ tls_conn_clear_pending(lua_State *L) {
   return 1;
 }
 
+/**
+ * Native stream mode
+ *
+ * Once attached to a uv stream the connection does its own I/O.  Ciphertext
+ * goes from the read callback straight into the read BIO and from the write
+ * BIO straight into uv_write, without a trip through Lua strings.  Cleartext
+ * is emitted as 'data' on the stream, just like a plain read, the end of the
+ * handshake as 'secure' and TLS failures as 'tlsError' with the message and
+ * code.
+ */
+
+/* Cleartext is handed to Lua in chunks of at most one TLS record */
+#define TLS_STREAM_READ_SIZE (16 * 1024)
+
+static uv_stream_t*
+tls_stream_get(lua_State *L, tls_conn_t *tc) {
+  if (!tc->lhandle || !tc->lhandle->handle) {
+    luaL_error(L, "TLS connection is not attached to an open stream");
+  }
+  if (!tc->ssl) {
+    luaL_error(L, "TLS connection is closed");
+  }
+  return (uv_stream_t*)tc->lhandle->handle;
+}
+
+/* Pushes the stream userdata kept in the connection's environment */
+static int
+tls_stream_push(lua_State *L, int conn_index) {
+  lua_getfenv(L, conn_index);
+  lua_getfield(L, -1, "stream");
+  lua_remove(L, -2);
+  return lua_gettop(L);
+}
+
+/* Handlers may close the stream or the connection under us */
+static int
+tls_stream_usable(tls_conn_t *tc) {
+  return tc->ssl && tc->lhandle->handle && !uv_is_closing(tc->lhandle->handle);
+}
+
+static void
+tls_stream_after_write(uv_write_t* req, int status) {
+  uv_stream_t *stream = req->handle;
+  uv_loop_t *loop = stream->loop;
+  luv_handle_t *lhandle = stream->data;
+  luv_io_ctx_t *cbs = &((luv_req_t*)req)->cbs;
+  lua_State *L;
+
+  /* The pool finds the size in the block header */
+  luv_on_alloc_release((uv_handle_t*)stream, uv_buf_init(req->data, 0));
+
+  L = luv_handle_get_lua(lhandle);
+  lua_pop(L, 1); /* We don't need the userdata */
+
+  luv_io_ctx_callback_rawgeti(L, cbs);
+  luv_io_ctx_unref(L, cbs);
+
+  if (lua_isfunction(L, -1)) {
+    if (status == -1) {
+      luv_push_async_error(L, uv_last_error(loop), "tls_after_write", NULL);
+      luv_acall(L, 1, 0, "tls_after_write");
+    } else {
+      luv_acall(L, 0, 0, "tls_after_write");
+    }
+  } else {
+    lua_pop(L, 1);
+  }
+
+  luv_handle_unref(L, lhandle);
+  luv_req_release(loop, (luv_req_t*)req);
+}
+
+/* Writes out whatever OpenSSL has queued as a single uv_write.  The
+ * callback at cb_index, when there is one, runs once it's written.  The
+ * stream userdata must be at ud_index.
+ */
+static void
+tls_stream_flush(lua_State *L, tls_conn_t *tc, int ud_index, int cb_index) {
+  uv_stream_t *stream = (uv_stream_t*)tc->lhandle->handle;
+  int pending = BIO_pending(tc->bio_write);
+  uv_buf_t buf;
+  luv_req_t *req;
+
+  if (pending <= 0) {
+    if (cb_index && lua_isfunction(L, cb_index)) {
+      lua_pushvalue(L, cb_index);
+      luv_acall(L, 0, 0, "tls_after_write");
+    }
+    return;
+  }
+
+  buf = luv_on_alloc((uv_handle_t*)stream, pending);
+  if (!buf.base) {
+    return;
+  }
+  buf.len = BIO_read(tc->bio_write, buf.base, pending);
+
+  req = luv_req_alloc(stream->loop, LUV_REQ_WRITE);
+  if (!req) {
+    luv_on_alloc_release((uv_handle_t*)stream, buf);
+    if (cb_index && lua_isfunction(L, cb_index)) {
+      lua_pushvalue(L, cb_index);
+      luv_push_async_error(L, uv_last_error(stream->loop), "tls_write", NULL);
+      luv_acall(L, 1, 0, "tls_after_write");
+    }
+    return;
+  }
+  req->uv.write.data = buf.base;
+  if (cb_index) {
+    luv_io_ctx_callback_add(L, &req->cbs, cb_index);
+  }
+  luv_handle_ref(L, tc->lhandle, ud_index);
+
+  uv_write(&req->uv.write, stream, &buf, 1, tls_stream_after_write);
+}
+
+static void
+tls_stream_emit_error(lua_State *L, tls_conn_t *tc, int ud_index) {
+  lua_pushvalue(L, ud_index);
+  lua_pushstring(L, tc->error_buf);
+  lua_pushnumber(L, tc->error);
+  tc->error = 0;
+  luv_emit_event(L, "tlsError", 2);
+}
+
+/* Advances the handshake, emits the cleartext OpenSSL can decrypt and
+ * flushes anything it wants to send in return.
+ */
+static void
+tls_stream_cycle(lua_State *L, tls_conn_t *tc, int ud_index) {
+  uv_stream_t *stream = (uv_stream_t*)tc->lhandle->handle;
+  uv_buf_t buf;
+  int rv;
+
+  if (!SSL_is_init_finished(tc->ssl)) {
+    if (tc->is_server) {
+      rv = SSL_accept(tc->ssl);
+      rv = tls_handle_ssl_error(tc, tc->ssl, rv, "SSL_accept:Stream");
+    } else {
+      rv = SSL_connect(tc->ssl);
+      rv = tls_handle_ssl_error(tc, tc->ssl, rv, "SSL_connect:Stream");
+    }
+    /* Handshake records and alerts go out before anything is reported */
+    tls_stream_flush(L, tc, ud_index, 0);
+    if (rv < 0) {
+      tls_stream_emit_error(L, tc, ud_index);
+      return;
+    }
+    if (!SSL_is_init_finished(tc->ssl)) {
+      return;
+    }
+    lua_pushvalue(L, ud_index);
+    luv_emit_event(L, "secure", 0);
+    if (!tls_stream_usable(tc)) {
+      return;
+    }
+  }
+
+  buf = luv_on_alloc((uv_handle_t*)stream, TLS_STREAM_READ_SIZE);
+  if (!buf.base) {
+    return;
+  }
+  /* Stop when paused, the rest stays buffered in OpenSSL until readStart */
+  while (tc->reading) {
+    rv = SSL_read(tc->ssl, buf.base, TLS_STREAM_READ_SIZE);
+    if (rv <= 0) {
+      if (SSL_get_error(tc->ssl, rv) == SSL_ERROR_ZERO_RETURN) {
+        /* close_notify, the peer won't send anything else */
+        if (!tc->ended) {
+          tc->ended = 1;
+          lua_pushvalue(L, ud_index);
+          luv_emit_event_slot(L, LUV_EVENT_END, 0);
+        }
+      } else if (tls_handle_ssl_error(tc, tc->ssl, rv, "SSL_read:Stream") < 0) {
+        tls_stream_emit_error(L, tc, ud_index);
+      }
+      break;
+    }
+    lua_pushvalue(L, ud_index);
+    lua_pushlstring(L, buf.base, rv);
+    lua_pushinteger(L, rv);
+    luv_emit_event_slot(L, LUV_EVENT_DATA, 2);
+    if (!tls_stream_usable(tc)) {
+      luv_on_alloc_release((uv_handle_t*)stream, buf);
+      return;
+    }
+  }
+  luv_on_alloc_release((uv_handle_t*)stream, buf);
+
+  if (tls_stream_usable(tc)) {
+    tls_stream_flush(L, tc, ud_index, 0);
+  }
+}
+
+static void
+tls_stream_on_read(uv_stream_t* handle, ssize_t nread, uv_buf_t buf) {
+  luv_handle_t *lhandle = handle->data;
+  tls_conn_t *tc = lhandle->layer;
+  /* load the lua state and the userdata */
+  lua_State *L = luv_handle_get_lua(lhandle);
+  int ud_index = lua_gettop(L);
+
+  /* Memory BIOs grow as needed, so this never writes short */
+  if (nread > 0 && tc->ssl) {
+    BIO_write(tc->bio_read, buf.base, nread);
+  }
+  luv_on_alloc_release((uv_handle_t*)handle, buf);
+
+  if (nread < 0) {
+    uv_err_t err = uv_last_error(handle->loop);
+    if (err.code != UV_EOF) {
+      luv_push_async_error(L, err, "on_read", NULL);
+      luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
+    } else if (!tc->ended) {
+      tc->ended = 1;
+      luv_emit_event_slot(L, LUV_EVENT_END, 0);
+    } else {
+      lua_pop(L, 1);
+    }
+    return;
+  }
+
+  if (nread > 0 && tc->ssl) {
+    tls_stream_cycle(L, tc, ud_index);
+  }
+  lua_settop(L, ud_index - 1);
+}
+
+/* conn:attach(stream) switches the connection to native stream mode */
+static int
+tls_conn_attach(lua_State *L) {
+  tls_conn_t *tc = getCONN(L, 1);
+  luv_handle_t *lhandle;
+
+  luv_checkudata(L, 2, "stream");
+  lhandle = lua_touserdata(L, 2);
+  if (tc->lhandle) {
+    return luaL_error(L, "attach: TLS connection is already attached");
+  }
+  if (lhandle->layer) {
+    return luaL_error(L, "attach: stream already carries a TLS connection");
+  }
+  tc->lhandle = lhandle;
+  lhandle->layer = tc;
+
+  /* The stream and the connection keep each other alive */
+  lua_getfenv(L, 2);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "tls");
+  lua_pop(L, 1);
+  lua_newtable(L);
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "stream");
+  lua_setfenv(L, 1);
+  return 0;
+}
+
+/* conn:detach() undoes attach before anything went over the stream, so a
+ * client can move to another handle, eg. the winner of a connect race
+ */
+static int
+tls_conn_detach(lua_State *L) {
+  tls_conn_t *tc = getCONN(L, 1);
+
+  if (!tc->lhandle) {
+    return 0;
+  }
+  if (tc->reading) {
+    return luaL_error(L, "detach: TLS connection is already in use");
+  }
+
+  lua_getfenv(L, 1);
+  lua_getfield(L, -1, "stream");
+  if (lua_isuserdata(L, -1)) {
+    lua_getfenv(L, -1);
+    lua_pushnil(L);
+    lua_setfield(L, -2, "tls");
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+  lua_newtable(L);
+  lua_setfenv(L, 1);
+
+  tc->lhandle->layer = NULL;
+  tc->lhandle = NULL;
+  return 0;
+}
+
+/* conn:readStart() starts reading the stream.  This also sends the client
+ * hello and emits cleartext left over from before a readStop.
+ */
+static int
+tls_conn_read_start(lua_State *L) {
+  tls_conn_t *tc = getCONN(L, 1);
+  uv_stream_t *stream = tls_stream_get(L, tc);
+  int ud_index = tls_stream_push(L, 1);
+
+  if (!tc->reading) {
+    uv_read_start(stream, luv_on_alloc, tls_stream_on_read);
+    luv_handle_ref(L, tc->lhandle, ud_index);
+    tc->reading = 1;
+  }
+  tls_stream_cycle(L, tc, ud_index);
+  return 0;
+}
+
+static int
+tls_conn_read_stop(lua_State *L) {
+  tls_conn_t *tc = getCONN(L, 1);
+  uv_stream_t *stream = tls_stream_get(L, tc);
+
+  if (tc->reading) {
+    uv_read_stop(stream);
+    tc->reading = 0;
+    luv_handle_unref(L, tc->lhandle);
+  }
+  return 0;
+}
+
+static void
+tls_stream_encrypt(lua_State *L, tls_conn_t *tc, int index) {
+  size_t len;
+  const char *data = luv_checkbuffer(L, index, &len);
+  int rv;
+
+  if (len == 0) {
+    return;
+  }
+  rv = tls_conn_write_records(L, tc, data, len);
+  if (rv != (int)len) {
+    tls_handle_ssl_error(tc, tc->ssl, rv, "SSL_write:Stream");
+    luaL_error(L, "write: %s", tc->error ? tc->error_buf : "TLS connection is not writable");
+  }
+}
+
+/* conn:write(data, [callback]) in stream mode.  data is a string, a Buffer
+ * or a list of them, which all go out in the same uv_write.
+ */
+static int
+tls_conn_write(lua_State *L) {
+  tls_conn_t *tc = getCONN(L, 1);
+  int ud_index;
+  int i, count;
+
+  tls_stream_get(L, tc);
+  if (!SSL_is_init_finished(tc->ssl)) {
+    return luaL_error(L, "write: TLS handshake not finished");
+  }
+
+  if (lua_istable(L, 2) && !luv_isbuffer(L, 2)) {
+    count = lua_objlen(L, 2);
+    for (i = 1; i <= count; i++) {
+      lua_rawgeti(L, 2, i);
+      tls_stream_encrypt(L, tc, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+  } else {
+    tls_stream_encrypt(L, tc, 2);
+  }
+
+  lua_settop(L, 3);
+  ud_index = tls_stream_push(L, 1);
+  tls_stream_flush(L, tc, ud_index, 3);
+  return 0;
+}
+
+/* Sends close_notify and shuts down the write side of the stream */
+static int
+tls_stream_shutdown(lua_State *L, tls_conn_t *tc) {
+  uv_stream_t *stream = tls_stream_get(L, tc);
+  int ud_index;
+  luv_req_t *req;
+
+  /* There's nothing to close before the handshake is done */
+  if (SSL_is_init_finished(tc->ssl)) {
+    SSL_shutdown(tc->ssl);
+  }
+  lua_settop(L, 2);
+  ud_index = tls_stream_push(L, 1);
+  tls_stream_flush(L, tc, ud_index, 0);
+
+  req = luv_req_alloc(stream->loop, LUV_REQ_SHUTDOWN);
+  if (!req) {
+    return luaL_error(L, "tls_shutdown: %s", uv_strerror(uv_last_error(stream->loop)));
+  }
+  luv_io_ctx_callback_add(L, &req->cbs, 2);
+  luv_handle_ref(L, tc->lhandle, ud_index);
+  uv_shutdown(&req->uv.shutdown, stream, luv_after_shutdown);
+  return 0;
+}
+
+/* In stream mode this takes a callback and shuts the stream down too */
 static int
 tls_conn_shutdown(lua_State *L) {
   tls_conn_t *tc = getCONN(L, 1);
-  int rv = SSL_shutdown(tc->ssl);
+  int rv;
+  if (tc->lhandle) {
+    return tls_stream_shutdown(L, tc);
+  }
+  rv = SSL_shutdown(tc->ssl);
   lua_pushnumber(L, rv);
   return 1;
 }
@@ -712,6 +1166,61 @@ tls_conn_get_peer_certificate(lua_State *L)
   return 1;
 }
 
+/* The negotiated session serialized, for resuming it on a later connection */
+static int
+tls_conn_get_session(lua_State *L) {
+  tls_conn_t *tc = getCONN(L, 1);
+  SSL_SESSION *sess;
+  unsigned char *buf, *p;
+  int len;
+
+  sess = tc->ssl ? SSL_get_session(tc->ssl) : NULL;
+  if (!sess || (len = i2d_SSL_SESSION(sess, NULL)) <= 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  buf = malloc(len);
+  if (!buf) {
+    return luaL_error(L, "getSession: out of memory");
+  }
+  p = buf;
+  i2d_SSL_SESSION(sess, &p);
+  lua_pushlstring(L, (const char*)buf, len);
+  free(buf);
+  return 1;
+}
+
+/* Offers a session from getSession to the server, before the handshake */
+static int
+tls_conn_set_session(lua_State *L) {
+  tls_conn_t *tc = getCONN(L, 1);
+  size_t len;
+  const unsigned char *p = (const unsigned char*)luaL_checklstring(L, 2, &len);
+  SSL_SESSION *sess;
+  int rv;
+
+  if (!tc->ssl) {
+    return luaL_error(L, "setSession: TLS connection is closed");
+  }
+  sess = d2i_SSL_SESSION(NULL, &p, len);
+  if (!sess) {
+    ERR_clear_error();
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  rv = SSL_set_session(tc->ssl, sess);
+  SSL_SESSION_free(sess);
+  lua_pushboolean(L, rv == 1);
+  return 1;
+}
+
+static int
+tls_conn_is_session_reused(lua_State *L) {
+  tls_conn_t *tc = getCONN(L, 1);
+  lua_pushboolean(L, tc->ssl && SSL_session_reused(tc->ssl));
+  return 1;
+}
+
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
 
 static int
@@ -758,15 +1267,19 @@ static const luaL_reg tls_conn_lib[] = {
   {"clearPending", tls_conn_clear_pending},
   {"getPeerCertificate", tls_conn_get_peer_certificate},
   {"getCurrentCipher", tls_conn_get_current_cipher},
-/*
   {"getSession", tls_conn_get_session},
   {"setSession", tls_conn_set_session},
-*/
+  {"isSessionReused", tls_conn_is_session_reused},
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
   {"getServerName", tls_conn_get_server_name},
   {"setSNICallback", tls_conn_set_sni_callback},
 #endif
   {"isInitFinished", tls_conn_is_init_finished},
+  {"attach", tls_conn_attach},
+  {"detach", tls_conn_detach},
+  {"readStart", tls_conn_read_start},
+  {"readStop", tls_conn_read_stop},
+  {"write", tls_conn_write},
   {"shutdown", tls_conn_shutdown},
   {"start", tls_conn_start},
   {"verifyError", tls_conn_verify_error},
@@ -16,12 +16,40 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
 
 #include "luv_portability.h"
 #include "luv_udp.h"
 #include "utils.h"
 
+#ifndef _WIN32
+/* Batched receive state, hung off the udp handle's layer.  It polls its
+ * own dup of the socket so libuv's watcher for sends is left alone.
+ */
+typedef struct {
+  uv_poll_t poll;
+  luv_handle_t* lhandle;
+  int fd;
+  int batch;           /* most datagrams read per wakeup */
+  size_t size;         /* bytes set aside for each datagram */
+#ifdef __linux__
+  struct mmsghdr* msgs;
+#else
+  struct msghdr* msgs;
+#endif
+  struct iovec* iovs;
+  struct sockaddr_storage* addrs;
+  size_t* lens;
+} luv_udp_batch_t;
+#endif
+
 #define X(name, fn) \
   int luv_udp_##name(lua_State *L) { \
     uv_udp_t* handle = (uv_udp_t*)luv_checkudata(L, 1, "udp"); \
@@ -41,10 +69,6 @@ X(set_multicast_loopback, uv_udp_set_multicast_loop);
 
 #undef X
 
-typedef struct {
-  int ref;
-} luv_udp_ref_t;
-
 static void luv_on_udp_recv(uv_udp_t* handle,
                             ssize_t nread,
                             uv_buf_t buf,
@@ -57,12 +81,15 @@ static void luv_on_udp_recv(uv_udp_t* handle,
   lua_State *L = luv_handle_get_lua(handle->data);
 
   if (nread == 0) {
+    lua_pop(L, 1);
+    luv_on_alloc_release((uv_handle_t*)handle, buf);
     return;
   }
 
   if (nread < 0) {
     luv_push_async_error(L, uv_last_error(luv_get_loop(L)), "on_recv", NULL);
-    luv_emit_event(L, "error", 1);
+    luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
+    luv_on_alloc_release((uv_handle_t*)handle, buf);
     return;
   }
 
@@ -85,22 +112,19 @@ static void luv_on_udp_recv(uv_udp_t* handle,
   lua_setfield(L, -2, "partial");
   lua_pushnumber(L, nread);
   lua_setfield(L, -2, "size");
-  luv_emit_event(L, "message", 2);
+  luv_emit_event_slot(L, LUV_EVENT_MESSAGE, 2);
 
-  free(buf.base);
-  buf.base = NULL;
+  luv_on_alloc_release((uv_handle_t*)handle, buf);
 }
 
 static void luv_on_udp_send(uv_udp_send_t* req, int status) {
-  luv_udp_ref_t *ref;
+  luv_io_ctx_t *cbs = &((luv_req_t*)req)->cbs;
   /* load the lua state and the userdata */
   lua_State *L = luv_handle_get_lua(req->handle->data);
   lua_pop(L, 1); /* We don't need the userdata */
   /* load the callback */
-  ref =  req->data;
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ref->ref);
-  luaL_unref(L, LUA_REGISTRYINDEX, ref->ref);
-  free(ref);
+  luv_io_ctx_callback_rawgeti(L, cbs);
+  luv_io_ctx_unref(L, cbs);
 
   if (lua_isfunction(L, -1)) {
     if (status != 0) {
@@ -114,7 +138,7 @@ static void luv_on_udp_send(uv_udp_send_t* req, int status) {
   }
 
   luv_handle_unref(L, req->handle->data);
-  free(req);
+  luv_req_release(req->handle->loop, (luv_req_t*)req);
 }
 
 int luv_new_udp (lua_State* L) {
@@ -221,36 +245,33 @@ static int luv_udp__send(lua_State* L, int family) {
   uv_udp_t* handle = (uv_udp_t*)luv_checkudata(L, 1, "udp");
   size_t len;
   const char* chunk = luaL_checklstring(L, 2, &len);
-  luv_udp_ref_t *ref;
-
-  uv_udp_send_t* req = (uv_udp_send_t*)malloc(sizeof(uv_udp_send_t));
+  luv_req_t* req;
   int port = luaL_checkint(L, 3);
   const char* host = luaL_checkstring(L, 4);
   struct sockaddr_in dest;
   struct sockaddr_in6 dest6;
   int rc;
 
-  /* Store a reference to the callback */
-  lua_pushvalue(L, 5);
-  ref = malloc(sizeof(*ref));
-  ref->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  req->data = ref;
+  req = luv_req_alloc(handle->loop, LUV_REQ_UDP_SEND);
+  if (!req) {
+    return luaL_error(L, "udp_send: %s", uv_strerror(uv_last_error(handle->loop)));
+  }
 
-  luv_handle_ref(L, handle->data, 1);
+  /* Keep the chunk alive until the send completes */
+  luv_io_ctx_add(L, &req->cbs, 2);
+  /* Store a reference to the callback */
+  luv_io_ctx_callback_add(L, &req->cbs, 5);
 
-  /* Store the chunk
-   * TODO: this is probably unsafe, should investigate
-   */
   buf = uv_buf_init((char*)chunk, len);
 
   switch(family) {
   case AF_INET:
     dest = uv_ip4_addr(host, port);
-    rc = uv_udp_send(req, handle, &buf, 1, dest, luv_on_udp_send);
+    rc = uv_udp_send(&req->uv.udp_send, handle, &buf, 1, dest, luv_on_udp_send);
     break;
   case AF_INET6:
     dest6 = uv_ip6_addr(host, port);
-    rc = uv_udp_send6(req, handle, &buf, 1, dest6, luv_on_udp_send);
+    rc = uv_udp_send6(&req->uv.udp_send, handle, &buf, 1, dest6, luv_on_udp_send);
     break;
   default:
     assert(0 && "unexpected family type");
@@ -259,9 +280,13 @@ static int luv_udp__send(lua_State* L, int family) {
 
   if (rc) {
     uv_err_t err = uv_last_error(luv_get_loop(L));
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_req_release(handle->loop, req);
     return luaL_error(L, "udp_send: %s", uv_strerror(err));
   }
 
+  luv_handle_ref(L, handle->data, 1);
+
   return 0;
 }
 
@@ -284,6 +309,345 @@ int luv_udp_recv_start(lua_State* L) {
   return 0;
 }
 
+#ifndef _WIN32
+/* Addresses go to Lua packed, 4 or 16 bytes.  Repeat senders share one
+ * interned string and udpAddressToString formats them when wanted. */
+static int luv_udp_push_packed_address(lua_State* L, struct sockaddr_storage* addr) {
+  if (addr->ss_family == AF_INET) {
+    struct sockaddr_in* in = (struct sockaddr_in*)addr;
+    lua_pushlstring(L, (const char*)&in->sin_addr, sizeof(in->sin_addr));
+    return ntohs(in->sin_port);
+  }
+  if (addr->ss_family == AF_INET6) {
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)addr;
+    lua_pushlstring(L, (const char*)&in6->sin6_addr, sizeof(in6->sin6_addr));
+    return ntohs(in6->sin6_port);
+  }
+  lua_pushnil(L);
+  return 0;
+}
+
+static void luv_udp_batch_on_poll(uv_poll_t* poll, int status, int events) {
+  luv_udp_batch_t* b = poll->data;
+  luv_buffer_pool_t* pool = &luv_loop_data(poll->loop)->buffer_pool;
+  lua_State* L;
+  uv_buf_t buf;
+  int i, n;
+
+  if (status == -1) {
+    L = luv_handle_get_lua(b->lhandle);
+    luv_push_async_error(L, uv_last_error(poll->loop), "on_recv_batch", NULL);
+    luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
+    return;
+  }
+
+  /* Every datagram of the batch lands in one pooled block */
+  buf = luv_buffer_pool_alloc(pool, b->batch * b->size);
+  if (!buf.base) {
+    return;
+  }
+  for (i = 0; i < b->batch; i++) {
+#ifdef __linux__
+    struct msghdr* hdr = &b->msgs[i].msg_hdr;
+#else
+    struct msghdr* hdr = &b->msgs[i];
+#endif
+    b->iovs[i].iov_base = buf.base + i * b->size;
+    b->iovs[i].iov_len = b->size;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &b->addrs[i];
+    hdr->msg_namelen = sizeof(b->addrs[i]);
+    hdr->msg_iov = &b->iovs[i];
+    hdr->msg_iovlen = 1;
+  }
+
+#ifdef __linux__
+  do {
+    n = recvmmsg(b->fd, b->msgs, b->batch, MSG_DONTWAIT, NULL);
+  } while (n < 0 && errno == EINTR);
+  for (i = 0; i < n; i++) {
+    b->lens[i] = b->msgs[i].msg_len;
+  }
+#else
+  for (n = 0; n < b->batch; n++) {
+    ssize_t r;
+    do {
+      r = recvmsg(b->fd, &b->msgs[n], MSG_DONTWAIT);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+      if (n == 0) {
+        n = -1;
+      }
+      break;
+    }
+    b->lens[n] = r;
+  }
+#endif
+
+  if (n <= 0) {
+    int errorno = errno;
+    luv_buffer_pool_release(pool, buf);
+    if (n < 0 && errorno != EAGAIN && errorno != EWOULDBLOCK) {
+      uv_err_t err;
+      memset(&err, 0, sizeof err);
+      err.code = uv_translate_sys_error(errorno);
+      L = luv_handle_get_lua(b->lhandle);
+      luv_push_async_error(L, err, "on_recv_batch", NULL);
+      luv_emit_event_slot(L, LUV_EVENT_ERROR, 1);
+    }
+    return;
+  }
+
+  /* 'messages' gets (payloads, addresses, ports, count) */
+  L = luv_handle_get_lua(b->lhandle);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushlstring(L, (const char*)b->iovs[i].iov_base, b->lens[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_createtable(L, n, 0);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    int port = luv_udp_push_packed_address(L, &b->addrs[i]);
+    lua_rawseti(L, -3, i + 1);
+    lua_pushnumber(L, port);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushnumber(L, n);
+  luv_buffer_pool_release(pool, buf);
+  luv_emit_event(L, "messages", 4);
+}
+
+static void luv_udp_batch_on_close(uv_handle_t* handle) {
+  luv_udp_batch_t* b = handle->data;
+  close(b->fd);
+  free(b->msgs);
+  free(b->iovs);
+  free(b->addrs);
+  free(b->lens);
+  free(b);
+}
+
+static void luv_udp_batch_close(luv_handle_t* lhandle) {
+  luv_udp_batch_t* b = lhandle->layer;
+
+  lhandle->layer = NULL;
+  lhandle->layer_close = NULL;
+  uv_close((uv_handle_t*)&b->poll, luv_udp_batch_on_close);
+}
+#endif
+
+/* udp:recvBatchStart([batch], [size]) reads up to batch datagrams of at
+ * most size bytes per wakeup, using recvmmsg where there is one, and emits
+ * them together as 'messages'.  Longer datagrams are truncated.
+ */
+int luv_udp_recv_batch_start(lua_State* L) {
+#ifdef _WIN32
+  return luaL_error(L, "udp_recv_batch_start: not supported on this platform");
+#else
+  uv_udp_t* handle = (uv_udp_t*)luv_checkudata(L, 1, "udp");
+  luv_handle_t* lhandle = handle->data;
+  int batch = luaL_optint(L, 2, 32);
+  int size = luaL_optint(L, 3, 2048);
+  luv_udp_batch_t* b;
+  int fd;
+
+  luaL_argcheck(L, batch > 0 && batch <= 1024, 2, "batch must be between 1 and 1024");
+  luaL_argcheck(L, size > 0 && size <= 65536, 3, "size must be between 1 and 65536");
+
+  if (lhandle->layer) {
+    return luaL_error(L, "udp_recv_batch_start: already receiving in batches");
+  }
+  if (handle->io_watcher.fd < 0) {
+    return luaL_error(L, "udp_recv_batch_start: socket is not bound");
+  }
+  /* The two receive modes would race for the same datagrams */
+  uv_udp_recv_stop(handle);
+
+  fd = dup(handle->io_watcher.fd);
+  if (fd < 0) {
+    uv_err_t err;
+    memset(&err, 0, sizeof err);
+    err.code = uv_translate_sys_error(errno);
+    return luaL_error(L, "udp_recv_batch_start: %s", uv_strerror(err));
+  }
+
+  b = malloc(sizeof(*b));
+  memset(b, 0, sizeof(*b));
+  b->lhandle = lhandle;
+  b->fd = fd;
+  b->batch = batch;
+  b->size = size;
+  b->msgs = malloc(batch * sizeof(*b->msgs));
+  b->iovs = malloc(batch * sizeof(*b->iovs));
+  b->addrs = malloc(batch * sizeof(*b->addrs));
+  b->lens = malloc(batch * sizeof(*b->lens));
+
+  uv_poll_init(handle->loop, &b->poll, fd);
+  b->poll.data = b;
+  uv_poll_start(&b->poll, UV_READABLE, luv_udp_batch_on_poll);
+
+  lhandle->layer = b;
+  lhandle->layer_close = luv_udp_batch_close;
+  luv_handle_ref(L, lhandle, 1);
+  return 0;
+#endif
+}
+
+int luv_udp_recv_batch_stop(lua_State* L) {
+#ifndef _WIN32
+  uv_udp_t* handle = (uv_udp_t*)luv_checkudata(L, 1, "udp");
+  luv_handle_t* lhandle = handle->data;
+
+  if (lhandle->layer_close == luv_udp_batch_close) {
+    luv_udp_batch_close(lhandle);
+    luv_handle_unref(L, lhandle);
+  }
+#endif
+  return 0;
+}
+
+/* udpAddressToString(packed) formats an address from 'messages' */
+int luv_udp_address_to_string(lua_State* L) {
+  size_t len;
+  const char* packed = luaL_checklstring(L, 1, &len);
+  char ip[INET6_ADDRSTRLEN];
+
+  if (len == 4) {
+    uv_inet_ntop(AF_INET, packed, ip, INET6_ADDRSTRLEN);
+  } else if (len == 16) {
+    uv_inet_ntop(AF_INET6, packed, ip, INET6_ADDRSTRLEN);
+  } else {
+    return luaL_argerror(L, 1, "packed address expected");
+  }
+  lua_pushstring(L, ip);
+  return 1;
+}
+
+/* udpPackAddress(ip, port) packs a destination for udp:sendBatch, so it's
+ * parsed once and not for every datagram sent to it.
+ */
+int luv_udp_pack_address(lua_State* L) {
+  const char* host = luaL_checkstring(L, 1);
+  int port = luaL_checkint(L, 2);
+  char probe[16];
+
+  if (uv_inet_pton(AF_INET, host, probe).code == UV_OK) {
+    struct sockaddr_in dest = uv_ip4_addr(host, port);
+    lua_pushlstring(L, (const char*)&dest, sizeof(dest));
+  } else if (uv_inet_pton(AF_INET6, host, probe).code == UV_OK) {
+    struct sockaddr_in6 dest6 = uv_ip6_addr(host, port);
+    lua_pushlstring(L, (const char*)&dest6, sizeof(dest6));
+  } else {
+    return luaL_argerror(L, 1, "ip address expected");
+  }
+  return 1;
+}
+
+#define LUV_UDP_SEND_BATCH 64
+
+/* udp:sendBatch(datagrams, destinations) sends each datagram to the packed
+ * destination at the same index, with sendmmsg where there is one.  It
+ * doesn't block or queue: it returns how many went out before the socket
+ * buffer filled, plus an error if one stopped it early.  The rest can go
+ * through udp:send.  Windows sends none this way.
+ */
+int luv_udp_send_batch(lua_State* L) {
+#ifdef _WIN32
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_pushnumber(L, 0);
+  return 1;
+#else
+  uv_udp_t* handle = (uv_udp_t*)luv_checkudata(L, 1, "udp");
+#ifdef __linux__
+  struct mmsghdr msgs[LUV_UDP_SEND_BATCH];
+#else
+  struct msghdr msgs[LUV_UDP_SEND_BATCH];
+#endif
+  struct iovec iovs[LUV_UDP_SEND_BATCH];
+  int count, sent = 0, errorno = 0;
+  int i, n, r;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  count = lua_objlen(L, 2);
+  luaL_argcheck(L, (int)lua_objlen(L, 3) == count, 3, "one destination per datagram expected");
+  if (handle->io_watcher.fd < 0) {
+    return luaL_error(L, "udp_send_batch: socket is not bound");
+  }
+  /* Datagrams and destinations stay on the stack while they're sent */
+  luaL_checkstack(L, 2 * LUV_UDP_SEND_BATCH, "udp_send_batch");
+
+  while (sent < count && !errorno) {
+    n = count - sent;
+    if (n > LUV_UDP_SEND_BATCH) {
+      n = LUV_UDP_SEND_BATCH;
+    }
+    for (i = 0; i < n; i++) {
+#ifdef __linux__
+      struct msghdr* hdr = &msgs[i].msg_hdr;
+#else
+      struct msghdr* hdr = &msgs[i];
+#endif
+      size_t len, addrlen;
+      const char* data;
+      const char* addr;
+
+      lua_rawgeti(L, 2, sent + i + 1);
+      data = luv_checkbuffer(L, -1, &len);
+      lua_rawgeti(L, 3, sent + i + 1);
+      addr = lua_tolstring(L, -1, &addrlen);
+      if (!addr || (addrlen != sizeof(struct sockaddr_in) &&
+                    addrlen != sizeof(struct sockaddr_in6))) {
+        return luaL_error(L, "udp_send_batch: destination %d is not a packed address", sent + i + 1);
+      }
+      iovs[i].iov_base = (void*)data;
+      iovs[i].iov_len = len;
+      memset(hdr, 0, sizeof(*hdr));
+      hdr->msg_name = (void*)addr;
+      hdr->msg_namelen = addrlen;
+      hdr->msg_iov = &iovs[i];
+      hdr->msg_iovlen = 1;
+    }
+
+#ifdef __linux__
+    do {
+      r = sendmmsg(handle->io_watcher.fd, msgs, n, MSG_DONTWAIT);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+      errorno = errno;
+    } else {
+      sent += r;
+    }
+#else
+    for (i = 0; i < n; i++) {
+      ssize_t w;
+      do {
+        w = sendmsg(handle->io_watcher.fd, &msgs[i], MSG_DONTWAIT);
+      } while (w < 0 && errno == EINTR);
+      if (w < 0) {
+        errorno = errno;
+        break;
+      }
+      sent++;
+    }
+#endif
+    lua_pop(L, 2 * n);
+  }
+
+  lua_pushnumber(L, sent);
+  if (errorno && errorno != EAGAIN && errorno != EWOULDBLOCK) {
+    uv_err_t err;
+    memset(&err, 0, sizeof err);
+    err.code = uv_translate_sys_error(errorno);
+    luv_push_async_error(L, err, "udp_send_batch", NULL);
+    return 2;
+  }
+  return 1;
+#endif
+}
+
 int luv_udp_recv_stop(lua_State* L) {
   uv_udp_t* handle = (uv_udp_t*)luv_checkudata(L, 1, "udp");
   if (uv_udp_recv_stop(handle)) {
@@ -33,6 +33,11 @@ int luv_udp_send(lua_State* L);
 int luv_udp_send6(lua_State* L);
 int luv_udp_recv_start(lua_State* L);
 int luv_udp_recv_stop(lua_State* L);
+int luv_udp_recv_batch_start(lua_State* L);
+int luv_udp_recv_batch_stop(lua_State* L);
+int luv_udp_address_to_string(lua_State* L);
+int luv_udp_pack_address(lua_State* L);
+int luv_udp_send_batch(lua_State* L);
 int luv_udp_set_broadcast(lua_State* L);
 int luv_udp_set_ttl(lua_State* L);
 int luv_udp_set_multicast_ttl(lua_State* L);
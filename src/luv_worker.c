@@ -0,0 +1,550 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include "uv.h"
+#include "utils.h"
+#include "luv_worker.h"
+#include "luv_alloc.h"
+#include "luv_zlib.h"
+#include "lyajl.h"
+
+/* Worker threads each own a lua_State of their own.  Jobs carry a chunk of
+ * code and its arguments serialized into a flat buffer, the results come
+ * back the same way and are handed to the callback on the loop thread.
+ */
+
+#define LUV_WORKER_MAX_THREADS 64
+#define LUV_WORKER_MAX_DEPTH 32
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} luv_worker_buf_t;
+
+typedef struct luv_worker_job_s {
+  struct luv_worker_job_s* next;
+  char* code;
+  size_t code_len;
+  luv_worker_buf_t payload; /* the arguments, then the results or error */
+  int failed;
+  int callback;             /* registry ref in the main state */
+} luv_worker_job_t;
+
+typedef struct {
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  luv_worker_job_t* queue;  /* waiting for a thread, oldest first */
+  luv_worker_job_t* queue_tail;
+  luv_worker_job_t* done;   /* finished, waiting for the loop */
+  luv_worker_job_t* done_tail;
+  uv_async_t async;
+  uv_thread_t threads[LUV_WORKER_MAX_THREADS];
+  int nthreads;
+  int started;
+  lua_State* L;             /* main thread */
+  char* path;               /* where worker states look for lib/luvit */
+  size_t queued;
+  size_t pending;           /* jobs whose callback hasn't run yet */
+  double completed;
+} luv_worker_pool_t;
+
+static luv_worker_pool_t luv_worker_pool;
+static uv_once_t luv_worker_once = UV_ONCE_INIT;
+
+/* The pool is shared by every loop thread, its lock comes first */
+static void luv_worker_init_locks(void) {
+  uv_mutex_init(&luv_worker_pool.mutex);
+  uv_cond_init(&luv_worker_pool.cond);
+}
+
+static void luv_worker_lock(luv_worker_pool_t* pool) {
+  uv_once(&luv_worker_once, luv_worker_init_locks);
+  uv_mutex_lock(&pool->mutex);
+}
+
+/* Bundled builds have lib/luvit compiled in and hand over its preloader */
+static void (*luv_worker_preload)(lua_State* L);
+
+void luv_worker_set_preload(void (*preload)(lua_State* L)) {
+  luv_worker_preload = preload;
+}
+
+static void luv_worker_buf_put(luv_worker_buf_t* b, const void* data, size_t len) {
+  if (b->len + len > b->cap) {
+    size_t cap = b->cap ? b->cap : 64;
+    while (cap < b->len + len) {
+      cap *= 2;
+    }
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void luv_worker_buf_tag(luv_worker_buf_t* b, char tag) {
+  luv_worker_buf_put(b, &tag, 1);
+}
+
+/* Appends the value at index, returns an error message if it can't be sent.
+ * Strings and Buffers are copied, tables are copied deeply.
+ */
+static const char* luv_worker_encode(lua_State* L, int index, luv_worker_buf_t* b, int depth) {
+  const char* err;
+  const char* str;
+  size_t len;
+  double num;
+
+  switch (lua_type(L, index)) {
+  case LUA_TNIL:
+    luv_worker_buf_tag(b, 'n');
+    return NULL;
+  case LUA_TBOOLEAN:
+    luv_worker_buf_tag(b, lua_toboolean(L, index) ? 't' : 'f');
+    return NULL;
+  case LUA_TNUMBER:
+    num = lua_tonumber(L, index);
+    luv_worker_buf_tag(b, 'd');
+    luv_worker_buf_put(b, &num, sizeof(num));
+    return NULL;
+  case LUA_TSTRING:
+    str = lua_tolstring(L, index, &len);
+    break;
+  case LUA_TTABLE:
+    if (luv_isbuffer(L, index)) {
+      str = luv_checkbuffer(L, index, &len);
+      break;
+    }
+    if (depth >= LUV_WORKER_MAX_DEPTH) {
+      return "tables nested too deeply for a worker";
+    }
+    if (!lua_checkstack(L, 2)) {
+      return "stack overflow";
+    }
+    luv_worker_buf_tag(b, '{');
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+      int top = lua_gettop(L);
+      if ((err = luv_worker_encode(L, top - 1, b, depth + 1)) ||
+          (err = luv_worker_encode(L, top, b, depth + 1))) {
+        lua_pop(L, 2);
+        return err;
+      }
+      lua_pop(L, 1);
+    }
+    luv_worker_buf_tag(b, '}');
+    return NULL;
+  default:
+    return "only nil, booleans, numbers, strings, Buffers and tables can be passed to or from a worker";
+  }
+
+  luv_worker_buf_tag(b, 's');
+  luv_worker_buf_put(b, &len, sizeof(len));
+  luv_worker_buf_put(b, str, len);
+  return NULL;
+}
+
+/* Pushes the value at *p and moves past it, the buffer is our own output */
+static void luv_worker_decode(lua_State* L, const char** p) {
+  double num;
+  size_t len;
+  char tag = *(*p)++;
+
+  luaL_checkstack(L, 3, "worker results");
+  switch (tag) {
+  case 'n':
+    lua_pushnil(L);
+    break;
+  case 't':
+  case 'f':
+    lua_pushboolean(L, tag == 't');
+    break;
+  case 'd':
+    memcpy(&num, *p, sizeof(num));
+    *p += sizeof(num);
+    lua_pushnumber(L, num);
+    break;
+  case 's':
+    memcpy(&len, *p, sizeof(len));
+    *p += sizeof(len);
+    lua_pushlstring(L, *p, len);
+    *p += len;
+    break;
+  case '{':
+    lua_newtable(L);
+    while (**p != '}') {
+      luv_worker_decode(L, p);
+      luv_worker_decode(L, p);
+      lua_rawset(L, -3);
+    }
+    (*p)++;
+    break;
+  }
+}
+
+/* Pushes every value in the buffer and returns how many there were */
+static int luv_worker_decode_all(lua_State* L, luv_worker_buf_t* b) {
+  const char* p = b->data;
+  const char* end = b->data + b->len;
+  int n = 0;
+
+  while (p < end) {
+    luv_worker_decode(L, &p);
+    n++;
+  }
+  return n;
+}
+
+/* Runs a job in a worker's state, under lua_cpcall so any error, even
+ * running out of memory, ends up as the job's error.
+ */
+static int luv_worker_job_run(lua_State* L) {
+  luv_worker_job_t* job = lua_touserdata(L, 1);
+  const char* err;
+  int nargs, i, top;
+
+  lua_settop(L, 0);
+  if (luaL_loadbuffer(L, job->code, job->code_len, "=worker")) {
+    return lua_error(L);
+  }
+  nargs = luv_worker_decode_all(L, &job->payload);
+  lua_call(L, nargs, LUA_MULTRET);
+
+  job->payload.len = 0;
+  top = lua_gettop(L);
+  for (i = 1; i <= top; i++) {
+    if ((err = luv_worker_encode(L, i, &job->payload, 0))) {
+      return luaL_error(L, "%s", err);
+    }
+  }
+  return 0;
+}
+
+static lua_State* luv_worker_new_state(luv_worker_pool_t* pool) {
+  lua_State* L = luv_newstate();
+
+  luaL_openlibs(L);
+
+  /* The natives that don't need a loop */
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  lua_pushcfunction(L, luaopen_yajl);
+  lua_setfield(L, -2, "yajl");
+  lua_pushcfunction(L, luaopen_zlib_native);
+  lua_setfield(L, -2, "zlib_native");
+  lua_pop(L, 1);
+
+  /* Pure Lua lib/luvit modules come from the same place the main state
+   * gets them, ahead of the stock search path */
+  if (pool->path) {
+    lua_pushstring(L, pool->path);
+    lua_pushliteral(L, ";");
+    lua_getfield(L, -3, "path");
+    lua_concat(L, 3);
+    lua_setfield(L, -2, "path");
+  }
+  lua_pop(L, 1);
+  if (luv_worker_preload) {
+    luv_worker_preload(L);
+  }
+  return L;
+}
+
+static void luv_worker_thread(void* arg) {
+  luv_worker_pool_t* pool = arg;
+  lua_State* L = luv_worker_new_state(pool);
+  luv_worker_job_t* job;
+
+  for (;;) {
+    uv_mutex_lock(&pool->mutex);
+    while (!pool->queue) {
+      uv_cond_wait(&pool->cond, &pool->mutex);
+    }
+    job = pool->queue;
+    pool->queue = job->next;
+    if (!pool->queue) {
+      pool->queue_tail = NULL;
+    }
+    pool->queued--;
+    uv_mutex_unlock(&pool->mutex);
+
+    if (lua_cpcall(L, luv_worker_job_run, job)) {
+      size_t len;
+      const char* msg = lua_tolstring(L, -1, &len);
+      if (!msg) {
+        msg = "worker failed";
+        len = strlen(msg);
+      }
+      job->failed = 1;
+      job->payload.len = 0;
+      luv_worker_buf_put(&job->payload, msg, len);
+    }
+    lua_settop(L, 0);
+    job->next = NULL;
+
+    uv_mutex_lock(&pool->mutex);
+    if (pool->done_tail) {
+      pool->done_tail->next = job;
+    } else {
+      pool->done = job;
+    }
+    pool->done_tail = job;
+    uv_mutex_unlock(&pool->mutex);
+    uv_async_send(&pool->async);
+  }
+}
+
+static void luv_worker_on_done(uv_async_t* handle, int status) {
+  luv_worker_pool_t* pool = handle->data;
+  lua_State* L = pool->L;
+  luv_worker_job_t* job;
+
+  uv_mutex_lock(&pool->mutex);
+  job = pool->done;
+  pool->done = NULL;
+  pool->done_tail = NULL;
+  uv_mutex_unlock(&pool->mutex);
+
+  while (job) {
+    luv_worker_job_t* next = job->next;
+    int nargs, idle;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, job->callback);
+    luaL_unref(L, LUA_REGISTRYINDEX, job->callback);
+    if (job->failed) {
+      lua_pushlstring(L, job->payload.data, job->payload.len);
+      nargs = 1;
+    } else {
+      lua_pushnil(L);
+      nargs = 1 + luv_worker_decode_all(L, &job->payload);
+    }
+    free(job->code);
+    free(job->payload.data);
+    free(job);
+
+    uv_mutex_lock(&pool->mutex);
+    pool->completed++;
+    idle = --pool->pending == 0;
+    uv_mutex_unlock(&pool->mutex);
+    if (idle) {
+      uv_unref((uv_handle_t*)&pool->async);
+    }
+    luv_acall(L, nargs, 0, "worker_after");
+    job = next;
+  }
+}
+
+/* Starts the threads on the first call from any loop, the first caller's
+ * loop gets the results */
+static luv_worker_pool_t* luv_worker_start(lua_State* L) {
+  luv_worker_pool_t* pool = &luv_worker_pool;
+  int i;
+
+  luv_worker_lock(pool);
+  if (pool->started) {
+    uv_mutex_unlock(&pool->mutex);
+    return pool;
+  }
+
+  if (!pool->nthreads) {
+    uv_cpu_info_t* cpus;
+    int count = 0;
+    if (uv_cpu_info(&cpus, &count).code == UV_OK) {
+      uv_free_cpu_info(cpus, count);
+    }
+    pool->nthreads = count > 0 ? count : 4;
+    if (pool->nthreads > LUV_WORKER_MAX_THREADS) {
+      pool->nthreads = LUV_WORKER_MAX_THREADS;
+    }
+  }
+
+  pool->L = luv_get_main_thread(L);
+
+  uv_async_init(luv_get_loop(L), &pool->async, luv_worker_on_done);
+  pool->async.data = pool;
+  /* Only outstanding jobs keep the loop alive */
+  uv_unref((uv_handle_t*)&pool->async);
+
+  /* The threads wait on the lock until the pool is marked started */
+  for (i = 0; i < pool->nthreads; i++) {
+    if (uv_thread_create(&pool->threads[i], luv_worker_thread, pool)) {
+      break;
+    }
+  }
+  if (i == 0) {
+    uv_close((uv_handle_t*)&pool->async, NULL);
+    uv_mutex_unlock(&pool->mutex);
+    return NULL;
+  }
+  pool->nthreads = i;
+  pool->started = 1;
+  uv_mutex_unlock(&pool->mutex);
+  return pool;
+}
+
+/* setup(threads) sets how many threads to start, before the first job */
+static int luv_worker_setup(lua_State* L) {
+  int threads = luaL_checkint(L, 1);
+
+  luaL_argcheck(L, threads > 0 && threads <= LUV_WORKER_MAX_THREADS, 1,
+                "threads must be between 1 and 64");
+  luv_worker_lock(&luv_worker_pool);
+  if (luv_worker_pool.started) {
+    uv_mutex_unlock(&luv_worker_pool.mutex);
+    return luaL_error(L, "worker: the threads are already running");
+  }
+  luv_worker_pool.nthreads = threads;
+  uv_mutex_unlock(&luv_worker_pool.mutex);
+  return 0;
+}
+
+/* setPath(path) sets the package.path entries worker states find lib/luvit
+ * with, before the first job.  Later calls leave it as it is.
+ */
+static int luv_worker_set_path(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  char* copy = malloc(strlen(path) + 1);
+
+  if (!copy) {
+    return luaL_error(L, "worker: out of memory");
+  }
+  strcpy(copy, path);
+  luv_worker_lock(&luv_worker_pool);
+  if (luv_worker_pool.started) {
+    uv_mutex_unlock(&luv_worker_pool.mutex);
+    free(copy);
+    return 0;
+  }
+  free(luv_worker_pool.path);
+  luv_worker_pool.path = copy;
+  uv_mutex_unlock(&luv_worker_pool.mutex);
+  return 0;
+}
+
+/* run(code, callback, ...) loads code, a chunk of source or bytecode, on a
+ * worker thread and calls it with the arguments.  callback(err, ...) gets
+ * what it returned.
+ */
+static int luv_worker_run(lua_State* L) {
+  size_t len;
+  const char* code = luaL_checklstring(L, 1, &len);
+  luv_worker_pool_t* pool;
+  luv_worker_job_t* job;
+  const char* err;
+  int i, top = lua_gettop(L);
+
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+
+  job = malloc(sizeof(*job));
+  if (!job) {
+    return luaL_error(L, "worker: out of memory");
+  }
+  memset(job, 0, sizeof(*job));
+  for (i = 3; i <= top; i++) {
+    if ((err = luv_worker_encode(L, i, &job->payload, 0))) {
+      free(job->payload.data);
+      free(job);
+      return luaL_argerror(L, i, err);
+    }
+  }
+
+  pool = luv_worker_start(L);
+  if (!pool) {
+    free(job->payload.data);
+    free(job);
+    return luaL_error(L, "worker: couldn't start any threads");
+  }
+  /* Results are delivered on the loop thread that started the pool, into
+   * its lua_State, callbacks from other loops would run in the wrong one */
+  if (luv_get_main_thread(L) != pool->L) {
+    free(job->payload.data);
+    free(job);
+    return luaL_error(L, "worker: the pool belongs to another loop");
+  }
+
+  job->code = malloc(len);
+  if (!job->code) {
+    free(job->payload.data);
+    free(job);
+    return luaL_error(L, "worker: out of memory");
+  }
+  memcpy(job->code, code, len);
+  job->code_len = len;
+  lua_pushvalue(L, 2);
+  job->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  uv_mutex_lock(&pool->mutex);
+  if (pool->pending++ == 0) {
+    uv_ref((uv_handle_t*)&pool->async);
+  }
+  if (pool->queue_tail) {
+    pool->queue_tail->next = job;
+  } else {
+    pool->queue = job;
+  }
+  pool->queue_tail = job;
+  pool->queued++;
+  uv_cond_signal(&pool->cond);
+  uv_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+static int luv_worker_stats(lua_State* L) {
+  luv_worker_pool_t* pool = &luv_worker_pool;
+  size_t queued, pending;
+  int threads;
+  double completed;
+
+  luv_worker_lock(pool);
+  threads = pool->started ? pool->nthreads : 0;
+  queued = pool->queued;
+  pending = pool->pending;
+  completed = pool->completed;
+  uv_mutex_unlock(&pool->mutex);
+
+  lua_newtable(L);
+  lua_pushnumber(L, threads);
+  lua_setfield(L, -2, "threads");
+  lua_pushnumber(L, queued);
+  lua_setfield(L, -2, "queued");
+  lua_pushnumber(L, pending);
+  lua_setfield(L, -2, "pending");
+  lua_pushnumber(L, completed);
+  lua_setfield(L, -2, "completed");
+  return 1;
+}
+
+static const luaL_reg luv_worker_f[] = {
+  {"setup", luv_worker_setup},
+  {"setPath", luv_worker_set_path},
+  {"run", luv_worker_run},
+  {"stats", luv_worker_stats},
+  {NULL, NULL}
+};
+
+LUALIB_API int luaopen_worker_native(lua_State *L) {
+  lua_newtable(L);
+  luaL_register(L, NULL, luv_worker_f);
+  return 1;
+}
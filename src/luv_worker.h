@@ -0,0 +1,30 @@
+/*
+ *  Copyright 2012 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef LUV_WORKER
+#define LUV_WORKER
+
+#include "lua.h"
+#include "lauxlib.h"
+
+LUALIB_API int luaopen_worker_native(lua_State *L);
+
+/* Called on every new worker state, bundled builds pass the function that
+ * registers their embedded lib/luvit
+ */
+void luv_worker_set_preload(void (*preload)(lua_State* L));
+
+#endif
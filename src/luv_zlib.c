@@ -24,10 +24,31 @@
 #include <lauxlib.h>
 #include <lua.h>
 
+#include "utils.h"
+
+/* Smallest output buffer handed to zlib */
+#define LZ_CHUNK_SIZE 16384
+
+/* Output buffers bigger than this are freed after use instead of kept */
+#define LZ_KEEP_SIZE (1024 * 1024)
+
+/* Room for the block and flush markers deflateBound doesn't count */
+#define LZ_FLUSH_SLACK 64
+
 typedef struct {
   z_stream stream;
   int (*filter)(z_stream *, int);
   int (*end)(z_stream *);
+  int method;        /* index into methods */
+  int flush;
+  /* Scratch output, reused from write to write */
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  /* State of the asynchronous write in progress, there's one at most */
+  int busy;
+  int rc;
+  lua_State *L;
 } z_t;
 
 static const char *methods[] = {
@@ -38,53 +59,233 @@ static const char *flush_opts[] = {
   "none", "sync", "full", "finish", NULL
 };
 
-static int lz_stream_write(lua_State *L) {
-
+static z_t *lz_check_stream(lua_State *L) {
   z_t *z;
-  int flush;
-  int rc = Z_OK;
-  luaL_Buffer buff;
-
+  luaL_checktype(L, 1, LUA_TTABLE);
   lua_getfield(L, 1, "stream");
   z = (z_t *)lua_touserdata(L, -1);
   lua_pop(L, 1);
+  if (!z) {
+    luaL_error(L, "zlib: not a stream");
+  }
+  if (z->busy) {
+    luaL_error(L, "zlib: stream is busy with an asynchronous write");
+  }
+  return z;
+}
 
-  z->stream.next_in = (uint8_t *)luaL_checklstring(L, 2, (size_t*)&z->stream.avail_in);
+/* Make room for need more bytes of output, at least doubling the buffer */
+static int lz_reserve(z_t *z, size_t need) {
+  size_t cap;
+  char *out;
 
-  flush = luaL_checkoption(L, 3, flush_opts[3], flush_opts);
-  if (flush) flush++;
+  if (z->out_cap - z->out_len >= need) {
+    return 1;
+  }
+  cap = z->out_cap * 2;
+  if (cap < z->out_len + need) {
+    cap = z->out_len + need;
+  }
+  if (cap < LZ_CHUNK_SIZE) {
+    cap = LZ_CHUNK_SIZE;
+  }
+  out = realloc(z->out, cap);
+  if (!out) {
+    return 0;
+  }
+  z->out = out;
+  z->out_cap = cap;
+  return 1;
+}
+
+/* Filters all of the pending input into the scratch buffer.  Deflate output
+ * is sized up front so it's normally done in one call, inflate output grows
+ * for as long as zlib fills it.
+ */
+static int lz_filter(z_t *z) {
+  size_t hint;
+  int rc;
+
+  z->out_len = 0;
+  if (z->method == 1) {
+    hint = deflateBound(&z->stream, z->stream.avail_in) + LZ_FLUSH_SLACK;
+  } else {
+    hint = (size_t)z->stream.avail_in * 4;
+  }
+  if (!lz_reserve(z, hint)) {
+    return Z_MEM_ERROR;
+  }
 
-  luaL_buffinit(L, &buff);
-  while (z->stream.avail_in) {
-    z->stream.next_out = (uint8_t *)luaL_prepbuffer(&buff);
-    z->stream.avail_out = LUAL_BUFFERSIZE;
-    rc = z->filter(&z->stream, flush);
-    if (rc != Z_BUF_ERROR) {
-      if (rc != Z_OK && rc != Z_STREAM_END) {
-        break;
-      }
+  for (;;) {
+    z->stream.next_out = (uint8_t *)z->out + z->out_len;
+    z->stream.avail_out = z->out_cap - z->out_len;
+    rc = z->filter(&z->stream, z->flush);
+    z->out_len = z->out_cap - z->stream.avail_out;
+    if (rc != Z_OK || z->stream.avail_out != 0) {
+      break;
     }
-    luaL_addsize(&buff, LUAL_BUFFERSIZE - z->stream.avail_out);
+    if (!lz_reserve(z, z->out_cap)) {
+      return Z_MEM_ERROR;
+    }
+  }
+
+  /* No progress possible just means there was nothing to do */
+  return rc == Z_BUF_ERROR ? Z_OK : rc;
+}
+
+/* Drop a scratch buffer that grew unusually large */
+static void lz_trim(z_t *z) {
+  if (z->out_cap > LZ_KEEP_SIZE) {
+    free(z->out);
+    z->out = NULL;
+    z->out_cap = 0;
   }
-  luaL_pushresult(&buff);
+  z->out_len = 0;
+}
+
+static int lz_stream_write(lua_State *L) {
+  z_t *z;
+  size_t len;
+  int rc;
+
+  z = lz_check_stream(L);
+
+  z->stream.next_in = (uint8_t *)luv_checkbuffer(L, 2, &len);
+  z->stream.avail_in = len;
 
-  /*if (rc == Z_STREAM_END) {
-    rc = z->end(&z->stream);
-  }*/
-  if (rc == Z_STREAM_END || rc == Z_BUF_ERROR || rc == Z_OK) {
+  z->flush = luaL_checkoption(L, 3, flush_opts[3], flush_opts);
+  if (z->flush) z->flush++;
+
+  rc = lz_filter(z);
+  if (rc == Z_OK || rc == Z_STREAM_END) {
+    lua_pushlstring(L, z->out, z->out_len);
+    lz_trim(z);
     return 1;
   }
+  lz_trim(z);
   lua_pushnil(L);
   lua_pushinteger(L, rc);
   return 2;
 }
 
+/* stream:writeInto(buffer, chunk, flush, offset) filters into a Buffer
+ * starting offset bytes in, and returns the bytes produced, the bytes of
+ * chunk consumed and whether the stream ended.  When the buffer filled up
+ * there may be more output, call again with the rest of the chunk.
+ */
+static int lz_stream_write_into(lua_State *L) {
+  z_t *z = lz_check_stream(L);
+  size_t cap, len = 0;
+  char *out = luv_checkwritablebuffer(L, 2, &cap);
+  const char *chunk = "";
+  int flush, offset, rc;
+
+  if (!lua_isnoneornil(L, 3)) {
+    chunk = luv_checkbuffer(L, 3, &len);
+  }
+  flush = luaL_checkoption(L, 4, flush_opts[3], flush_opts);
+  if (flush) flush++;
+  offset = luaL_optint(L, 5, 0);
+  luaL_argcheck(L, offset >= 0 && (size_t)offset <= cap, 5, "offset out of bounds");
+
+  z->stream.next_in = (uint8_t *)chunk;
+  z->stream.avail_in = len;
+  z->stream.next_out = (uint8_t *)out + offset;
+  z->stream.avail_out = cap - offset;
+  rc = z->filter(&z->stream, flush);
+  if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+    lua_pushnil(L);
+    lua_pushinteger(L, rc);
+    return 2;
+  }
+  lua_pushinteger(L, cap - offset - z->stream.avail_out);
+  lua_pushinteger(L, len - z->stream.avail_in);
+  lua_pushboolean(L, rc == Z_STREAM_END);
+  return 3;
+}
+
+/* Runs in the thread pool */
+static void lz_work(uv_work_t *work) {
+  z_t *z = (z_t *)work->data;
+  z->rc = lz_filter(z);
+}
+
+static void lz_after_work(uv_work_t *work, int status) {
+  luv_req_t *req = (luv_req_t *)work;
+  z_t *z = (z_t *)work->data;
+  lua_State *L = z->L;
+
+  z->busy = 0;
+  luv_io_ctx_callback_rawgeti(L, &req->cbs);
+  if (z->rc == Z_OK || z->rc == Z_STREAM_END) {
+    lua_pushnil(L);
+    lua_pushlstring(L, z->out, z->out_len);
+  } else {
+    lua_pushfstring(L, "zlib: %s (%d)",
+      z->stream.msg ? z->stream.msg : zError(z->rc), z->rc);
+    lua_pushnil(L);
+  }
+  lz_trim(z);
+  /* Unpin the stream and input only once we're done touching them */
+  luv_io_ctx_unref(L, &req->cbs);
+  luv_req_release(work->loop, req);
+
+  luv_acall(L, 2, 0, "zlib_after_work");
+}
+
+/* stream:writeAsync(chunk, flush, callback) filters chunk on the thread
+ * pool and calls callback(err, text) back on the loop.  The stream and the
+ * chunk are kept alive until then.
+ */
+static int lz_stream_write_async(lua_State *L) {
+  z_t *z = lz_check_stream(L);
+  size_t len = 0;
+  const char *chunk = "";
+  int flush;
+  uv_loop_t *loop = luv_get_loop(L);
+  luv_req_t *req;
+
+  if (!lua_isnoneornil(L, 2)) {
+    chunk = luv_checkbuffer(L, 2, &len);
+  }
+  flush = luaL_checkoption(L, 3, flush_opts[3], flush_opts);
+  if (flush) flush++;
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+
+  req = luv_req_alloc(loop, LUV_REQ_WORK);
+  if (!req) {
+    return luaL_error(L, "zlib: %s", uv_strerror(uv_last_error(loop)));
+  }
+  luv_io_ctx_callback_add(L, &req->cbs, 4);
+  luv_io_ctx_add(L, &req->cbs, 1);
+  if (len) {
+    luv_io_ctx_add(L, &req->cbs, 2);
+  }
+
+  z->stream.next_in = (uint8_t *)chunk;
+  z->stream.avail_in = len;
+  z->flush = flush;
+  z->L = luv_get_main_thread(L);
+  z->busy = 1;
+  req->uv.work.data = z;
+
+  if (uv_queue_work(loop, &req->uv.work, lz_work, lz_after_work)) {
+    z->busy = 0;
+    luv_io_ctx_unref(L, &req->cbs);
+    luv_req_release(loop, req);
+    return luaL_error(L, "zlib: uv_queue_work: %s",
+      uv_strerror(uv_last_error(loop)));
+  }
+  return 0;
+}
+
 static int lz_stream_delete(lua_State *L) {
   z_t *z;
   lua_getfield(L, -1, "stream");
   z = (z_t *)lua_touserdata(L, -1);
   lua_pop(L, 2);
   z->end(&z->stream);
+  free(z->out);
   free(z);
   return 0;
 }
@@ -96,6 +297,7 @@ static int lz_stream_new(lua_State *L) {
   memset(z, 0, sizeof(*z));
 
   method = luaL_checkoption(L, 1, NULL, methods);
+  z->method = method;
   if (method == 0) {
     int window_size = lua_isnumber(L, 2) ? lua_tonumber(L, 2) : MAX_WBITS + 32;
     int rc = inflateInit2(&z->stream, window_size);
@@ -106,9 +308,12 @@ static int lz_stream_new(lua_State *L) {
     z->end = inflateEnd;
   } else if (method == 1) {
     int level = luaL_optint(L, 2, Z_DEFAULT_COMPRESSION);
-    int rc = deflateInit(&z->stream, level);
+    /* MAX_WBITS + 16 writes a gzip wrapper instead of a zlib one */
+    int window_bits = luaL_optint(L, 3, MAX_WBITS);
+    int rc = deflateInit2(&z->stream, level, Z_DEFLATED, window_bits, 8,
+                          Z_DEFAULT_STRATEGY);
     if (rc != Z_OK && rc != Z_STREAM_END) {
-      return luaL_error(L, "deflateInit: %d", rc);
+      return luaL_error(L, "deflateInit2: %d", rc);
     }
     z->filter = deflate;
     z->end = deflateEnd;
@@ -142,6 +347,10 @@ LUALIB_API int luaopen_zlib_native(lua_State *L) {
   lua_setfield(L, -2, "__gc");
   lua_pushcfunction(L, lz_stream_write);
   lua_setfield(L, -2, "write");
+  lua_pushcfunction(L, lz_stream_write_async);
+  lua_setfield(L, -2, "writeAsync");
+  lua_pushcfunction(L, lz_stream_write_into);
+  lua_setfield(L, -2, "writeInto");
   lua_pop(L, 1);
 
   /* module table */
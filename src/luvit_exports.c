@@ -1,67 +1,118 @@
 /* This file is generated by bundler.lua */
 #include <string.h>
+#include "lua.h"
+#include "lauxlib.h"
 #include "luvit.h"
+#include "luvit_exports.h"
 
 const void *luvit_ugly_hack = NULL;
 
-extern const char *luaJIT_BC_buffer[];
-extern const char *luaJIT_BC_childprocess[];
-extern const char *luaJIT_BC_core[];
-extern const char *luaJIT_BC_dgram[];
-extern const char *luaJIT_BC_dns[];
-extern const char *luaJIT_BC_fiber[];
-extern const char *luaJIT_BC_fs[];
-extern const char *luaJIT_BC_http[];
-extern const char *luaJIT_BC_https[];
-extern const char *luaJIT_BC_json[];
-extern const char *luaJIT_BC_luvit[];
-extern const char *luaJIT_BC_mime[];
-extern const char *luaJIT_BC_module[];
-extern const char *luaJIT_BC_net[];
-extern const char *luaJIT_BC_path[];
-extern const char *luaJIT_BC_querystring[];
-extern const char *luaJIT_BC_repl[];
-extern const char *luaJIT_BC_stack[];
-extern const char *luaJIT_BC_timer[];
+extern const char luaJIT_BC_buffer[];
+extern const char luaJIT_BC_childprocess[];
+extern const char luaJIT_BC_cluster[];
+extern const char luaJIT_BC_core[];
+extern const char luaJIT_BC_dgram[];
+extern const char luaJIT_BC_dns[];
+extern const char luaJIT_BC_fiber[];
+extern const char luaJIT_BC_filecache[];
+extern const char luaJIT_BC_fs[];
+extern const char luaJIT_BC_http[];
+extern const char luaJIT_BC_https[];
+extern const char luaJIT_BC_json[];
+extern const char luaJIT_BC_luvit[];
+extern const char luaJIT_BC_mime[];
+extern const char luaJIT_BC_module[];
+extern const char luaJIT_BC_net[];
+extern const char luaJIT_BC_path[];
+extern const char luaJIT_BC_profiler[];
+extern const char luaJIT_BC_querystring[];
+extern const char luaJIT_BC_repl[];
+extern const char luaJIT_BC_shm[];
+extern const char luaJIT_BC_stack[];
+extern const char luaJIT_BC_timer[];
 #ifdef USE_OPENSSL
-extern const char *luaJIT_BC_tls[];
+extern const char luaJIT_BC_tls[];
 #endif
-extern const char *luaJIT_BC_url[];
-extern const char *luaJIT_BC_utils[];
-extern const char *luaJIT_BC_uv[];
-extern const char *luaJIT_BC_zlib[];
+extern const char luaJIT_BC_url[];
+extern const char luaJIT_BC_utils[];
+extern const char luaJIT_BC_uv[];
+extern const char luaJIT_BC_worker[];
+extern const char luaJIT_BC_zlib[];
 
+/* Bytecode for every module in lib/luvit, by module name */
+static const struct {
+  const char *name;
+  const char *bytecode;
+} luvit_bundle[] = {
+  { "buffer", luaJIT_BC_buffer },
+  { "childprocess", luaJIT_BC_childprocess },
+  { "cluster", luaJIT_BC_cluster },
+  { "core", luaJIT_BC_core },
+  { "dgram", luaJIT_BC_dgram },
+  { "dns", luaJIT_BC_dns },
+  { "fiber", luaJIT_BC_fiber },
+  { "filecache", luaJIT_BC_filecache },
+  { "fs", luaJIT_BC_fs },
+  { "http", luaJIT_BC_http },
+  { "https", luaJIT_BC_https },
+  { "json", luaJIT_BC_json },
+  { "luvit", luaJIT_BC_luvit },
+  { "mime", luaJIT_BC_mime },
+  { "module", luaJIT_BC_module },
+  { "net", luaJIT_BC_net },
+  { "path", luaJIT_BC_path },
+  { "profiler", luaJIT_BC_profiler },
+  { "querystring", luaJIT_BC_querystring },
+  { "repl", luaJIT_BC_repl },
+  { "shm", luaJIT_BC_shm },
+  { "stack", luaJIT_BC_stack },
+  { "timer", luaJIT_BC_timer },
+#ifdef USE_OPENSSL
+  { "tls", luaJIT_BC_tls },
+#endif
+  { "url", luaJIT_BC_url },
+  { "utils", luaJIT_BC_utils },
+  { "uv", luaJIT_BC_uv },
+  { "worker", luaJIT_BC_worker },
+  { "zlib", luaJIT_BC_zlib },
+  { NULL, NULL }
+};
 
 const void *luvit__suck_in_symbols(void)
 {
-  luvit_ugly_hack = (const char*)
-
-    (size_t)(const char *)luaJIT_BC_buffer +
-    (size_t)(const char *)luaJIT_BC_childprocess +
-    (size_t)(const char *)luaJIT_BC_core +
-    (size_t)(const char *)luaJIT_BC_dgram +
-    (size_t)(const char *)luaJIT_BC_dns +
-    (size_t)(const char *)luaJIT_BC_fiber +
-    (size_t)(const char *)luaJIT_BC_fs +
-    (size_t)(const char *)luaJIT_BC_http +
-    (size_t)(const char *)luaJIT_BC_https +
-    (size_t)(const char *)luaJIT_BC_json +
-    (size_t)(const char *)luaJIT_BC_luvit +
-    (size_t)(const char *)luaJIT_BC_mime +
-    (size_t)(const char *)luaJIT_BC_module +
-    (size_t)(const char *)luaJIT_BC_net +
-    (size_t)(const char *)luaJIT_BC_path +
-    (size_t)(const char *)luaJIT_BC_querystring +
-    (size_t)(const char *)luaJIT_BC_repl +
-    (size_t)(const char *)luaJIT_BC_stack +
-    (size_t)(const char *)luaJIT_BC_timer +
-#ifdef USE_OPENSSL
-    (size_t)(const char *)luaJIT_BC_tls +
-#endif
-    (size_t)(const char *)luaJIT_BC_url +
-    (size_t)(const char *)luaJIT_BC_utils +
-    (size_t)(const char *)luaJIT_BC_uv +
-    (size_t)(const char *)luaJIT_BC_zlib;
+  luvit_ugly_hack = (const char*)luvit_bundle;
 
   return luvit_ugly_hack;
 }
+
+/* package.preload entry for a bundled module, the bytecode is only loaded
+ * once something requires it.
+ */
+static int luvit_bundle_loader(lua_State *L)
+{
+  const char *bytecode = (const char *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *name = lua_tostring(L, lua_upvalueindex(2));
+
+  /* Like LuaJIT's own preload fallback, let the bytecode reader find the end */
+  if (luaL_loadbuffer(L, bytecode, ~(size_t)0, name)) {
+    return lua_error(L);
+  }
+  lua_pushstring(L, name);
+  lua_call(L, 1, 1);
+  return 1;
+}
+
+void luvit_bundle_preload(lua_State *L)
+{
+  int i;
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  for (i = 0; luvit_bundle[i].name; i++) {
+    lua_pushlightuserdata(L, (void *)luvit_bundle[i].bytecode);
+    lua_pushstring(L, luvit_bundle[i].name);
+    lua_pushcclosure(L, luvit_bundle_loader, 2);
+    lua_setfield(L, -2, luvit_bundle[i].name);
+  }
+  lua_pop(L, 2);
+}
@@ -2,6 +2,11 @@
 #ifndef LUV_EXPORTS
 #define LUV_EXPORTS
 
+#include "lua.h"
+
 const void *luvit__suck_in_symbols(void);
 
+/* Register the embedded lib/luvit bytecode in package.preload */
+void luvit_bundle_preload(lua_State *L);
+
 #endif
@@ -34,8 +34,10 @@
 #ifdef USE_OPENSSL
 #include "luv_tls.h"
 #include "lcrypto.h"
+#include "luv_digest.h"
 #endif
 #include "luv_zlib.h"
+#include "luv_worker.h"
 #include "luv_portability.h"
 #include "lconstants.h"
 #include "lhttp_parser.h"
@@ -104,9 +106,9 @@ static void crypto_lock_cb(int mode, int n, const char* file, int line) {
 #define PATH_MAX 1024
 #endif
 
-static char getbuf[PATH_MAX + 1];
-
 static int luvit_getcwd(lua_State* L) {
+  /* On the stack, every loop thread has its own lua state calling this */
+  char getbuf[PATH_MAX + 1];
   uv_err_t rc;
 
   rc = uv_cwd(getbuf, ARRAY_SIZE(getbuf) - 1);
@@ -120,7 +122,9 @@ static int luvit_getcwd(lua_State* L) {
 }
 
 #ifdef USE_OPENSSL
-int luvit_init_ssl()
+static uv_once_t ssl_init_once = UV_ONCE_INIT;
+
+static void luvit__init_ssl(void)
 {
 #if !defined(OPENSSL_NO_COMP)
   STACK_OF(SSL_COMP)* comp_methods;
@@ -147,9 +151,33 @@ int luvit_init_ssl()
   sk_SSL_COMP_zero(comp_methods);
   assert(sk_SSL_COMP_num(comp_methods) == 0);
 #endif
+}
 
+/* Safe to call any number of times, only the first call does the work */
+int luvit_init_ssl()
+{
+  uv_once(&ssl_init_once, luvit__init_ssl);
   return 0;
 }
+
+/* OpenSSL is only set up once _tls or _crypto gets required, loading its
+ * algorithms and error strings is a noticeable part of startup.
+ */
+static int luvit_open_tls(lua_State *L)
+{
+  luvit_init_ssl();
+  return luaopen_tls(L);
+}
+
+static int luvit_open_crypto(lua_State *L)
+{
+  int n;
+  luvit_init_ssl();
+  n = luaopen_crypto(L);
+  /* Thread pool hashing next to luacrypto's own */
+  luv_digest_open(L, lua_gettop(L) - n + 1);
+  return n;
+}
 #endif
 
 #if defined(__unix__) || defined(__POSIX__)
@@ -187,10 +215,10 @@ int luvit_init(lua_State *L, uv_loop_t* loop, int argc, char *argv[])
 
 #ifdef USE_OPENSSL
   /* Register tls */
-  lua_pushcfunction(L, luaopen_tls);
+  lua_pushcfunction(L, luvit_open_tls);
   lua_setfield(L, -2, "_tls");
-  /* Register tls */
-  lua_pushcfunction(L, luaopen_crypto);
+  /* Register crypto */
+  lua_pushcfunction(L, luvit_open_crypto);
   lua_setfield(L, -2, "_crypto");
 #endif
   /* Register yajl */
@@ -217,6 +245,9 @@ int luvit_init(lua_State *L, uv_loop_t* loop, int argc, char *argv[])
   /* Register zlib */
   lua_pushcfunction(L, luaopen_zlib_native);
   lua_setfield(L, -2, "zlib_native");
+  /* Register worker */
+  lua_pushcfunction(L, luaopen_worker_native);
+  lua_setfield(L, -2, "worker_native");
 
   /* We're done with preload, put it away */
   lua_pop(L, 1);
@@ -269,9 +300,6 @@ int luvit_init(lua_State *L, uv_loop_t* loop, int argc, char *argv[])
   /* Store the loop within the registry */
   luv_set_loop(L, loop);
 
-  /* ares setup */
-  luv_dns_initialize(L);
-
   return 0;
 }
 
@@ -31,49 +31,153 @@
 #include "luvit.h"
 #include "luvit_init.h"
 #include "luv.h"
+#include "luv_alloc.h"
+#include "luv_worker.h"
 
 #ifdef BUNDLE
 #include "luvit_exports.h"
 #endif
 
-int main(int argc, char *argv[])
+/* Milliseconds, on the same clock as uv.hrtime() */
+static double luvit_now(void)
 {
-  lua_State *L;
-  uv_loop_t *loop;
+  return (double) uv_hrtime() / 1000000.0;
+}
 
-  argv = uv_setup_args(argc, argv);
+/* LUVIT_LOOPS starts this many loops, each on its own thread with its own
+ * lua state running the same script.  Servers listening on the same port
+ * share one socket, see tcp:bindShared.
+ */
+#define LUVIT_MAX_LOOPS 64
 
-  L = luaL_newstate();
+typedef struct {
+  uv_thread_t thread;
+  uv_loop_t* loop;
+  int index;
+  int count;
+  int argc;
+  char** argv;
+  double start;
+  int status;
+} luvit_loop_t;
+
+static int luvit_start(luvit_loop_t* self)
+{
+  lua_State *L;
+  double libs_done;
+  int status;
+
+  L = luv_newstate();
   if (L == NULL) {
-    fprintf(stderr, "luaL_newstate has failed\n");
+    fprintf(stderr, "luv_newstate has failed\n");
     return 1;
   }
 
   luaL_openlibs(L);
 
-  loop = uv_default_loop();
-
 #ifdef LUV_EXPORTS
-  luvit__suck_in_symbols();
+  /* Serve lib/luvit from the embedded bytecode instead of the disk */
+  luvit_bundle_preload(L);
+  luv_worker_set_preload(luvit_bundle_preload);
 #endif
 
-#ifdef USE_OPENSSL
-  luvit_init_ssl();
-#endif
+  libs_done = luvit_now();
 
-  if (luvit_init(L, loop, argc, argv)) {
+  if (luvit_init(L, self->loop, self->argc, self->argv)) {
     fprintf(stderr, "luvit_init has failed\n");
     return 1;
   }
 
+  /* Where the C side of startup went, luvit.lua adds its own phases */
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, self->start);
+  lua_setfield(L, -2, "start");
+  lua_pushnumber(L, libs_done);
+  lua_setfield(L, -2, "libs");
+  lua_pushnumber(L, luvit_now());
+  lua_setfield(L, -2, "init");
+  lua_setglobal(L, "STARTUP_TIMES");
+
+  lua_pushinteger(L, self->index);
+  lua_setglobal(L, "LOOP_INDEX");
+  lua_pushinteger(L, self->count);
+  lua_setglobal(L, "LOOP_COUNT");
+
   /* Run the main lua script */
   if (luvit_run(L)) {
     printf("%s\n", lua_tostring(L, -1));
     lua_pop(L, 1);
-    lua_close(L);
+    luv_close_state(L);
     return -1;
   }
 
-  lua_close(L);
-  return 0;
+  /* Only a loop among several gets here, with its status as exitCode */
+  lua_getglobal(L, "process");
+  lua_getfield(L, -1, "exitCode");
+  status = lua_tointeger(L, -1);
+  lua_pop(L, 2);
+
+  luv_close_state(L);
+  return status;
+}
+
+static void luvit_loop_thread(void* arg)
+{
+  luvit_loop_t* self = arg;
+  self->status = luvit_start(self);
+}
+
+int main(int argc, char *argv[])
+{
+  luvit_loop_t loops[LUVIT_MAX_LOOPS];
+  const char* env;
+  int count, i, status;
+  double start;
+
+  start = luvit_now();
+  argv = uv_setup_args(argc, argv);
+
+#ifdef LUV_EXPORTS
+  luvit__suck_in_symbols();
+#endif
+
+  env = getenv("LUVIT_LOOPS");
+  count = env ? atoi(env) : 1;
+  if (count < 1) {
+    count = 1;
+  } else if (count > LUVIT_MAX_LOOPS) {
+    count = LUVIT_MAX_LOOPS;
+  }
+
+  for (i = 0; i < count; i++) {
+    loops[i].loop = i ? uv_loop_new() : uv_default_loop();
+    loops[i].index = i;
+    loops[i].count = count;
+    loops[i].argc = argc;
+    loops[i].argv = argv;
+    loops[i].start = start;
+    loops[i].status = 0;
+  }
+
+  /* The extra loops get threads, the first one keeps the main thread so
+   * signals and the tty behave as they do with a single loop.
+   */
+  for (i = 1; i < count; i++) {
+    if (uv_thread_create(&loops[i].thread, luvit_loop_thread, &loops[i])) {
+      fprintf(stderr, "uv_thread_create has failed\n");
+      return 1;
+    }
+  }
+
+  status = luvit_start(&loops[0]);
+
+  for (i = 1; i < count; i++) {
+    uv_thread_join(&loops[i].thread);
+    if (!status) {
+      status = loops[i].status;
+    }
+    uv_loop_delete(loops[i].loop);
+  }
+
+  return status;
 }
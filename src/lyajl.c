@@ -36,6 +36,17 @@ typedef struct {
 
 #define JSON_PARSER_HANDLE "llyajl_parser_handle"
 #define JSON_GENERATOR_HANDLE "llyajl_generator_handle"
+#define JSON_DECODER_HANDLE "llyajl_decoder_handle"
+#define JSON_STREAM_HANDLE "llyajl_stream_handle"
+
+/* fenv slots of a stream decoder */
+#define LYAJL_STREAM_CALLBACK 1
+#define LYAJL_STREAM_NULL 2
+#define LYAJL_STREAM_ARRAY_MT 3
+#define LYAJL_STREAM_OBJECT_MT 4
+#define LYAJL_STREAM_SAVED 5
+#define LYAJL_STREAM_PATH 6
+#define LYAJL_STREAM_ERROR 7
 
 typedef struct luvit_parser_t {
   luv_ref_t *ref;
@@ -46,6 +57,74 @@ typedef struct luvit_generator_t {
   yajl_gen gen;
 } luvit_generator_t;
 
+/* yajl allows no deeper nesting than this when generating */
+#define LYAJL_ENCODE_MAX_DEPTH 128
+
+/* State of a yajl.encode call.  path holds the tables being walked, to
+ * catch cycles.
+ */
+typedef struct luvit_encoder_t {
+  lua_State* L;
+  yajl_gen gen;
+  int null_index;     /* stack slot of the null sentinel, or 0 */
+  int depth;
+  const void* path[LYAJL_ENCODE_MAX_DEPTH];
+} luvit_encoder_t;
+
+/* State of a yajl.decode call.  The containers being built sit on the Lua
+ * stack, each map's pending key right above it, and finished top level
+ * values pile up below them.
+ */
+typedef struct luvit_decoder_t {
+  lua_State* L;
+  yajl_handle handle;
+  int depth;          /* open maps and arrays */
+  int null_index;     /* stack slot of the null sentinel, 0 to drop nulls */
+  int array_mt_index; /* stack slot of the array metatable, or 0 */
+  int object_mt_index;
+} luvit_decoder_t;
+
+/* One element of a stream decoder's path, a map key, an array index or
+ * a wildcard matching either.
+ */
+typedef struct {
+  const char* key;   /* NULL for an index or the wildcard */
+  size_t len;
+  int index;         /* 1 based, 0 for the wildcard */
+} lyajl_path_elem_t;
+
+/* A container the stream decoder is inside of but not building */
+typedef struct {
+  char is_array;
+  char matches;      /* on the way to the selected values */
+  char key_matches;  /* a map's current key is on the path */
+  int index;         /* elements seen so far in an array */
+} lyajl_frame_t;
+
+/* State of a stream decoder.  Only values selected by the path are turned
+ * into Lua values, everything else is parsed and dropped.  Tables being
+ * built sit on the Lua stack while a chunk is parsed and are parked in
+ * the fenv in between.
+ */
+typedef struct luvit_stream_t {
+  lua_State* L;      /* set while a chunk is being parsed */
+  yajl_handle handle;
+  lyajl_path_elem_t* path;
+  int path_len;
+  lyajl_frame_t* frames;
+  int frame_count;
+  int frame_cap;
+  int building;      /* open tables of the value being built */
+  int saved;         /* stack slots parked in the fenv */
+  int failed;
+  const char* error; /* why the parse was canceled, if not by a callback */
+  int fenv_index;
+  int callback_index;
+  int null_index;
+  int array_mt_index;
+  int object_mt_index;
+} luvit_stream_t;
+
 static int lyajl_on_null (void * ctx) {
   /* Load the callback */
   luv_ref_t* ref = ctx;
@@ -292,25 +371,30 @@ static int lyajl_complete_parse (lua_State *L) {
   return 0;
 }
 
+static const char* lyajl_option_names[] = {
+  "allow_comments", "dont_validate_strings", "allow_trailing_garbage",
+  "allow_multiple_values", "allow_partial_values", NULL
+};
+
+static const yajl_option lyajl_options[] = {
+  yajl_allow_comments, yajl_dont_validate_strings, yajl_allow_trailing_garbage,
+  yajl_allow_multiple_values, yajl_allow_partial_values
+};
+
 static int lyajl_config (lua_State *L) {
   const char* option;
+  int i;
   luvit_parser_t *parser = parser_get(L, 1);
 
   option = luaL_checkstring(L, 2);
 
-  if (strcmp(option, "allow_comments") == 0) {
-    yajl_config(parser->handle, yajl_allow_comments, lua_toboolean(L, 3));
-  } else if (strcmp(option, "dont_validate_strings") == 0) {
-    yajl_config(parser->handle, yajl_dont_validate_strings, lua_toboolean(L, 3));
-  } else if (strcmp(option, "allow_trailing_garbage") == 0) {
-    yajl_config(parser->handle, yajl_allow_trailing_garbage, lua_toboolean(L, 3));
-  } else if (strcmp(option, "allow_multiple_values") == 0) {
-    yajl_config(parser->handle, yajl_allow_multiple_values, lua_toboolean(L, 3));
-  } else if (strcmp(option, "allow_partial_values") == 0) {
-    yajl_config(parser->handle, yajl_allow_partial_values, lua_toboolean(L, 3));
-  } else {
-    luaL_error(L, "Invalid config option %s", option);
+  for (i = 0; lyajl_option_names[i]; i++) {
+    if (strcmp(option, lyajl_option_names[i]) == 0) {
+      yajl_config(parser->handle, lyajl_options[i], lua_toboolean(L, 3));
+      return 0;
+    }
   }
+  luaL_error(L, "Invalid config option %s", option);
   return 0;
 }
 
@@ -451,6 +535,863 @@ static int lyajl_gen_gc(lua_State *L) {
   return 0;
 }
 
+/* Store the value on top of the stack in the table below it.  A map has
+ * the value's key right below the value.
+ */
+static void lyajl_insert (lua_State* L) {
+  if (lua_type(L, -2) == LUA_TSTRING) {
+    lua_rawset(L, -3);
+  } else {
+    lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+  }
+}
+
+/* Store the value on top of the stack in the container being built, or
+ * leave it where it is when it's a top level value.
+ */
+static int lyajl_decode_insert (luvit_decoder_t* decoder) {
+  if (decoder->depth > 0) {
+    lyajl_insert(decoder->L);
+  }
+  return 1;
+}
+
+static int lyajl_decode_null (void * ctx) {
+  luvit_decoder_t* decoder = ctx;
+  lua_State* L = decoder->L;
+  if (decoder->null_index) {
+    if (!lua_checkstack(L, 1)) return 0;
+    lua_pushvalue(L, decoder->null_index);
+    return lyajl_decode_insert(decoder);
+  }
+  /* Without a sentinel nulls are left out, drop the key they belong to */
+  if (decoder->depth > 0 && lua_type(L, -1) == LUA_TSTRING) {
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+static int lyajl_decode_boolean (void * ctx, int value) {
+  luvit_decoder_t* decoder = ctx;
+  if (!lua_checkstack(decoder->L, 1)) return 0;
+  lua_pushboolean(decoder->L, value);
+  return lyajl_decode_insert(decoder);
+}
+
+static int lyajl_decode_integer (void * ctx, long long value) {
+  luvit_decoder_t* decoder = ctx;
+  if (!lua_checkstack(decoder->L, 1)) return 0;
+  lua_pushnumber(decoder->L, value);
+  return lyajl_decode_insert(decoder);
+}
+
+static int lyajl_decode_double (void * ctx, double value) {
+  luvit_decoder_t* decoder = ctx;
+  if (!lua_checkstack(decoder->L, 1)) return 0;
+  lua_pushnumber(decoder->L, value);
+  return lyajl_decode_insert(decoder);
+}
+
+static int lyajl_decode_string (void * ctx, const unsigned char* value, size_t len) {
+  luvit_decoder_t* decoder = ctx;
+  if (!lua_checkstack(decoder->L, 1)) return 0;
+  lua_pushlstring(decoder->L, (const char*)value, len);
+  return lyajl_decode_insert(decoder);
+}
+
+static int lyajl_decode_open (luvit_decoder_t* decoder, int mt_index) {
+  lua_State* L = decoder->L;
+  /* Room for the new table, its next key and value */
+  if (!lua_checkstack(L, 3)) return 0;
+  lua_newtable(L);
+  if (mt_index) {
+    lua_pushvalue(L, mt_index);
+    lua_setmetatable(L, -2);
+  }
+  decoder->depth++;
+  return 1;
+}
+
+static int lyajl_decode_start_map (void * ctx) {
+  luvit_decoder_t* decoder = ctx;
+  return lyajl_decode_open(decoder, decoder->object_mt_index);
+}
+
+static int lyajl_decode_start_array (void * ctx) {
+  luvit_decoder_t* decoder = ctx;
+  return lyajl_decode_open(decoder, decoder->array_mt_index);
+}
+
+static int lyajl_decode_map_key (void * ctx, const unsigned char* key, size_t len) {
+  luvit_decoder_t* decoder = ctx;
+  lua_pushlstring(decoder->L, (const char*)key, len);
+  return 1;
+}
+
+static int lyajl_decode_close (void * ctx) {
+  luvit_decoder_t* decoder = ctx;
+  decoder->depth--;
+  return lyajl_decode_insert(decoder);
+}
+
+static yajl_callbacks lyajl_decode_callbacks = {
+  lyajl_decode_null, lyajl_decode_boolean,
+  lyajl_decode_integer, lyajl_decode_double, NULL,
+  lyajl_decode_string,
+  lyajl_decode_start_map, lyajl_decode_map_key, lyajl_decode_close,
+  lyajl_decode_start_array, lyajl_decode_close
+};
+
+static void lyajl_decode_check (lua_State *L, luvit_decoder_t* decoder,
+    yajl_status stat, const char* json, size_t len) {
+  unsigned char* str;
+  if (stat == yajl_status_ok) return;
+  if (stat == yajl_status_client_canceled) {
+    luaL_error(L, "parse error: too deeply nested");
+  }
+  str = yajl_get_error(decoder->handle, 1, (const unsigned char*)json, len);
+  lua_pushstring(L, (const char*)str);
+  yajl_free_error(decoder->handle, str);
+  lua_error(L);
+}
+
+/* Only get the metatable and sentinel slots when they're set, so the
+ * callbacks can test for them cheaply.
+ */
+static int lyajl_decode_option (lua_State *L, const char* name) {
+  lua_getfield(L, 2, name);
+  return lua_isnil(L, -1) ? 0 : lua_gettop(L);
+}
+
+/* yajl.decode(json, options) parses a whole JSON text and returns its
+ * values, building the tables from within the yajl callbacks.
+ *
+ * options:
+ *   null       value stored for JSON nulls, they're left out otherwise
+ *   array_mt   metatable given to arrays
+ *   object_mt  metatable given to objects
+ * plus the boolean parser flags accepted by Parser:config.
+ */
+static int lyajl_decode (lua_State *L) {
+  size_t len;
+  const char* json = luaL_checklstring(L, 1, &len);
+  luvit_decoder_t* decoder;
+  int base, i;
+
+  lua_settop(L, 2);
+  if (!lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+  }
+
+  decoder = lua_newuserdata(L, sizeof(*decoder));
+  memset(decoder, 0, sizeof(*decoder));
+  luaL_getmetatable(L, JSON_DECODER_HANDLE);
+  lua_setmetatable(L, -2);
+  decoder->L = L;
+  decoder->handle = yajl_alloc(&lyajl_decode_callbacks, NULL, (void*)decoder);
+  if (!decoder->handle) {
+    return luaL_error(L, "Could not allocate a JSON parser");
+  }
+
+  if (lua_istable(L, 2)) {
+    decoder->null_index = lyajl_decode_option(L, "null");
+    decoder->array_mt_index = lyajl_decode_option(L, "array_mt");
+    decoder->object_mt_index = lyajl_decode_option(L, "object_mt");
+    for (i = 0; lyajl_option_names[i]; i++) {
+      lua_getfield(L, 2, lyajl_option_names[i]);
+      if (lua_toboolean(L, -1)) {
+        yajl_config(decoder->handle, lyajl_options[i], 1);
+      }
+      lua_pop(L, 1);
+    }
+  }
+  base = lua_gettop(L);
+
+  lyajl_decode_check(L, decoder,
+    yajl_parse(decoder->handle, (const unsigned char*)json, len), json, len);
+  lyajl_decode_check(L, decoder,
+    yajl_complete_parse(decoder->handle), NULL, 0);
+
+  /* Errors leave the handle to __gc, free it right away otherwise */
+  yajl_free(decoder->handle);
+  decoder->handle = NULL;
+
+  return lua_gettop(L) - base;
+}
+
+static int lyajl_decoder_gc (lua_State *L) {
+  luvit_decoder_t* decoder = luaL_checkudata(L, 1, JSON_DECODER_HANDLE);
+  if (decoder->handle) {
+    yajl_free(decoder->handle);
+    decoder->handle = NULL;
+  }
+  return 0;
+}
+
+static void lyajl_encode_check (lua_State *L, yajl_gen_status stat) {
+  switch (stat) {
+    case yajl_gen_status_ok:
+      return;
+    case yajl_max_depth_exceeded:
+      luaL_error(L, "Cannot stringify, tables nested too deeply");
+      break;
+    case yajl_gen_invalid_string:
+      luaL_error(L, "Cannot stringify invalid UTF-8 string");
+      break;
+    case yajl_gen_invalid_number:
+      luaL_error(L, "Cannot stringify invalid number");
+      break;
+    default:
+      luaL_error(L, "JSON generator error %d", (int)stat);
+  }
+}
+
+/* The length n of a table whose keys are exactly 1..n, or -1 when it must
+ * be written as an object.  Empty tables are arrays.
+ */
+static int lyajl_encode_array_length (lua_State *L, int index) {
+  int count = 0;
+  lua_Number max = 0;
+  lua_Number key;
+
+  lua_pushnil(L);
+  while (lua_next(L, index)) {
+    lua_pop(L, 1);
+    if (lua_type(L, -1) != LUA_TNUMBER) {
+      lua_pop(L, 1);
+      return -1;
+    }
+    key = lua_tonumber(L, -1);
+    if (key < 1 || key != (lua_Number)(int)key) {
+      lua_pop(L, 1);
+      return -1;
+    }
+    if (key > max) max = key;
+    count++;
+  }
+  return max == count ? count : -1;
+}
+
+static void lyajl_encode_value (luvit_encoder_t* encoder, int index);
+
+static void lyajl_encode_table (luvit_encoder_t* encoder, int index) {
+  lua_State* L = encoder->L;
+  const void* table = lua_topointer(L, index);
+  size_t len;
+  const char* key;
+  int i, length;
+
+  for (i = 0; i < encoder->depth; i++) {
+    if (encoder->path[i] == table) {
+      luaL_error(L, "Cannot stringify cyclic table");
+    }
+  }
+  if (encoder->depth == LYAJL_ENCODE_MAX_DEPTH) {
+    lyajl_encode_check(L, yajl_max_depth_exceeded);
+  }
+  if (!lua_checkstack(L, 4)) {
+    luaL_error(L, "Cannot stringify, out of stack space");
+  }
+  encoder->path[encoder->depth++] = table;
+
+  length = lyajl_encode_array_length(L, index);
+  if (length >= 0) {
+    lyajl_encode_check(L, yajl_gen_array_open(encoder->gen));
+    for (i = 1; i <= length; i++) {
+      lua_rawgeti(L, index, i);
+      lyajl_encode_value(encoder, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+    lyajl_encode_check(L, yajl_gen_array_close(encoder->gen));
+  } else {
+    lyajl_encode_check(L, yajl_gen_map_open(encoder->gen));
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+      switch (lua_type(L, -2)) {
+        case LUA_TSTRING:
+          key = lua_tolstring(L, -2, &len);
+          lyajl_encode_check(L, yajl_gen_string(encoder->gen, (const unsigned char*)key, len));
+          break;
+        case LUA_TNUMBER:
+          /* Convert a copy, converting the key itself would break lua_next */
+          lua_pushvalue(L, -2);
+          key = lua_tolstring(L, -1, &len);
+          lyajl_encode_check(L, yajl_gen_string(encoder->gen, (const unsigned char*)key, len));
+          lua_pop(L, 1);
+          break;
+        default:
+          luaL_error(L, "Keys must be strings to stringify as JSON");
+      }
+      lyajl_encode_value(encoder, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+    lyajl_encode_check(L, yajl_gen_map_close(encoder->gen));
+  }
+
+  encoder->depth--;
+}
+
+static void lyajl_encode_value (luvit_encoder_t* encoder, int index) {
+  lua_State* L = encoder->L;
+  yajl_gen gen = encoder->gen;
+  size_t len;
+  const char* value;
+  char number[32];
+  lua_Number num;
+
+  if (encoder->null_index && lua_rawequal(L, index, encoder->null_index)) {
+    lyajl_encode_check(L, yajl_gen_null(gen));
+    return;
+  }
+
+  switch (lua_type(L, index)) {
+    case LUA_TNIL:
+      lyajl_encode_check(L, yajl_gen_null(gen));
+      break;
+    case LUA_TBOOLEAN:
+      lyajl_encode_check(L, yajl_gen_bool(gen, lua_toboolean(L, index)));
+      break;
+    case LUA_TNUMBER:
+      num = lua_tonumber(L, index);
+      /* JSON has no inf or nan, reject them like yajl_gen_double does */
+      if (num != num || num - num != 0) {
+        lyajl_encode_check(L, yajl_gen_invalid_number);
+      }
+      /* Same formatting as tostring */
+      sprintf(number, LUA_NUMBER_FMT, num);
+      lyajl_encode_check(L, yajl_gen_number(gen, number, strlen(number)));
+      break;
+    case LUA_TSTRING:
+      value = lua_tolstring(L, index, &len);
+      lyajl_encode_check(L, yajl_gen_string(gen, (const unsigned char*)value, len));
+      break;
+    case LUA_TTABLE:
+      lyajl_encode_table(encoder, index);
+      break;
+    case LUA_TLIGHTUSERDATA:
+      if (lua_touserdata(L, index) == yjajl_js_null) {
+        lyajl_encode_check(L, yajl_gen_null(gen));
+        break;
+      }
+      /* fall through */
+    default:
+      luaL_error(L, "Cannot stringify %s value", luaL_typename(L, index));
+  }
+}
+
+/* yajl.encode(value, options) walks value in C and returns its JSON text.
+ * A single generator, kept as an upvalue, is reused so its output buffer
+ * only grows once.
+ *
+ * options:
+ *   null            value written as null, besides nil and yajl.null
+ *   beautify        pretty print
+ *   indent_string   indentation when beautifying, defaults to 4 spaces
+ *   validate_utf8   raise an error for strings that aren't valid UTF-8
+ *   escape_solidus  write / as \/
+ */
+static int lyajl_encode (lua_State *L) {
+  luvit_encoder_t encoder;
+  luvit_generator_t* generator;
+  const unsigned char* buf;
+  size_t len;
+  const char* indent = "    ";
+  int beautify = 0, validate_utf8 = 0, escape_solidus = 0;
+
+  lua_settop(L, 2);
+  generator = lua_touserdata(L, lua_upvalueindex(1));
+  encoder.L = L;
+  encoder.gen = generator->gen;
+  encoder.null_index = 0;
+  encoder.depth = 0;
+
+  if (!lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "null");
+    if (!lua_isnil(L, -1)) {
+      encoder.null_index = lua_gettop(L);
+    }
+    lua_getfield(L, 2, "beautify");
+    beautify = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "validate_utf8");
+    validate_utf8 = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "escape_solidus");
+    escape_solidus = lua_toboolean(L, -1);
+    /* Stays on the stack, yajl keeps the pointer */
+    lua_getfield(L, 2, "indent_string");
+    if (lua_isstring(L, -1)) {
+      indent = lua_tostring(L, -1);
+    }
+  }
+
+  /* Whatever an earlier call that raised an error left behind */
+  yajl_gen_clear(encoder.gen);
+  yajl_gen_reset(encoder.gen, NULL);
+  yajl_gen_config(encoder.gen, yajl_gen_beautify, beautify);
+  yajl_gen_config(encoder.gen, yajl_gen_indent_string, indent);
+  yajl_gen_config(encoder.gen, yajl_gen_validate_utf8, validate_utf8);
+  yajl_gen_config(encoder.gen, yajl_gen_escape_solidus, escape_solidus);
+
+  lyajl_encode_value(&encoder, 1);
+
+  yajl_gen_get_buf(encoder.gen, &buf, &len);
+  lua_pushlstring(L, (const char*)buf, len);
+  yajl_gen_clear(encoder.gen);
+  return 1;
+}
+
+/* Where a value goes relative to the path */
+#define LYAJL_SKIP 0
+#define LYAJL_TRACK 1
+#define LYAJL_SELECT 2
+
+static int lyajl_stream_reserve (luvit_stream_t* stream) {
+  /* A key and value, plus the callback and its arguments */
+  if (!lua_checkstack(stream->L, 5)) {
+    stream->error = "parse error: too deeply nested";
+    return 0;
+  }
+  return 1;
+}
+
+/* Where the value about to arrive goes.  Counts array elements. */
+static int lyajl_stream_position (luvit_stream_t* stream) {
+  lyajl_frame_t* frame;
+  lyajl_path_elem_t* elem;
+
+  if (stream->frame_count == 0) {
+    return stream->path_len == 0 ? LYAJL_SELECT : LYAJL_TRACK;
+  }
+  frame = &stream->frames[stream->frame_count - 1];
+  if (frame->is_array) {
+    frame->index++;
+  }
+  if (!frame->matches) {
+    return LYAJL_SKIP;
+  }
+  if (frame->is_array) {
+    elem = &stream->path[stream->frame_count - 1];
+    if (elem->key || (elem->index && elem->index != frame->index)) {
+      return LYAJL_SKIP;
+    }
+  } else if (!frame->key_matches) {
+    return LYAJL_SKIP;
+  }
+  return stream->frame_count == stream->path_len ? LYAJL_SELECT : LYAJL_TRACK;
+}
+
+/* Push what the callback gets as the selected value's key.  Map keys were
+ * pushed when they arrived.
+ */
+static void lyajl_stream_push_key (luvit_stream_t* stream) {
+  lyajl_frame_t* frame;
+  if (stream->frame_count == 0) {
+    lua_pushnil(stream->L);
+    return;
+  }
+  frame = &stream->frames[stream->frame_count - 1];
+  if (frame->is_array) {
+    lua_pushinteger(stream->L, frame->index);
+  }
+}
+
+/* Call the callback with the value and key on top of the stack, and pop
+ * them.  Errors are kept to be raised once yajl has returned.
+ */
+static int lyajl_stream_emit (luvit_stream_t* stream) {
+  lua_State* L = stream->L;
+  lua_pushvalue(L, stream->callback_index);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -4);
+  if (lua_pcall(L, 2, 0, 0)) {
+    lua_rawseti(L, stream->fenv_index, LYAJL_STREAM_ERROR);
+    lua_pop(L, 2);
+    return 0;
+  }
+  lua_pop(L, 2);
+  return 1;
+}
+
+/* Whether a scalar value is kept, pushing its key when it's selected */
+static int lyajl_stream_keep (luvit_stream_t* stream) {
+  if (stream->building) {
+    return 1;
+  }
+  if (lyajl_stream_position(stream) != LYAJL_SELECT) {
+    return 0;
+  }
+  lyajl_stream_push_key(stream);
+  return 1;
+}
+
+/* Store or emit the scalar value just pushed */
+static int lyajl_stream_store (luvit_stream_t* stream) {
+  if (stream->building) {
+    lyajl_insert(stream->L);
+    return 1;
+  }
+  return lyajl_stream_emit(stream);
+}
+
+static int lyajl_stream_null (void * ctx) {
+  luvit_stream_t* stream = ctx;
+  lua_State* L = stream->L;
+  if (!lyajl_stream_reserve(stream)) return 0;
+  if (stream->building && !stream->null_index) {
+    /* Left out like yajl.decode does, drop the key it belongs to */
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      lua_pop(L, 1);
+    }
+    return 1;
+  }
+  if (!lyajl_stream_keep(stream)) return 1;
+  if (stream->null_index) {
+    lua_pushvalue(L, stream->null_index);
+  } else {
+    lua_pushnil(L);
+  }
+  return lyajl_stream_store(stream);
+}
+
+static int lyajl_stream_boolean (void * ctx, int value) {
+  luvit_stream_t* stream = ctx;
+  if (!lyajl_stream_reserve(stream)) return 0;
+  if (!lyajl_stream_keep(stream)) return 1;
+  lua_pushboolean(stream->L, value);
+  return lyajl_stream_store(stream);
+}
+
+static int lyajl_stream_integer (void * ctx, long long value) {
+  luvit_stream_t* stream = ctx;
+  if (!lyajl_stream_reserve(stream)) return 0;
+  if (!lyajl_stream_keep(stream)) return 1;
+  lua_pushnumber(stream->L, value);
+  return lyajl_stream_store(stream);
+}
+
+static int lyajl_stream_double (void * ctx, double value) {
+  luvit_stream_t* stream = ctx;
+  if (!lyajl_stream_reserve(stream)) return 0;
+  if (!lyajl_stream_keep(stream)) return 1;
+  lua_pushnumber(stream->L, value);
+  return lyajl_stream_store(stream);
+}
+
+static int lyajl_stream_string (void * ctx, const unsigned char* value, size_t len) {
+  luvit_stream_t* stream = ctx;
+  if (!lyajl_stream_reserve(stream)) return 0;
+  if (!lyajl_stream_keep(stream)) return 1;
+  lua_pushlstring(stream->L, (const char*)value, len);
+  return lyajl_stream_store(stream);
+}
+
+static int lyajl_stream_open (luvit_stream_t* stream, int is_array) {
+  lua_State* L = stream->L;
+  lyajl_frame_t* frame;
+  int position, mt_index;
+
+  if (!lyajl_stream_reserve(stream)) return 0;
+
+  if (!stream->building) {
+    position = lyajl_stream_position(stream);
+    if (position != LYAJL_SELECT) {
+      /* Only track where we are */
+      if (stream->frame_count == stream->frame_cap) {
+        int cap = stream->frame_cap ? stream->frame_cap * 2 : 16;
+        lyajl_frame_t* frames = realloc(stream->frames, cap * sizeof(*frames));
+        if (!frames) {
+          stream->error = "Out of memory";
+          return 0;
+        }
+        stream->frames = frames;
+        stream->frame_cap = cap;
+      }
+      frame = &stream->frames[stream->frame_count++];
+      frame->is_array = is_array;
+      frame->matches = position == LYAJL_TRACK;
+      frame->key_matches = 0;
+      frame->index = 0;
+      return 1;
+    }
+    lyajl_stream_push_key(stream);
+  }
+
+  lua_newtable(L);
+  mt_index = is_array ? stream->array_mt_index : stream->object_mt_index;
+  if (mt_index) {
+    lua_pushvalue(L, mt_index);
+    lua_setmetatable(L, -2);
+  }
+  stream->building++;
+  return 1;
+}
+
+static int lyajl_stream_start_map (void * ctx) {
+  return lyajl_stream_open(ctx, 0);
+}
+
+static int lyajl_stream_start_array (void * ctx) {
+  return lyajl_stream_open(ctx, 1);
+}
+
+static int lyajl_stream_map_key (void * ctx, const unsigned char* key, size_t len) {
+  luvit_stream_t* stream = ctx;
+  lyajl_frame_t* frame;
+  lyajl_path_elem_t* elem;
+
+  if (!lyajl_stream_reserve(stream)) return 0;
+  if (stream->building) {
+    lua_pushlstring(stream->L, (const char*)key, len);
+    return 1;
+  }
+  frame = &stream->frames[stream->frame_count - 1];
+  if (!frame->matches) return 1;
+  elem = &stream->path[stream->frame_count - 1];
+  if (elem->key) {
+    frame->key_matches = elem->len == len && memcmp(elem->key, key, len) == 0;
+  } else {
+    frame->key_matches = elem->index == 0;
+  }
+  /* The key goes to the callback along with its value */
+  if (frame->key_matches && stream->frame_count == stream->path_len) {
+    lua_pushlstring(stream->L, (const char*)key, len);
+  }
+  return 1;
+}
+
+static int lyajl_stream_close (void * ctx) {
+  luvit_stream_t* stream = ctx;
+  if (stream->building) {
+    stream->building--;
+    if (stream->building == 0) {
+      return lyajl_stream_emit(stream);
+    }
+    lyajl_insert(stream->L);
+    return 1;
+  }
+  stream->frame_count--;
+  return 1;
+}
+
+static yajl_callbacks lyajl_stream_callbacks = {
+  lyajl_stream_null, lyajl_stream_boolean,
+  lyajl_stream_integer, lyajl_stream_double, NULL,
+  lyajl_stream_string,
+  lyajl_stream_start_map, lyajl_stream_map_key, lyajl_stream_close,
+  lyajl_stream_start_array, lyajl_stream_close
+};
+
+static int lyajl_stream_slot (lua_State *L, int fenv, int slot) {
+  lua_rawgeti(L, fenv, slot);
+  return lua_isnil(L, -1) ? 0 : lua_gettop(L);
+}
+
+/* Feeds a chunk, or the end of input when complete is set */
+static int lyajl_stream_feed (lua_State *L, int complete) {
+  luvit_stream_t* stream = luaL_checkudata(L, 1, JSON_STREAM_HANDLE);
+  const char* chunk = NULL;
+  size_t len = 0;
+  yajl_status stat;
+  unsigned char* str;
+  int saved_index, base, count, i;
+
+  if (stream->L) {
+    return luaL_error(L, "Cannot feed a JSON decoder from its own callback");
+  }
+  if (stream->failed) {
+    return luaL_error(L, "JSON decoder already failed");
+  }
+  if (!complete) {
+    chunk = luv_checkbuffer(L, 2, &len);
+  }
+  lua_settop(L, 2);
+
+  lua_getfenv(L, 1);
+  stream->fenv_index = lua_gettop(L);
+  lua_rawgeti(L, stream->fenv_index, LYAJL_STREAM_CALLBACK);
+  stream->callback_index = lua_gettop(L);
+  stream->null_index = lyajl_stream_slot(L, stream->fenv_index, LYAJL_STREAM_NULL);
+  stream->array_mt_index = lyajl_stream_slot(L, stream->fenv_index, LYAJL_STREAM_ARRAY_MT);
+  stream->object_mt_index = lyajl_stream_slot(L, stream->fenv_index, LYAJL_STREAM_OBJECT_MT);
+  lua_rawgeti(L, stream->fenv_index, LYAJL_STREAM_SAVED);
+  saved_index = lua_gettop(L);
+  base = saved_index;
+
+  /* Put the partly built value back where the callbacks expect it */
+  if (!lua_checkstack(L, stream->saved + 5)) {
+    return luaL_error(L, "parse error: too deeply nested");
+  }
+  for (i = 1; i <= stream->saved; i++) {
+    lua_rawgeti(L, saved_index, i);
+  }
+
+  stream->L = L;
+  stream->error = NULL;
+  if (complete) {
+    stat = yajl_complete_parse(stream->handle);
+  } else {
+    stat = yajl_parse(stream->handle, (const unsigned char*)chunk, len);
+  }
+  stream->L = NULL;
+
+  if (stat != yajl_status_ok) {
+    stream->failed = 1;
+    if (stat == yajl_status_client_canceled) {
+      lua_rawgeti(L, stream->fenv_index, LYAJL_STREAM_ERROR);
+      if (!lua_isnil(L, -1)) {
+        return lua_error(L);
+      }
+      return luaL_error(L, stream->error ? stream->error : "parse canceled");
+    }
+    str = yajl_get_error(stream->handle, 1, (const unsigned char*)chunk, len);
+    lua_pushstring(L, (const char*)str);
+    yajl_free_error(stream->handle, str);
+    return lua_error(L);
+  }
+
+  /* Park what's left until the next chunk */
+  count = lua_gettop(L) - base;
+  for (i = count; i > 0; i--) {
+    lua_rawseti(L, saved_index, i);
+  }
+  for (i = count + 1; i <= stream->saved; i++) {
+    lua_pushnil(L);
+    lua_rawseti(L, saved_index, i);
+  }
+  stream->saved = count;
+  return 0;
+}
+
+static int lyajl_stream_parse (lua_State *L) {
+  return lyajl_stream_feed(L, 0);
+}
+
+static int lyajl_stream_complete (lua_State *L) {
+  return lyajl_stream_feed(L, 1);
+}
+
+static int lyajl_stream_gc (lua_State *L) {
+  luvit_stream_t* stream = luaL_checkudata(L, 1, JSON_STREAM_HANDLE);
+  if (stream->handle) {
+    yajl_free(stream->handle);
+    stream->handle = NULL;
+  }
+  free(stream->path);
+  stream->path = NULL;
+  free(stream->frames);
+  stream->frames = NULL;
+  return 0;
+}
+
+/* yajl.newDecoder(callback, options) decodes JSON fed to it in chunks of
+ * any size and calls callback(value, key) as each value completes.  Memory
+ * use is bounded by the largest value selected, not the input.
+ *
+ * options:
+ *   path  list of map keys and array indexes leading to the values to
+ *         decode, "*" matches any.  Without one each top level value is
+ *         decoded, so newline delimited JSON works as is.  The key is the
+ *         map key or array index of the value.
+ * plus null, array_mt and object_mt as for decode, and the parser flags.
+ * allow_multiple_values is on by default.
+ */
+static int lyajl_new_stream (lua_State *L) {
+  luvit_stream_t* stream;
+  int stream_index, fenv_index, path_index, copy_index, i, n;
+  lyajl_path_elem_t* elem;
+
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  lua_settop(L, 2);
+  if (!lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+  }
+
+  stream = lua_newuserdata(L, sizeof(*stream));
+  memset(stream, 0, sizeof(*stream));
+  stream_index = lua_gettop(L);
+  luaL_getmetatable(L, JSON_STREAM_HANDLE);
+  lua_setmetatable(L, -2);
+  stream->handle = yajl_alloc(&lyajl_stream_callbacks, NULL, (void*)stream);
+  if (!stream->handle) {
+    return luaL_error(L, "Could not allocate a JSON parser");
+  }
+  yajl_config(stream->handle, yajl_allow_multiple_values, 1);
+
+  lua_createtable(L, LYAJL_STREAM_ERROR, 0);
+  fenv_index = lua_gettop(L);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, fenv_index, LYAJL_STREAM_CALLBACK);
+  lua_newtable(L);
+  lua_rawseti(L, fenv_index, LYAJL_STREAM_SAVED);
+
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "null");
+    lua_rawseti(L, fenv_index, LYAJL_STREAM_NULL);
+    lua_getfield(L, 2, "array_mt");
+    lua_rawseti(L, fenv_index, LYAJL_STREAM_ARRAY_MT);
+    lua_getfield(L, 2, "object_mt");
+    lua_rawseti(L, fenv_index, LYAJL_STREAM_OBJECT_MT);
+
+    for (i = 0; lyajl_option_names[i]; i++) {
+      lua_getfield(L, 2, lyajl_option_names[i]);
+      if (!lua_isnil(L, -1)) {
+        yajl_config(stream->handle, lyajl_options[i], lua_toboolean(L, -1));
+      }
+      lua_pop(L, 1);
+    }
+
+    lua_getfield(L, 2, "path");
+    path_index = lua_gettop(L);
+    if (!lua_isnil(L, path_index)) {
+      luaL_checktype(L, path_index, LUA_TTABLE);
+      n = lua_objlen(L, path_index);
+      if (n > 0) {
+        stream->path = malloc(n * sizeof(*stream->path));
+        if (!stream->path) {
+          return luaL_error(L, "Out of memory");
+        }
+        stream->path_len = n;
+      }
+      /* The keys point into these strings, keep them with the decoder */
+      lua_createtable(L, n, 0);
+      copy_index = lua_gettop(L);
+      for (i = 0; i < n; i++) {
+        elem = &stream->path[i];
+        elem->key = NULL;
+        elem->len = 0;
+        elem->index = 0;
+        lua_rawgeti(L, path_index, i + 1);
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+          elem->index = lua_tointeger(L, -1);
+          if (elem->index < 1) {
+            return luaL_error(L, "Path indexes start at 1");
+          }
+        } else if (lua_type(L, -1) == LUA_TSTRING) {
+          elem->key = lua_tolstring(L, -1, &elem->len);
+          if (elem->len == 1 && elem->key[0] == '*') {
+            elem->key = NULL;
+          }
+        } else {
+          return luaL_error(L, "Path elements must be strings or numbers");
+        }
+        lua_rawseti(L, copy_index, i + 1);
+      }
+      lua_rawseti(L, fenv_index, LYAJL_STREAM_PATH);
+    }
+    lua_pop(L, 1);
+  }
+
+  lua_setfenv(L, stream_index);
+  return 1;
+}
+
+static const luaL_reg lyajl_stream_m[] = {
+  {"parse", lyajl_stream_parse},
+  {"complete", lyajl_stream_complete},
+  {"__gc", lyajl_stream_gc},
+  {NULL, NULL}
+};
+
 static const luaL_reg lyajl_parser_m[] = {
   {"parse", lyajl_parse},
   {"complete", lyajl_complete_parse},
@@ -477,6 +1418,8 @@ static const luaL_reg lyajl_gen_m[] = {
 static const luaL_reg lyajl_lib[] = {
   {"newParser", lyajl_new_parser},
   {"newGenerator", lyajl_new_generator},
+  {"decode", lyajl_decode},
+  {"newDecoder", lyajl_new_stream},
   {NULL, NULL}
 };
 
@@ -496,8 +1439,25 @@ LUALIB_API int luaopen_yajl (lua_State *L) {
   luaL_openlib(L, NULL, lyajl_gen_m, 0);
   lua_pushvalue(L, -1);
 
+  luaL_newmetatable(L, JSON_STREAM_HANDLE);
+  lua_pushliteral(L, "__index");
+  lua_pushvalue(L, -2);  /* push metatable */
+  lua_rawset(L, -3);  /* metatable.__index = metatable */
+  luaL_openlib(L, NULL, lyajl_stream_m, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, JSON_DECODER_HANDLE);
+  lua_pushcfunction(L, lyajl_decoder_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
   luaL_openlib(L, "_yajl", lyajl_lib, 1);
 
+  /* The generator reused by encode */
+  generator_new(L);
+  lua_pushcclosure(L, lyajl_encode, 1);
+  lua_setfield(L, -2, "encode");
+
   /* And version info */
   lua_pushnumber(L, YAJL_MAJOR);
   lua_setfield(L, -2, "VERSION_MAJOR");
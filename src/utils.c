@@ -20,12 +20,25 @@
 #include <assert.h>
 
 #include "utils.h"
+#include "luv_dns.h"
 
 /* Meant as a lua_call replace for use in async callbacks
  * Uses the main loop and event source
  */
 void luv_acall(lua_State *C, int nargs, int nresults, const char* source) {
   lua_State* L;
+  luv_loop_stats_t* stats = NULL;
+  uint64_t start = 0;
+
+  /* Timing callbacks is opt-in, see loopStatsEnable */
+  if (luv_loop_stats_used) {
+    stats = &luv_loop_data(luv_get_loop(C))->loop_stats;
+    if (stats->enabled) {
+      start = luv_loop_stats_call_start(stats);
+    } else {
+      stats = NULL;
+    }
+  }
 
   /* Get the main thread without cheating */
   lua_getfield(C, LUA_REGISTRYINDEX, "main_thread");
@@ -48,6 +61,10 @@ void luv_acall(lua_State *C, int nargs, int nresults, const char* source) {
     lua_insert(L, -offset);
     lua_call(L, nargs + 2, nresults);
   }
+
+  if (stats) {
+    luv_loop_stats_call_end(stats, source, start);
+  }
 }
 
 /* Pushes an error object onto the stack */
@@ -95,37 +112,102 @@ uv_handle_t* luv_checkudata(lua_State* L, int index, const char* type) {
   return ((luv_handle_t*)lua_touserdata(L, index))->handle;
 }
 
+int luv_isbuffer(lua_State* L, int index) {
+  int is;
+  if (!lua_istable(L, index)) {
+    return 0;
+  }
+  lua_getfield(L, index, "ctype");
+  is = lua_type(L, -1) == LUV_TCDATA;
+  lua_pop(L, 1);
+  return is;
+}
+
+const char* luv_checkbuffer(lua_State* L, int index, size_t* len) {
+  const char* data;
+
+  if (lua_isstring(L, index)) {
+    return lua_tolstring(L, index, len);
+  }
+
+  if (!luv_isbuffer(L, index)) {
+    luaL_typerror(L, index, "string or Buffer");
+    return NULL;
+  }
+
+  /* Make the index absolute, we're about to push things */
+  if (index < 0 && index > LUA_REGISTRYINDEX) {
+    index = lua_gettop(L) + index + 1;
+  }
+
+  /* For pointer cdata, LuaJIT's lua_topointer points at the pointer value */
+  lua_getfield(L, index, "ctype");
+  data = *(const char**)lua_topointer(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "length");
+  *len = (size_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  return data;
+}
+
+char* luv_checkwritablebuffer(lua_State* L, int index, size_t* len) {
+  int readonly;
+
+  if (!luv_isbuffer(L, index)) {
+    luaL_typerror(L, index, "Buffer");
+    return NULL;
+  }
+  /* Mapped files are read-only, writing into them would crash */
+  lua_getfield(L, index, "readonly");
+  readonly = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  if (readonly) {
+    luaL_typerror(L, index, "writable Buffer");
+    return NULL;
+  }
+  return (char*)luv_checkbuffer(L, index, len);
+}
+
 void luv_io_ctx_init(luv_io_ctx_t *cbs)
 {
   cbs->rcb = LUA_NOREF;
   cbs->rdata = LUA_NOREF;
+  cbs->ndata = 0;
 }
-
 void luv_io_ctx_add(lua_State* L, luv_io_ctx_t *cbs, int index)
 {
-  int n;
+  /* Make the index absolute, we're about to push things */
+  if (index < 0 && index > LUA_REGISTRYINDEX) {
+    index = lua_gettop(L) + index + 1;
+  }
 
-  /* Create the data table if it doesn't exist */
-  if (cbs->rdata == LUA_NOREF) {
-    lua_newtable(L);
+  /* The common case is a single value, ref it directly */
+  if (cbs->ndata == 0) {
+    lua_pushvalue(L, index);
     cbs->rdata = luaL_ref(L, LUA_REGISTRYINDEX);
+    cbs->ndata = 1;
+    return;
   }
 
-  /* grab state table */
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cbs->rdata);
-
-  /* find next slot in state table */
-  n = luaL_getn(L, -1);
-  lua_pushinteger(L, n + 1);
+  /* Move to a state table on the second value */
+  if (cbs->ndata == 1) {
+    lua_createtable(L, 4, 0);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cbs->rdata);
+    lua_rawseti(L, -2, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, cbs->rdata);
+    lua_pushvalue(L, -1);
+    cbs->rdata = luaL_ref(L, LUA_REGISTRYINDEX);
+  } else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cbs->rdata);
+  }
 
-  /* push the state variable to be reffed */
+  /* ref into the state table and cleanup */
   lua_pushvalue(L, index);
-
-  /* ref into table and cleanup */
-  lua_settable(L, -3);
+  lua_rawseti(L, -2, ++cbs->ndata);
   lua_pop(L, 1);
 }
-
 void luv_io_ctx_callback_add(lua_State *L, luv_io_ctx_t *cbs, int index)
 {
   if (lua_isfunction(L, index)) {
@@ -165,9 +247,15 @@ const char* luv_handle_type_to_string(uv_handle_type type) {
   }
 }
 
+static luv_loop_data_t* luv_loop_data_create(uv_loop_t *loop);
+
 void luv_set_loop(lua_State *L, uv_loop_t *loop) {
   lua_pushlightuserdata(L, loop);
   lua_setfield(L, LUA_REGISTRYINDEX, "loop");
+  /* Set up here, where running out of memory can still be raised */
+  if (!loop->data && !luv_loop_data_create(loop)) {
+    luaL_error(L, "set_loop: out of memory");
+  }
 }
 
 uv_loop_t* luv_get_loop(lua_State *L) {
@@ -178,6 +266,34 @@ uv_loop_t* luv_get_loop(lua_State *L) {
   return loop;
 }
 
+static luv_loop_data_t* luv_loop_data_create(uv_loop_t *loop) {
+  luv_loop_data_t* data = malloc(sizeof(luv_loop_data_t));
+  if (!data) {
+    return NULL;
+  }
+  luv_buffer_pool_init(&data->buffer_pool);
+  luv_req_pool_init(&data->req_pool);
+  luv_timer_wheel_init(&data->timer_wheel, loop);
+  luv_loop_stats_init(&data->loop_stats);
+  luv_handle_stats_init(&data->handle_stats);
+  luv_gc_sched_init(&data->gc_sched);
+  loop->data = data;
+  return data;
+}
+
+luv_loop_data_t* luv_loop_data(uv_loop_t *loop) {
+  luv_loop_data_t* data = loop->data;
+  /* Loops are given their data in luv_set_loop, this only covers ones that
+   * never went through it and have no state to raise an error on */
+  if (!data) {
+    data = luv_loop_data_create(loop);
+    if (!data) {
+      abort();
+    }
+  }
+  return data;
+}
+
 
 /* Initialize a new lhandle and push the new userdata on the stack. */
 luv_handle_t* luv_handle_create(lua_State* L, size_t size, const char* type) {
@@ -195,6 +311,10 @@ luv_handle_t* luv_handle_create(lua_State* L, size_t size, const char* type) {
 
   /* Initialize and return the lhandle */
   lhandle->handle = (uv_handle_t*)malloc(size);
+  if (!lhandle->handle) {
+    luaL_error(L, "handle_create: out of memory");
+    return NULL;
+  }
   lhandle->handle->data = lhandle; /* Point back to lhandle from handle */
   lhandle->refCount = 0;
   lhandle->L = L;
@@ -209,6 +329,10 @@ luv_handle_t* luv_handle_create(lua_State* L, size_t size, const char* type) {
   }
   lhandle->ref = LUA_NOREF;
   lhandle->type = type;
+  lhandle->events = 0;
+  lhandle->layer = NULL;
+  lhandle->layer_close = NULL;
+  luv_handle_stats_add(L, lhandle);
   return lhandle;
 }
 
@@ -233,6 +357,12 @@ uv_pipe_t* luv_create_pipe(lua_State* L) {
 uv_signal_t* luv_create_signal(lua_State* L) {
   return (uv_signal_t*)luv_handle_create(L, sizeof(uv_signal_t), "luv_signal")->handle;
 }
+uv_check_t* luv_create_check(lua_State* L) {
+  return (uv_check_t*)luv_handle_create(L, sizeof(uv_check_t), "luv_check")->handle;
+}
+uv_idle_t* luv_create_idle(lua_State* L) {
+  return (uv_idle_t*)luv_handle_create(L, sizeof(uv_idle_t), "luv_idle")->handle;
+}
 uv_tty_t* luv_create_tty(lua_State* L) {
   return (uv_tty_t*)luv_handle_create(L, sizeof(uv_tty_t), "luv_tty")->handle;
 }
@@ -286,6 +416,13 @@ ares_channel luv_get_ares_channel(lua_State *L) {
   lua_getfield(L, LUA_REGISTRYINDEX, "ares_channel");
   channel = lua_touserdata(L, -1);
   lua_pop(L, 1);
+  /* ares is set up on the first query, most scripts never make one */
+  if (!channel) {
+    luv_dns_initialize(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, "ares_channel");
+    channel = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+  }
   return channel;
 }
 
@@ -22,6 +22,12 @@
 #include "lauxlib.h"
 #include "uv.h"
 #include "ares.h"
+#include "luv_buffer_pool.h"
+#include "luv_req_pool.h"
+#include "luv_timer_wheel.h"
+#include "luv_loop_stats.h"
+#include "luv_handle_stats.h"
+#include "luv_gc.h"
 
 /* C doesn't have booleans on it's own */
 #ifndef FALSE
@@ -36,6 +42,21 @@ void luv_acall(lua_State *L, int nargs, int nresults, const char* source);
 void luv_set_loop(lua_State *L, uv_loop_t *loop);
 uv_loop_t* luv_get_loop(lua_State *L);
 
+/* Native per-loop state.  It lives in loop->data so callbacks that only have
+ * a uv handle can reach it without going through the Lua registry.
+ */
+typedef struct {
+  luv_buffer_pool_t buffer_pool; /* read buffers for stream and udp handles */
+  luv_req_pool_t req_pool;       /* write, shutdown, connect and send requests */
+  luv_timer_wheel_t timer_wheel; /* idle timeouts, see luv_timer_wheel.h */
+  luv_loop_stats_t loop_stats;   /* callback and lag metrics, see luv_loop_stats.h */
+  luv_handle_stats_t handle_stats; /* live handles and requests in flight */
+  luv_gc_sched_t gc_sched;       /* idle time collection, see luv_gc.h */
+} luv_loop_data_t;
+
+/* Returns the loop's native state, creating it on first use */
+luv_loop_data_t* luv_loop_data(uv_loop_t *loop);
+
 void luv_set_ares_channel(lua_State *L, ares_channel channel);
 ares_channel luv_get_ares_channel(lua_State *L);
 lua_State* luv_get_main_thread(lua_State *L);
@@ -44,6 +65,25 @@ lua_State* luv_get_main_thread(lua_State *L);
 void luv_push_async_error(lua_State* L, uv_err_t err, const char* source, const char* path);
 void luv_push_async_error_raw(lua_State* L, const char *code, const char *msg, const char* source, const char* path);
 
+#ifndef _WIN32
+/* libuv's errno mapping, exported by 0.10 but not declared in uv.h */
+uv_err_code uv_translate_sys_error(int sys_errno);
+#endif
+
+/* LuaJIT's type tag for cdata values, not exported by lua.h */
+#define LUV_TCDATA 10
+
+/* Whether the value at index is a buffer.Buffer (a table with a cdata ctype) */
+int luv_isbuffer(lua_State* L, int index);
+
+/* Like luaL_checklstring, but also accepts a buffer.Buffer and returns its
+ * memory.  The caller must keep the Buffer alive while the memory is in use.
+ */
+const char* luv_checkbuffer(lua_State* L, int index, size_t* len);
+
+/* Like luv_checkbuffer, but only accepts a buffer.Buffer, for filling in */
+char* luv_checkwritablebuffer(lua_State* L, int index, size_t* len);
+
 /* An alternative to luaL_checkudata that takes inheritance into account for polymorphism
  * Make sure to not call with long type strings or strcat will overflow
  */
@@ -51,11 +91,16 @@ uv_handle_t* luv_checkudata(lua_State* L, int index, const char* type);
 
 const char* luv_handle_type_to_string(uv_handle_type type);
 
+typedef struct luv_handle_s luv_handle_t;
+
+/* Shuts down a handle's layer when the handle is closed */
+typedef void (*luv_layer_close_cb)(luv_handle_t* lhandle);
+
 /* luv handles are used as the userdata type that points to uv handles. 
  * The luv handle is considered strong when it's "active" or has non-zero 
  * reqCount.  When this happens ref will contain a luaL_ref to the userdata.
  */
-typedef struct {
+struct luv_handle_s {
   uv_handle_t* handle; /* The actual uv handle. memory managed by luv */
   int refCount;        /* a count of all pending request to know strength */
   lua_State* L;        /* L and ref together form a reference to the userdata */
@@ -68,7 +113,16 @@ typedef struct {
                           invalid pointer. */
   int ref;             /* ref is null when refCount is 0 meaning we're weak */
   const char* type;
-} luv_handle_t;
+  unsigned int events; /* bitmask of the luv_event_t slots that have a handler */
+  void* layer;         /* native state stacked on the handle, eg. TLS */
+  luv_layer_close_cb layer_close; /* if set, called when the handle is closed */
+  uv_loop_t* loop;     /* loop whose handle stats count it, NULL once removed */
+  struct luv_handle_s* stats_prev; /* the loop's live list */
+  struct luv_handle_s* stats_next;
+  int stats_type;      /* index in the loop's per type counts */
+  uint64_t created;    /* uv_hrtime at creation */
+  int traceback;       /* ref to where it was created, in handle debug mode */
+};
 
 /* Create a new luv_handle.  Input is the lua state and the size of the desired 
  * uv struct.  A new userdata is created and pushed onto the stack.  The luv
@@ -81,7 +135,8 @@ luv_handle_t* luv_handle_create(lua_State* L, size_t size, const char* type);
  */
 typedef struct {
   int rcb; /* callback ref */
-  int rdata; /* string ref */
+  int rdata; /* the data value itself, or a table of them once there are several */
+  int ndata; /* number of values held by rdata */
 } luv_io_ctx_t;
 
 void luv_io_ctx_init(luv_io_ctx_t *cbs);
@@ -90,6 +145,30 @@ void luv_io_ctx_callback_add(lua_State* L, luv_io_ctx_t *cbs, int index);
 void luv_io_ctx_callback_rawgeti(lua_State *L, luv_io_ctx_t *cbs);
 void luv_io_ctx_unref(lua_State* L, luv_io_ctx_t *cbs);
 
+/* A uv request allocated together with its callback refs.  These are
+ * recycled through the loop's request pool.  The uv request must stay the
+ * first member so callbacks can cast their req back to a luv_req_t.
+ */
+struct luv_req_s {
+  union {
+    uv_req_t req;
+    uv_write_t write;
+    uv_shutdown_t shutdown;
+    uv_connect_t connect;
+    uv_udp_send_t udp_send;
+    uv_work_t work;
+  } uv;
+  luv_io_ctx_t cbs;
+  luv_req_kind_t kind; /* for the loop's in flight counts */
+  luv_req_t* next; /* freelist link */
+};
+
+/* Takes a req from the loop's freelist or mallocs one.  Gives NULL when out
+ * of memory, with the loop's last error set to ENOMEM for the caller to
+ * report. */
+luv_req_t* luv_req_alloc(uv_loop_t* loop, luv_req_kind_t kind);
+void luv_req_release(uv_loop_t* loop, luv_req_t* req);
+
 /* Convenience wrappers */
 uv_udp_t*      luv_create_udp(lua_State* L);
 uv_fs_event_t* luv_create_fs_watcher(lua_State* L);
@@ -99,6 +178,8 @@ uv_tcp_t*      luv_create_tcp(lua_State* L);
 uv_pipe_t*     luv_create_pipe(lua_State* L);
 uv_signal_t*   luv_create_signal(lua_State* L);
 uv_tty_t*      luv_create_tty(lua_State* L);
+uv_check_t*    luv_create_check(lua_State* L);
+uv_idle_t*     luv_create_idle(lua_State* L);
 
 /**/
 lua_State* luv_handle_get_lua(luv_handle_t* lhandle);
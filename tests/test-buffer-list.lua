@@ -0,0 +1,142 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local net = require('net')
+local http = require('http')
+local buffer = require('buffer')
+local BufferList = buffer.BufferList
+
+local list = BufferList:new()
+list:push("hel")
+list:push("")
+list:push(buffer.Buffer:new("lo wo"))
+list:push("rld\r")
+list:push("\nnext")
+assert(#list == 17)
+assert(list:indexOf("lo") == 4)
+assert(list:indexOf("o w") == 5)
+assert(list:indexOf("\r\n") == 12)
+assert(list:indexOf(("w"):byte()) == 7)
+assert(list:indexOf("world", 8) == nil)
+assert(list:indexOf("xyz") == nil)
+assert(list:consume(2) == "he")
+assert(list:indexOf("lo") == 2)
+assert(list:readUntil("\r\n") == "llo world")
+assert(list:readUntil("\r\n") == nil)
+list:push("\r")
+assert(list:readUntil("\r\n") == nil)
+list:push("\nrest")
+assert(list:readUntil("\r\n") == "next")
+assert(tostring(list) == "rest")
+assert(list:toString() == "rest")
+assert(list:consume(10) == "rest")
+assert(#list == 0 and list:consume(1) == "")
+
+-- A delimiter split over many chunks
+local split = BufferList:new()
+for c in ("abc--|--def"):gmatch(".") do
+  split:push(c)
+  local found = split:readUntil("--|--")
+  if found then
+    assert(found == "abc")
+  end
+end
+assert(split:toString() == "def")
+
+-- With the first chunk partly consumed, later chunks are searched from
+-- their own start
+local partial = BufferList:new()
+partial:push("xxab")
+partial:push("\ncd")
+partial:push("e\n")
+assert(partial:consume(2) == "xx")
+assert(partial:indexOf("\n") == 3)
+assert(partial:indexOf("cd") == 4)
+assert(partial:readUntil("\n") == "ab")
+assert(partial:readUntil("\n") == "cde")
+
+-- Buffers are held rather than copied, matches across them included
+local held = BufferList:new()
+local first = buffer.Buffer:new("ab\r")
+held:push(first)
+held:push(buffer.Buffer:new("\ncd"))
+assert(held:indexOf("\r\n") == 3)
+assert(held:indexOf("cd") == 5)
+first[1] = ("x"):byte()
+assert(held:readUntil("\r\n") == "xb")
+assert(held:toString() == "cd")
+
+local PORT = process.env.PORT or 10103
+local lines = {}
+local body
+
+local server = net.createServer(function (client)
+  client:setLineMode("\r\n")
+  client:on("line", function (line)
+    lines[#lines + 1] = line
+  end)
+  client:on("end", function ()
+    client:destroy()
+  end)
+end)
+
+server:listen(PORT, "127.0.0.1", function ()
+  local client = net.createConnection(PORT, "127.0.0.1", function ()
+    client:write("one\r\ntw")
+    client:write("o\r")
+    client:write("\n\r\nlast")
+    client:shutdown()
+  end)
+  client:on("close", function ()
+    server:close()
+
+    local httpServer
+    httpServer = http.createServer(function (req, res)
+      req:readBody(function (err, data)
+        assert(not err)
+        res:finish(data:upper())
+      end)
+    end)
+    httpServer:listen(PORT + 1, "127.0.0.1", function ()
+      local req = http.request({
+        host = "127.0.0.1",
+        port = PORT + 1,
+        method = "POST",
+        headers = { ["Transfer-Encoding"] = "chunked" }
+      }, function (res)
+        res:readBody(function (err, data)
+          assert(not err)
+          body = data
+          httpServer:close()
+        end)
+      end)
+      req:write("streamed ")
+      req:write("in ")
+      req:done("pieces")
+    end)
+  end)
+end)
+
+process:on('exit', function ()
+  p(lines, body)
+  assert(#lines == 4)
+  assert(lines[1] == "one" and lines[2] == "two" and lines[3] == "" and lines[4] == "last")
+  assert(body == "STREAMED IN PIECES")
+end)
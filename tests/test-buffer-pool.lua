@@ -0,0 +1,60 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local uv = require('uv')
+local net = require('net')
+
+local PORT = process.env.PORT or 10083
+local ROUNDS = 20
+
+local before = uv.bufferPoolStats()
+
+local server = net.createServer(function (client)
+  client:on("data", function (chunk)
+    client:write(chunk)
+  end)
+end)
+
+server:listen(PORT, "127.0.0.1")
+
+local rounds = 0
+local client
+client = net.createConnection(PORT, "127.0.0.1", function ()
+  client:write("ping")
+end)
+
+client:on("data", function (chunk)
+  assert(chunk == "ping")
+  rounds = rounds + 1
+  if rounds < ROUNDS then
+    client:write("ping")
+    return
+  end
+
+  local stats = uv.bufferPoolStats()
+  p(stats)
+  -- Every read after the first few should reuse a pooled buffer
+  assert(stats.hits > before.hits)
+  assert(stats.hits + stats.misses >= ROUNDS * 2)
+  assert(stats.retained <= stats.limit)
+
+  client:destroy()
+  server:close()
+end)
@@ -58,3 +58,75 @@ assert(buf2:toString(1, 2) == 'ab')
 assert(buf2:toString(2, 3) == 'bc')
 assert(buf2:toString(3) == 'cd')
 assert(buf2:toString() == 'abcd')
+
+-- Strings are copied, binary data survives both ways
+local binary = Buffer:new('a\0b\0')
+assert(#binary == 4)
+assert(tostring(binary) == 'a\0b\0')
+binary[1] = 0x41
+assert(tostring(binary) == 'A\0b\0')
+
+-- Typed writes round trip through the typed reads
+local typed = Buffer:new(16)
+typed:writeUInt16LE(1, 0xBEEF)
+assert(typed:readUInt8(1) == 0xEF and typed:readUInt8(2) == 0xBE)
+typed:writeUInt16BE(1, 0xBEEF)
+assert(typed:readUInt16BE(1) == 0xBEEF)
+assert(typed:readInt16BE(1) == -0x4111)
+typed:writeUInt32BE(3, 0xFB042342)
+assert(typed:readUInt32BE(3) == 0xFB042342)
+assert(typed:readUInt32LE(3) == 0x422304FB)
+typed:writeInt32LE(3, -2)
+assert(typed:readInt32LE(3) == -2)
+assert(typed:readUInt32LE(3) == 0xFFFFFFFE)
+typed:writeInt8(7, -1)
+assert(typed:readUInt8(7) == 0xFF)
+typed:writeFloatBE(8, 1.5)
+assert(typed:readFloatBE(8) == 1.5)
+assert(typed:readUInt8(8) == 0x3F)
+typed:writeDoubleLE(9, 1 / 3)
+assert(typed:readDoubleLE(9) == 1 / 3)
+typed:writeDoubleBE(9, -2.25)
+assert(typed:readDoubleBE(9) == -2.25)
+assert(typed:readUInt8(9) == 0xC0)
+assert(not pcall(typed.readUInt32LE, typed, 14))
+assert(not pcall(typed.writeUInt16LE, typed, 0, 1))
+
+-- Slices share memory with their parent
+local whole = Buffer:new('hello world')
+local world = whole:slice(7)
+assert(tostring(world) == 'world')
+assert(#world == 5)
+world[1] = ('W'):byte()
+assert(tostring(whole) == 'hello World')
+local ell = whole:slice(2, 4)
+assert(tostring(ell) == 'ell')
+assert(ell:readUInt8(1) == ('e'):byte())
+assert(not pcall(ell.readUInt8, ell, 4))
+assert(not pcall(whole.slice, whole, 5, 12))
+assert(#whole:slice(3, 2) == 0)
+
+-- copy, fill and indexOf
+local target = Buffer:new(8)
+target:fill(0)
+assert(whole:copy(target, 2, 1, 5) == 5)
+assert(target:toString() == '\0hello\0\0')
+assert(whole:copy(target, 6) == 3)
+assert(target:toString() == '\0hellhel')
+whole:copy(whole, 3, 1, 5)
+assert(tostring(whole) == 'hehelloorld')
+whole:fill('-', 1, 2)
+assert(tostring(whole) == '--helloorld')
+assert(whole:indexOf(('l'):byte()) == 5)
+assert(whole:indexOf(('l'):byte(), 6) == 6)
+assert(whole:indexOf('lo') == 6)
+assert(whole:indexOf('l', 7) == 10)
+assert(whole:indexOf(Buffer:new('rld')) == 9)
+assert(whole:indexOf('xyz') == nil)
+assert(whole:indexOf(0) == nil)
+
+-- Native writers take Buffers as they are
+local Zlib = require('zlib_native')
+local plain = Buffer:new('buffers all the way down')
+local packed = Zlib.new('deflate'):write(plain:slice(1, 7), "finish")
+assert(Zlib.new('inflate'):write(Buffer:new(packed), "finish") == 'buffers')
@@ -0,0 +1,142 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local childProcess = require('childprocess')
+local os = require('os')
+
+-- The children are plain shell tools
+if os.type() == 'win32' then return end
+
+local results = {}
+
+-- cat answers each line with itself
+local lines = childProcess.createPool('cat', {}, { size = 2 })
+local answered = 0
+for i = 1, 10 do
+  lines:request("request " .. i, function (err, response)
+    assert(not err)
+    assert(response == "request " .. i)
+    answered = answered + 1
+    if answered == 10 then
+      local stats = lines:stats()
+      assert(stats.workers == 2 and stats.served == 10 and stats.queued == 0)
+      results.line = true
+      lines:close()
+    end
+  end)
+end
+
+-- Length framed echo, payloads can have newlines
+local echo = 'while read n; do echo $n; dd bs=1 count=$n 2>/dev/null; done'
+local framed = childProcess.createPool('bash', {'-c', echo}, {
+  size = 1,
+  framing = "length",
+  concurrency = 2,
+  maxRequests = 3
+})
+local payloads = { "one\ntwo", "", "three\n", "four" }
+local done = 0
+for i = 1, #payloads do
+  framed:request(payloads[i], function (err, response)
+    assert(not err)
+    assert(response == payloads[i])
+    done = done + 1
+    if done == #payloads then
+      assert(framed:stats().served == 4)
+      results.length = true
+      framed:close()
+    end
+  end)
+end
+
+-- Children that die fail their request and get replaced
+local crashing = childProcess.createPool('bash', {'-c', 'read line; exit 3'}, {
+  size = 1,
+  restartDelay = 10
+})
+crashing:request("hello", function (err, response)
+  assert(err.code == "ECHILD")
+  crashing:request("again", function (err)
+    assert(err.code == "ECHILD")
+    assert(crashing:stats().restarts >= 1)
+    results.crash = true
+    crashing:close()
+  end)
+end)
+
+-- Responses split over several reads of the child's stdout
+local splitter = 'read a; read b; printf "%s\\n%s" "$a" "${b:0:1}"; sleep 0.1; ' ..
+  'printf "%s\\n" "${b:1}"; exec cat'
+local split = childProcess.createPool('bash', {'-c', splitter}, {
+  size = 1,
+  concurrency = 2
+})
+local splitAnswers = {}
+for i, payload in ipairs({"first", "second", "third"}) do
+  split:request(payload, function (err, response)
+    assert(not err)
+    splitAnswers[i] = response
+    if #splitAnswers == 3 then
+      assert(deep_equal({"first", "second", "third"}, splitAnswers))
+      results.split = true
+      split:close()
+    end
+  end)
+end
+
+-- A command that can't be spawned is only retried maxSpawnErrors times
+local missing = childProcess.createPool('/nonexistent/luvit-pool-test', {}, {
+  size = 1,
+  restartDelay = 1,
+  maxSpawnErrors = 3
+})
+missing:request("hello", function (err)
+  assert(err)
+end)
+require('timer').setTimeout(100, function ()
+  assert(missing:stats().spawnErrors == 3)
+  missing:request("again", function (err)
+    assert(err)
+    results.missing = true
+  end)
+end)
+
+-- The queue is bounded with maxQueue
+local bounded = childProcess.createPool('cat', {}, { size = 1, maxQueue = 1 })
+bounded:request("a", function (err) assert(not err) end)
+bounded:request("b", function (err)
+  assert(not err)
+  bounded:close()
+  bounded:request("c", function (err)
+    assert(err.code == "EPIPE")
+    results.closed = true
+  end)
+end)
+bounded:request("c", function (err)
+  assert(err.code == "EAGAIN")
+  results.full = true
+end)
+
+process:on('exit', function ()
+  assert(deep_equal({
+    line = true, length = true, crash = true, full = true, closed = true,
+    split = true, missing = true
+  }, results))
+end)
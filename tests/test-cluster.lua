@@ -0,0 +1,83 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+require("helper")
+
+local cluster = require('cluster')
+local net = require('net')
+
+local PORT = process.env.PORT or 10098
+
+if cluster.isWorker then
+  net.createServer(function (client)
+    client:write("worker " .. cluster.worker.id, function ()
+      client:destroy()
+    end)
+  end):listen(PORT, "127.0.0.1")
+  return
+end
+
+local WORKERS = 2
+local listening = 0
+local replies = {}
+local exits = 0
+
+local function connect(callback)
+  local client = net.createConnection(PORT, "127.0.0.1")
+  local reply = ""
+  client:on('data', function (chunk)
+    reply = reply .. chunk
+  end)
+  client:on('end', function ()
+    client:destroy()
+    replies[#replies + 1] = reply
+    callback()
+  end)
+  client:on('error', function (err)
+    p(err)
+    assert(false)
+  end)
+end
+
+cluster:on('exit', function (worker, code)
+  exits = exits + 1
+end)
+
+cluster:on('listening', function (worker, address)
+  assert(address.port == PORT)
+  listening = listening + 1
+  if listening ~= WORKERS then return end
+  connect(function ()
+    connect(function ()
+      -- Workers leave once their servers are closed
+      cluster.disconnect()
+    end)
+  end)
+end)
+
+for i = 1, WORKERS do
+  cluster.fork()
+end
+
+process:on('exit', function ()
+  p(replies)
+  assert(#replies == 2)
+  for i = 1, #replies do
+    assert(replies[i]:find("^worker %d+$"))
+  end
+  assert(exits == WORKERS)
+end)
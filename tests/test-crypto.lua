@@ -67,3 +67,56 @@ local bogus = crypto.pkey.from_pem(1)
 assert(bogus == nil)
 
 
+
+-- Test thread pool digests, updates apply in order
+local Buffer = require('buffer').Buffer
+local results = {}
+
+local ad = crypto.newDigest("sha256")
+ad:updateAsync(message1)
+ad:updateAsync(Buffer:new(message2), function (err)
+  assert(not err)
+  results.update = true
+end)
+assert(ad:pending() == 2)
+ad:finalAsync(function (err, digest)
+  assert(not err)
+  assert(digest == hash)
+  results.digest = true
+end)
+
+local sync = crypto.newDigest("sha256")
+sync:update(message1):update(message2)
+assert(sync:final() == hash)
+
+local fox = 'The quick brown fox jumps over the lazy dog'
+local hmac = crypto.newHmac("sha256", "key")
+hmac:updateAsync(fox)
+hmac:finalAsync(true, function (err, raw)
+  assert(not err)
+  assert(#raw == 32)
+  local hex = raw:gsub('.', function (c)
+    return ('%02x'):format(c:byte())
+  end)
+  assert(hex == 'f7bc83f430538424b13298e6aa6fb143ef4d59a14946175997479dbc2d1a3cd8')
+  results.hmac = true
+end)
+
+local file = path.join(__dirname, 'fixtures', 'x.txt')
+crypto.hashFile(file, "sha1", function (err, digest, size)
+  assert(not err)
+  local contents = fs.readFileSync(file)
+  assert(size == #contents)
+  assert(digest == crypto.digest.new("sha1"):final(contents))
+  results.file = true
+end)
+
+crypto.hashFile(path.join(__dirname, 'fixtures', 'missing'), "sha1", function (err)
+  assert(err.code == "ENOENT")
+  results.missing = true
+end)
+
+process:on('exit', function ()
+  assert(results.update and results.digest and results.hmac)
+  assert(results.file and results.missing)
+end)
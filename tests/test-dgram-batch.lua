@@ -0,0 +1,73 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+local dgram = require('dgram')
+local os = require('os')
+local string = require('string')
+
+if os.type() == 'win32' then
+  return
+end
+
+local PORT = process.env.PORT or 10094
+local HOST = '127.0.0.1'
+local COUNT = 20
+
+local receiver = dgram.createSocket('udp4')
+local sender = dgram.createSocket('udp4')
+local received = {}
+local events = 0
+
+receiver:on('message', function ()
+  error('batch mode should only emit messages')
+end)
+
+receiver:on('messages', function (msgs, addresses, ports, count)
+  events = events + 1
+  assert(count == #msgs and count == #addresses and count == #ports)
+  for i = 1, count do
+    assert(dgram.addressToString(addresses[i]) == HOST)
+    assert(ports[i] == sender:address().port)
+    received[#received + 1] = msgs[i]
+  end
+  if #received == COUNT then
+    receiver:close()
+    sender:close()
+  end
+end)
+
+receiver:on('listening', function ()
+  for i = 1, COUNT do
+    -- The last one doesn't fit and gets cut short
+    local msg = i == COUNT and 'x' .. string.rep('y', 64) or 'msg' .. i
+    sender:send(msg, PORT, HOST)
+  end
+end)
+
+receiver:setBatchMode({ batch = 8, size = 16 })
+receiver:bind(PORT, HOST)
+
+process:on('exit', function ()
+  p({ events = events, received = #received })
+  assert(#received == COUNT)
+  for i = 1, COUNT - 1 do
+    assert(received[i] == 'msg' .. i)
+  end
+  assert(#received[COUNT] == 16)
+end)
@@ -0,0 +1,78 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+local dgram = require('dgram')
+local Buffer = require('buffer').Buffer
+
+local PORT = process.env.PORT or 10095
+local HOST = '127.0.0.1'
+local COUNT = 10
+
+local receiver = dgram.createSocket('udp4')
+local sender = dgram.createSocket('udp4')
+local received = {}
+local callbacks = 0
+
+local function batch(round)
+  local list = {}
+  for i = 1, COUNT do
+    list[i] = { 'r' .. round .. '-' .. i, PORT, i % 2 == 0 and 'localhost' or HOST }
+  end
+  list[COUNT] = { Buffer:new('r' .. round .. '-' .. COUNT), PORT, HOST }
+  return list
+end
+
+receiver:on('message', function (msg)
+  received[msg] = true
+  local n = 0
+  for _ in pairs(received) do n = n + 1 end
+  if n == 2 * COUNT then
+    receiver:close()
+    sender:close()
+  end
+end)
+
+receiver:on('listening', function ()
+  sender:sendBatch(batch(1), function (err, sent)
+    assert(not err)
+    assert(sent == COUNT)
+    callbacks = callbacks + 1
+    -- Both destinations are resolved now, the second batch goes out at once
+    assert(sender._destinationCount == 2)
+    -- Only the hostname is looked up again once its ttl is up
+    assert(sender._destinations['localhost:' .. PORT].expires)
+    assert(not sender._destinations[HOST .. ':' .. PORT].expires)
+    sender:sendBatch(batch(2), function (err, sent)
+      assert(not err)
+      assert(sent == COUNT)
+      callbacks = callbacks + 1
+    end)
+  end)
+end)
+
+receiver:bind(PORT, HOST)
+
+process:on('exit', function ()
+  assert(callbacks == 2)
+  for round = 1, 2 do
+    for i = 1, COUNT do
+      assert(received['r' .. round .. '-' .. i])
+    end
+  end
+end)
@@ -0,0 +1,108 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local dns = require('dns')
+local timer = require('timer')
+local table = require('table')
+
+local cache = dns.DnsCache:new({ maxEntries = 2 })
+local queries = 0
+local pending = {}
+
+-- A fake resolver answering once we say so
+local function query(done)
+  queries = queries + 1
+  pending[#pending + 1] = done
+end
+
+local function answer(ttl, ...)
+  local done = table.remove(pending, 1)
+  done(ttl, ...)
+end
+
+-- Concurrent queries share one request
+local answers = 0
+for i = 1, 3 do
+  cache:query("a", query, function (err, addresses)
+    assert(not err)
+    assert(addresses[1] == "127.0.0.1")
+    answers = answers + 1
+  end)
+end
+assert(queries == 1)
+answer(1, nil, { "127.0.0.1" })
+assert(answers == 3)
+assert(cache:stats().coalesced == 2)
+
+-- Then it's served from the cache
+cache:query("a", query, function (err, addresses)
+  assert(addresses[1] == "127.0.0.1")
+  answers = answers + 1
+end)
+assert(queries == 1)
+
+-- Misses are kept, transient errors aren't
+cache:query("missing", query, function () end)
+answer(60, { message = "4, ENOTFOUND" })
+cache:query("missing", query, function (err)
+  assert(err.message == "4, ENOTFOUND")
+end)
+cache:query("flaky", query, function () end)
+answer(60, { message = "12, ETIMEOUT", transient = true })
+cache:query("flaky", query, function () end)
+assert(queries == 4)
+answer(60, nil, { "::1" })
+
+-- maxEntries evicts the least recently used
+assert(cache:stats().size == 2)
+assert(cache:stats().evictions >= 1)
+
+local stats = cache:stats()
+p(stats)
+assert(stats.hits == 1 and stats.negativeHits == 1 and stats.misses == 4)
+
+-- Entries go away with their TTL
+local ttlCache = dns.DnsCache:new()
+ttlCache:set("short", { n = 2, nil, { "127.0.0.1" } }, 1)
+ttlCache:set("long", { n = 2, nil, { "127.0.0.1" } }, 60)
+assert(ttlCache:get("short") and ttlCache:get("long"))
+timer.setTimeout(1100, function ()
+  assert(not ttlCache:get("short"))
+  assert(ttlCache:get("long"))
+  assert(answers == 4)
+end)
+
+-- dns.lookup goes through the shared cache
+local looked = 0
+dns.lookup('localhost', function (err, ip)
+  assert(not err)
+  looked = looked + 1
+  local hits = dns.cache:stats().hits
+  dns.lookup('localhost', function (err, again)
+    assert(not err)
+    assert(again == ip)
+    assert(dns.cache:stats().hits == hits + 1)
+    looked = looked + 1
+  end)
+end)
+
+process:on('exit', function ()
+  assert(looked == 2)
+end)
@@ -18,6 +18,96 @@ limitations under the License.
 
 require("helper")
 
+local Emitter = require('core').Emitter
+
+--
+-- removing a listener mid emit doesn't skip the ones after it
+--
+local calls = {}
+local emitter = Emitter:new()
+local function second() calls[#calls + 1] = "second" end
+emitter:on("x", function ()
+  calls[#calls + 1] = "first"
+  emitter:removeListener("x", second)
+end)
+emitter:on("x", second)
+emitter:on("x", function () calls[#calls + 1] = "third" end)
+emitter:emit("x")
+assert(deep_equal(calls, { "first", "second", "third" }))
+calls = {}
+emitter:emit("x")
+assert(deep_equal(calls, { "first", "third" }))
+
+--
+-- once listeners fire once, even when emitted again from inside, and can
+-- be removed by the function given
+--
+local count = 0
+local nested = Emitter:new()
+nested:once("y", function ()
+  count = count + 1
+  nested:emit("y")
+end)
+nested:emit("y")
+nested:emit("y")
+assert(count == 1)
+assert(rawget(nested.handlers, "y") == nil)
+
+-- nor when an emit nested in an earlier listener gets to it first
+local fired = 0
+local reentered = false
+nested:on("v", function ()
+  if reentered then return end
+  reentered = true
+  nested:emit("v")
+end)
+nested:once("v", function () fired = fired + 1 end)
+nested:emit("v")
+assert(fired == 1)
+
+local never = function () error("removed once listener ran") end
+nested:once("z", never)
+nested:removeListener("z", never)
+nested:emit("z")
+
+--
+-- listeners added while emitting wait for the next emit
+--
+local added = 0
+nested:on("w", function ()
+  nested:on("w", function () added = added + 1 end)
+end)
+nested:emit("w")
+assert(added == 0)
+nested:emit("w")
+assert(added == 1)
+
+--
+-- a listener that throws doesn't leave the list stuck mid emit
+--
+local throwing = Emitter:new()
+local kept = function () end
+local thrower = function () error("listener failed") end
+throwing:on("t", kept)
+throwing:on("t", thrower)
+local ok, err = pcall(throwing.emit, throwing, "t")
+assert(not ok and err:find("listener failed"))
+-- It comes out as thrown, however many listeners there are
+assert(not err:find("stack traceback", 1, true))
+throwing:removeListener("t", thrower)
+assert(rawget(throwing.handlers, "t") == kept)
+
+--
+-- removing everything
+--
+nested:removeListener("w")
+assert(rawget(nested.handlers, "w") == nil)
+assert(nested:emit("nobody") == nested)
+nested:on("error", function () end)
+nested:removeListener("error")
+-- so an error emitted now would go unhandled again
+assert(rawget(nested.handlers, "error") == nil)
+
 --
 -- chaining works
 --
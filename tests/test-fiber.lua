@@ -0,0 +1,138 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local fiber = require('fiber')
+local timer = require('timer')
+local fs = require('fs')
+local math = require('math')
+local Error = require('core').Error
+
+local results = {}
+
+-- Awaiting callbacks, sync and async, and a native op
+fiber.spawn(function (a, b)
+  local x, y = fiber.await(function (p, q, resume) resume(p + q, "sync") end, a, b)
+  assert(x == 3 and y == "sync")
+  fiber.sleep(5)
+  local err, stat = fiber.await(fs.stat, __filename)
+  assert(not err and stat.size > 0)
+  return x * 2, "done"
+end, nil, function (err, value, word)
+  assert(not err, err)
+  results.basic = { value, word }
+end, 1, 2)
+
+-- Coroutines of finished fibers are reused
+local before = fiber.stats()
+for i = 1, 10 do
+  fiber.spawn(function () return i end)
+end
+local after = fiber.stats()
+assert(after.created - before.created <= 1)
+
+-- Errors carry a traceback to the callback
+fiber.spawn(function ()
+  fiber.sleep(1)
+  error("failed here")
+end, nil, function (err)
+  results.failed = err
+end)
+
+-- Error objects are wrapped, not rewritten, the thrower may keep using them
+local shared = Error:new("shared failure")
+shared.code = "ESHARED"
+fiber.spawn(function ()
+  fiber.sleep(1)
+  error(shared)
+end, nil, function (err)
+  results.wrapped = err
+end)
+
+-- Cancelling stops the fiber at its await, a late callback is ignored
+local late
+local cancelled = fiber.spawn(function ()
+  fiber.await(function (resume) late = resume end)
+  error("should not get past the await")
+end, nil, function (err)
+  results.cancelled = err
+end)
+cancelled:cancel()
+late("too late")
+
+-- Timeouts cancel too
+fiber.spawn(function ()
+  fiber.sleep(1000)
+end, { timeout = 10 }, function (err)
+  results.timeout = err
+end)
+
+-- all runs at most limit at once and keeps the order
+local active, peak = 0, 0
+local tasks = {}
+for i = 1, 6 do
+  tasks[i] = function ()
+    active = active + 1
+    peak = math.max(peak, active)
+    fiber.sleep(7 - i)
+    active = active - 1
+    return i * 10
+  end
+end
+fiber.all(tasks, 2, function (err, values)
+  assert(not err)
+  results.all = values
+  results.peak = peak
+end)
+
+-- race takes the first success, failures make room for the next
+fiber.race({
+  function () fiber.sleep(1) error("first fails") end,
+  function () fiber.sleep(50) return "slow" end,
+  function () fiber.sleep(5) return "fast" end,
+}, 2, function (err, value, index)
+  results.race = { err, value, index }
+end)
+
+-- The original interface still works, from inside fibers as well
+fiber.new(function (wrap, wait)
+  local value = wait(function (resume) timer.setTimeout(1, resume, "waited") end)
+  local _, pair = fiber.await(fiber.all, { function () return 1 end, function () return 2 end }, nil)
+  return value, pair
+end, function (err, value, pair)
+  results.new = { err, value, pair }
+end)
+
+process:on('exit', function ()
+  p(results)
+  assert(results.basic[1] == 6 and results.basic[2] == "done")
+  assert(tostring(results.failed):find("failed here"))
+  assert(tostring(results.failed):find("traceback"))
+  assert(results.wrapped ~= shared and results.wrapped.cause == shared)
+  assert(results.wrapped.code == "ESHARED")
+  assert(tostring(results.wrapped):find("traceback"))
+  assert(shared.message == "shared failure")
+  assert(results.cancelled.code == "ECANCELED")
+  assert(results.timeout.code == "ETIMEDOUT")
+  assert(deep_equal(results.all, { 10, 20, 30, 40, 50, 60 }))
+  assert(results.peak == 2)
+  assert(results.race[1] == nil and results.race[2] == "fast" and results.race[3] == 3)
+  assert(results.new[1] == nil and results.new[2] == "waited")
+  assert(deep_equal(results.new[3], { 1, 2 }))
+end)
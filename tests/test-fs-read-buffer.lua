@@ -0,0 +1,67 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local string = require('string')
+local table = require('table')
+local FS = require('fs')
+local Path = require('path')
+local Buffer = require('buffer').Buffer
+
+local filepath = Path.join(__dirname, 'fixtures', 'x.txt')
+local fd = FS.openSync(filepath, 'r')
+local expected = 'xyz\n'
+local readCalled = 0
+
+local buffer = Buffer:new(8)
+FS.read(fd, 0, buffer, 2, #expected, function(err, bytesRead)
+  readCalled = readCalled + 1
+  assert(not err)
+  assert(bytesRead == #expected)
+  assert(buffer:toString(3, 2 + bytesRead) == expected)
+end)
+
+local other = Buffer:new(4)
+local bytesRead = FS.readSync(fd, 0, other, 0, #expected)
+assert(bytesRead == #expected)
+assert(tostring(other) == expected)
+
+-- Reads must fit in the Buffer
+assert(not pcall(FS.readSync, fd, 0, other, 1, #expected))
+
+-- A stream cycling through two Buffers sees the whole file
+local big = Path.join(__dirname, 'fixtures', 'elipses.txt')
+local parts = {}
+local seen = {}
+local stream = FS.createReadStream(big, {buffers = 2, chunk_size = 4096})
+stream:on('data', function(chunk, len)
+  seen[chunk] = true
+  parts[#parts + 1] = chunk:toString(1, len)
+end)
+stream:on('end', function()
+  readCalled = readCalled + 1
+  assert(table.concat(parts) == string.rep('…', 10000))
+  local count = 0
+  for _ in pairs(seen) do count = count + 1 end
+  assert(count == 2)
+end)
+
+process:on('exit', function()
+  assert(readCalled == 2)
+end)
@@ -0,0 +1,55 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local FS = require('fs')
+local Path = require('path')
+local string = require('string')
+
+local fn = Path.join(__dirname, 'fixtures', 'elipses.txt')
+local empty = Path.join(__dirname, 'fixtures', 'empty.txt')
+local expected = string.rep('…', 10000)
+
+local mapped = FS.readFileSync(fn, {mmap = true})
+assert(mapped.readonly)
+assert(mapped.length == #expected)
+assert(tostring(mapped) == expected)
+assert(not pcall(function () mapped[1] = 0 end))
+
+-- Empty files can't be mapped, they still come back as a Buffer
+local nothing = FS.readFileSync(empty, {mmap = true})
+assert(nothing.length == 0)
+assert(tostring(nothing) == '')
+
+local calls = 0
+FS.readFile(fn, {mmap = true}, function (err, data)
+  assert(not err)
+  assert(data:toString() == expected)
+  calls = calls + 1
+end)
+
+FS.readFile(Path.join(__dirname, 'fixtures', 'missing.txt'), {mmap = true}, function (err, data)
+  assert(err.code == 'ENOENT')
+  assert(data == nil)
+  calls = calls + 1
+end)
+
+process:on('exit', function()
+  assert(calls == 2)
+end)
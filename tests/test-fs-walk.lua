@@ -0,0 +1,98 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local FS = require('fs')
+local Path = require('path')
+
+local root = Path.join(__dirname, 'fixtures', 'test-fs-walk')
+local sub = Path.join(root, 'sub')
+local deep = Path.join(sub, 'deep')
+
+local function mkdir(dir)
+  local ok, err = pcall(FS.mkdirSync, dir, '0777')
+  if not ok then
+    assert(err.code == 'EEXIST')
+  end
+end
+
+mkdir(root)
+mkdir(sub)
+mkdir(deep)
+local files = {
+  Path.join(root, 'a.png'),
+  Path.join(root, 'b.txt'),
+  Path.join(sub, 'c.png'),
+  Path.join(deep, 'd.png')
+}
+for _, file in ipairs(files) do
+  FS.writeFileSync(file, 'x')
+end
+
+local function cleanup()
+  for _, file in ipairs(files) do
+    FS.unlinkSync(file)
+  end
+  FS.rmdirSync(deep)
+  FS.rmdirSync(sub)
+  FS.rmdirSync(root)
+end
+
+local function walk(options, callback)
+  local found = {}
+  FS.walk(root, options, function (err, entries, done)
+    assert(not err)
+    for _, entry in ipairs(entries) do
+      assert(entry.path == Path.join(Path.dirname(entry.path), entry.name))
+      found[entry.name] = entry
+    end
+    if done then callback(found) end
+  end)
+end
+
+local finished = 0
+
+walk({batchSize = 1}, function (found)
+  assert(found['a.png'].is_file and found['a.png'].size == 1)
+  assert(found['sub'].is_directory)
+  assert(found['deep'] and found['d.png'] and found['b.txt'])
+
+  walk({extensions = {'.png'}, maxDepth = 1}, function (found)
+    assert(found['a.png'] and found['c.png'])
+    -- Too deep
+    assert(not found['d.png'])
+    -- Filtered out, though the walk went through sub
+    assert(not found['b.txt'] and not found['sub'])
+
+    walk({glob = '?.txt'}, function (found)
+      assert(found['b.txt'] and not found['a.png'])
+      cleanup()
+      finished = finished + 1
+    end)
+  end)
+end)
+
+FS.walk(Path.join(root, 'missing'), function (err)
+  assert(err.code == 'ENOENT')
+  finished = finished + 1
+end)
+
+process:on('exit', function()
+  assert(finished == 2)
+end)
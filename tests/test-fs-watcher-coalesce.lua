@@ -0,0 +1,63 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local FS = require('fs')
+local Path = require('path')
+local timer = require('timer')
+local Watcher = require('uv').Watcher
+
+local dir = Path.join(__dirname, 'fixtures', 'test-fs-watcher-coalesce')
+local file = Path.join(dir, 'watched.txt')
+
+local ok, err = pcall(FS.mkdirSync, dir, '0777')
+if not ok then
+  assert(err.code == 'EEXIST')
+end
+FS.writeFileSync(file, 'start')
+
+local batches = 0
+local seen = {}
+
+local watcher = Watcher:new(dir, {coalesce = 100})
+watcher:on('changes', function (changes)
+  batches = batches + 1
+  for _, change in ipairs(changes) do
+    local key = change.event .. ':' .. tostring(change.filename)
+    -- Repeats within a window are merged
+    assert(not seen[key])
+    seen[key] = true
+  end
+end)
+
+-- A burst of writes, all inside one window
+for i = 1, 20 do
+  FS.writeFileSync(file, 'edit ' .. i)
+end
+
+timer.setTimeout(500, function ()
+  watcher:close()
+  FS.unlinkSync(file)
+  FS.rmdirSync(dir)
+end)
+
+process:on('exit', function()
+  assert(batches == 1)
+  assert(seen['change:watched.txt'])
+end)
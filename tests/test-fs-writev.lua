@@ -0,0 +1,79 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local FS = require('fs')
+local Path = require('path')
+local string = require('string')
+local table = require('table')
+local Buffer = require('buffer').Buffer
+
+local fn = Path.join(__dirname, 'tmp', 'writev.txt')
+local fn2 = Path.join(__dirname, 'tmp', 'writev2.txt')
+local done = 0
+
+-- A slice of a string, without the substring
+local fd = FS.openSync(fn, 'w', tonumber('0644', 8))
+assert(FS.writeSync(fd, 0, 'hello world', 6, 5) == 5)
+local buffer = Buffer:new('!?')
+assert(FS.writeSync(fd, 5, buffer, 0, 1) == 1)
+assert(not pcall(FS.writeSync, fd, 0, 'short', 3, 5))
+-- Numbers are written as strings, the list is left alone
+local list = {' and ', 'more', Buffer:new(' buffers'), ' ', 42}
+assert(FS.writevSync(fd, 6, list) == 20)
+assert(list[5] == 42)
+FS.closeSync(fd)
+assert(FS.readFileSync(fn) == 'world! and more buffers 42')
+FS.unlinkSync(fn)
+
+-- Lots of chunks in one request, more than fit in a single writev
+local chunks = {}
+for i = 1, 3000 do
+  chunks[i] = string.format('%04d,', i)
+end
+local expected = table.concat(chunks)
+
+FS.open(fn2, 'w', tonumber('0644', 8), function(err, fd)
+  assert(not err)
+  FS.writev(fd, 0, chunks, function(err, written)
+    assert(not err)
+    assert(written == #expected)
+    FS.write(fd, written, expected, 0, 5, function(err, written)
+      assert(not err)
+      assert(written == 5)
+      FS.closeSync(fd)
+      assert(FS.readFileSync(fn2) == expected .. expected:sub(1, 5))
+      FS.unlinkSync(fn2)
+      done = done + 1
+    end)
+  end)
+end)
+
+-- writeFile writes big strings without cutting them up
+local big = string.rep('0123456789', 20000)
+FS.writeFile(fn, big, function(err)
+  assert(not err)
+  assert(FS.readFileSync(fn) == big)
+  FS.unlinkSync(fn)
+  done = done + 1
+end)
+
+process:on('exit', function()
+  assert(done == 2)
+end)
@@ -0,0 +1,58 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local timer = require('timer')
+local uv = require('uv')
+
+uv.loopStatsEnable()
+process.gcSchedule({ sliceMs = 0.5, pause = 120 })
+
+local stats = process.gcStats()
+assert(stats.enabled)
+assert(stats.pause == 120)
+assert(stats.backstop >= 170)
+
+-- Garbage made a tick at a time leaves the collector room between ticks
+local ticks = 0
+local keep
+local interval
+interval = timer.setInterval(1, function ()
+  local garbage = {}
+  for i = 1, 2000 do
+    garbage[i] = { i }
+  end
+  keep = garbage
+  ticks = ticks + 1
+  if ticks == 100 then
+    timer.clearTimer(interval)
+  end
+end)
+
+process:on('exit', function ()
+  local stats = process.gcStats()
+  p(stats)
+  assert(stats.cycles > 0)
+  assert(stats.slices >= stats.cycles)
+  assert(stats.sliceTime.count == stats.slices)
+  assert(uv.loopStats().sources.gc_idle.count == stats.slices)
+  process.gcSchedule(false)
+  assert(not process.gcStats().enabled)
+  assert(keep)
+end)
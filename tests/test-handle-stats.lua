@@ -0,0 +1,75 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local uv = require('uv')
+local net = require('net')
+
+local PORT = process.env.PORT or 10102
+
+uv.handleStatsDebug(true)
+
+local before = uv.handleStats()
+local created = before.handles.tcp and before.handles.tcp.created or 0
+
+local server = net.createServer(function (client)
+  client:on("data", function (chunk)
+    client:write(chunk)
+  end)
+  client:on("end", function ()
+    client:destroy()
+  end)
+end)
+
+server:listen(PORT, "127.0.0.1")
+
+local client
+client = net.createConnection(PORT, "127.0.0.1", function ()
+  client:write("ping")
+end)
+
+client:on("data", function ()
+  local stats = uv.handleStats()
+  p(stats)
+  -- The server, the client and the accepted connection
+  assert(stats.handles.tcp.created - created >= 3)
+  assert(stats.handles.tcp.live >= 3)
+  assert(stats.live >= stats.handles.tcp.live)
+  assert(stats.requests.write >= 0)
+  assert(stats.writeQueueSize >= 0)
+
+  -- The listening socket is active and referenced from Lua
+  local leaks = uv.handleLeaks()
+  local found = false
+  for _, leak in ipairs(leaks) do
+    if leak.type == "tcp" and leak.traceback then
+      found = true
+    end
+  end
+  assert(found)
+
+  client:destroy()
+  server:close()
+end)
+
+process:on('exit', function ()
+  local stats = uv.handleStats()
+  p(stats)
+  assert(stats.handles.tcp.closed - (before.handles.tcp and before.handles.tcp.closed or 0) >= 2)
+end)
@@ -0,0 +1,95 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local http = require('http')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10101
+
+local connections = 0
+local responses = 0
+local reused = false
+
+local server
+server = http.createServer(function (request, response)
+  local body = request.url:sub(2)
+  response:writeHead(200, {
+    ["Content-Type"] = "text/plain",
+    ["Content-Length"] = #body
+  })
+  response:finish(body)
+end)
+server:on('connection', function ()
+  connections = connections + 1
+end)
+
+local agent = http.Agent:new({ keepAlive = true, maxSockets = 1 })
+
+local function get(path, callback)
+  local req = http.request({
+    host = HOST,
+    port = PORT,
+    path = path,
+    agent = agent
+  }, function (response)
+    local body = ""
+    response:on('data', function (chunk)
+      body = body .. chunk
+    end)
+    response:on('end', function ()
+      assert(response.should_keep_alive)
+      callback(body)
+    end)
+  end)
+  req:done()
+end
+
+server:listen(PORT, HOST, function ()
+  -- One connection at a time, the others wait for it to come free
+  local waiting = 3
+  for i = 1, 3 do
+    get("/" .. i, function (body)
+      assert(body == tostring(i))
+      responses = responses + 1
+      waiting = waiting - 1
+      if waiting > 0 then return end
+      -- nextTick lets the connection go back to the pool
+      process.nextTick(function ()
+        local name = agent:getName({ host = HOST, port = PORT })
+        assert(#agent.freeSockets[name] == 1)
+        assert(not agent.requests[name])
+        get("/again", function (body)
+          assert(body == "again")
+          reused = true
+          process.nextTick(function ()
+            agent:destroy()
+            server:close()
+          end)
+        end)
+      end)
+    end)
+  end
+end)
+
+process:on('exit', function ()
+  assert(responses == 3)
+  assert(reused)
+  assert(connections == 1)
+end)
@@ -0,0 +1,111 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local http = require('http')
+local net = require('net')
+local chunkFrame = require('http_parser').chunkFrame
+local Buffer = require('buffer').Buffer
+local stringRep = require('string').rep
+local tableConcat = require('table').concat
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10104
+
+-- Frames are lists for a vectored write, the size line is in hex
+assert(deep_equal({"ff\r\n", stringRep("x", 255), "\r\n"}, chunkFrame(stringRep("x", 255))))
+assert(deep_equal({"5\r\n", "ab", "cde", "\r\n"}, chunkFrame({"ab", "cde"})))
+assert(deep_equal({"2\r\n", "ab", "\r\n", "0\r\n", "X: 1\r\n", "\r\n"},
+  chunkFrame("ab", true, "X: 1\r\n")))
+-- Empty chunks would end the body, they are left out
+assert(deep_equal({}, chunkFrame({})))
+assert(deep_equal({"0\r\n", "\r\n"}, chunkFrame("", true)))
+
+local big = stringRep("B", 10000)
+local callbacks = 0
+
+local server
+server = http.createServer(function (request, response)
+  response:writeHead(200, {["Content-Type"] = "text/plain"})
+  -- These are held back and sent as a single chunk
+  for i = 1, 100 do
+    response:write("line " .. i .. "\n", function ()
+      callbacks = callbacks + 1
+    end)
+  end
+  -- A big one follows whatever is still held back in the same chunk
+  response:write(big)
+  response:write("tail\n")
+  -- Held back Buffers are copied, reusing one doesn't change what was written
+  local reused = Buffer:new("buf\n")
+  response:write(reused)
+  reused:fill("X")
+  response:finish("end\n")
+end)
+
+server:listen(PORT, HOST, function ()
+  local received = {}
+  local client
+  client = net.createConnection(PORT, HOST, function ()
+    client:write("GET / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+  end)
+  client:on("data", function (chunk)
+    received[#received + 1] = chunk
+  end)
+  client:on("end", function ()
+    local raw = tableConcat(received)
+    local start = raw:find("\r\n\r\n", 1, true)
+    assert(raw:sub(1, start):find("Transfer-Encoding: chunked", 1, true))
+
+    -- Decode the body by hand, counting the chunks
+    local body = {}
+    local chunks = 0
+    local pos = start + 4
+    while true do
+      local size, after = raw:match("^(%x+)\r\n()", pos)
+      assert(size, "bad chunk at " .. pos)
+      size = tonumber(size, 16)
+      if size == 0 then
+        assert(raw:sub(after) == "\r\n")
+        break
+      end
+      body[#body + 1] = raw:sub(after, after + size - 1)
+      assert(raw:sub(after + size, after + size + 1) == "\r\n")
+      pos = after + size + 2
+      chunks = chunks + 1
+    end
+
+    local expected = {}
+    for i = 1, 100 do
+      expected[i] = "line " .. i .. "\n"
+    end
+    expected[#expected + 1] = big
+    expected[#expected + 1] = "tail\nbuf\nend\n"
+    p(chunks, #raw)
+    assert(tableConcat(body) == tableConcat(expected))
+    -- One chunk for everything up to the big write, one for the rest
+    assert(chunks == 2)
+    client:destroy()
+    server:close()
+  end)
+end)
+
+process:on('exit', function ()
+  assert(callbacks == 100)
+end)
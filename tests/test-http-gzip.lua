@@ -0,0 +1,57 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local http = require('http')
+local Zlib = require('zlib_native')
+local table = require('table')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10090
+
+local body = string.rep("compress me ", 1000)
+
+local server
+server = http.createServer(function (request, response)
+  response:setHeader("Content-Type", "text/plain")
+  local out = response:gzip()
+  out:write(body:sub(1, 100))
+  out:finish(body:sub(101))
+end)
+
+server:listen(PORT, HOST, function ()
+  http.request({
+    host = HOST,
+    port = PORT,
+    path = "/",
+    headers = { ["Accept-Encoding"] = "gzip, deflate" }
+  }, function (response)
+    assert(response.headers["content-encoding"] == "gzip")
+    local chunks = {}
+    response:on('data', function (chunk)
+      chunks[#chunks + 1] = chunk
+    end)
+    response:on('end', function ()
+      local gzipped = table.concat(chunks)
+      assert(#gzipped < #body)
+      assert(Zlib.new('inflate'):write(gzipped, "finish") == body)
+      server:close()
+    end)
+  end):done()
+end)
@@ -0,0 +1,80 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local http = require('http')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10088
+
+assert(http.date():match("^%a%a%a, %d%d %a%a%a %d%d%d%d %d%d:%d%d:%d%d GMT$"))
+
+local cors = http.HeaderBlock:new({
+  ["Access-Control-Allow-Origin"] = "*",
+  Server = "Test"
+})
+local extra = http.HeaderBlock:new({{"X-Extra", "1"}})
+
+-- Headers the response sets itself aren't repeated from the server's blocks
+local head
+do
+  local Emitter = require('core').Emitter
+  local response = http.Response:new(Emitter:new())
+  response.server_header_blocks = {cors}
+  response:setHeader("server", "Mine")
+  response:setHeader("Date", "Thu, 01 Jan 1970 00:00:00 GMT")
+  response:setHeader("Content-Type", "text/plain")
+  head = response:_serializeHead()
+end
+p(head)
+local function count(name)
+  local n = 0
+  for _ in head:lower():gmatch("\r\n" .. name .. ":") do n = n + 1 end
+  return n
+end
+assert(count("server") == 1)
+assert(count("date") == 1)
+assert(head:find("server: Mine", 1, true))
+assert(head:find("Access-Control-Allow-Origin: *", 1, true))
+-- The Content-Type header implies a body, which gets chunked framing
+assert(count("transfer%-encoding") == 1)
+
+local server
+server = http.createServer(function (request, response)
+  response:addHeaderBlock(extra)
+  response:finish("Hello")
+end)
+server.headerBlocks = {cors}
+
+server:listen(PORT, HOST, function ()
+  http.get({
+    host = HOST,
+    port = PORT,
+    path = "/"
+  }, function (response)
+    p(response.headers)
+    assert(response.headers["access-control-allow-origin"] == "*")
+    assert(response.headers["x-extra"] == "1")
+    -- The block's Server header replaces the automatic one
+    assert(response.headers.server == "Test")
+    assert(response.headers.date)
+    server:close()
+    process.exit()
+  end)
+end)
@@ -0,0 +1,116 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local HttpParser = require('http_parser')
+
+-- Split in the middle of a field and of a value to exercise joining
+local packets = {
+  "GET /path HTTP/1.1\r\nHo",
+  "st: example.com\r\nX-Custom-Hea",
+  "der: some val",
+  "ue\r\nEmpty:\r\n\r\n",
+}
+
+local function parse(mode)
+  local info
+  local parser = HttpParser.new("request", {
+    onHeaderField = function ()
+      error("onHeaderField should not be called in " .. mode .. " mode")
+    end,
+    onHeadersComplete = function (i)
+      info = i
+    end
+  }, mode)
+  for _, packet in ipairs(packets) do
+    assert(parser:execute(packet, 0, #packet) == #packet)
+  end
+  return info
+end
+
+local map = parse("map")
+p(map.headers)
+assert(map.method == "GET")
+assert(map.headers.host == "example.com")
+assert(map.headers["x-custom-header"] == "some value")
+assert(map.headers.empty == "")
+
+-- An empty header in the middle, followed by a field split across packets
+packets = {
+  "GET / HTTP/1.1\r\nX-Empty:\r\nX-Af",
+  "ter: 1\r\nX-Blank: \r\nX-Last: 2\r\n\r\n",
+}
+local middle = parse("map")
+p(middle.headers)
+assert(middle.headers["x-empty"] == "")
+assert(middle.headers["x-after"] == "1")
+assert(middle.headers["x-blank"] == "")
+assert(middle.headers["x-last"] == "2")
+local middleArray = parse("array")
+assert(#middleArray.headers == 8)
+assert(middleArray.headers[1] == "X-Empty")
+assert(middleArray.headers[2] == "")
+assert(middleArray.headers[3] == "X-After")
+assert(middleArray.headers[4] == "1")
+assert(middleArray.headers[5] == "X-Blank")
+assert(middleArray.headers[7] == "X-Last")
+
+packets = {
+  "GET /path HTTP/1.1\r\nHo",
+  "st: example.com\r\nX-Custom-Hea",
+  "der: some val",
+  "ue\r\nEmpty:\r\n\r\n",
+}
+
+local array = parse("array")
+p(array.headers)
+assert(#array.headers == 6)
+assert(array.headers[1] == "Host")
+assert(array.headers[2] == "example.com")
+assert(array.headers[3] == "X-Custom-Header")
+assert(array.headers[4] == "some value")
+assert(array.headers[5] == "Empty")
+assert(array.headers[6] == "")
+
+-- The default still reports every fragment through the callbacks
+local fields = {}
+local parser = HttpParser.new("request", {
+  onHeaderField = function (field)
+    fields[#fields + 1] = field
+  end
+})
+for _, packet in ipairs(packets) do
+  parser:execute(packet, 0, #packet)
+end
+assert(fields[1] == "Ho")
+assert(fields[2] == "st")
+
+-- Callbacks are resolved up front, reinitialize picks up changes
+local urls = {}
+local callbacks = {}
+parser = HttpParser.new("request", callbacks)
+callbacks.onUrl = function (url)
+  urls[#urls + 1] = url
+end
+local request = "GET /first HTTP/1.1\r\n\r\n"
+parser:execute(request, 0, #request)
+assert(#urls == 0)
+parser:reinitialize("request")
+parser:execute(request, 0, #request)
+assert(urls[1] == "/first")
@@ -0,0 +1,84 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local http = require('http')
+local net = require('net')
+local timer = require('timer')
+local table = require('table')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10088
+
+local answering = 0
+local mostAnswering = 0
+local handled = 0
+
+local server
+server = http.createServer(function (request, response)
+  answering = answering + 1
+  handled = handled + 1
+  if answering > mostAnswering then
+    mostAnswering = answering
+  end
+  local body = request.url:sub(2)
+  timer.setTimeout(10, function ()
+    answering = answering - 1
+    response:writeHead(200, {
+      ["Content-Type"] = "text/plain",
+      ["Content-Length"] = #body
+    })
+    response:finish(body)
+  end)
+end)
+server.maxPipelined = 2
+
+server:listen(PORT, HOST, function ()
+  local received = ""
+  local client
+  client = net.createConnection(PORT, HOST, function ()
+    -- More requests than the limit, all in the same packet
+    local requests = {}
+    for i = 1, 5 do
+      local close = i == 5 and "Connection: close\r\n" or ""
+      requests[i] = "GET /r" .. i .. " HTTP/1.1\r\nHost: test\r\n" .. close .. "\r\n"
+    end
+    client:write(table.concat(requests))
+  end)
+  client:on("data", function (chunk)
+    received = received .. chunk
+  end)
+  client:on("end", function ()
+    p(received)
+    local last = 0
+    for i = 1, 5 do
+      local at = received:find("\r\n\r\nr" .. i, 1, true)
+      assert(at and at > last)
+      last = at
+    end
+    client:destroy()
+    server:close()
+  end)
+end)
+
+process:on('exit', function ()
+  assert(handled == 5)
+  -- The requests past the limit waited, though they came in the same read
+  assert(mostAnswering == 2)
+end)
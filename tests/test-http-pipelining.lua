@@ -0,0 +1,68 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local http = require('http')
+local net = require('net')
+local timer = require('timer')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10087
+
+local server
+server = http.createServer(function (request, response)
+  local body = request.url:sub(2)
+  local headers = {
+    ["Content-Type"] = "text/plain",
+    ["Content-Length"] = #body
+  }
+  if request.url == "/slow" then
+    -- Finishes after the second request was answered by the handler
+    timer.setTimeout(50, function ()
+      response:writeHead(200, headers)
+      response:finish(body)
+    end)
+  else
+    response:writeHead(200, headers)
+    response:finish(body)
+  end
+end)
+
+server:listen(PORT, HOST, function ()
+  local received = ""
+  local client
+  client = net.createConnection(PORT, HOST, function ()
+    -- Both requests go out in the same packet
+    client:write("GET /slow HTTP/1.1\r\nHost: test\r\n\r\n" ..
+                 "GET /fast HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+  end)
+  client:on("data", function (chunk)
+    received = received .. chunk
+  end)
+  client:on("end", function ()
+    p(received)
+    local slow = received:find("\r\n\r\nslow", 1, true)
+    local fast = received:find("\r\n\r\nfast", 1, true)
+    assert(slow and fast)
+    -- Responses come back in request order
+    assert(slow < fast)
+    client:destroy()
+    server:close()
+  end)
+end)
@@ -0,0 +1,106 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local http = require('http')
+local net = require('net')
+local fs = require('fs')
+local Path = require('path')
+local Zlib = require('zlib_native')
+local filecache = require('filecache')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10091
+
+local body = string.rep("compress me please\n", 200)
+local filepath = Path.join(__dirname, 'tmp', 'compressed.txt')
+local sidecar = filepath .. ".gz"
+fs.writeFileSync(filepath, body)
+pcall(fs.unlinkSync, sidecar)
+
+local cache = filecache.FileCache:new()
+local compressed = filecache.CompressedCache:new()
+
+-- The same body compressed outside the cache is what a client inflates
+local data = Zlib.new('deflate', 9, 31):write(body, "finish")
+assert(Zlib.new('inflate'):write(data, "finish") == body)
+
+local server
+server = http.createServer(function (request, response)
+  response:sendFile(filepath, {cache = cache, compressed = compressed})
+end)
+
+local function request(encoding, callback)
+  local received = ""
+  local client
+  client = net.createConnection(PORT, HOST, function ()
+    client:write("GET / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n" ..
+                 "Accept-Encoding: " .. encoding .. "\r\n\r\n")
+  end)
+  client:on("data", function (chunk)
+    received = received .. chunk
+  end)
+  client:on("end", function ()
+    client:destroy()
+    local split = received:find("\r\n\r\n", 1, true)
+    callback(received:sub(1, split), received:sub(split + 4))
+  end)
+end
+
+server:listen(PORT, HOST, function ()
+  request("deflate;q=0.5, gzip", function (head, payload)
+    p(head)
+    assert(head:find("Content-Encoding: gzip", 1, true))
+    assert(head:find("Vary: Accept-Encoding", 1, true))
+    assert(head:find("Content-Length: " .. #payload, 1, true))
+    assert(Zlib.new('inflate'):write(payload, "finish") == body)
+    assert(compressed.misses == 1)
+
+    request("gzip;q=0, identity", function (head, payload)
+      assert(not head:find("Content-Encoding", 1, true))
+      assert(payload == body)
+
+      -- identity weighted above gzip goes out uncompressed
+      request("gzip;q=0.1, identity;q=1", function (head, payload)
+        assert(not head:find("Content-Encoding", 1, true))
+        assert(payload == body)
+
+        -- gzip;q=0 isn't brought back by the wildcard
+        request("gzip;q=0, *", function (head, payload)
+          assert(head:find("Content-Encoding: deflate", 1, true))
+          assert(Zlib.new('inflate'):write(payload, "finish") == body)
+          assert(compressed.misses == 2)
+
+          -- A precompressed file next to the original is served as is
+          for key in pairs(compressed.entries) do compressed:remove(key) end
+          fs.writeFileSync(sidecar, "not really gzip")
+          request("gzip", function (head, payload)
+            assert(head:find("Content-Encoding: gzip", 1, true))
+            assert(payload == "not really gzip")
+            assert(compressed.misses == 3)
+            server:close()
+            cache:clear()
+            fs.unlinkSync(sidecar)
+            fs.unlinkSync(filepath)
+          end)
+        end)
+      end)
+    end)
+  end)
+end)
@@ -0,0 +1,82 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local http = require('http')
+local net = require('net')
+local Path = require('path')
+local filecache = require('filecache')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10089
+
+local filepath = Path.join(__dirname, 'fixtures', 'x.txt')
+local cache = filecache.FileCache:new({max = 4})
+
+local server
+server = http.createServer(function (request, response)
+  if request.url == "/missing" then
+    return response:sendFile(filepath .. ".missing", {cache = cache})
+  end
+  response:sendFile(filepath, {cache = cache, contentType = "text/plain"})
+end)
+
+cache:open(filepath, function (err, entry)
+  assert(not err)
+  local etag = entry.etag
+  cache:release(entry)
+
+  server:listen(PORT, HOST, function ()
+    local received = ""
+    local client
+    client = net.createConnection(PORT, HOST, function ()
+      -- The first response goes out with sendfile, the held ones are read
+      client:write("GET / HTTP/1.1\r\nHost: test\r\n\r\n" ..
+                   "GET / HTTP/1.1\r\nHost: test\r\nRange: bytes=1-2\r\n\r\n" ..
+                   "GET / HTTP/1.1\r\nHost: test\r\nIf-None-Match: " .. etag .. "\r\n\r\n" ..
+                   "GET / HTTP/1.1\r\nHost: test\r\nRange: bytes=9-\r\n\r\n" ..
+                   "GET /missing HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+    end)
+    client:on("data", function (chunk)
+      received = received .. chunk
+    end)
+    client:on("end", function ()
+      p(received)
+      local full = received:find("HTTP/1.1 200 OK", 1, true)
+      local partial = received:find("HTTP/1.1 206 Partial Content", 1, true)
+      local notModified = received:find("HTTP/1.1 304 Not Modified", 1, true)
+      local unsatisfiable = received:find("HTTP/1.1 416", 1, true)
+      local missing = received:find("HTTP/1.1 404 Not Found", 1, true)
+      assert(full and partial and notModified and unsatisfiable and missing)
+      assert(full < partial and partial < notModified)
+      assert(notModified < unsatisfiable and unsatisfiable < missing)
+      assert(received:find("ETag: " .. etag, 1, true))
+      assert(received:find("Content-Type: text/plain", 1, true))
+      assert(received:find("\r\n\r\nxyz\n", 1, true))
+      assert(received:find("Content-Range: bytes 1-2/4\r\n", 1, true))
+      assert(received:find("\r\n\r\nyz", 1, true))
+      assert(received:find("Content-Range: bytes */4\r\n", 1, true))
+      -- The fixture was opened once, the missing file isn't cached
+      assert(cache.misses == 2)
+      client:destroy()
+      server:close()
+      cache:clear()
+    end)
+  end)
+end)
@@ -0,0 +1,75 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require('helper')
+
+local JSON = require('json')
+
+-- Feeds text one byte at a time and collects what comes out
+local function decode(text, options)
+  local values, keys = {}, {}
+  local decoder = JSON.streamingDecoder(function (value, key)
+    values[#values + 1] = value
+    keys[#keys + 1] = key == nil and false or key
+  end, options)
+  for i = 1, #text do
+    decoder:parse(text:sub(i, i))
+  end
+  decoder:complete()
+  return values, keys
+end
+
+-- newline delimited documents
+local values = decode('{"a":1,"b":[1,2]}\n{"a":2}\n"three"\n')
+assert(#values == 3)
+assert(deep_equal(values[1], {a = 1, b = {1, 2}}))
+assert(deep_equal(values[2], {a = 2}))
+assert(values[3] == "three")
+
+-- path selection, other subtrees are skipped
+local doc = '{"meta":{"events":[9]},"events":[{"id":1},{"id":2,"tags":["x"]},3],"n":1}'
+local keys
+values, keys = decode(doc, {path = {"events", "*"}})
+assert(#values == 3)
+assert(deep_equal(values[1], {id = 1}))
+assert(deep_equal(values[2], {id = 2, tags = {"x"}}))
+assert(values[3] == 3)
+assert(deep_equal(keys, {1, 2, 3}))
+
+values = decode(doc .. doc, {path = {"events", 2, "id"}})
+assert(deep_equal(values, {2, 2}))
+
+values, keys = decode('{"a":{"x":1},"b":{"x":2}}', {path = {"*", "x"}})
+assert(deep_equal(values, {1, 2}))
+assert(deep_equal(keys, {"x", "x"}))
+
+-- elements of a top level array
+values = decode('[1,[2],{"c":null}]', {path = {"*"}, use_null = true})
+assert(values[1] == 1)
+assert(deep_equal(values[2], {2}))
+assert(values[3].c == JSON.null)
+
+-- errors in the callback come out of parse
+local decoder = JSON.streamingDecoder(function ()
+  error("stop")
+end)
+local status, result = pcall(decoder.parse, decoder, '1 ')
+assert(not status and result:find("stop"))
+
+status, result = pcall(decode, '{"a":]')
+assert(not status and result:find("parse error"))
@@ -117,3 +117,56 @@ end
 --
 -- TODO: multivalue?
 --
+
+--
+-- decode
+--
+
+local Yajl = require('yajl')
+
+assert(deep_equal(JSON.parse('{"a":[1,2,{"b":true}],"c":"d"}'),
+  {a = {1, 2, {b = true}}, c = 'd'}))
+-- nulls are left out unless a sentinel is given
+assert(deep_equal(JSON.parse('[1,null,2]'), {1, 2}))
+assert(deep_equal(JSON.parse('{"a":null,"b":1}'), {b = 1}))
+local nulls = JSON.parse('[1,null,{"a":null}]', {use_null = true})
+assert(nulls[2] == JSON.null and nulls[3].a == JSON.null)
+local sentinel = {}
+assert(Yajl.decode('[null]', {null = sentinel})[1] == sentinel)
+
+local arrayMeta, objectMeta = {}, {}
+local value = Yajl.decode('{"list":[[]]}', {array_mt = arrayMeta, object_mt = objectMeta})
+assert(getmetatable(value) == objectMeta)
+assert(getmetatable(value.list) == arrayMeta)
+assert(getmetatable(value.list[1]) == arrayMeta)
+
+-- parser flags pass through
+local a, b = Yajl.decode('1 [2]', {allow_multiple_values = true})
+assert(a == 1 and deep_equal(b, {2}))
+assert(Yajl.decode('/* hi */ 3', {allow_comments = true}) == 3)
+assert(not pcall(Yajl.decode, '/* hi */ 3'))
+
+--
+-- encode
+--
+
+assert(JSON.stringify({1, 2, {a = false}}) == '[1,2,{"a":false}]')
+assert(JSON.stringify({[1] = 1, [3] = 3}) == '{"1":1,"3":3}')
+assert(JSON.stringify({1, JSON.null, 3}) == '[1,null,3]')
+assert(JSON.stringify({0.5, 1e100}) == '[0.5,1e+100]')
+local marker = {}
+assert(JSON.stringify({marker}, {null = marker}) == '[null]')
+assert(JSON.stringify({a = 1}, {beautify = true, indent_string = '\t'}):find('{\n\t"a": 1\n}', 1, true))
+-- cycles are caught
+local cyclic = {}
+cyclic.self = cyclic
+local status, result = pcall(JSON.stringify, cyclic)
+assert(not status and result:find('cyclic'))
+-- JSON has no inf or nan
+status, result = pcall(JSON.stringify, {1 / 0})
+assert(not status and result:find('invalid number'))
+assert(not pcall(JSON.stringify, {-1 / 0}))
+assert(not pcall(JSON.stringify, {0 / 0}))
+-- the shared generator recovers from errors
+assert(not pcall(JSON.stringify, {f = function () end}))
+assert(JSON.stringify({a = 'a'}) == '{"a":"a"}')
@@ -0,0 +1,99 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local FS = require('fs')
+local Path = require('path')
+local LogStream = require('uv').LogStream
+local Buffer = require('buffer').Buffer
+local tableConcat = require('table').concat
+
+local fn = Path.join(__dirname, 'tmp', 'log-stream.txt')
+local fd = FS.openSync(fn, 'w')
+
+-- Lines written together go out as one batch
+local log = LogStream:new(fd, { interval = 1 })
+local lines = {}
+for i = 1, 100 do
+  lines[i] = "line " .. i .. "\n"
+  assert(log:write(lines[i]) == true)
+end
+assert(log:write(Buffer:new("buffer\n")) == true)
+lines[#lines + 1] = "buffer\n"
+
+-- A full queue drops with the drop policy
+local small = LogStream:new(fd, { maxBytes = 8, policy = "drop" })
+local dropErr
+assert(small:write("12345678") == true)
+assert(small:write("x", function (err) dropErr = err end) == false)
+assert(dropErr.code == "ENOBUFS")
+local stats = small:stats()
+assert(stats.dropped == 1 and stats.droppedBytes == 1)
+assert(stats.queued == 8)
+small:close()
+
+-- and is written out on the spot with the block policy
+local blocking = LogStream:new(fd, { maxBytes = 8, policy = "block" })
+assert(blocking:write("abcd") == true)
+assert(blocking:write("efghijk") == true)
+stats = blocking:stats()
+assert(stats.syncWrites == 1 and stats.queued == 0 and stats.dropped == 0)
+assert(stats.written == 11)
+blocking:close()
+
+-- At exit an outstanding write is taken over, libuv still had "def" of it
+local fn2 = Path.join(__dirname, 'tmp', 'log-stream-exit.txt')
+local fd2 = FS.openSync(fn2, 'w')
+local stuck = LogStream:new(fd2, {
+  handle = {
+    write = function () end,
+    writeQueueSize = function () return 3 end
+  }
+})
+local stuckErr = 0
+stuck:write("abcdef", function (err) stuckErr = stuckErr + (err and 10 or 1) end)
+stuck:_flush()
+stuck:write("gh", function (err) stuckErr = stuckErr + (err and 10 or 1) end)
+stuck:flushSync()
+assert(stuck:stats().syncWrites == 0)
+stuck:flushSync(true)
+stats = stuck:stats()
+assert(stats.syncWrites == 1 and stats.written == 8 and stuckErr == 2)
+FS.closeSync(fd2)
+assert(FS.readFileSync(fn2) == "defgh")
+FS.unlinkSync(fn2)
+
+local written = false
+log:write("last\n", function (err)
+  assert(not err)
+  written = true
+  lines[#lines + 1] = "last\n"
+  local stats = log:stats()
+  p(stats)
+  assert(stats.batches < 10)
+  assert(stats.dropped == 0 and stats.queued == 0)
+  log:close()
+  FS.closeSync(fd)
+end)
+
+process:on('exit', function ()
+  assert(written)
+  local data = FS.readFileSync(fn)
+  assert(data == "12345678abcdefghijk" .. tableConcat(lines))
+end)
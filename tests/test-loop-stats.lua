@@ -0,0 +1,55 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local uv = require('uv')
+local native = require('uv_native')
+local timer = require('timer')
+
+local stats
+
+uv.loopStatsEnable()
+uv.loopStatsReset()
+
+-- A timer callback that blocks the loop for a while
+timer.setTimeout(10, function ()
+  local start = native.hrtime()
+  while native.hrtime() - start < 30 do
+  end
+  timer.setTimeout(10, function ()
+    stats = uv.loopStats()
+    uv.loopStatsEnable(false)
+  end)
+end)
+
+process:on('exit', function ()
+  p(stats)
+  assert(stats.enabled)
+  assert(not uv.loopStats().enabled)
+  assert(stats.iterations >= 2)
+  assert(stats.elapsed >= 40)
+  -- The busy callback held the loop up
+  assert(stats.lag.max >= 25)
+  assert(stats.lag.count == stats.iterations)
+  -- timer.setTimeout runs on the timing wheel
+  local timeouts = stats.sources.on_wheel_timer
+  assert(timeouts and timeouts.count >= 1)
+  assert(timeouts.max >= 25)
+  assert(timeouts.p50 <= timeouts.max)
+end)
@@ -0,0 +1,62 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local usage = process.memoryUsage()
+p(usage)
+assert(usage.heapUsed > 0)
+assert(usage.heapPeak >= usage.heapUsed)
+assert(usage.rss == nil or usage.rss >= usage.heapUsed)
+
+-- Allocating shows up in the live count and the peak
+local data = {}
+for i = 1, 10000 do
+  data[i] = { i, tostring(i) }
+end
+local grown = process.memoryUsage()
+assert(grown.heapUsed > usage.heapUsed)
+assert(grown.heapPeak >= grown.heapUsed)
+data = nil
+collectgarbage()
+collectgarbage()
+local collected = process.memoryUsage()
+assert(collected.heapUsed < grown.heapUsed)
+assert(collected.heapPeak >= grown.heapUsed)
+
+-- Growing past the limit is an error that pcall catches
+process.setMemoryLimit(collected.heapUsed + 1024 * 1024)
+local ok, err = pcall(function ()
+  local hog = {}
+  for i = 1, 1e7 do
+    hog[i] = { i }
+  end
+end)
+process.setMemoryLimit(0)
+p(ok, err)
+assert(not ok)
+assert(tostring(err):find("memory"))
+assert(process.memoryUsage().refused > 0)
+
+-- Things work again once the memory is released
+collectgarbage()
+local after = {}
+for i = 1, 1000 do
+  after[i] = { i }
+end
+assert(#after == 1000)
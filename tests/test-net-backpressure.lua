@@ -0,0 +1,74 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+require("helper")
+
+local net = require('net')
+local timer = require('timer')
+local string = require('string')
+
+local PORT = process.env.PORT or 10099
+
+local CHUNK = string.rep("x", 64 * 1024)
+local received = 0
+local written = 0
+local drained = false
+
+local server
+server = net.createServer(function (client)
+  -- Don't read until the writer is backed up
+  client:pause()
+  timer.setTimeout(100, function ()
+    client:resume()
+  end)
+  client:on('data', function (chunk)
+    received = received + #chunk
+  end)
+  client:on('end', function ()
+    server:close()
+  end)
+end)
+
+server:listen(PORT, "127.0.0.1", function ()
+  local socket
+  socket = net.createConnection(PORT, "127.0.0.1", function ()
+    socket:setWaterMarks(256 * 1024, 32 * 1024)
+    -- The kernel takes some, then the queue fills up to the high mark
+    local ok = true
+    while ok and written < 256 * 1024 * 1024 do
+      ok = socket:write(CHUNK)
+      written = written + #CHUNK
+    end
+    assert(ok == false)
+    assert(socket._handle:writeQueueSize() >= 256 * 1024)
+  end)
+  socket:on('drain', function ()
+    assert(not drained)
+    assert(socket._handle:writeQueueSize() <= 32 * 1024)
+    drained = true
+    socket:done()
+  end)
+  socket:on('error', function (err)
+    p(err)
+    assert(false)
+  end)
+end)
+
+process:on('exit', function ()
+  assert(drained)
+  assert(received == written)
+end)
@@ -0,0 +1,54 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local net = require('net')
+local instanceof = require('core').instanceof
+local Buffer = require('buffer').Buffer
+
+local PORT = process.env.PORT or 10084
+
+local server = net.createServer({buffer = true}, function (client)
+  client:on("data", function (chunk)
+    assert(instanceof(chunk, Buffer))
+    assert(chunk.length == 4)
+    assert(chunk:toString() == "ping")
+    client:write("pong", function ()
+      client:destroy()
+    end)
+  end)
+end)
+
+server:listen(PORT, "127.0.0.1")
+
+local client
+client = net.createConnection(PORT, "127.0.0.1", function ()
+  client:setBufferMode(true)
+  client:write("ping")
+end)
+
+client:on("data", function (chunk)
+  p('client:on("data")', chunk.length)
+  assert(instanceof(chunk, Buffer))
+  assert(#chunk == 4)
+  assert(chunk:toString() == "pong")
+  assert(client.bytesRead == 4)
+  client:destroy()
+  server:close()
+end)
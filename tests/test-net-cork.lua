@@ -0,0 +1,84 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+require("helper")
+
+local net = require('net')
+local timer = require('timer')
+local table = require('table')
+
+local PORT = process.env.PORT or 10100
+
+local chunks = {}
+local callbacks = 0
+
+local server
+server = net.createServer(function (client)
+  client:on('data', function (chunk)
+    chunks[#chunks + 1] = chunk
+    -- Nothing else wakes the loop for the write made from the timer, the
+    -- flush alone has to get it here
+    if table.concat(chunks) == "abc1234567890xyz" then
+      client:destroy()
+      server:close()
+    end
+  end)
+end)
+
+server:listen(PORT, "127.0.0.1", function ()
+  local socket
+  socket = net.createConnection(PORT, "127.0.0.1", function ()
+    local function counted()
+      callbacks = callbacks + 1
+    end
+
+    -- Manual corks hold everything until the last uncork
+    socket:cork()
+    socket:cork()
+    socket:write("a", counted)
+    socket:write({"b", "c"}, counted)
+    socket:uncork()
+    assert(socket._corkQueue ~= nil)
+    socket:uncork()
+    assert(socket._corkQueue == nil)
+
+    -- Auto cork gathers what this iteration writes
+    socket:setAutoCork(true)
+    for i = 1, 10 do
+      socket:write(tostring(i % 10), counted)
+    end
+    assert(#socket._corkQueue == 10)
+
+    -- Writes from a timer are flushed without waiting for other I/O
+    timer.setTimeout(1, function ()
+      socket:write("xyz", counted)
+      assert(#socket._corkQueue == 1)
+    end)
+  end)
+  socket:on('end', function ()
+    socket:destroy()
+  end)
+  socket:on('error', function (err)
+    p(err)
+    assert(false)
+  end)
+end)
+
+process:on('exit', function ()
+  assert(table.concat(chunks) == "abc1234567890xyz")
+  assert(callbacks == 13)
+end)
@@ -0,0 +1,73 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+local net = require('net')
+local dns = require('dns')
+
+local PORT = process.env.PORT or 10093
+local HOST = '127.0.0.1'
+
+-- Answer from a fake DNS: an IPv6 address nothing listens on and the
+-- server's IPv4 address
+local resolve4, resolve6 = dns.resolve4, dns.resolve6
+dns.resolve6 = function (domain, callback)
+  assert(domain == 'dual.example')
+  callback(nil, { '100::1' })
+end
+dns.resolve4 = function (domain, callback)
+  assert(domain == 'dual.example')
+  callback(nil, { HOST })
+end
+
+local connected = false
+
+local server = net.createServer(function (client)
+  client:on('data', function (chunk)
+    client:write(chunk)
+  end)
+  client:on('end', function ()
+    client:destroy()
+  end)
+end)
+
+server:listen(PORT, HOST, function ()
+  local client
+  client = net.createConnection({
+    port = PORT,
+    host = 'dual.example',
+    happyEyeballs = true,
+    connectionAttemptDelay = 50
+  }, function ()
+    dns.resolve4, dns.resolve6 = resolve4, resolve6
+    connected = true
+    -- The IPv4 attempt won
+    assert(client.remoteAddress == HOST)
+    assert(client.remoteFamily == 4)
+    client:on('data', function (data)
+      assert(data == 'hello')
+      client:destroy()
+      server:close()
+    end)
+    client:write('hello')
+  end)
+end)
+
+process:on('exit', function ()
+  assert(connected)
+end)
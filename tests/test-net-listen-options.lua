@@ -0,0 +1,72 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+require("helper")
+
+local net = require('net')
+
+local PORT = process.env.PORT or 10097
+
+local served = 0
+local function onConnection(client)
+  client:on('data', function (chunk)
+    assert(chunk == "ping")
+    served = served + 1
+    client:write("pong", function ()
+      client:destroy()
+    end)
+  end)
+end
+
+-- With SO_REUSEPORT both servers get the port, the kernel picks one per
+-- connection
+local first = net.createServer(onConnection)
+first:listen(PORT, "127.0.0.1", { reuseport = true, backlog = 16 })
+local second = net.createServer(onConnection)
+second:listen(PORT, "127.0.0.1", { reuseport = true, deferAccept = 1 })
+
+local replies = 0
+local function connect(callback)
+  local client
+  client = net.createConnection(PORT, "127.0.0.1", function ()
+    client:write("ping")
+  end)
+  client:on('data', function (chunk)
+    assert(chunk == "pong")
+    replies = replies + 1
+  end)
+  client:on('end', function ()
+    client:destroy()
+    callback()
+  end)
+  client:on('error', function (err)
+    p(err)
+    assert(false)
+  end)
+end
+
+connect(function ()
+  connect(function ()
+    first:close()
+    second:close()
+  end)
+end)
+
+process:on('exit', function ()
+  assert(served == 2)
+  assert(replies == 2)
+end)
@@ -0,0 +1,58 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local net = require('net')
+local Buffer = require('buffer').Buffer
+
+local PORT = process.env.PORT or 10085
+
+local tail = Buffer:new(4)
+tail[1], tail[2], tail[3], tail[4] = 116, 97, 105, 108 -- "tail"
+
+local expected = "head\r\nbodytail"
+local writeDone = false
+
+local server = net.createServer(function (client)
+  local received = ""
+  client:on("data", function (chunk)
+    received = received .. chunk
+    if #received < #expected then
+      return
+    end
+    assert(received == expected)
+    client:destroy()
+    server:close()
+  end)
+end)
+
+server:listen(PORT, "127.0.0.1")
+
+local client
+client = net.createConnection(PORT, "127.0.0.1", function ()
+  client:write({"head\r\n", "body", tail}, function ()
+    writeDone = true
+    client:destroy()
+  end)
+  assert(client.bytesWritten == #expected)
+end)
+
+process:on('exit', function ()
+  assert(writeDone)
+end)
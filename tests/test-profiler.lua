@@ -0,0 +1,58 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local profiler = require('profiler')
+local native = require('uv_native')
+local jit = require('jit')
+
+local output, samples
+
+local function spin(ms)
+  local start = native.hrtime()
+  local n = 0
+  while native.hrtime() - start < ms do
+    n = n + 1
+  end
+  return n
+end
+
+local function busyFunction()
+  -- Not a tail call, so the frame stays on the stack
+  local n = spin(200)
+  return n
+end
+
+-- Compiled traces don't run hooks
+jit.off()
+profiler.start({ interval = 1 })
+assert(profiler.isRunning())
+busyFunction()
+profiler.stop()
+jit.on()
+
+output, samples = profiler.collapsed()
+
+process:on('exit', function ()
+  p(output, samples)
+  assert(not profiler.isRunning())
+  assert(samples > 0)
+  -- Lines are root first stacks and a count
+  assert(output:find("busyFunction [^;\n]*;spin [^\n]* %d+\n"))
+end)
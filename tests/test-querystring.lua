@@ -18,6 +18,7 @@ limitations under the License.
 
 require('helper')
 
+local string = require('string')
 local parse = require('querystring').parse
 
 -- Basic code coverage
@@ -36,3 +37,26 @@ for input, output in pairs(tests) do
     error("Test failed " .. input[1])
   end
 end
+
+-- Repeated keys collect their values in order
+assert(deep_equal(parse('a=1&b=2&a=3&a=4'), {a = {'1', '3', '4'}, b = '2'}))
+assert(deep_equal(parse('&&a=&=x&&'), {a = '', [''] = 'x'}))
+assert(deep_equal(parse('a=1;b=2&c=3', ';&'), {a = '1', b = '2', c = '3'}))
+assert(deep_equal(parse('k=a=b'), {k = 'a=b'}))
+
+local unescape = require('querystring').unescape
+assert(unescape('plain') == 'plain')
+assert(unescape('a+b%20c%2B') == 'a b c+')
+assert(unescape('%zz%4') == '%zz%4')
+assert(unescape('%0D%0Aline\r\n') == '\nline\n')
+assert(unescape(string.rep('%41', 1000)) == string.rep('A', 1000))
+
+-- http requests parse their query on first use
+local Request = require('http').Request
+local request = Request:new({})
+request.url = '/search?q=luvit+fast&tag=a&tag=b'
+assert(rawget(request, 'query') == nil)
+assert(request.query.q == 'luvit fast')
+assert(deep_equal(request.query.tag, {'a', 'b'}))
+assert(rawget(request, 'query') == request.query)
+assert(type(request.pause) == 'function')
@@ -0,0 +1,56 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local FS = require('fs')
+local Path = require('path')
+local module = require('module')
+
+local root = Path.join(__dirname, 'fixtures', 'test-require-cache')
+local late = Path.join(root, 'late.lua')
+local manifest = Path.join(root, 'manifest.lua')
+
+local ok, err = pcall(FS.mkdirSync, root, '0777')
+if not ok then
+  assert(err.code == 'EEXIST')
+end
+
+-- Misses are remembered, a module showing up later isn't seen
+assert(not pcall(require, './fixtures/test-require-cache/late'))
+FS.writeFileSync(late, 'return { late = true }')
+assert(not pcall(require, './fixtures/test-require-cache/late'))
+
+-- Until the cache is cleared
+module.clearCache()
+local lateModule = require('./fixtures/test-require-cache/late')
+assert(lateModule.late)
+assert(require('./fixtures/test-require-cache/late') == lateModule)
+
+-- The manifest has what was resolved and seeds a fresh cache
+module.saveManifest(manifest)
+local saved = FS.readFileSync(manifest)
+p(saved)
+assert(saved:find('late.lua', 1, true))
+module.clearCache()
+module.loadManifest(manifest)
+assert(require('./fixtures/test-require-cache/late') == lateModule)
+
+FS.unlinkSync(manifest)
+FS.unlinkSync(late)
+FS.rmdirSync(root)
@@ -0,0 +1,75 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local shm = require('shm')
+local os = require('os')
+
+if os.type() == 'win32' then return end
+
+local name = "luvit-test-shm-" .. process.pid
+local sender = shm.Sender:new(name, { create = true, size = 4096 })
+local receiver = shm.Receiver:new(name)
+
+-- Big enough that a few of them fill the ring
+local big = ("0123456789abcdef"):rep(100)
+local sent = {}
+local received = {}
+local drained = false
+
+receiver:on('message', function (buffer)
+  assert(buffer.readonly)
+  received[#received + 1] = buffer:toString()
+  if #received == #sent and drained then
+    -- This message is only consumed once the listener returns
+    process.nextTick(function ()
+      local stats = receiver:stats()
+      assert(stats.used == 0 and stats.size == 4096)
+      receiver:close()
+      sender:close()
+    end)
+  end
+end)
+
+local full = false
+for i = 1, 8 do
+  local message = i .. ":" .. big
+  sent[i] = message
+  if not sender:write(message) then
+    full = true
+  end
+end
+-- Only a couple fit, the rest wait for the receiver
+assert(full)
+assert(sender:pendingCount() > 0)
+sent[#sent + 1] = ""
+sender:write("")
+
+sender:once('drain', function ()
+  assert(sender:pendingCount() == 0)
+  drained = true
+end)
+
+-- Messages that don't fit even in an empty ring are refused
+assert(not pcall(sender.write, sender, big .. big))
+
+process:on('exit', function ()
+  assert(drained)
+  assert(deep_equal(sent, received))
+end)
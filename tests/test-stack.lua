@@ -0,0 +1,118 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local table = require("table")
+local stack = require('stack')
+
+-- Enough of a response to see what the error handler did
+local function fakeResponse()
+  local res = {}
+  function res:setCode(code) self.code = code end
+  function res:finish(body) self.body = body end
+  return res
+end
+
+local order = {}
+local function note(name)
+  return function (req, res, continue)
+    order[#order + 1] = name
+    continue()
+  end
+end
+
+-- Chains inside compiled stacks run in order and fall through to a 404
+local app = stack.compile(note("a"), stack.chain(note("b"), note("c")), note("d"))
+local res = fakeResponse()
+app({ url = "/" }, res)
+assert(table.concat(order, "") == "abcd")
+assert(res.code == 404)
+
+-- Errors thrown or passed on reach the error handler, the rest is skipped
+order = {}
+res = fakeResponse()
+stack.compile(note("a"), function () error("boom") end, note("never"))({ url = "/" }, res)
+assert(table.concat(order, "") == "a")
+assert(res.code == 500 and res.body:find("boom"))
+
+res = fakeResponse()
+stack.compile(function (req, res, continue) continue("passed") end)({ url = "/" }, res)
+assert(res.code == 500 and res.body:find("passed"))
+
+-- Continuing later is still protected
+local later
+res = fakeResponse()
+stack.compile(function (req, res, continue)
+  later = continue
+end, function () error("async boom") end)({ url = "/" }, res)
+assert(res.code == nil)
+later()
+assert(res.code == 500 and res.body:find("async boom"))
+
+-- Mounts rewrite the url for their layers and restore it
+local seen
+res = fakeResponse()
+local req = { url = "/api/v1/users" }
+stack.compile(stack.compiledMount("/api/", function (req, res, continue)
+  seen = req.url
+  continue()
+end))(req, res)
+assert(seen == "/v1/users")
+assert(req.url == "/api/v1/users" and req.real_url == "/api/v1/users")
+seen = nil
+stack.compile(stack.compiledMount("/api", note("x")))({ url = "/apix" }, fakeResponse())
+assert(seen == nil)
+
+-- Router
+local router = stack.Router:new()
+local function named(name)
+  return function (req, res) res.route = name end
+end
+router:get("/", named("root"))
+router:get("/users", named("users"))
+router:get("/users/:id", named("user"))
+router:post("/users/:id", named("update"))
+router:get("/users/me", named("me"))
+router:get("/users/:id/posts/:post", named("post"))
+router:all("/static/*path", named("static"))
+router:get("/u", named("u"))
+
+local function dispatch(method, url)
+  local res = fakeResponse()
+  local request = { method = method, url = url }
+  stack.compile(router)(request, res)
+  return res.route or res.code, request.params
+end
+
+assert(dispatch("GET", "/") == "root")
+assert(dispatch("GET", "/users") == "users")
+assert(dispatch("GET", "/u") == "u")
+assert(dispatch("GET", "/users/me") == "me")
+local route, params = dispatch("GET", "/users/42?full=1")
+assert(route == "user" and params.id == "42")
+route, params = dispatch("POST", "/users/42")
+assert(route == "update" and params.id == "42")
+route, params = dispatch("GET", "/users/7/posts/hello")
+assert(route == "post" and params.id == "7" and params.post == "hello")
+route, params = dispatch("DELETE", "/static/css/site.css")
+assert(route == "static" and params.path == "css/site.css")
+assert(dispatch("DELETE", "/users/42") == 404)
+assert(dispatch("GET", "/users/") == 404)
+assert(dispatch("GET", "/nothing") == 404)
+assert(not pcall(router.get, router, "/users/:name", named("clash")))
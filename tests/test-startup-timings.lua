@@ -0,0 +1,47 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+local timer = require('timer')
+local spawn = require('childprocess').spawn
+
+-- Filled in once the main script is done, right before the loop starts
+assert(process.startupTimings == nil)
+
+timer.setTimeout(1, function ()
+  local timings = process.startupTimings
+  p(timings)
+  for _, phase in ipairs({"libs", "init", "bootstrap", "main", "total"}) do
+    assert(type(timings[phase]) == "number" and timings[phase] >= 0)
+  end
+  assert(timings.total >= timings.bootstrap + timings.main)
+end)
+
+-- The env var makes luvit print them on stderr
+local stderr = ""
+local child = spawn(process.execPath, {"-e", "1"}, {
+  env = { LUVIT_STARTUP_TIMINGS = "1" }
+})
+child.stderr:on('data', function (chunk)
+  stderr = stderr .. chunk
+end)
+
+process:on('exit', function ()
+  p(stderr)
+  assert(stderr:find("^startup: libs [%d.]+ms, init [%d.]+ms, bootstrap [%d.]+ms, main [%d.]+ms, total [%d.]+ms"))
+end)
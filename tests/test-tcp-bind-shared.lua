@@ -0,0 +1,70 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+require("helper")
+
+local Tcp = require('uv').Tcp
+local net = require('net')
+
+local PORT = process.env.PORT or 10096
+
+-- Two servers on one socket, as two loops of LUVIT_LOOPS would have them
+local accepted = { 0, 0 }
+local servers = {}
+for i = 1, 2 do
+  local server = Tcp:new()
+  server:bindShared("127.0.0.1", PORT)
+  server:listen(function (err)
+    assert(not err)
+    local client = Tcp:new()
+    server:accept(client)
+    accepted[i] = accepted[i] + 1
+    client:close()
+  end)
+  servers[i] = server
+end
+
+local connections = 0
+local function connect(callback)
+  local client = net.createConnection(PORT, "127.0.0.1", function ()
+    connections = connections + 1
+  end)
+  client:on('error', function (err)
+    p(err)
+    assert(false)
+  end)
+  client:on('end', function ()
+    client:destroy()
+    callback()
+  end)
+end
+
+-- The socket outlives the server that created it
+connect(function ()
+  connect(function ()
+    servers[1]:close()
+    connect(function ()
+      servers[2]:close()
+    end)
+  end)
+end)
+
+process:on('exit', function ()
+  p(accepted)
+  assert(connections == 3)
+  assert(accepted[1] + accepted[2] == 3)
+end)
@@ -0,0 +1,55 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local timer = require('timer')
+local uv = require('uv')
+local Timer = uv.Timer
+
+local COUNT = 20
+local SLACK = 50
+local start = Timer.now()
+local wakeups = uv.timerWheelStats().wakeups
+local fired = 0
+
+for i = 1, COUNT do
+  local duration = 100 + i
+  timer.coarse(duration, function ()
+    local elapsed = Timer.now() - start
+    assert(elapsed >= duration)
+    -- Late only by the slack, give or take loop lag
+    assert(elapsed <= duration + SLACK + 20)
+    fired = fired + 1
+  end, SLACK)
+end
+
+-- Cancelling works as for setTimeout
+local cancelled = timer.coarse(10, function ()
+  error('cancelled coarse timer fired')
+end)
+timer.clearTimer(cancelled)
+
+process:on('exit', function ()
+  local stats = uv.timerWheelStats()
+  p(stats)
+  assert(fired == COUNT)
+  -- Deadlines spread over 20ms round to at most two multiples of the slack.
+  -- Allow for the wheel moving them down a level and the cancelled timer.
+  assert(stats.wakeups - wakeups <= 5)
+end)
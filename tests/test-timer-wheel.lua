@@ -0,0 +1,70 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local uv = require('uv')
+local Timer = uv.Timer
+
+local start = Timer.now()
+local fired = {}
+
+-- Spread over the first three levels of the wheel
+local timeouts = { 1, 30, 63, 64, 65, 200, 4100 }
+for i = 1, #timeouts do
+  local msecs = timeouts[i]
+  local t
+  t = uv.newWheelTimer(function ()
+    assert(not t:isActive())
+    assert(Timer.now() - start >= msecs)
+    fired[#fired + 1] = msecs
+  end)
+  t:start(msecs)
+  assert(t:isActive())
+end
+
+-- Restarting pushes it back, from 100ms to 150ms
+local restarted = uv.newWheelTimer(function ()
+  fired[#fired + 1] = 'restarted'
+  assert(Timer.now() - start >= 150)
+end)
+restarted:start(100)
+local nudge = uv.newWheelTimer(function ()
+  restarted:start(100)
+end)
+nudge:start(50)
+
+-- Stopped timers never fire
+local stopped = uv.newWheelTimer(function ()
+  error('stopped timer fired')
+end)
+stopped:start(10)
+stopped:stop()
+assert(not stopped:isActive())
+
+assert(uv.timerWheelStats().active == #timeouts + 2)
+
+process:on('exit', function ()
+  p(fired, uv.timerWheelStats())
+  local order = { 1, 30, 63, 64, 65, 'restarted', 200, 4100 }
+  assert(#fired == #order)
+  for i = 1, #order do
+    assert(fired[i] == order[i])
+  end
+  assert(uv.timerWheelStats().active == 0)
+end)
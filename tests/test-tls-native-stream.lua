@@ -0,0 +1,65 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require('helper')
+
+local fixture = require('./fixture-tls')
+local tls = require('tls')
+local string = require('string')
+local table = require('table')
+
+local options = {
+  key = fixture.loadPEM('agent1-key'),
+  cert = fixture.loadPEM('agent1-cert')
+}
+
+-- Bigger than a record and than a read so both sides loop
+local payload = string.rep("0123456789abcdef", 64 * 1024)
+local received = {}
+local echoed = 0
+
+local server
+server = tls.createServer(options, function(conn)
+  assert(conn.ssl)
+  conn:on('data', function(chunk)
+    conn:write(chunk)
+  end)
+end)
+
+server:listen(fixture.commonPort, function()
+  local client
+  client = tls.connect({port = fixture.commonPort, host = '127.0.0.1'}, function()
+    assert(client.ssl)
+    assert(client:getCipher())
+  end)
+  -- Written before the handshake, held until it's done, lists go out whole
+  client:write({payload:sub(1, 100), payload:sub(101)})
+  client:on('data', function(chunk)
+    received[#received + 1] = chunk
+    echoed = echoed + #chunk
+    if echoed == #payload then
+      assert(table.concat(received) == payload)
+      client:destroy()
+      server:close()
+    end
+  end)
+end)
+
+process:on('exit', function()
+  assert(echoed == #payload)
+end)
@@ -0,0 +1,95 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require('helper')
+
+local fixture = require('./fixture-tls')
+local tls = require('tls')
+local net = require('net')
+local string = require('string')
+
+local PROXY_PORT = process.env.PORT or 10092
+
+local options = {
+  key = fixture.loadPEM('agent1-key'),
+  cert = fixture.loadPEM('agent1-cert'),
+  recordSizing = { small = 1000, large = 4000, ramp = 3000 }
+}
+
+-- One write, three small records then large ones
+local payload = string.rep('x', 10000)
+local received = 0
+
+-- Sizes of the application data records the server sent, seen from a
+-- proxy between the two.  Records carrying less than a small record's worth,
+-- like empty CBC fragments and session tickets, are left out.
+local records = {}
+local pending = ''
+
+local function parseRecords(chunk)
+  pending = pending .. chunk
+  while #pending >= 5 do
+    local length = pending:byte(4) * 256 + pending:byte(5)
+    if #pending < 5 + length then break end
+    if pending:byte(1) == 23 and length > 900 then
+      records[#records + 1] = length
+    end
+    pending = pending:sub(6 + length)
+  end
+end
+
+local server, proxy
+
+server = tls.createServer(options, function(conn)
+  conn:write(payload)
+end)
+
+proxy = net.createServer(function(inbound)
+  local outbound = net.createConnection(fixture.commonPort, '127.0.0.1')
+  inbound:on('data', function(chunk) outbound:write(chunk) end)
+  outbound:on('data', function(chunk)
+    parseRecords(chunk)
+    inbound:write(chunk)
+  end)
+  inbound:on('end', function() outbound:destroy() end)
+  outbound:on('end', function() inbound:destroy() end)
+end)
+
+server:listen(fixture.commonPort, function()
+  proxy:listen(PROXY_PORT, '127.0.0.1', function()
+    local client
+    client = tls.connect({port = PROXY_PORT, host = '127.0.0.1'})
+    client:on('data', function(chunk)
+      received = received + #chunk
+      if received == #payload then
+        client:destroy()
+        proxy:close()
+        server:close()
+      end
+    end)
+  end)
+end)
+
+process:on('exit', function()
+  assert(received == #payload)
+  p(records)
+  assert(#records == 5)
+  assert(records[1] == records[2] and records[2] == records[3])
+  assert(records[4] > records[3] + 2000)
+  assert(records[5] < records[4])
+end)
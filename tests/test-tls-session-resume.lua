@@ -0,0 +1,71 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require('helper')
+
+local fixture = require('./fixture-tls')
+local tls = require('tls')
+local string = require('string')
+
+local options = {
+  key = fixture.loadPEM('agent1-key'),
+  cert = fixture.loadPEM('agent1-cert'),
+  ticketKeys = string.rep('k', 48)
+}
+
+local reused = {}
+
+local server
+server = tls.createServer(options, function(conn)
+  reused[#reused + 1] = conn.ssl:isSessionReused()
+  conn:destroy()
+end)
+
+local cache = tls.SessionCache:new()
+
+local function connect(callback)
+  local client
+  client = tls.connect({port = fixture.commonPort, host = '127.0.0.1',
+                        sessionCache = cache}, function()
+    client:on('end', function()
+      client:destroy()
+      callback()
+    end)
+  end)
+end
+
+server:listen(fixture.commonPort, function()
+  connect(function()
+    assert(cache:get('127.0.0.1:' .. fixture.commonPort))
+    connect(function()
+      -- Tickets under the previous key are still honoured
+      server:rotateTicketKeys()
+      connect(function()
+        server:close()
+      end)
+    end)
+  end)
+end)
+
+process:on('exit', function()
+  p(reused)
+  assert(#reused == 3)
+  assert(reused[1] == false)
+  assert(reused[2] == true)
+  assert(reused[3] == true)
+end)
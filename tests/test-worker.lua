@@ -0,0 +1,98 @@
+--[[
+
+Copyright 2012 The Luvit Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+require("helper")
+
+local worker = require('worker')
+local Buffer = require('buffer').Buffer
+
+worker.setup(2)
+
+local results = {}
+
+-- Arguments and results cross over, tables included
+worker.run(function (list, scale)
+  local sum = 0
+  for i = 1, #list do sum = sum + list[i] * scale end
+  return sum, { count = #list, nested = { ok = true } }, nil, "done"
+end, { 1, 2, 3, 4 }, 10, function (err, sum, info, none, done)
+  assert(not err)
+  assert(sum == 100)
+  assert(info.count == 4 and info.nested.ok == true)
+  assert(none == nil and done == "done")
+  results.table = true
+end)
+
+-- Buffers arrive as strings
+worker.run(function (data)
+  return #data, data:upper()
+end, Buffer:new('abc'), function (err, len, upper)
+  assert(not err)
+  assert(len == 3 and upper == 'ABC')
+  results.buffer = true
+end)
+
+-- Source works as well as functions
+worker.run("local a, b = ... return a + b", 2, 3, function (err, sum)
+  assert(not err and sum == 5)
+  results.source = true
+end)
+
+-- lib/luvit modules that don't need a loop can be required
+worker.run(function (text)
+  local json = require('json')
+  local value = json.parse(text)
+  return json.stringify({ n = value.n + 1 })
+end, '{"n":1}', function (err, text)
+  assert(not err, err)
+  assert(text == '{"n":2}')
+  results.require = true
+end)
+
+-- Errors are reported, the thread keeps going
+worker.run(function ()
+  error('boom')
+end, function (err)
+  assert(err:find('boom'))
+  results.error = true
+end)
+
+-- Functions can't be sent
+assert(not pcall(worker.run, function () end, print, function () end))
+
+-- More jobs than threads queue up
+local finished = 0
+for i = 1, 20 do
+  worker.run(function (n)
+    local x = 0
+    for j = 1, 100000 do x = x + j % n end
+    return n
+  end, i, function (err, n)
+    assert(not err and n == i)
+    finished = finished + 1
+  end)
+end
+
+process:on('exit', function ()
+  p(results, worker.stats())
+  assert(results.table and results.buffer and results.source and results.error)
+  assert(results.require)
+  assert(finished == 20)
+  assert(worker.stats().threads == 2)
+  assert(worker.stats().pending == 0)
+end)
@@ -48,10 +48,45 @@ local unpacker = Zlib.new('inflate')
 inflated = unpacker:write(deflated:sub(1, 6)) .. unpacker:write(deflated:sub(7), "finish")
 assert(inflated == test_str)
 
+-- output much bigger than the input grows the scratch buffer
+local big = string.rep("abcdefgh", 100000)
+assert(Zlib.new('inflate'):write(Zlib.new('deflate'):write(big, "finish"), "finish") == big)
+
+-- into a Buffer
+local Buffer = require('buffer').Buffer
+local packed = Zlib.new('deflate'):write(big, "finish")
+local into = Buffer:new(4096)
+local unpacker2 = Zlib.new('inflate')
+local pieces, input, ended = {}, packed, false
+while not ended do
+  local produced, consumed
+  produced, consumed, ended = unpacker2:writeInto(into, input, "none")
+  assert(produced)
+  pieces[#pieces + 1] = into:toString(1, produced)
+  input = input:sub(consumed + 1)
+end
+assert(require("table").concat(pieces) == big)
+assert(not pcall(unpacker2.writeInto, unpacker2, "not a buffer", ""))
+
 --
--- TODO: inside worker
+-- inside worker
 --
 
+local text = string.rep("luvit ", 10000)
+local gzipper = Zlib.new('deflate', 6, 31)
+gzipper:writeAsync(text, "finish", function (err, gzipped)
+  assert(not err)
+  assert(#gzipped > 0 and #gzipped < #text)
+  -- gzip magic
+  assert(gzipped:byte(1) == 0x1f and gzipped:byte(2) == 0x8b)
+  Zlib.new('inflate'):writeAsync(gzipped, "finish", function (err, plain)
+    assert(not err)
+    assert(plain == text)
+  end)
+end)
+-- one write at a time per stream
+assert(not pcall(gzipper.write, gzipper, "x"))
+
 --
 -- stream interface
 --
@@ -72,6 +107,40 @@ gunzip:on('end', function ()
 end)
 file:pipe(gunzip)
 
+-- thread pool transforms, chained
+local gzip = Zlib.Gzip:new()
+local gunzip2 = Zlib.Gunzip:new()
+local out = {}
+gzip:pipe(gunzip2)
+gunzip2:on('data', function (text)
+  out[#out + 1] = text
+end)
+gunzip2:on('end', function ()
+  assert(Table.concat(out) == "hello hello hello")
+end)
+gzip:write("hello ")
+gzip:write("hello ")
+gzip:done("hello")
+
+-- a paused transform filters nothing until it's resumed
+local paused = Zlib.Gzip:new()
+local pausedData = 0
+local resumed = false
+paused:on('data', function ()
+  assert(resumed)
+  pausedData = pausedData + 1
+end)
+paused:on('end', function ()
+  assert(pausedData > 0)
+end)
+paused:pause()
+paused:write("held ")
+paused:done("back")
+require('timer').setTimeout(20, function ()
+  resumed = true
+  paused:resume()
+end)
+
 --
 -- TODO: unzip a zipball
 --
@@ -36,26 +36,82 @@ end
 local libdir = Path.join(Path.dirname(process.execPath), Path.join("..", "lib", "luvit"))
 
 local files = FS.readdirSync(libdir)
+-- Sort the files rather than the names so names[i] stays files[i]'s name
+Table.sort(files)
 local names = map(files, function (file)
   return file:match("^([^.]*)")
 end)
-Table.sort(names)
+
+-- tls is only built with openssl
+local function guard(name, text)
+  if name == "tls" then
+    return "#ifdef USE_OPENSSL\n" .. text .. "#endif\n"
+  end
+  return text
+end
 
 local exports_c = [[
 /* This file is generated by bundler.lua */
 #include <string.h>
+#include "lua.h"
+#include "lauxlib.h"
 #include "luvit.h"
+#include "luvit_exports.h"
 
 const void *luvit_ugly_hack = NULL;
 
-]] .. mapcat(names, function (name) return "extern const char *luaJIT_BC_" .. name .. "[];\n" end) .. [[
+]] .. mapcat(names, function (name)
+  return guard(name, "extern const char luaJIT_BC_" .. name .. "[];\n")
+end) .. [[
+
+/* Bytecode for every module in lib/luvit, by module name */
+static const struct {
+  const char *name;
+  const char *bytecode;
+} luvit_bundle[] = {
+]] .. mapcat(names, function (name)
+  return guard(name, '  { "' .. name .. '", luaJIT_BC_' .. name .. ' },\n')
+end) .. [[
+  { NULL, NULL }
+};
+
 const void *luvit__suck_in_symbols(void)
 {
-  int luvit_ugly_hack =
-  {
-]] .. mapcat(names, function (name) return "    (int)*luaJIT_BC_" .. name end, " +\n") .. [[    0;
+  luvit_ugly_hack = (const char*)luvit_bundle;
+
+  return luvit_ugly_hack;
+}
+
+/* package.preload entry for a bundled module, the bytecode is only loaded
+ * once something requires it.
+ */
+static int luvit_bundle_loader(lua_State *L)
+{
+  const char *bytecode = (const char *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *name = lua_tostring(L, lua_upvalueindex(2));
+
+  /* Like LuaJIT's own preload fallback, let the bytecode reader find the end */
+  if (luaL_loadbuffer(L, bytecode, ~(size_t)0, name)) {
+    return lua_error(L);
+  }
+  lua_pushstring(L, name);
+  lua_call(L, 1, 1);
+  return 1;
+}
 
-  return (const void *)&luvit_ugly_hack[0];
+void luvit_bundle_preload(lua_State *L)
+{
+  int i;
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  for (i = 0; luvit_bundle[i].name; i++) {
+    lua_pushlightuserdata(L, (void *)luvit_bundle[i].bytecode);
+    lua_pushstring(L, luvit_bundle[i].name);
+    lua_pushcclosure(L, luvit_bundle_loader, 2);
+    lua_setfield(L, -2, luvit_bundle[i].name);
+  }
+  lua_pop(L, 2);
 }
 ]]
 
@@ -64,8 +120,13 @@ local exports_h = [[
 #ifndef LUV_EXPORTS
 #define LUV_EXPORTS
 
+#include "lua.h"
+
 const void *luvit__suck_in_symbols(void);
 
+/* Register the embedded lib/luvit bytecode in package.preload */
+void luvit_bundle_preload(lua_State *L);
+
 #endif
 ]]
 